@@ -124,6 +124,7 @@ TAP_FLAG_REQUEST_KEYS_ONLY = 0x20
 TAP_FLAG_CHECKPOINT        = 0x40
 TAP_FLAG_REGISTERED_CLIENT = 0x80
 TAP_FLAG_TAP_FIX_FLAG_BYTEORDER = 0x100
+TAP_FLAG_COMPRESS_VALUES   = 0x200
 
 TAP_FLAG_TYPES = {TAP_FLAG_BACKFILL: ">Q",
                   TAP_FLAG_REGISTERED_CLIENT: ">B"}
@@ -131,6 +132,7 @@ TAP_FLAG_TYPES = {TAP_FLAG_BACKFILL: ">Q",
 # TAP per-message flags
 TAP_FLAG_ACK      = 0x01
 TAP_FLAG_NO_VALUE = 0x02 # The value for the key is not included in the packet
+TAP_FLAG_COMPRESSED = 0x08 # The value is compressed (see tap.decompress)
 
 # Flags, expiration
 SET_PKT_FMT=">II"
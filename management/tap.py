@@ -20,6 +20,32 @@ from memcacheConstants import SET_PKT_FMT, DEL_PKT_FMT, INCRDECR_RES_FMT
 
 import memcacheConstants
 
+def decompress(data):
+    """Decompress a value sent with TAP_FLAG_COMPRESSED."""
+    length = struct.unpack(">I", data[:4])[0]
+    out = []
+    i = 4
+    while i < len(data):
+        c = ord(data[i])
+        i += 1
+        if c < 32:
+            out.extend(data[i:i + c + 1])
+            i += c + 1
+        else:
+            n = c >> 5
+            if n == 7:
+                n += ord(data[i])
+                i += 1
+            ref = len(out) - ((c & 0x1f) << 8) - ord(data[i]) - 1
+            i += 1
+            if ref < 0:
+                raise ValueError("corrupt compressed value")
+            for j in range(n + 2):
+                out.append(out[ref + j])
+    if len(out) != length:
+        raise ValueError("corrupt compressed value")
+    return ''.join(out)
+
 class TapConnection(mc_bin_server.MemcachedBinaryChannel):
 
     def __init__(self, server, port, callback, clientId=None, opts={}, user=None, pswd=None):
@@ -98,6 +124,9 @@ class TapConnection(mc_bin_server.MemcachedBinaryChannel):
         key_start = extralen + es_length
         key = data[key_start:(key_start+klen)]
         val = data[(key_start+klen):]
+        if (cmd == memcacheConstants.CMD_TAP_MUTATION and
+            _flags & memcacheConstants.TAP_FLAG_COMPRESSED):
+            val = decompress(val)
         return self.callback(self.identifier, cmd, extra, key, vb, val, cas)
 
     def handle_connect(self):
@@ -17,43 +17,96 @@
 
 #include "config.h"
 
+#include <sys/stat.h>
+
 #include <iostream>
+#include <vector>
 
 #include "access_scanner.h"
 #include "ep_engine.h"
 
+/**
+ * Get the size of a file, 0 if there's none.
+ */
+static size_t fileSize(const std::string &path) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+        return 0;
+    }
+    return static_cast<size_t>(st.st_size);
+}
+
 class ItemAccessVisitor : public VBucketVisitor {
 public:
     ItemAccessVisitor(EventuallyPersistentStore &_store, EPStats &_stats,
-                      bool *sfin) :
+                      AccessScanner *as, bool rw) :
         store(_store), stats(_stats), startTime(ep_real_time()),
-        stateFinalizer(sfin)
+        scanner(as), rewrite(rw), initialSize(0), hotKeys(0), fullBytes(0),
+        sliceStart(0), log(NULL)
     {
         Configuration &conf = store.getEPEngine().getConfiguration();
         name = conf.getAlogPath();
         prev = name + ".old";
         next = name + ".next";
+        incremental = conf.isAlogIncremental();
+        sliceTime = static_cast<hrtime_t>(conf.getAlogSliceTime()) * 1000000;
 
-        log = new MutationLog(next, conf.getAlogBlockSize());
-        assert(log != NULL);
-        log->open();
+        if (!rewrite) {
+            initialSize = fileSize(name);
+            log = new MutationLog(name, conf.getAlogBlockSize());
+            try {
+                log->open();
+            } catch (MutationLog::ReadException &e) {
+                LOG(EXTENSION_LOG_WARNING, "Failed to append to access log "
+                    "%s, rewriting it: %s", name.c_str(), e.what());
+                delete log;
+                rewrite = true;
+                initialSize = 0;
+            }
+        }
+        if (rewrite) {
+            log = new MutationLog(next, conf.getAlogBlockSize());
+            assert(log != NULL);
+            log->open();
+        }
         if (!log->isOpen()) {
             LOG(EXTENSION_LOG_WARNING, "FATAL: Failed to open access log: %s",
-                next.c_str());
+                log->getLogFile().c_str());
             delete log;
             log = NULL;
         }
     }
 
     void visit(StoredValue *v) {
-        if (log != NULL && v->isResident()) {
+        if (log == NULL) {
+            return;
+        }
+        if (sliceStart == 0) {
+            sliceStart = gethrtime();
+        }
+
+        bool hot = false;
+        if (v->isResident()) {
             if (v->isExpired(startTime) || v->isDeleted()) {
                 LOG(EXTENSION_LOG_INFO, "INFO: Skipping expired/deleted item: %s",
                     v->getKey().c_str());
             } else {
+                hot = !incremental || v->getNRUValue() < MAX_NRU_VALUE;
+            }
+        }
+
+        if (hot) {
+            ++hotKeys;
+            fullBytes += MutationLogEntry::len(v->getKeyLen());
+            if (rewrite) {
                 log->newItem(currentBucket->getId(), v->getKey(), v->getId());
+            } else if (!v->isInAccessLog()) {
+                changes.push_back(Change(currentBucket->getId(), v, true));
             }
+        } else if (!rewrite && v->isInAccessLog()) {
+            changes.push_back(Change(currentBucket->getId(), v, false));
         }
+        v->setInAccessLog(hot);
     }
 
     bool visitBucket(RCPtr<VBucket> &vb) {
@@ -61,48 +114,104 @@ public:
             return false;
         }
 
+        // Each vbucket starts a dispatcher slice of its own.
+        sliceStart = 0;
         return VBucketVisitor::visitBucket(vb);
     }
 
+    bool shouldYield() {
+        if (sliceTime == 0 || sliceStart == 0 ||
+            gethrtime() - sliceStart < sliceTime) {
+            return false;
+        }
+        sliceStart = 0;
+        return true;
+    }
+
     virtual void complete() {
-        if (stateFinalizer) {
-            *stateFinalizer = true;
+        if (log == NULL) {
+            scanner->rewritten(false, 0);
+            scanner->available = true;
+            return;
         }
 
-        if (log != NULL) {
-            size_t num_items = log->itemsLogged[ML_NEW];
+        // The live log only ever grows by whole committed runs, so a
+        // restart in the middle of one leaves it loadable.
+        std::vector<Change>::iterator it;
+        for (it = changes.begin(); it != changes.end(); ++it) {
+            if (it->hot) {
+                log->newItem(it->vbucket, it->key, it->rowid);
+            } else {
+                log->delItem(it->vbucket, it->key);
+            }
+        }
+        if (rewrite || !changes.empty()) {
             log->commit1();
             log->commit2();
-            delete log;
-            log = NULL;
-            ++stats.alogRuns;
-            stats.alogRuntime.set(ep_real_time() - startTime);
-            stats.alogNumItems.set(num_items);
-
-            if (num_items == 0) {
-                LOG(EXTENSION_LOG_INFO, "The new access log is empty. "
-                    "Delete it without replacing the current access log...\n");
-                remove(next.c_str());
-                return;
-            }
+        }
+        delete log;
+        log = NULL;
+        ++stats.alogRuns;
+        stats.alogRuntime.set(ep_real_time() - startTime);
+        stats.alogNumItems.set(hotKeys);
+        stats.alogFullBytes.set(fullBytes);
 
-            if (access(prev.c_str(), F_OK) == 0 && remove(prev.c_str()) == -1) {
-                LOG(EXTENSION_LOG_WARNING, "FATAL: Failed to remove '%s': %s",
-                    prev.c_str(), strerror(errno));
-                remove(next.c_str());
-            } else if (access(name.c_str(), F_OK) == 0 && rename(name.c_str(), prev.c_str()) == -1) {
-                LOG(EXTENSION_LOG_WARNING, "FATAL: Failed to rename '%s' to '%s': %s",
-                    name.c_str(), prev.c_str(), strerror(errno));
-                remove(next.c_str());
-            } else if (rename(next.c_str(), name.c_str()) == -1) {
-                LOG(EXTENSION_LOG_WARNING, "FATAL: Failed to rename '%s' to '%s': %s",
-                    next.c_str(), name.c_str(), strerror(errno));
-                remove(next.c_str());
-            }
+        if (rewrite) {
+            stats.alogBytesWritten.set(fileSize(next));
+            scanner->rewritten(install(), hotKeys);
+        } else {
+            stats.alogBytesWritten.set(fileSize(name) - initialSize);
+            scanner->appended(changes.size());
         }
+        scanner->available = true;
     }
 
 private:
+    /**
+     * A key to add to or drop from the access log being appended to.
+     */
+    struct Change {
+        Change(uint16_t vb, StoredValue *v, bool h) :
+            key(v->getKey()), rowid(v->getId()), vbucket(vb), hot(h) {}
+
+        std::string key;
+        uint64_t rowid;
+        uint16_t vbucket;
+        bool hot;
+    };
+
+    /**
+     * Replace the access log with the one just written.
+     *
+     * @return false if the new log was dropped
+     */
+    bool install() {
+        if (hotKeys == 0) {
+            LOG(EXTENSION_LOG_INFO, "The new access log is empty. "
+                "Delete it without replacing the current access log...\n");
+            remove(next.c_str());
+            return false;
+        }
+
+        if (access(prev.c_str(), F_OK) == 0 && remove(prev.c_str()) == -1) {
+            LOG(EXTENSION_LOG_WARNING, "FATAL: Failed to remove '%s': %s",
+                prev.c_str(), strerror(errno));
+            remove(next.c_str());
+            return false;
+        } else if (access(name.c_str(), F_OK) == 0 && rename(name.c_str(), prev.c_str()) == -1) {
+            LOG(EXTENSION_LOG_WARNING, "FATAL: Failed to rename '%s' to '%s': %s",
+                name.c_str(), prev.c_str(), strerror(errno));
+            remove(next.c_str());
+            return false;
+        } else if (rename(next.c_str(), name.c_str()) == -1) {
+            LOG(EXTENSION_LOG_WARNING, "FATAL: Failed to rename '%s' to '%s': %s",
+                next.c_str(), name.c_str(), strerror(errno));
+            remove(next.c_str());
+            return false;
+        }
+        return true;
+    }
+
     EventuallyPersistentStore &store;
     EPStats &stats;
     rel_time_t startTime;
@@ -110,19 +219,37 @@ private:
     std::string next;
     std::string name;
 
+    AccessScanner *scanner;
+    //! True if the log is rewritten rather than appended to.
+    bool rewrite;
+    bool incremental;
+    size_t initialSize;
+    size_t hotKeys;
+    //! Bytes the hot keys take in a rewritten log.
+    size_t fullBytes;
+    hrtime_t sliceTime;
+    hrtime_t sliceStart;
+
     MutationLog *log;
-    bool *stateFinalizer;
+    //! What an incremental run changed, appended when it completes.
+    std::vector<Change> changes;
 };
 
 AccessScanner::AccessScanner(EventuallyPersistentStore &_store, EPStats &st,
                              size_t sleeptime) :
-    store(_store), stats(st), sleepTime(sleeptime), available(true)
+    store(_store), stats(st), sleepTime(sleeptime), available(true),
+    needRewrite(true), rewriteKeys(0), appendedKeys(0)
 { }
 
 bool AccessScanner::callback(Dispatcher &d, TaskId &t) {
     if (available) {
         available = false;
-        shared_ptr<ItemAccessVisitor> pv(new ItemAccessVisitor(store, stats, &available));
+        Configuration &conf = store.getEPEngine().getConfiguration();
+        // What's in the log isn't known before it's written once.
+        bool rewrite = !conf.isAlogIncremental() || needRewrite ||
+            access(conf.getAlogPath().c_str(), F_OK) != 0;
+        shared_ptr<ItemAccessVisitor> pv(new ItemAccessVisitor(store, stats,
+                                                               this, rewrite));
         store.resetAccessScannerTasktime();
         store.visit(pv, "Item access scanner", &d, Priority::AccessScannerPriority);
     }
@@ -131,6 +258,20 @@ bool AccessScanner::callback(Dispatcher &d, TaskId &t) {
     return true;
 }
 
+void AccessScanner::rewritten(bool installed, size_t keys) {
+    needRewrite = !installed;
+    rewriteKeys = keys;
+    appendedKeys = 0;
+}
+
+void AccessScanner::appended(size_t changes) {
+    Configuration &conf = store.getEPEngine().getConfiguration();
+    appendedKeys += changes;
+    if (appendedKeys > rewriteKeys * conf.getAlogCompactionRatio()) {
+        needRewrite = true;
+    }
+}
+
 std::string AccessScanner::description() {
     return std::string("Generating access log");
 }
@@ -30,8 +30,20 @@
 class EventuallyPersistentStore;
 class AccessScannerValueChangeListener;
 
+/**
+ * Periodically logs the keys that are resident, so that warmup can load
+ * them first.
+ *
+ * Every run rewrites the access log, unless alog_incremental is set.
+ * Then the keys the item pager found unreferenced (by their NRU bits)
+ * don't count either, and only the keys that turned hot or cold since
+ * the previous run are appended to the log, which is rewritten once
+ * these changes outnumber its keys alog_compaction_ratio times.  A run
+ * lets other tasks go every alog_slice_time ms.
+ */
 class AccessScanner : public DispatcherCallback {
     friend class AccessScannerValueChangeListener;
+    friend class ItemAccessVisitor;
 public:
     AccessScanner(EventuallyPersistentStore &_store, EPStats &st,
                   size_t sleetime);
@@ -40,10 +52,19 @@ public:
     size_t startTime();
 
 private:
+    void rewritten(bool installed, size_t keys);
+    void appended(size_t changes);
+
     EventuallyPersistentStore &store;
     EPStats &stats;
     size_t sleepTime;
     bool available;
+    //! True if the next run has to rewrite the log.
+    bool needRewrite;
+    //! Keys the log was last rewritten with.
+    size_t rewriteKeys;
+    //! Changes appended to the log since.
+    size_t appendedKeys;
 };
 
 #endif  // SRC_ACCESS_SCANNER_H_
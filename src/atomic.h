@@ -315,6 +315,15 @@ private:
     mutable Atomic<int> _rc_refcount;
 };
 
+/**
+ * Release an RCValue whose last reference is gone.  Types that are
+ * not allocated with plain new provide an overload of this.
+ */
+template <class C>
+inline void rcRelease(C *value) {
+    delete value;
+}
+
 /**
  * Concurrent reference counted pointer.
  */
@@ -331,7 +340,7 @@ public:
 
     ~RCPtr() {
         if (value && static_cast<RCValue *>(value)->_rc_decref() == 0) {
-            delete value;
+            rcRelease(value.get());
         }
     }
 
@@ -354,7 +363,7 @@ public:
             if (tmp != NULL &&
                 static_cast<RCValue *>(tmp)->_rc_decref() == 0) {
                 lh.unlock();
-                delete tmp;
+                rcRelease(tmp);
             }
             return true;
         }
@@ -401,7 +410,7 @@ private:
         C *tmp(value.swap(newValue));
         lh.unlock();
         if (tmp != NULL && static_cast<RCValue *>(tmp)->_rc_decref() == 0) {
-            delete tmp;
+            rcRelease(tmp);
         }
     }
 
@@ -428,7 +437,7 @@ public:
 
     ~SingleThreadedRCPtr() {
         if (value && static_cast<RCValue *>(value)->_rc_decref() == 0) {
-            delete value;
+            rcRelease(value);
         }
     }
 
@@ -481,7 +490,7 @@ private:
         T *old = value;
         value = newValue;
         if (old != NULL && static_cast<RCValue *>(old)->_rc_decref() == 0) {
-            delete old;
+            rcRelease(old);
         }
     }
 
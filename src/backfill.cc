@@ -17,11 +17,15 @@
 
 #include "config.h"
 
+#include <algorithm>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include "atomic.h"
 #include "backfill.h"
 #include "ep.h"
+#include "statwriter.h"
 #include "vbucket.h"
 
 static bool isMemoryUsageTooHigh(EPStats &stats) {
@@ -31,34 +35,152 @@ static bool isMemoryUsageTooHigh(EPStats &stats) {
 }
 
 /**
- * Callback class used to process an item backfilled from disk and push it into
- * the corresponding TAP queue.
+ * Callback class used to collect a chunk of items backfilled from disk.
  */
 class BackfillDiskCallback : public Callback<GetValue> {
 public:
-    BackfillDiskCallback(hrtime_t token, const std::string &n,
-                         TapConnMap &tcm, EventuallyPersistentEngine* e)
-        : connToken(token), tapConnName(n), connMap(tcm), engine(e) {
-        assert(engine);
+    void callback(GetValue &gv) {
+        assert(gv.getValue());
+        items.push_back(gv.getValue());
     }
 
-    void callback(GetValue &val);
+    std::vector<Item*> items;
+};
+
+BackfillExecutor::BackfillExecutor(EventuallyPersistentStore *s, size_t nreaders) :
+    store(s), dispatcher(s->getAuxIODispatcher()), readDispatcher(NULL),
+    debt(0), lastCharge(gethrtime())
+{
+    if (nreaders > 1) {
+        readDispatcher = new Dispatcher(store->getEPEngine(),
+                                        "BACKFILL_Dispatcher", nreaders);
+        dispatcher = readDispatcher;
+        for (size_t i = 0; i < nreaders; ++i) {
+            allReaders.push_back(store->getEPEngine().newKVStore(true));
+        }
+        readers = allReaders;
+    } else {
+        readers.push_back(store->getAuxUnderlying());
+    }
+}
 
-private:
+BackfillExecutor::~BackfillExecutor() {
+    // Drops the reads still scheduled, which unregister themselves.
+    delete readDispatcher;
+    std::vector<KVStore*>::iterator it;
+    for (it = allReaders.begin(); it != allReaders.end(); ++it) {
+        delete *it;
+    }
+}
 
-    hrtime_t                    connToken;
-    const std::string           tapConnName;
-    TapConnMap                 &connMap;
-    EventuallyPersistentEngine *engine;
-};
+void BackfillExecutor::start() {
+    if (readDispatcher) {
+        readDispatcher->start();
+    }
+}
+
+void BackfillExecutor::stop() {
+    if (readDispatcher) {
+        readDispatcher->stop(store->getEPEngine().getEpStats().forceShutdown);
+    }
+}
+
+void BackfillExecutor::schedule(const std::string &name, uint16_t vbid,
+                                backfill_t type, hrtime_t token) {
+    load_key_t key(vbid, type);
+    LockHolder lh(loadsMutex);
+    std::map<load_key_t, BackfillDiskLoad*>::iterator it = loads.find(key);
+    if (it != loads.end()) {
+        LOG(EXTENSION_LOG_INFO,
+            "Join the backfill from disk running for vbucket %d.\n", vbid);
+        it->second->joining.push_back(BackfillDiskLoad::Subscriber(name, token));
+        ++it->second->numProducers;
+        return;
+    }
 
-void BackfillDiskCallback::callback(GetValue &gv) {
-    assert(gv.getValue());
-    CompletedBGFetchTapOperation tapop(connToken, gv.getValue()->getVBucketId(), true);
-    // if the tap connection is closed, then free an Item instance
-    if (!connMap.performTapOp(tapConnName, tapop, gv.getValue())) {
-        delete gv.getValue();
+    LOG(EXTENSION_LOG_INFO,
+        "Schedule a full backfill from disk for vbucket %d.\n", vbid);
+    EventuallyPersistentEngine *engine(&store->getEPEngine());
+    BackfillDiskLoad *load = new BackfillDiskLoad(engine, engine->getTapConnMap(),
+                                                  *this, vbid, type);
+    load->joining.push_back(BackfillDiskLoad::Subscriber(name, token));
+    ++load->numProducers;
+    loads[key] = load;
+    lh.unlock();
+
+    shared_ptr<DispatcherCallback> cb(load);
+    dispatcher->schedule(cb, NULL, Priority::TapBgFetcherPriority);
+}
+
+void BackfillExecutor::addStats(ADD_STAT add_stat, const void *c) {
+    LockHolder lh(loadsMutex);
+    hrtime_t now = gethrtime();
+    std::map<load_key_t, BackfillDiskLoad*>::iterator it = loads.begin();
+    for (; it != loads.end(); ++it) {
+        BackfillDiskLoad *load = it->second;
+        std::stringstream prefix;
+        prefix << "ep_tap_backfill:vb_" << it->first.first;
+        if (it->first.second == DELETIONS_ONLY) {
+            prefix << ":deletions";
+        }
+        add_prefixed_stat(prefix.str().c_str(), "producers",
+                          load->numProducers.get(), add_stat, c);
+        add_prefixed_stat(prefix.str().c_str(), "items_read",
+                          load->itemsRead.get(), add_stat, c);
+        add_prefixed_stat(prefix.str().c_str(), "bytes_read",
+                          load->bytesRead.get(), add_stat, c);
+        add_prefixed_stat(prefix.str().c_str(), "runtime",
+                          (now - load->startTime) / 1000000, add_stat, c);
+    }
+}
+
+KVStore *BackfillExecutor::acquireReader() {
+    LockHolder lh(readersMutex);
+    // There are as many readers as threads running reads.
+    assert(!readers.empty());
+    KVStore *kvstore = readers.back();
+    readers.pop_back();
+    return kvstore;
+}
+
+void BackfillExecutor::releaseReader(KVStore *kvstore) {
+    LockHolder lh(readersMutex);
+    readers.push_back(kvstore);
+}
+
+double BackfillExecutor::getThrottleDelay() {
+    size_t rate = store->getEPEngine().getTapConfig().getBackfillDiskRate();
+    LockHolder lh(throttleMutex);
+    hrtime_t now = gethrtime();
+    if (rate == 0) {
+        debt = 0;
+    } else {
+        debt -= static_cast<double>(now - lastCharge) * rate / 1000000000.0;
+        if (debt < 0) {
+            debt = 0;
+        }
     }
+    lastCharge = now;
+    return rate == 0 ? 0 : debt / rate;
+}
+
+void BackfillExecutor::consume(size_t bytes) {
+    LockHolder lh(throttleMutex);
+    debt += bytes;
+}
+
+void BackfillExecutor::remove(BackfillDiskLoad *load) {
+    LockHolder lh(loadsMutex);
+    load_key_t key(load->vbucket, load->backfillType);
+    std::map<load_key_t, BackfillDiskLoad*>::iterator it = loads.find(key);
+    if (it != loads.end() && it->second == load) {
+        loads.erase(it);
+    }
+}
+
+BackfillDiskLoad::~BackfillDiskLoad() {
+    // Only still registered if the dispatcher dropped the task.
+    executor.remove(this);
 }
 
 bool BackfillDiskLoad::callback(Dispatcher &d, TaskId &t) {
@@ -70,30 +192,141 @@ bool BackfillDiskLoad::callback(Dispatcher &d, TaskId &t) {
         return true;
     }
 
-    if (connMap.checkConnectivity(name) && !engine->getEpStore()->isFlushAllScheduled()) {
-        shared_ptr<Callback<GetValue> > backfill_cb(new BackfillDiskCallback(connToken,
-                                                                             name, connMap,
-                                                                             engine));
-        if (backfillType == ALL_MUTATIONS) {
-            store->dump(vbucket, backfill_cb);
-        } else if (store->getStorageProperties().hasPersistedDeletions() &&
-                   backfillType == DELETIONS_ONLY) {
-            store->dumpDeleted(vbucket, backfill_cb);
+    LockHolder lh(executor.loadsMutex);
+    std::list<Subscriber>::iterator it = joining.begin();
+    for (; it != joining.end(); ++it) {
+        it->joinedAt = nextSeqno;
+    }
+    subscribers.splice(subscribers.end(), joining);
+    lh.unlock();
+
+    // Read no further ahead than the fullest tap queue has room for.
+    bool flushing = engine->getEpStore()->isFlushAllScheduled();
+    ssize_t limit = engine->getTapConfig().getBackfillBacklogLimit();
+    ssize_t room = limit;
+    it = subscribers.begin();
+    while (it != subscribers.end()) {
+        ssize_t depth = connMap.backfillQueueDepth(it->name);
+        if (flushing || depth < 0 || !connMap.checkConnectivity(it->name)) {
+            complete(*it);
+            it = subscribers.erase(it);
         } else {
-            LOG(EXTENSION_LOG_WARNING,
-                "Underlying KVStore doesn't support this kind of backfill");
-            abort();
+            room = std::min(room, limit - depth);
+            ++it;
         }
     }
 
-    LOG(EXTENSION_LOG_INFO,"VBucket %d backfill task from disk is completed",
-        vbucket);
+    if (!subscribers.empty()) {
+        if (room < std::min(limit, static_cast<ssize_t>(BACKFILL_DISK_MIN_CHUNK))) {
+            d.snooze(t, BACKFILL_DISK_SNOOZE);
+            return true;
+        }
+        double delay = executor.getThrottleDelay();
+        if (delay > 0) {
+            d.snooze(t, delay);
+            return true;
+        }
+        readChunk(std::min(static_cast<size_t>(room),
+                           static_cast<size_t>(BACKFILL_DISK_CHUNK)));
+    }
 
-    // Should decr the disk backfill counter regardless of the connectivity status
-    CompleteDiskBackfillTapOperation op;
-    connMap.performTapOp(name, op, static_cast<void*>(NULL));
+    if (subscribers.empty()) {
+        lh.lock();
+        if (joining.empty()) {
+            executor.loads.erase(BackfillExecutor::load_key_t(vbucket, backfillType));
+            LOG(EXTENSION_LOG_INFO, "VBucket %d backfill task from disk is completed",
+                vbucket);
+            return false;
+        }
+    }
+    return true;
+}
 
-    return false;
+void BackfillDiskLoad::readChunk(size_t limit) {
+    shared_ptr<BackfillDiskCallback> cb(new BackfillDiskCallback);
+    KVStore *store = executor.acquireReader();
+    if (backfillType == ALL_MUTATIONS) {
+        nextSeqno = store->dumpChunk(vbucket, nextSeqno, limit, cb);
+    } else if (store->getStorageProperties().hasPersistedDeletions() &&
+               backfillType == DELETIONS_ONLY) {
+        store->dumpDeleted(vbucket, cb);
+        nextSeqno = 0;
+    } else {
+        LOG(EXTENSION_LOG_WARNING,
+            "Underlying KVStore doesn't support this kind of backfill");
+        abort();
+    }
+    executor.releaseReader(store);
+
+    std::vector<Item*> &items = cb->items;
+    size_t bytes(0);
+    std::vector<Item*>::iterator iit = items.begin();
+    for (; iit != items.end(); ++iit) {
+        bytes += (*iit)->getNKey() + (*iit)->getNBytes();
+    }
+    itemsRead.incr(items.size());
+    bytesRead.incr(bytes);
+    executor.consume(bytes);
+
+    std::list<Subscriber>::iterator it = subscribers.begin();
+    while (it != subscribers.end()) {
+        // The last producer, often the only one, takes the items read;
+        // the others get copies sharing their values.
+        std::list<Subscriber>::iterator next(it);
+        bool last = ++next == subscribers.end();
+        // After wrapping around a producer only needs what it missed.
+        std::vector<Item*> batch;
+        for (iit = items.begin(); iit != items.end(); ++iit) {
+            Item *itm = *iit;
+            if (!it->wrapped || static_cast<uint64_t>(itm->getId()) < it->joinedAt) {
+                if (last) {
+                    batch.push_back(itm);
+                    *iit = NULL;
+                    continue;
+                }
+                const std::string &key = itm->getKey();
+                batch.push_back(new Item(itm->getValue(), key.data(),
+                                         static_cast<uint16_t>(key.length()),
+                                         itm->getFlags(), itm->getExptime(),
+                                         itm->getCas(), itm->getId(),
+                                         itm->getVBucketId(), itm->getSeqno()));
+            }
+        }
+        if (!batch.empty()) {
+            CompletedDiskBackfillTapOperation tapop(it->connToken, vbucket);
+            // if the tap connection is closed, then free the Item instances
+            if (!connMap.performTapOp(it->name, tapop, &batch)) {
+                for (iit = batch.begin(); iit != batch.end(); ++iit) {
+                    delete *iit;
+                }
+            }
+        }
+
+        bool done(false);
+        if (nextSeqno == 0) {
+            done = it->wrapped || it->joinedAt == 0;
+            it->wrapped = true;
+        } else {
+            done = it->wrapped && nextSeqno >= it->joinedAt;
+        }
+        if (done) {
+            complete(*it);
+            it = subscribers.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    for (iit = items.begin(); iit != items.end(); ++iit) {
+        delete *iit;
+    }
+}
+
+void BackfillDiskLoad::complete(const Subscriber &sub) {
+    --numProducers;
+    // Should decr the disk backfill counter regardless of the connectivity status
+    CompleteDiskBackfillTapOperation op(vbucket);
+    connMap.performTapOp(sub.name, op, static_cast<void*>(NULL));
 }
 
 std::string BackfillDiskLoad::description() {
@@ -128,12 +361,12 @@ bool BackFillVisitor::visitBucket(RCPtr<VBucket> &vb) {
             num_backfill_items = (vb->opsCreate - vb->opsDelete) +
                 static_cast<size_t>(num_items - num_non_resident);
             vbuckets[vb->getId()] = ALL_MUTATIONS;
-            ScheduleDiskBackfillTapOperation tapop;
+            ScheduleDiskBackfillTapOperation tapop(vb->getId());
             engine->tapConnMap->performTapOp(name, tapop, static_cast<void*>(NULL));
         } else {
             if (engine->epstore->getStorageProperties().hasPersistedDeletions()) {
                 vbuckets[vb->getId()] = DELETIONS_ONLY;
-                ScheduleDiskBackfillTapOperation tapop;
+                ScheduleDiskBackfillTapOperation tapop(vb->getId());
                 engine->tapConnMap->performTapOp(name, tapop, static_cast<void*>(NULL));
             }
             num_backfill_items = static_cast<size_t>(num_items);
@@ -165,20 +398,9 @@ void BackFillVisitor::apply(void) {
     if (efficientVBDump) {
         std::map<uint16_t, backfill_t>::iterator it = vbuckets.begin();
         for (; it != vbuckets.end(); ++it) {
-            Dispatcher *d(engine->epstore->getAuxIODispatcher());
-            KVStore *underlying(engine->epstore->getAuxUnderlying());
-            assert(d);
-            LOG(EXTENSION_LOG_INFO,
-                "Schedule a full backfill from disk for vbucket %d.\n",
-                it->first);
-            shared_ptr<DispatcherCallback> cb(new BackfillDiskLoad(name,
-                                                                   engine,
-                                                                   *engine->tapConnMap,
-                                                                   underlying,
-                                                                   it->first,
-                                                                   it->second,
-                                                                   connToken));
-            d->schedule(cb, NULL, Priority::TapBgFetcherPriority);
+            engine->epstore->getBackfillExecutor()->schedule(name, it->first,
+                                                             it->second,
+                                                             connToken);
         }
         vbuckets.clear();
     }
@@ -26,7 +26,10 @@
 #include <map>
 #include <set>
 #include <string>
+#include <utility>
+#include <vector>
 
+#include "atomic.h"
 #include "common.h"
 #include "dispatcher.h"
 #include "ep_engine.h"
@@ -35,42 +38,165 @@
 
 
 #define BACKFILL_MEM_THRESHOLD 0.95
+//! Most items read from disk at once for a backfill
+#define BACKFILL_DISK_CHUNK 1000
+//! Least room in the tap queues worth reading another chunk for
+#define BACKFILL_DISK_MIN_CHUNK 100
+//! Seconds to wait for the tap queues to drain
+#define BACKFILL_DISK_SNOOZE 0.1
 
 typedef enum backfill_t {
     ALL_MUTATIONS = 1,
     DELETIONS_ONLY
 } backfill_t;
 
+class BackfillExecutor;
+
 /**
  * Dispatcher callback responsible for bulk backfilling tap queues
  * from a KVStore.
  *
+ * A vbucket is read in chunks of sequence numbers, and only as far
+ * ahead as the tap queues it feeds have room for below the backfill
+ * backlog limit, so a slow consumer pauses the read instead of
+ * piling the vbucket up in memory.  All the producers backfilling the
+ * same vbucket at the same time share one read: a producer joining
+ * midway gets the rest of the vbucket first and is completed once the
+ * read wrapped around to where it joined.
+ *
  * Note that this is only used if the KVStore reports that it has
  * efficient vbucket ops.
  */
 class BackfillDiskLoad : public DispatcherCallback {
 public:
 
-    BackfillDiskLoad(const std::string &n, EventuallyPersistentEngine* e,
-                     TapConnMap &tcm, KVStore *s, uint16_t vbid, backfill_t type,
-                     hrtime_t token)
-        : name(n), engine(e), connMap(tcm), store(s), vbucket(vbid), backfillType(type),
-       connToken(token) { }
-
-    void callback(GetValue &gv);
+    ~BackfillDiskLoad();
 
     bool callback(Dispatcher &, TaskId &);
 
     std::string description();
 
 private:
-    const std::string           name;
+    friend class BackfillExecutor;
+
+    struct Subscriber {
+        Subscriber(const std::string &n, hrtime_t token)
+            : name(n), connToken(token), joinedAt(0), wrapped(false) { }
+
+        std::string name;
+        hrtime_t    connToken;
+        //! The sequence number the read was at when the producer joined
+        uint64_t    joinedAt;
+        //! True once the read went past the end of the vbucket
+        bool        wrapped;
+    };
+
+    BackfillDiskLoad(EventuallyPersistentEngine* e, TapConnMap &tcm,
+                     BackfillExecutor &ex, uint16_t vbid, backfill_t type)
+        : engine(e), connMap(tcm), executor(ex), vbucket(vbid),
+          backfillType(type), nextSeqno(0), startTime(gethrtime()) { }
+
+    void readChunk(size_t limit);
+
+    void complete(const Subscriber &sub);
+
     EventuallyPersistentEngine *engine;
     TapConnMap                 &connMap;
-    KVStore                    *store;
+    BackfillExecutor           &executor;
     uint16_t                    vbucket;
     backfill_t                  backfillType;
-    hrtime_t                    connToken;
+    //! Where the next chunk starts, 0 at the beginning of the vbucket
+    uint64_t                    nextSeqno;
+    std::list<Subscriber>       subscribers;
+    //! Producers that joined since the last chunk, guarded by the executor
+    std::list<Subscriber>       joining;
+
+    // Progress, read by the executor's stats.
+    hrtime_t                    startTime;
+    Atomic<size_t>              itemsRead;
+    Atomic<size_t>              bytesRead;
+    Atomic<size_t>              numProducers;
+};
+
+/**
+ * Runs the disk backfills of the TAP producers.
+ *
+ * With a single reader the backfills share the auxiliary IO dispatcher
+ * and store.  With more, the vbuckets are read in parallel on a
+ * dispatcher with a worker thread per reader, each read going through
+ * a read-only store of its own, like the BgFetcher does.  Either way
+ * the reads together stay below tap_backfill_disk_rate bytes/sec.
+ */
+class BackfillExecutor {
+public:
+    BackfillExecutor(EventuallyPersistentStore *s, size_t nreaders = 1);
+
+    ~BackfillExecutor();
+
+    void start(void);
+    void stop(void);
+
+    /**
+     * Backfill a vbucket from disk for a tap producer, joining the
+     * read of the vbucket that is already running if there is one.
+     */
+    void schedule(const std::string &name, uint16_t vbid, backfill_t type,
+                  hrtime_t token);
+
+    /**
+     * Get the number of vbuckets read at the same time.
+     */
+    size_t getNumReaders() const {
+        return allReaders.empty() ? 1 : allReaders.size();
+    }
+
+    /**
+     * Add the progress of every vbucket being read.
+     */
+    void addStats(ADD_STAT add_stat, const void *c);
+
+private:
+    friend class BackfillDiskLoad;
+
+    typedef std::pair<uint16_t, backfill_t> load_key_t;
+
+    KVStore *acquireReader(void);
+    void releaseReader(KVStore *kvstore);
+
+    /**
+     * Get how many seconds to wait before reading more to stay below
+     * the disk rate limit.
+     */
+    double getThrottleDelay(void);
+
+    /**
+     * Charge bytes read to the disk rate limit.
+     */
+    void consume(size_t bytes);
+
+    void remove(BackfillDiskLoad *load);
+
+    EventuallyPersistentStore *store;
+    Dispatcher *dispatcher;
+
+    //! Runs the reads when reading in parallel (NULL otherwise).
+    Dispatcher *readDispatcher;
+    //! The read-only stores not in use by a read.
+    std::vector<KVStore*> readers;
+    Mutex readersMutex;
+    //! All the stores created for readDispatcher.
+    std::vector<KVStore*> allReaders;
+
+    //! The reads running, also guarding the producers joining them.
+    Mutex loadsMutex;
+    std::map<load_key_t, BackfillDiskLoad*> loads;
+
+    //! Bytes read beyond what the disk rate limit allowed so far.
+    Mutex throttleMutex;
+    double debt;
+    hrtime_t lastCharge;
+
+    DISALLOW_COPY_AND_ASSIGN(BackfillExecutor);
 };
 
 /**
@@ -21,6 +21,7 @@
 
 #include "bgfetcher.h"
 #include "ep.h"
+#include "ep_engine.h"
 
 const double BgFetcher::sleepInterval = 1.0;
 
@@ -28,31 +29,82 @@ bool BgFetcherCallback::callback(Dispatcher &, TaskId &t) {
     return bgfetcher->run(t);
 }
 
+bool BgFetchBatchCallback::callback(Dispatcher &, TaskId &) {
+    bgfetcher->fetchBatch(vbId, *items);
+    return false;
+}
+
+BgFetcher::BgFetcher(EventuallyPersistentStore *s, Dispatcher *d, EPStats &st,
+                     size_t nreaders) :
+    store(s), dispatcher(d), stats(st), readDispatcher(NULL)
+{
+    if (nreaders > 1) {
+        readDispatcher = new Dispatcher(store->getEPEngine(),
+                                        "BGFETCH_Dispatcher", nreaders);
+        for (size_t i = 0; i < nreaders; ++i) {
+            allReaders.push_back(store->getEPEngine().newKVStore(true));
+        }
+        readers = allReaders;
+    }
+}
+
+BgFetcher::~BgFetcher() {
+    delete readDispatcher;
+    std::vector<KVStore*>::iterator it;
+    for (it = allReaders.begin(); it != allReaders.end(); ++it) {
+        delete *it;
+    }
+}
+
 void BgFetcher::start() {
     LockHolder lh(taskMutex);
     dispatcher->schedule(shared_ptr<BgFetcherCallback>(new BgFetcherCallback(this)),
                          &task, Priority::BgFetcherPriority);
     assert(task.get());
+    if (readDispatcher) {
+        readDispatcher->start();
+    }
 }
 
 void BgFetcher::stop() {
     LockHolder lh(taskMutex);
     assert(task.get());
     dispatcher->cancel(task);
+    lh.unlock();
+    if (readDispatcher) {
+        // Completes the batches already handed over, unless forced.
+        readDispatcher->stop(stats.forceShutdown);
+    }
 }
 
-void BgFetcher::doFetch(uint16_t vbId) {
+void BgFetcher::fetchBatch(uint16_t vbId, vb_bgfetch_queue_t &items) {
+    LockHolder lh(readersMutex);
+    // There are as many readers as threads running batches.
+    assert(!readers.empty());
+    KVStore *kvstore = readers.back();
+    readers.pop_back();
+    lh.unlock();
+
+    doFetch(vbId, items, kvstore);
+
+    lh.lock();
+    readers.push_back(kvstore);
+}
+
+void BgFetcher::doFetch(uint16_t vbId, vb_bgfetch_queue_t &items,
+                        KVStore *kvstore) {
     hrtime_t startTime(gethrtime());
     LOG(EXTENSION_LOG_DEBUG, "BgFetcher is fetching data, vBucket = %d "
-        "numDocs = %d, startTime = %lld\n", vbId, items2fetch.size(),
+        "numDocs = %d, startTime = %lld\n", vbId, items.size(),
         startTime/1000000);
 
-    store->getROUnderlying()->getMulti(vbId, items2fetch);
+    kvstore->getMulti(vbId, items);
+    stats.bgFetchBatchHisto.add(items.size());
 
     int totalfetches = 0;
     std::vector<VBucketBGFetchItem *> fetchedItems;
-    vb_bgfetch_queue_t::iterator itr = items2fetch.begin();
-    for (; itr != items2fetch.end(); ++itr) {
+    vb_bgfetch_queue_t::iterator itr = items.begin();
+    for (; itr != items.end(); ++itr) {
         std::list<VBucketBGFetchItem *> &requestedItems = (*itr).second;
         std::list<VBucketBGFetchItem *>::iterator itm = requestedItems.begin();
         for(; itm != requestedItems.end(); ++itm) {
@@ -77,14 +129,14 @@ void BgFetcher::doFetch(uint16_t vbId) {
     }
 
     // failed requests will get requeued for retry within clearItems()
-    clearItems(vbId);
+    clearItems(vbId, items);
 }
 
-void BgFetcher::clearItems(uint16_t vbId) {
-    vb_bgfetch_queue_t::iterator itr = items2fetch.begin();
+void BgFetcher::clearItems(uint16_t vbId, vb_bgfetch_queue_t &items) {
+    vb_bgfetch_queue_t::iterator itr = items.begin();
     size_t numRequeuedItems = 0;
 
-    for(; itr != items2fetch.end(); ++itr) {
+    for(; itr != items.end(); ++itr) {
         // every fetched item belonging to the same seq_id shares
         // a single data buffer, just delete it from the first fetched item
         std::list<VBucketBGFetchItem *> &doneItems = (*itr).second;
@@ -110,8 +162,12 @@ void BgFetcher::clearItems(uint16_t vbId) {
         }
     }
 
-    if (numRequeuedItems) {
-        stats.numRemainingBgJobs.incr(numRequeuedItems);
+    if (numRequeuedItems &&
+        stats.numRemainingBgJobs.incr(numRequeuedItems) == 0 &&
+        readDispatcher) {
+        // The fetcher may have gone to sleep meanwhile.
+        LockHolder lh(taskMutex);
+        dispatcher->wake(task);
     }
 }
 
@@ -125,8 +181,21 @@ bool BgFetcher::run(TaskId &tid) {
         RCPtr<VBucket> vb = vbMap.getBucket(vbid);
         assert(items2fetch.empty());
         if (vb && vb->getBGFetchItems(items2fetch)) {
-            doFetch(vbid);
-            num_fetched_items += items2fetch.size();
+            // Count every request, including the ones sharing a read.
+            vb_bgfetch_queue_t::iterator itr = items2fetch.begin();
+            for (; itr != items2fetch.end(); ++itr) {
+                num_fetched_items += itr->second.size();
+            }
+            if (readDispatcher) {
+                vb_bgfetch_queue_t *batch = new vb_bgfetch_queue_t;
+                batch->swap(items2fetch);
+                shared_ptr<DispatcherCallback> cb(
+                    new BgFetchBatchCallback(this, vbid, batch));
+                readDispatcher->schedule(cb, NULL, Priority::BgFetcherPriority,
+                                         0, false, true);
+            } else {
+                doFetch(vbid, items2fetch, store->getROUnderlying());
+            }
             items2fetch.clear();
         }
     }
@@ -65,6 +65,7 @@ typedef unordered_map<uint64_t, std::list<VBucketBGFetchItem *> > vb_bgfetch_que
 // Forward declaration.
 class EventuallyPersistentStore;
 class BgFetcher;
+class KVStore;
 
 /**
  * A DispatcherCallback for BgFetcher
@@ -82,9 +83,39 @@ private:
     BgFetcher *bgfetcher;
 };
 
+/**
+ * A DispatcherCallback reading one vbucket's batch of background
+ * fetches through one of the BgFetcher's readers.
+ */
+class BgFetchBatchCallback : public DispatcherCallback {
+public:
+    BgFetchBatchCallback(BgFetcher *b, uint16_t vb, vb_bgfetch_queue_t *i) :
+        bgfetcher(b), vbId(vb), items(i) { }
+
+    ~BgFetchBatchCallback() {
+        delete items;
+    }
+
+    bool callback(Dispatcher &d, TaskId &t);
+    std::string description() {
+        std::stringstream ss;
+        ss << "Fetching a batch of items from disk for vbucket " << vbId;
+        return ss.str();
+    }
+
+private:
+    BgFetcher *bgfetcher;
+    uint16_t vbId;
+    vb_bgfetch_queue_t *items;
+};
+
 /**
  * Dispatcher job responsible for batching data reads and push to
  * underlying storage
+ *
+ * With more than one reader the batches of the different vbuckets are
+ * handed to a dispatcher with a worker thread per reader, so they are
+ * read in parallel while new requests are being collected.
  */
 class BgFetcher {
 public:
@@ -95,14 +126,21 @@ public:
      * @param s the store
      * @param d the dispatcher
      */
-    BgFetcher(EventuallyPersistentStore *s, Dispatcher *d, EPStats &st) :
-        store(s), dispatcher(d), stats(st) {}
+    BgFetcher(EventuallyPersistentStore *s, Dispatcher *d, EPStats &st,
+              size_t nreaders = 1);
+
+    ~BgFetcher();
 
     void start(void);
     void stop(void);
     bool run(TaskId &tid);
     bool pendingJob(void);
 
+    /**
+     * Read a batch of fetches on one of the readers and complete them.
+     */
+    void fetchBatch(uint16_t vbId, vb_bgfetch_queue_t &items);
+
     void notifyBGEvent(void) {
         if (++stats.numRemainingBgJobs == 1) {
             LockHolder lh(taskMutex);
@@ -112,8 +150,8 @@ public:
     }
 
 private:
-    void doFetch(uint16_t vbId);
-    void clearItems(uint16_t vbId);
+    void doFetch(uint16_t vbId, vb_bgfetch_queue_t &items, KVStore *kvstore);
+    void clearItems(uint16_t vbId, vb_bgfetch_queue_t &items);
 
     EventuallyPersistentStore *store;
     Dispatcher *dispatcher;
@@ -121,6 +159,16 @@ private:
     TaskId task;
     Mutex taskMutex;
     EPStats &stats;
+
+    //! Runs the batches when reading in parallel (NULL otherwise).
+    Dispatcher *readDispatcher;
+    //! The read-only stores not in use by a batch.
+    std::vector<KVStore*> readers;
+    Mutex readersMutex;
+    //! All the stores created for readDispatcher.
+    std::vector<KVStore*> allReaders;
+
+    DISALLOW_COPY_AND_ASSIGN(BgFetcher);
 };
 
 #endif  // SRC_BGFETCHER_H_
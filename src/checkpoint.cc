@@ -23,6 +23,8 @@
 
 #include "checkpoint.h"
 #include "ep_engine.h"
+#include "epoch.h"
+#include "keyhash.h"
 #define STATWRITER_NAMESPACE checkpoint
 #include "statwriter.h"
 #undef STATWRITER_NAMESPACE
@@ -72,15 +74,227 @@ void Checkpoint::setState(checkpoint_state state) {
     checkpointState = state;
 }
 
+const size_t CheckpointLog::NOT_FOUND(static_cast<size_t>(-1));
+
+//! Position of an unused slot of the key index.
+static const uint32_t EMPTY_SLOT(0xffffffff);
+
+static inline uint32_t hashKey(const std::string &key) {
+    return static_cast<uint32_t>(KeyHash::xx64(key.data(), key.size(), 0));
+}
+
+CheckpointLog::~CheckpointLog() {
+    for (size_t i = 0; i < numChunks; ++i) {
+        delete []chunks[i];
+    }
+    delete []chunks;
+    delete []table;
+}
+
+size_t CheckpointLog::find(const std::string &key) {
+    if (tableUsed == 0) {
+        return NOT_FOUND;
+    }
+    size_t slot = findSlot(key, hashKey(key));
+    return table[slot].pos == EMPTY_SLOT ? NOT_FOUND : table[slot].pos;
+}
+
+CheckpointEntry &CheckpointLog::push(const queued_item &qi, uint64_t mutationId) {
+    size_t capacity = numChunks == 0 ? 0 :
+        FIRST_CHUNK_ENTRIES + (numChunks - 1) * CHUNK_ENTRIES;
+    if (used == capacity) {
+        if (numChunks == chunksSize) {
+            size_t newSize = chunksSize == 0 ? 4 : chunksSize * 2;
+            CheckpointEntry **newChunks = new CheckpointEntry*[newSize];
+            std::copy(chunks, chunks + numChunks, newChunks);
+            CheckpointEntry **oldChunks = chunks;
+            ep_sync_synchronize();
+            chunks = newChunks;
+            chunksSize = newSize;
+            if (oldChunks != NULL) {
+                Epoch::retire(new RetiredArray<CheckpointEntry*>(oldChunks));
+            }
+        }
+        chunks[numChunks] = new CheckpointEntry[numChunks == 0 ?
+                                                FIRST_CHUNK_ENTRIES : CHUNK_ENTRIES];
+        ++numChunks;
+    }
+    CheckpointEntry &e = entry(used++);
+    e.item = qi;
+    e.mutationId = mutationId;
+    ++live;
+    return e;
+}
+
+void CheckpointLog::publish() {
+    // swap() is a full barrier, so the entries are complete before
+    // readers can get to them.
+    publishedUsed.swap(used);
+}
+
+void CheckpointLog::append(const queued_item &qi, uint64_t mutationId) {
+    push(qi, mutationId);
+    if (qi->getKey().size() > 0) {
+        index(qi->getKey(), used - 1);
+    }
+    publish();
+}
+
+void CheckpointLog::moveToBack(size_t pos, uint64_t mutationId) {
+    CheckpointEntry &old = entry(pos);
+    assert(old.item);
+    const std::string &key = old.item->getKey();
+    size_t slot = findSlot(key, hashKey(key));
+    assert(table[slot].pos == pos);
+    push(old.item, mutationId);
+    old.item.reset();
+    --live;
+    table[slot].pos = static_cast<uint32_t>(used - 1);
+    publish();
+}
+
+void CheckpointLog::popBack() {
+    size_t pos = prevLive(used);
+    CheckpointEntry &e = entry(pos);
+    if (e.item) {
+        const std::string &key = e.item->getKey();
+        if (key.size() > 0) {
+            size_t slot = findSlot(key, hashKey(key));
+            if (table[slot].pos == pos) {
+                eraseSlot(slot);
+            }
+        }
+        e.item.reset();
+        --live;
+    }
+    used = pos;
+    publish();
+    size_t keep = 1;
+    if (used > FIRST_CHUNK_ENTRIES) {
+        keep = 2 + (used - FIRST_CHUNK_ENTRIES - 1) / CHUNK_ENTRIES;
+    }
+    while (numChunks > keep) {
+        delete []chunks[--numChunks];
+    }
+}
+
+void CheckpointLog::rebuild(size_t at, const std::vector<CheckpointEntry> &inserted,
+                            std::vector<size_t> &newPositions) {
+    CheckpointLog fresh;
+    newPositions.assign(used, NOT_FOUND);
+    for (size_t i = 0; i <= used; ++i) {
+        if (i == at) {
+            std::vector<CheckpointEntry>::const_iterator it;
+            for (it = inserted.begin(); it != inserted.end(); ++it) {
+                fresh.append(it->item, it->mutationId);
+            }
+        }
+        if (i < used && entry(i).item) {
+            newPositions[i] = fresh.used;
+            fresh.append(entry(i).item, entry(i).mutationId);
+        }
+    }
+    // The caller keeps the readers out, so the old chunks can go now.
+    swap(fresh);
+}
+
+size_t CheckpointLog::memorySize() const {
+    size_t rv = chunksSize * sizeof(CheckpointEntry*) +
+        tableSize * sizeof(IndexSlot);
+    if (numChunks > 0) {
+        rv += (FIRST_CHUNK_ENTRIES + (numChunks - 1) * CHUNK_ENTRIES) *
+            sizeof(CheckpointEntry);
+    }
+    return rv;
+}
+
+void CheckpointLog::index(const std::string &key, size_t pos) {
+    if ((tableUsed + 1) * 2 > tableSize) {
+        growIndex();
+    }
+    uint32_t hash = hashKey(key);
+    size_t slot = findSlot(key, hash);
+    if (table[slot].pos == EMPTY_SLOT) {
+        table[slot].hash = hash;
+        ++tableUsed;
+    }
+    // A key queued again takes over the slot of its previous entry.
+    table[slot].pos = static_cast<uint32_t>(pos);
+}
+
+size_t CheckpointLog::findSlot(const std::string &key, uint32_t hash) {
+    size_t mask = tableSize - 1;
+    for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+        const IndexSlot &s = table[i];
+        if (s.pos == EMPTY_SLOT ||
+            (s.hash == hash && entry(s.pos).item->getKey() == key)) {
+            return i;
+        }
+    }
+}
+
+void CheckpointLog::eraseSlot(size_t slot) {
+    // Shift back the following slots that would no longer be reachable
+    // from their home slot, so lookups need no deletion markers.
+    size_t mask = tableSize - 1;
+    size_t i = slot;
+    for (size_t j = (i + 1) & mask; table[j].pos != EMPTY_SLOT; j = (j + 1) & mask) {
+        size_t home = table[j].hash & mask;
+        bool stays = i <= j ? (i < home && home <= j) : (i < home || home <= j);
+        if (!stays) {
+            table[i] = table[j];
+            i = j;
+        }
+    }
+    table[i].pos = EMPTY_SLOT;
+    --tableUsed;
+}
+
+void CheckpointLog::growIndex() {
+    IndexSlot *old = table;
+    size_t oldSize = tableSize;
+    tableSize = tableSize == 0 ? 16 : tableSize * 2;
+    table = new IndexSlot[tableSize];
+    for (size_t i = 0; i < tableSize; ++i) {
+        table[i].pos = EMPTY_SLOT;
+    }
+    size_t mask = tableSize - 1;
+    for (size_t i = 0; i < oldSize; ++i) {
+        if (old[i].pos != EMPTY_SLOT) {
+            size_t j = old[i].hash & mask;
+            while (table[j].pos != EMPTY_SLOT) {
+                j = (j + 1) & mask;
+            }
+            table[j] = old[i];
+        }
+    }
+    delete []old;
+}
+
+void CheckpointLog::swap(CheckpointLog &other) {
+    std::swap(chunks, other.chunks);
+    std::swap(numChunks, other.numChunks);
+    std::swap(chunksSize, other.chunksSize);
+    std::swap(used, other.used);
+    size_t otherPublished = other.publishedUsed.get();
+    other.publishedUsed.set(publishedUsed.get());
+    publishedUsed.set(otherPublished);
+    std::swap(live, other.live);
+    std::swap(table, other.table);
+    std::swap(tableSize, other.tableSize);
+    std::swap(tableUsed, other.tableUsed);
+}
+
 void Checkpoint::popBackCheckpointEndItem() {
-    if (!toWrite.empty() && toWrite.back()->getOperation() == queue_op_checkpoint_end) {
-        keyIndex.erase(toWrite.back()->getKey());
-        toWrite.pop_back();
+    if (!toWrite.empty() &&
+        (*(--toWrite.end()))->getOperation() == queue_op_checkpoint_end) {
+        toWrite.popBack();
+        updateMemOverhead();
     }
 }
 
 bool Checkpoint::keyExists(const std::string &key) {
-    return keyIndex.find(key) != keyIndex.end();
+    return toWrite.find(key) != CheckpointLog::NOT_FOUND;
 }
 
 queue_dirty_t Checkpoint::queueDirty(const queued_item &qi, CheckpointManager *checkpointManager) {
@@ -89,29 +303,25 @@ queue_dirty_t Checkpoint::queueDirty(const queued_item &qi, CheckpointManager *c
     uint64_t newMutationId = checkpointManager->nextMutationId();
     queue_dirty_t rv;
 
-    checkpoint_index::iterator it = keyIndex.find(qi->getKey());
+    size_t currPos = qi->getKey().size() > 0 ?
+        toWrite.find(qi->getKey()) : CheckpointLog::NOT_FOUND;
     // Check if this checkpoint already had an item for the same key.
-    if (it != keyIndex.end()) {
+    if (currPos != CheckpointLog::NOT_FOUND) {
         rv = EXISTING_ITEM;
-        std::list<queued_item>::iterator currPos = it->second.position;
-        uint64_t currMutationId = it->second.mutation_id;
+        // The readers of the cursors here must not see the item move.
+        checkpointManager->lockCursorsIn_UNLOCKED(this);
         CheckpointCursor &pcursor = checkpointManager->persistenceCursor;
 
         if (*(pcursor.currentCheckpoint) == this) {
             // If the existing item is in the left-hand side of the item pointed by the
             // persistence cursor, decrease the persistence cursor's offset by 1.
-            const std::string &key = (*(pcursor.currentPos))->getKey();
-            checkpoint_index::iterator ita = keyIndex.find(key);
-            if (ita != keyIndex.end()) {
-                uint64_t mutationId = ita->second.mutation_id;
-                if (currMutationId <= mutationId) {
-                    checkpointManager->decrCursorOffset_UNLOCKED(pcursor, 1);
-                    rv = PERSIST_AGAIN;
-                }
+            if (currPos <= pcursor.currentPos.position()) {
+                checkpointManager->decrCursorOffset_UNLOCKED(pcursor, 1);
+                rv = PERSIST_AGAIN;
             }
             // If the persistence cursor points to the existing item for the same key,
             // shift the cursor left by 1.
-            if (pcursor.currentPos == currPos) {
+            if (pcursor.currentPos.position() == currPos) {
                 checkpointManager->decrCursorPos_UNLOCKED(pcursor);
             }
         }
@@ -121,97 +331,104 @@ queue_dirty_t Checkpoint::queueDirty(const queued_item &qi, CheckpointManager *c
              map_it != checkpointManager->tapCursors.end(); ++map_it) {
 
             if (*(map_it->second.currentCheckpoint) == this) {
-                const std::string &key = (*(map_it->second.currentPos))->getKey();
-                checkpoint_index::iterator ita = keyIndex.find(key);
-                if (ita != keyIndex.end()) {
-                    uint64_t mutationId = ita->second.mutation_id;
-                    if (currMutationId <= mutationId) {
-                        checkpointManager->decrCursorOffset_UNLOCKED(map_it->second, 1);
-                    }
+                if (currPos <= map_it->second.currentPos.position()) {
+                    checkpointManager->decrCursorOffset_UNLOCKED(map_it->second, 1);
                 }
                 // If an TAP cursor points to the existing item for the same key, shift it left by 1
-                if (map_it->second.currentPos == currPos) {
+                if (map_it->second.currentPos.position() == currPos) {
                     checkpointManager->decrCursorPos_UNLOCKED(map_it->second);
                 }
             }
         }
 
-        queued_item &existing_itm = *currPos;
+        // Move the existing item to the tail, leaving a tombstone behind.
+        queued_item &existing_itm = toWrite.entry(currPos).item;
         existing_itm->setOperation(qi->getOperation());
         existing_itm->setQueuedTime(qi->getQueuedTime());
-        toWrite.push_back(existing_itm);
-        // Remove the existing item for the same key from the list.
-        toWrite.erase(currPos);
+        toWrite.moveToBack(currPos, newMutationId);
+        if (toWrite.needsCompaction()) {
+            compact(checkpointManager);
+        }
+        checkpointManager->unlockCursorsIn_UNLOCKED(this);
     } else {
         if (qi->getOperation() == queue_op_set || qi->getOperation() == queue_op_del) {
             ++numItems;
         }
         rv = NEW_ITEM;
         // Push the new item into the list
-        toWrite.push_back(qi);
+        toWrite.append(qi, newMutationId);
     }
 
-    if (qi->getKey().size() > 0) {
-        std::list<queued_item>::iterator last = toWrite.end();
-        // --last is okay as the list is not empty now.
-        index_entry entry = {--last, newMutationId};
-        // Set the index of the key to the new item that is pushed back into the list.
-        keyIndex[qi->getKey()] = entry;
-        if (rv == NEW_ITEM) {
-            size_t newEntrySize = qi->getKey().size() + sizeof(index_entry) + sizeof(queued_item);
-            memOverhead += newEntrySize;
-            stats.memOverhead.incr(newEntrySize);
-            assert(stats.memOverhead.get() < GIGANTOR);
-        }
-    }
+    updateMemOverhead();
     return rv;
 }
 
-size_t Checkpoint::mergePrevCheckpoint(Checkpoint *pPrevCheckpoint) {
-    size_t numNewItems = 0;
-    size_t newEntryMemOverhead = 0;
-    std::list<queued_item>::reverse_iterator rit = pPrevCheckpoint->rbegin();
+size_t Checkpoint::mergePrevCheckpoint(Checkpoint *pPrevCheckpoint,
+                                       CheckpointManager *checkpointManager) {
+    std::vector<CheckpointEntry> merged;
 
     LOG(EXTENSION_LOG_INFO,
         "Collapse the checkpoint %llu into the checkpoint %llu for vbucket %d",
         pPrevCheckpoint->getId(), checkpointId, vbucketId);
 
-    keyIndex["dummy_key"].mutation_id =
+    toWrite.entry(toWrite.find("dummy_key")).mutationId =
         pPrevCheckpoint->getMutationIdForKey("dummy_key");
-    keyIndex["checkpoint_start"].mutation_id =
+    toWrite.entry(toWrite.find("checkpoint_start")).mutationId =
         pPrevCheckpoint->getMutationIdForKey("checkpoint_start");
-    for (; rit != pPrevCheckpoint->rend(); ++rit) {
-        const std::string &key = (*rit)->getKey();
-        if ((*rit)->getOperation() != queue_op_del &&
-            (*rit)->getOperation() != queue_op_set) {
+    CheckpointLog::iterator it = pPrevCheckpoint->begin();
+    for (; it != pPrevCheckpoint->end(); ++it) {
+        if ((*it)->getOperation() != queue_op_del &&
+            (*it)->getOperation() != queue_op_set) {
             continue;
         }
-        checkpoint_index::iterator it = keyIndex.find(key);
-        if (it == keyIndex.end()) {
-            std::list<queued_item>::iterator pos = toWrite.begin();
-            // Skip the first two meta items
-            ++pos; ++pos;
-            toWrite.insert(pos, *rit);
-            index_entry entry = {--pos, pPrevCheckpoint->getMutationIdForKey(key)};
-            keyIndex[key] = entry;
-            newEntryMemOverhead += key.size() + sizeof(index_entry);
-            ++numItems;
-            ++numNewItems;
+        if (!keyExists((*it)->getKey())) {
+            CheckpointEntry e = {*it, pPrevCheckpoint->getMutationIdForKey((*it)->getKey())};
+            merged.push_back(e);
         }
     }
-    memOverhead += newEntryMemOverhead;
-    stats.memOverhead.incr(newEntryMemOverhead);
-    assert(stats.memOverhead.get() < GIGANTOR);
-    return numNewItems;
+
+    // Insert them after the first two meta items in a single pass.
+    if (!merged.empty()) {
+        compact(checkpointManager, 2, merged);
+        numItems += merged.size();
+    }
+    return merged.size();
 }
 
 uint64_t Checkpoint::getMutationIdForKey(const std::string &key) {
-    uint64_t mid = 0;
-    checkpoint_index::iterator it = keyIndex.find(key);
-    if (it != keyIndex.end()) {
-        mid = it->second.mutation_id;
+    size_t pos = toWrite.find(key);
+    return pos == CheckpointLog::NOT_FOUND ? 0 : toWrite.entry(pos).mutationId;
+}
+
+void Checkpoint::compact(CheckpointManager *checkpointManager, size_t at,
+                         const std::vector<CheckpointEntry> &inserted) {
+    std::vector<size_t> newPositions;
+    toWrite.rebuild(at, inserted, newPositions);
+
+    CheckpointCursor &pcursor = checkpointManager->persistenceCursor;
+    if (pcursor.currentPos.isIn(toWrite)) {
+        pcursor.currentPos = toWrite.at(newPositions[pcursor.currentPos.position()]);
+    }
+    std::map<const std::string, CheckpointCursor>::iterator map_it;
+    for (map_it = checkpointManager->tapCursors.begin();
+         map_it != checkpointManager->tapCursors.end(); ++map_it) {
+        CheckpointLog::iterator &pos = map_it->second.currentPos;
+        if (pos.isIn(toWrite)) {
+            pos = toWrite.at(newPositions[pos.position()]);
+        }
+    }
+    updateMemOverhead();
+}
+
+void Checkpoint::updateMemOverhead() {
+    size_t current = toWrite.memorySize();
+    if (current > memOverhead) {
+        stats.memOverhead.incr(current - memOverhead);
+    } else {
+        stats.memOverhead.decr(memOverhead - current);
     }
-    return mid;
+    assert(stats.memOverhead.get() < GIGANTOR);
+    memOverhead = current;
 }
 
 CheckpointManager::~CheckpointManager() {
@@ -254,15 +471,17 @@ void CheckpointManager::setOpenCheckpointId_UNLOCKED(uint64_t id) {
     if (!checkpointList.empty()) {
         LOG(EXTENSION_LOG_INFO, "Set the current open checkpoint id to %llu "
             "for vbucket %d", id, vbucketId);
+        AllCursorsLockHolder clh(*this);
         checkpointList.back()->setId(id);
         // Update the checkpoint_start item with the new Id.
         queued_item qi = createCheckpointItem(id, vbucketId, queue_op_checkpoint_start);
-        std::list<queued_item>::iterator it = ++(checkpointList.back()->begin());
+        CheckpointLog::iterator it = ++(checkpointList.back()->begin());
         *it = qi;
     }
 }
 
 bool CheckpointManager::addNewCheckpoint_UNLOCKED(uint64_t id) {
+    AllCursorsLockHolder clh(*this);
     // This is just for making sure that the current checkpoint should be closed.
     if (!checkpointList.empty() &&
         checkpointList.back()->getState() == CHECKPOINT_OPEN) {
@@ -350,6 +569,7 @@ bool CheckpointManager::closeOpenCheckpoint(uint64_t id) {
 
 void CheckpointManager::registerPersistenceCursor() {
     LockHolder lh(queueLock);
+    SpinLockHolder clh(&persistenceCursor.lock);
     assert(!checkpointList.empty());
     persistenceCursor.currentCheckpoint = checkpointList.begin();
     persistenceCursor.currentPos = checkpointList.front()->begin();
@@ -370,6 +590,7 @@ bool CheckpointManager::registerTAPCursor_UNLOCKED(const std::string &name,
                                                    bool closedCheckpointOnly,
                                                    bool alwaysFromBeginning) {
     assert(!checkpointList.empty());
+    AllCursorsLockHolder clh(*this);
 
     bool found = false;
     std::list<Checkpoint*>::iterator it = checkpointList.begin();
@@ -406,11 +627,11 @@ bool CheckpointManager::registerTAPCursor_UNLOCKED(const std::string &name,
         CheckpointCursor cursor(name, it, (*it)->begin(),
                             numItems - ((*it)->getNumItems() + 1), // 1 is for checkpoint start item
                             closedCheckpointOnly, open_chk_id);
-        tapCursors.insert(std::pair<std::string, CheckpointCursor>(name, cursor));
+        insertTAPCursor_UNLOCKED(name, cursor);
         (*it)->registerCursorName(name);
     } else {
         size_t offset = 0;
-        std::list<queued_item>::iterator curr;
+        CheckpointLog::iterator curr;
 
         LOG(EXTENSION_LOG_DEBUG,
             "Checkpoint %llu for vbucket %d exists in memory. "
@@ -434,7 +655,7 @@ bool CheckpointManager::registerTAPCursor_UNLOCKED(const std::string &name,
         }
 
         CheckpointCursor cursor(name, it, curr, offset, closedCheckpointOnly, open_chk_id);
-        tapCursors.insert(std::pair<std::string, CheckpointCursor>(name, cursor));
+        insertTAPCursor_UNLOCKED(name, cursor);
         // Register the tap cursor's name to the checkpoint.
         (*it)->registerCursorName(name);
     }
@@ -453,6 +674,7 @@ bool CheckpointManager::removeTAPCursor(const std::string &name) {
     if (it == tapCursors.end()) {
         return false;
     }
+    AllCursorsLockHolder clh(*this);
 
     // We can simply remove the cursor's name from the checkpoint to which it currently belongs,
     // by calling
@@ -464,6 +686,7 @@ bool CheckpointManager::removeTAPCursor(const std::string &name) {
         (*cit)->removeCursorName(name);
     }
 
+    it->second.lock.release();
     tapCursors.erase(it);
     return true;
 }
@@ -523,6 +746,7 @@ size_t CheckpointManager::removeClosedUnrefCheckpoints(const RCPtr<VBucket> &vbu
 
     // This function is executed periodically by the non-IO dispatcher.
     LockHolder lh(queueLock);
+    AllCursorsLockHolder clh(*this);
     assert(vbucket);
     uint64_t oldCheckpointId = 0;
     bool canCreateNewCheckpoint = false;
@@ -614,6 +838,7 @@ size_t CheckpointManager::removeClosedUnrefCheckpoints(const RCPtr<VBucket> &vbu
           checkpointConfig.isInconsistentSlaveCheckpoint()))) {
         collapseClosedCheckpoints(unrefCheckpointList);
     }
+    clh.unlock();
     lh.unlock();
 
     std::list<Checkpoint*>::iterator chkpoint_it = unrefCheckpointList.begin();
@@ -662,7 +887,7 @@ void CheckpointManager::collapseClosedCheckpoints(std::list<Checkpoint*> &collap
         ++rit; ++rit;// Move to the second lastest closed checkpoint.
         size_t numDuplicatedItems = 0, numMetaItems = 0;
         for (; rit != checkpointList.rend(); ++rit) {
-            size_t numAddedItems = (*lastClosedChk)->mergePrevCheckpoint(*rit);
+            size_t numAddedItems = (*lastClosedChk)->mergePrevCheckpoint(*rit, this);
             numDuplicatedItems += ((*rit)->getNumItems() - numAddedItems);
             numMetaItems += 2; // checkpoint start and end meta items
 
@@ -705,6 +930,21 @@ void CheckpointManager::collapseClosedCheckpoints(std::list<Checkpoint*> &collap
 
 bool CheckpointManager::queueDirty(const queued_item &qi, const RCPtr<VBucket> &vbucket) {
     LockHolder lh(queueLock);
+    return queueDirty_UNLOCKED(qi, vbucket);
+}
+
+void CheckpointManager::queueDirty(const std::vector<queued_item> &items,
+                                   const RCPtr<VBucket> &vbucket,
+                                   std::vector<bool> &queued) {
+    queued.assign(items.size(), false);
+    LockHolder lh(queueLock);
+    for (size_t i = 0; i < items.size(); ++i) {
+        queued[i] = queueDirty_UNLOCKED(items[i], vbucket);
+    }
+}
+
+bool CheckpointManager::queueDirty_UNLOCKED(const queued_item &qi,
+                                            const RCPtr<VBucket> &vbucket) {
     if (vbucket->getState() != vbucket_state_active &&
         checkpointList.back()->getState() == CHECKPOINT_CLOSED) {
         // Replica vbucket might receive items from the master even if the current open checkpoint
@@ -764,7 +1004,13 @@ void CheckpointManager::getAllItemsFromCurrentPosition(CheckpointCursor &cursor,
 }
 
 void CheckpointManager::getAllItemsForPersistence(std::vector<queued_item> &items) {
+    // Copy what is already published before contending with the writers.
+    SpinLockHolder plh(&persistenceCursor.lock);
+    getPublishedItems(persistenceCursor, items);
+    plh.unlock();
+
     LockHolder lh(queueLock);
+    plh.lock();
     // Get all the items up to the end of the current open checkpoint.
     getAllItemsFromCurrentPosition(persistenceCursor, 0, items);
     persistenceCursor.offset = numItems;
@@ -777,6 +1023,12 @@ void CheckpointManager::getAllItemsForPersistence(std::vector<queued_item> &item
 
 void CheckpointManager::getAllItemsForTAPConnection(const std::string &name,
                                                     std::vector<queued_item> &items) {
+    CheckpointCursor *cursor = lockTAPCursor(name);
+    if (cursor != NULL) {
+        getPublishedItems(*cursor, items);
+        cursor->lock.release();
+    }
+
     LockHolder lh(queueLock);
     std::map<const std::string, CheckpointCursor>::iterator it = tapCursors.find(name);
     if (it == tapCursors.end()) {
@@ -785,6 +1037,7 @@ void CheckpointManager::getAllItemsForTAPConnection(const std::string &name,
             name.c_str());
         return;
     }
+    SpinLockHolder clh(&it->second.lock);
     getAllItemsFromCurrentPosition(it->second, 0, items);
     it->second.offset = numItems;
 
@@ -794,8 +1047,18 @@ void CheckpointManager::getAllItemsForTAPConnection(const std::string &name,
 }
 
 queued_item CheckpointManager::nextItem(const std::string &name, bool &isLastMutationItem) {
-    LockHolder lh(queueLock);
     isLastMutationItem = false;
+    CheckpointCursor *published = lockTAPCursor(name);
+    if (published != NULL) {
+        queued_item qi;
+        bool found = nextPublishedItem(*published, qi, isLastMutationItem);
+        published->lock.release();
+        if (found) {
+            return qi;
+        }
+    }
+
+    LockHolder lh(queueLock);
     std::map<const std::string, CheckpointCursor>::iterator it = tapCursors.find(name);
     if (it == tapCursors.end()) {
         LOG(EXTENSION_LOG_WARNING, "The cursor with name \"%s\" is not found in"
@@ -813,6 +1076,7 @@ queued_item CheckpointManager::nextItem(const std::string &name, bool &isLastMut
     }
 
     CheckpointCursor &cursor = it->second;
+    SpinLockHolder clh(&cursor.lock);
     if ((*(it->second.currentCheckpoint))->getState() == CHECKPOINT_CLOSED) {
         return nextItemFromClosedCheckpoint(cursor, isLastMutationItem);
     } else {
@@ -820,6 +1084,40 @@ queued_item CheckpointManager::nextItem(const std::string &name, bool &isLastMut
     }
 }
 
+size_t CheckpointManager::nextItems(const std::string &name,
+                                    std::vector<queued_item> &items,
+                                    size_t max) {
+    CheckpointCursor *cursor = lockTAPCursor(name);
+    if (cursor == NULL) {
+        return 0;
+    }
+
+    size_t count = 0;
+    Checkpoint *checkpoint = *(cursor->currentCheckpoint);
+    // Backfill and cursors for closed checkpoints only go through nextItem().
+    if (checkpoint->getId() != 0 && !cursor->closedCheckpointOnly) {
+        EpochGuard eg;
+        CheckpointLog::iterator next = cursor->currentPos;
+        while (count < max && checkpoint->nextPublished(next)) {
+            enum queue_operation op = (*next)->getOperation();
+            if (op != queue_op_set && op != queue_op_del) {
+                break;
+            }
+            CheckpointLog::iterator after = next;
+            if (!checkpoint->nextPublished(after) ||
+                (*after)->getOperation() == queue_op_checkpoint_end) {
+                break;
+            }
+            items.push_back(*next);
+            cursor->currentPos = next;
+            ++(cursor->offset);
+            ++count;
+        }
+    }
+    cursor->lock.release();
+    return count;
+}
+
 queued_item CheckpointManager::nextItemFromClosedCheckpoint(CheckpointCursor &cursor,
                                                             bool &isLastMutationItem) {
     // The cursor already reached to the beginning of the checkpoint that had "open" state
@@ -874,6 +1172,7 @@ queued_item CheckpointManager::nextItemFromOpenCheckpoint(CheckpointCursor &curs
 
 void CheckpointManager::clear(vbucket_state_t vbState) {
     LockHolder lh(queueLock);
+    AllCursorsLockHolder clh(*this);
     std::list<Checkpoint*>::iterator it = checkpointList.begin();
     // Remove all the checkpoints.
     while(it != checkpointList.end()) {
@@ -911,6 +1210,7 @@ void CheckpointManager::resetCursors(bool resetPersistenceCursor) {
 
 void CheckpointManager::resetTAPCursors(const std::list<std::string> &cursors) {
     LockHolder lh(queueLock);
+    AllCursorsLockHolder clh(*this);
     std::list<std::string>::const_iterator it = cursors.begin();
     for (; it != cursors.end(); ++it) {
         registerTAPCursor_UNLOCKED(*it, getOpenCheckpointId_UNLOCKED(), false, true);
@@ -978,10 +1278,13 @@ bool CheckpointManager::eligibleForEviction(const std::string &key) {
     // Get the mutation id of the item pointed by the slowest cursor.
     // This won't cause much overhead as the number of cursors per vbucket is
     // usually bounded to 3 (persistence cursor + 2 replicas).
+    SpinLockHolder plh(&persistenceCursor.lock);
     const std::string &pkey = (*(persistenceCursor.currentPos))->getKey();
     smallest_mid = (*(persistenceCursor.currentCheckpoint))->getMutationIdForKey(pkey);
+    plh.unlock();
     std::map<const std::string, CheckpointCursor>::iterator mit = tapCursors.begin();
     for (; mit != tapCursors.end(); ++mit) {
+        SpinLockHolder clh(&mit->second.lock);
         const std::string &tkey = (*(mit->second.currentPos))->getKey();
         uint64_t mid = (*(mit->second.currentCheckpoint))->getMutationIdForKey(tkey);
         if (mid < smallest_mid) {
@@ -1018,8 +1321,11 @@ size_t CheckpointManager::getNumItemsForTAPConnection(const std::string &name) {
 void CheckpointManager::decrTapCursorFromCheckpointEnd(const std::string &name) {
     LockHolder lh(queueLock);
     std::map<const std::string, CheckpointCursor>::iterator it = tapCursors.find(name);
-    if (it != tapCursors.end() &&
-        (*(it->second.currentPos))->getOperation() == queue_op_checkpoint_end) {
+    if (it == tapCursors.end()) {
+        return;
+    }
+    SpinLockHolder clh(&it->second.lock);
+    if ((*(it->second.currentPos))->getOperation() == queue_op_checkpoint_end) {
         decrCursorOffset_UNLOCKED(it->second, 1);
         decrCursorPos_UNLOCKED(it->second);
     }
@@ -1036,7 +1342,7 @@ uint64_t CheckpointManager::getMutationIdForKey(uint64_t chk_id, std::string key
 }
 
 bool CheckpointManager::isLastMutationItemInCheckpoint(CheckpointCursor &cursor) {
-    std::list<queued_item>::iterator it = cursor.currentPos;
+    CheckpointLog::iterator it = cursor.currentPos;
     ++it;
     if (it == (*(cursor.currentCheckpoint))->end() ||
         (*it)->getOperation() == queue_op_checkpoint_end) {
@@ -1047,6 +1353,7 @@ bool CheckpointManager::isLastMutationItemInCheckpoint(CheckpointCursor &cursor)
 
 void CheckpointManager::checkAndAddNewCheckpoint(uint64_t id) {
     LockHolder lh(queueLock);
+    AllCursorsLockHolder clh(*this);
 
     // Ignore CHECKPOINT_START message with ID 0 as 0 is reserved for representing backfill.
     if (id == 0) {
@@ -1124,7 +1431,7 @@ void CheckpointManager::collapseCheckpoints(uint64_t id) {
     size_t numDuplicatedItems = 0, numMetaItems = 0;
     // Collapse all checkpoints.
     for (; rit != checkpointList.rend(); ++rit) {
-        size_t numAddedItems = checkpointList.back()->mergePrevCheckpoint(*rit);
+        size_t numAddedItems = checkpointList.back()->mergePrevCheckpoint(*rit, this);
         numDuplicatedItems += ((*rit)->getNumItems() - numAddedItems);
         numMetaItems += 2; // checkpoint start and end meta items
         delete *rit;
@@ -1149,8 +1456,8 @@ void CheckpointManager::putCursorsInChk(std::map<std::string, uint64_t> &cursors
                                         std::list<Checkpoint*>::iterator chkItr) {
     int i;
     Checkpoint *chk = *chkItr;
-    std::list<queued_item>::iterator cit = chk->begin();
-    std::list<queued_item>::iterator last = chk->begin();
+    CheckpointLog::iterator cit = chk->begin();
+    CheckpointLog::iterator last = chk->begin();
     for (i = 0; cit != chk->end(); ++i, ++cit) {
         uint64_t id = chk->getMutationIdForKey((*cit)->getKey());
         std::map<std::string, uint64_t>::iterator mit = cursors.begin();
@@ -1196,14 +1503,24 @@ void CheckpointManager::putCursorsInChk(std::map<std::string, uint64_t> &cursors
 }
 
 bool CheckpointManager::hasNext(const std::string &name) {
+    CheckpointCursor *published = lockTAPCursor(name);
+    if (published != NULL) {
+        bool found = hasPublishedNext(*published);
+        published->lock.release();
+        if (found) {
+            return true;
+        }
+    }
+
     LockHolder lh(queueLock);
     std::map<const std::string, CheckpointCursor>::iterator it = tapCursors.find(name);
     if (it == tapCursors.end() || getOpenCheckpointId_UNLOCKED() == 0) {
         return false;
     }
 
+    SpinLockHolder clh(&it->second.lock);
     bool hasMore = true;
-    std::list<queued_item>::iterator curr = it->second.currentPos;
+    CheckpointLog::iterator curr = it->second.currentPos;
     ++curr;
     if (curr == (*(it->second.currentCheckpoint))->end() &&
         (*(it->second.currentCheckpoint)) == checkpointList.back()) {
@@ -1227,9 +1544,16 @@ queued_item CheckpointManager::createCheckpointItem(uint64_t id,
 }
 
 bool CheckpointManager::hasNextForPersistence() {
+    SpinLockHolder plh(&persistenceCursor.lock);
+    if (hasPublishedNext(persistenceCursor)) {
+        return true;
+    }
+    plh.unlock();
+
     LockHolder lh(queueLock);
+    plh.lock();
     bool hasMore = true;
-    std::list<queued_item>::iterator curr = persistenceCursor.currentPos;
+    CheckpointLog::iterator curr = persistenceCursor.currentPos;
     ++curr;
     if (curr == (*(persistenceCursor.currentCheckpoint))->end() &&
         (*(persistenceCursor.currentCheckpoint)) == checkpointList.back()) {
@@ -1248,6 +1572,124 @@ uint64_t CheckpointManager::createNewCheckpoint() {
     return checkpointList.back()->getId();
 }
 
+CheckpointCursor *CheckpointManager::lockTAPCursor(const std::string &name) {
+    SpinLockHolder lh(&cursorsLock);
+    std::map<const std::string, CheckpointCursor>::iterator it = tapCursors.find(name);
+    if (it == tapCursors.end()) {
+        return NULL;
+    }
+    it->second.lock.acquire();
+    return &it->second;
+}
+
+bool CheckpointManager::nextPublishedItem(CheckpointCursor &cursor, queued_item &qi,
+                                          bool &isLastMutationItem) {
+    Checkpoint *checkpoint = *(cursor.currentCheckpoint);
+    // Backfill and cursors for closed checkpoints only take the locked path.
+    if (checkpoint->getId() == 0 || cursor.closedCheckpointOnly) {
+        return false;
+    }
+
+    EpochGuard eg;
+    CheckpointLog::iterator next = cursor.currentPos;
+    if (!checkpoint->nextPublished(next)) {
+        return false;
+    }
+    cursor.currentPos = next;
+    ++(cursor.offset);
+    qi = *next;
+    isLastMutationItem = !checkpoint->nextPublished(next) ||
+        (*next)->getOperation() == queue_op_checkpoint_end;
+    return true;
+}
+
+void CheckpointManager::getPublishedItems(CheckpointCursor &cursor,
+                                          std::vector<queued_item> &items) {
+    Checkpoint *checkpoint = *(cursor.currentCheckpoint);
+    EpochGuard eg;
+    CheckpointLog::iterator next = cursor.currentPos;
+    while (checkpoint->nextPublished(next)) {
+        items.push_back(*next);
+        cursor.currentPos = next;
+    }
+}
+
+bool CheckpointManager::hasPublishedNext(CheckpointCursor &cursor) {
+    Checkpoint *checkpoint = *(cursor.currentCheckpoint);
+    if (checkpoint->getId() == 0) {
+        return false;
+    }
+    EpochGuard eg;
+    CheckpointLog::iterator next = cursor.currentPos;
+    return checkpoint->nextPublished(next);
+}
+
+void CheckpointManager::lockAllCursors_UNLOCKED() {
+    if (cursorsLockDepth++ > 0) {
+        return;
+    }
+    cursorsLock.acquire();
+    persistenceCursor.lock.acquire();
+    std::map<const std::string, CheckpointCursor>::iterator it = tapCursors.begin();
+    for (; it != tapCursors.end(); ++it) {
+        it->second.lock.acquire();
+    }
+}
+
+void CheckpointManager::unlockAllCursors_UNLOCKED() {
+    assert(cursorsLockDepth > 0);
+    if (--cursorsLockDepth > 0) {
+        return;
+    }
+    std::map<const std::string, CheckpointCursor>::iterator it = tapCursors.begin();
+    for (; it != tapCursors.end(); ++it) {
+        it->second.lock.release();
+    }
+    persistenceCursor.lock.release();
+    cursorsLock.release();
+}
+
+void CheckpointManager::lockCursorsIn_UNLOCKED(Checkpoint *checkpoint) {
+    if (cursorsLockDepth > 0) {
+        return;
+    }
+    if (*(persistenceCursor.currentCheckpoint) == checkpoint) {
+        persistenceCursor.lock.acquire();
+    }
+    std::map<const std::string, CheckpointCursor>::iterator it = tapCursors.begin();
+    for (; it != tapCursors.end(); ++it) {
+        if (*(it->second.currentCheckpoint) == checkpoint) {
+            it->second.lock.acquire();
+        }
+    }
+}
+
+void CheckpointManager::unlockCursorsIn_UNLOCKED(Checkpoint *checkpoint) {
+    if (cursorsLockDepth > 0) {
+        return;
+    }
+    if (*(persistenceCursor.currentCheckpoint) == checkpoint) {
+        persistenceCursor.lock.release();
+    }
+    std::map<const std::string, CheckpointCursor>::iterator it = tapCursors.begin();
+    for (; it != tapCursors.end(); ++it) {
+        if (*(it->second.currentCheckpoint) == checkpoint) {
+            it->second.lock.release();
+        }
+    }
+}
+
+void CheckpointManager::insertTAPCursor_UNLOCKED(const std::string &name,
+                                                 const CheckpointCursor &cursor) {
+    assert(cursorsLockDepth > 0);
+    std::pair<std::map<const std::string, CheckpointCursor>::iterator, bool> rv =
+        tapCursors.insert(std::pair<std::string, CheckpointCursor>(name, cursor));
+    if (rv.second) {
+        // Released along with the others.
+        rv.first->second.lock.acquire();
+    }
+}
+
 void CheckpointManager::decrCursorOffset_UNLOCKED(CheckpointCursor &cursor, size_t decr) {
     if (cursor.offset >= decr) {
         cursor.offset -= decr;
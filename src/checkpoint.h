@@ -54,17 +54,242 @@ typedef enum {
 } checkpoint_state;
 
 /**
- * A checkpoint index entry.
+ * An entry of a checkpoint log.  An entry without an item is a
+ * tombstone left behind by a later mutation of the same key.
  */
-struct index_entry {
-    std::list<queued_item>::iterator position;
-    uint64_t mutation_id;
+struct CheckpointEntry {
+    queued_item item;
+    uint64_t    mutationId;
 };
 
 /**
- * The checkpoint index maps a key to a checkpoint index_entry.
+ * The items of a checkpoint in the order they were queued.
+ *
+ * Entries are appended to chunks that never move, and a deduplicated
+ * entry is only tombstoned, so queueing an item allocates nothing but
+ * an occasional chunk.  Keys are indexed by their hash in an open
+ * addressed table of positions, which compares against the keys held
+ * by the queued items instead of copying them.
+ *
+ * Entries are identified by their position.  Positions only change
+ * when rebuild() squeezes out the tombstones, and it reports where
+ * every entry went so the owner can move its cursors along.
+ *
+ * A single writer changes the log.  Readers may walk the entries below
+ * published() concurrently with it appending, from inside an
+ * EpochGuard; anything else the writer does needs the readers kept
+ * out.
  */
-typedef unordered_map<std::string, index_entry> checkpoint_index;
+class CheckpointLog {
+public:
+
+    //! Position returned by find() for a key not in the log.
+    static const size_t NOT_FOUND;
+
+    /**
+     * Bidirectional iterator over the live entries of a log.
+     */
+    class iterator {
+    public:
+        iterator() : log(NULL), pos(0) { }
+
+        queued_item &operator *() const {
+            return log->entry(pos).item;
+        }
+
+        queued_item *operator ->() const {
+            return &log->entry(pos).item;
+        }
+
+        iterator &operator ++() {
+            pos = log->nextLive(pos);
+            return *this;
+        }
+
+        iterator &operator --() {
+            pos = log->prevLive(pos);
+            return *this;
+        }
+
+        bool operator ==(const iterator &other) const {
+            return pos == other.pos && log == other.log;
+        }
+
+        bool operator !=(const iterator &other) const {
+            return !(*this == other);
+        }
+
+        //! The position of the entry in its log.
+        size_t position() const {
+            return pos;
+        }
+
+        //! True if this iterator walks the given log.
+        bool isIn(const CheckpointLog &l) const {
+            return log == &l;
+        }
+
+    private:
+        friend class CheckpointLog;
+
+        iterator(CheckpointLog *l, size_t p) : log(l), pos(p) { }
+
+        CheckpointLog *log;
+        size_t         pos;
+    };
+
+    CheckpointLog() : chunks(NULL), numChunks(0), chunksSize(0), used(0),
+                      live(0), table(NULL), tableSize(0), tableUsed(0) { }
+
+    ~CheckpointLog();
+
+    iterator begin() {
+        return iterator(this, nextLive(static_cast<size_t>(-1)));
+    }
+
+    iterator end() {
+        return iterator(this, used);
+    }
+
+    //! Get an iterator to the entry at a given position.
+    iterator at(size_t pos) {
+        return iterator(this, pos);
+    }
+
+    CheckpointEntry &entry(size_t pos) {
+        if (pos < FIRST_CHUNK_ENTRIES) {
+            return chunks[0][pos];
+        }
+        pos -= FIRST_CHUNK_ENTRIES;
+        return chunks[1 + pos / CHUNK_ENTRIES][pos % CHUNK_ENTRIES];
+    }
+
+    bool empty() const {
+        return live == 0;
+    }
+
+    //! The number of positions in use, tombstones included.
+    size_t size() const {
+        return used;
+    }
+
+    //! The number of positions readers may look at.
+    size_t published() const {
+        return publishedUsed.get();
+    }
+
+    /**
+     * Get the first live position after a given one that readers may
+     * look at, or NOT_FOUND.
+     */
+    size_t nextPublished(size_t pos) {
+        size_t limit = published();
+        while (++pos < limit) {
+            if (entry(pos).item) {
+                return pos;
+            }
+        }
+        return NOT_FOUND;
+    }
+
+    /**
+     * Find the live entry for a key.
+     *
+     * @return its position, or NOT_FOUND
+     */
+    size_t find(const std::string &key);
+
+    /**
+     * Append an item, indexing it under its key unless the key is
+     * empty.
+     */
+    void append(const queued_item &qi, uint64_t mutationId);
+
+    /**
+     * Move the item of a live entry to a new entry at the end of the
+     * log, leaving a tombstone in its place.
+     */
+    void moveToBack(size_t pos, uint64_t mutationId);
+
+    /**
+     * Remove the last live entry and any tombstones behind it.
+     */
+    void popBack();
+
+    /**
+     * True if tombstones make up enough of the log to squeeze them out.
+     */
+    bool needsCompaction() const {
+        size_t dead = used - live;
+        return dead >= CHUNK_ENTRIES && dead > live;
+    }
+
+    /**
+     * Rebuild the log without its tombstones, inserting the given
+     * entries in front of the entry at a given position.
+     *
+     * @param at the position to insert at
+     * @param inserted the entries to insert
+     * @param newPositions set to where each position of the log moved
+     */
+    void rebuild(size_t at, const std::vector<CheckpointEntry> &inserted,
+                 std::vector<size_t> &newPositions);
+
+    //! The memory used by the chunks and the index.
+    size_t memorySize() const;
+
+private:
+
+    //! Entries in the first chunk, kept small for idle vbuckets.
+    static const size_t FIRST_CHUNK_ENTRIES = 16;
+    //! Entries in every following chunk.
+    static const size_t CHUNK_ENTRIES = 256;
+
+    /**
+     * A slot of the key index.
+     */
+    struct IndexSlot {
+        uint32_t hash;
+        uint32_t pos;
+    };
+
+    size_t nextLive(size_t pos) {
+        while (++pos < used && !entry(pos).item) {
+        }
+        return pos < used ? pos : used;
+    }
+
+    size_t prevLive(size_t pos) {
+        while (pos > 0) {
+            if (entry(--pos).item) {
+                return pos;
+            }
+        }
+        return 0;
+    }
+
+    CheckpointEntry &push(const queued_item &qi, uint64_t mutationId);
+    void publish();
+    void index(const std::string &key, size_t pos);
+    size_t findSlot(const std::string &key, uint32_t hash);
+    void eraseSlot(size_t slot);
+    void growIndex();
+    void swap(CheckpointLog &other);
+
+    // The chunk directory is replaced when it fills up, and the old one
+    // retired to Epoch as readers may still be looking at it.
+    CheckpointEntry             **chunks;
+    size_t                        numChunks;
+    size_t                        chunksSize;
+    size_t                        used;
+    Atomic<size_t>                publishedUsed;
+    size_t                        live;
+    IndexSlot                    *table;
+    size_t                        tableSize;
+    size_t                        tableUsed;
+
+    DISALLOW_COPY_AND_ASSIGN(CheckpointLog);
+};
 
 class Checkpoint;
 class CheckpointManager;
@@ -73,6 +298,12 @@ class VBucket;
 
 /**
  * A checkpoint cursor
+ *
+ * The reader owning a cursor moves it along the published items of its
+ * current checkpoint holding just the cursor's lock.  Anything else
+ * that reads or moves the cursor holds the checkpoint manager's
+ * queueLock and the cursor's lock, and only code holding both changes
+ * the checkpoint the cursor is in.
  */
 class CheckpointCursor {
     friend class CheckpointManager;
@@ -89,17 +320,27 @@ public:
 
     CheckpointCursor(const std::string &n,
                      std::list<Checkpoint*>::iterator checkpoint,
-                     std::list<queued_item>::iterator pos,
+                     CheckpointLog::iterator pos,
                      size_t os = 0, bool isClosedCheckpointOnly = false,
                      uint64_t openChkId = 1) :
         name(n), currentCheckpoint(checkpoint), currentPos(pos),
         offset(os), closedCheckpointOnly(isClosedCheckpointOnly),
         openChkIdAtRegistration(openChkId) { }
 
+    // The lock isn't copied along.
+    CheckpointCursor(const CheckpointCursor &other) :
+        name(other.name), currentCheckpoint(other.currentCheckpoint),
+        currentPos(other.currentPos), offset(other.offset.get()),
+        closedCheckpointOnly(other.closedCheckpointOnly),
+        openChkIdAtRegistration(other.openChkIdAtRegistration) { }
+
 private:
+    void operator =(const CheckpointCursor &);
+
+    SpinLock                         lock;
     std::string                      name;
     std::list<Checkpoint*>::iterator currentCheckpoint;
-    std::list<queued_item>::iterator currentPos;
+    CheckpointLog::iterator          currentPos;
     Atomic<size_t>                   offset;
     bool                             closedCheckpointOnly;
     uint64_t                         openChkIdAtRegistration;
@@ -232,20 +473,28 @@ public:
     queue_dirty_t queueDirty(const queued_item &qi, CheckpointManager *checkpointManager);
 
 
-    std::list<queued_item>::iterator begin() {
+    CheckpointLog::iterator begin() {
         return toWrite.begin();
     }
 
-    std::list<queued_item>::iterator end() {
+    CheckpointLog::iterator end() {
         return toWrite.end();
     }
 
-    std::list<queued_item>::reverse_iterator rbegin() {
-        return toWrite.rbegin();
-    }
-
-    std::list<queued_item>::reverse_iterator rend() {
-        return toWrite.rend();
+    /**
+     * Move an iterator to the next item that readers may look at
+     * without the checkpoint manager's lock.  Must be called inside an
+     * EpochGuard.
+     *
+     * @return false if there is no such item yet
+     */
+    bool nextPublished(CheckpointLog::iterator &it) {
+        size_t pos = toWrite.nextPublished(it.position());
+        if (pos == CheckpointLog::NOT_FOUND) {
+            return false;
+        }
+        it = toWrite.at(pos);
+        return true;
     }
 
     bool keyExists(const std::string &key);
@@ -264,9 +513,11 @@ public:
      * Merge the previous checkpoint into the this checkpoint by adding the items from
      * the previous checkpoint, which don't exist in this checkpoint.
      * @param pPrevCheckpoint pointer to the previous checkpoint.
+     * @param checkpointManager the checkpoint manager to which this checkpoint belongs
      * @return the number of items added from the previous checkpoint.
      */
-    size_t mergePrevCheckpoint(Checkpoint *pPrevCheckpoint);
+    size_t mergePrevCheckpoint(Checkpoint *pPrevCheckpoint,
+                               CheckpointManager *checkpointManager);
 
     /**
      * Get the mutation id for a given key in this checkpoint
@@ -276,6 +527,21 @@ public:
     uint64_t getMutationIdForKey(const std::string &key);
 
 private:
+    /**
+     * Squeeze the tombstones out of the log, moving the cursors that
+     * are in this checkpoint along with their entries.  The locks of
+     * those cursors must be held.
+     */
+    void compact(CheckpointManager *checkpointManager,
+                 size_t at = 0,
+                 const std::vector<CheckpointEntry> &inserted =
+                     std::vector<CheckpointEntry>());
+
+    /**
+     * Bring memOverhead and the global stats up to date with the log.
+     */
+    void updateMemOverhead();
+
     EPStats                       &stats;
     uint64_t                       checkpointId;
     uint16_t                       vbucketId;
@@ -283,9 +549,7 @@ private:
     checkpoint_state               checkpointState;
     size_t                         numItems;
     std::set<std::string>          cursors; // List of cursors with their unique names.
-    // List is used for queueing mutations as vector incurs shift operations for deduplication.
-    std::list<queued_item>         toWrite;
-    checkpoint_index               keyIndex;
+    CheckpointLog                  toWrite;
     size_t                         memOverhead;
 };
 
@@ -305,7 +569,7 @@ public:
         mutationCounter(0), persistenceCursor("persistence"),
         isCollapsedCheckpoint(false),
         checkpointExtension(false),
-        pCursorPreCheckpointId(0)
+        pCursorPreCheckpointId(0), cursorsLockDepth(0)
     {
         addNewCheckpoint(checkpointId);
         registerPersistenceCursor();
@@ -377,6 +641,17 @@ public:
      */
     bool queueDirty(const queued_item &qi, const RCPtr<VBucket> &vbucket);
 
+    /**
+     * Queue a batch of items to be written to persistent layer, in order,
+     * taking the queue lock only once.
+     * @param items the items to be persisted.
+     * @param vbucket the vbucket that the items are pushed into.
+     * @param queued set for each item to what queueDirty would return.
+     */
+    void queueDirty(const std::vector<queued_item> &items,
+                    const RCPtr<VBucket> &vbucket,
+                    std::vector<bool> &queued);
+
     /**
      * Return the next item to be sent to a given TAP connection
      * @param name the name of a given TAP connection
@@ -386,6 +661,22 @@ public:
      */
     queued_item nextItem(const std::string &name, bool &isLastMutationItem);
 
+    /**
+     * Move a TAP connection's cursor over a run of mutations at once.
+     *
+     * The run stops in front of anything but a set or a delete, at the
+     * end of the cursor's checkpoint, and in front of the last mutation
+     * of the checkpoint, so that nextItem() still hands out the items
+     * the caller needs to treat specially.
+     *
+     * @param name the name of a given TAP connection
+     * @param items the array the mutations are appended to
+     * @param max the maximum number of mutations to return
+     * @return the number of mutations appended to items
+     */
+    size_t nextItems(const std::string &name, std::vector<queued_item> &items,
+                     size_t max);
+
     /**
      * Return the list of items, which needs to be persisted, to the flusher.
      * @param items the array that will contain the list of items to be persisted and
@@ -515,6 +806,9 @@ private:
      */
     bool addNewCheckpoint_UNLOCKED(uint64_t id);
 
+    bool queueDirty_UNLOCKED(const queued_item &qi,
+                             const RCPtr<VBucket> &vbucket);
+
     void removeInvalidCursorsOnCheckpoint(Checkpoint *pCheckpoint);
 
     /**
@@ -576,6 +870,86 @@ private:
     static queued_item createCheckpointItem(uint64_t id, uint16_t vbid,
                                             enum queue_operation checkpoint_op);
 
+    /**
+     * Find a TAP cursor and acquire its lock without queueLock.
+     * @return the locked cursor, or NULL if there is none with that name
+     */
+    CheckpointCursor *lockTAPCursor(const std::string &name);
+
+    /**
+     * Move a cursor to the next item of its checkpoint without queueLock,
+     * if the item was already published.  The cursor's lock must be held.
+     * @return false if the caller needs to take the locked path
+     */
+    bool nextPublishedItem(CheckpointCursor &cursor, queued_item &qi,
+                           bool &isLastMutationItem);
+
+    /**
+     * Collect the items published in a cursor's checkpoint after its
+     * position without queueLock.  The cursor's lock must be held.
+     */
+    void getPublishedItems(CheckpointCursor &cursor, std::vector<queued_item> &items);
+
+    /**
+     * True if an item after the cursor was already published in its
+     * checkpoint.  The cursor's lock must be held.
+     */
+    bool hasPublishedNext(CheckpointCursor &cursor);
+
+    /**
+     * Acquire the locks of all the cursors, keeping their readers out
+     * while the checkpoints and cursors are restructured.  Nests; the
+     * queueLock must be held.
+     */
+    void lockAllCursors_UNLOCKED();
+    void unlockAllCursors_UNLOCKED();
+
+    /**
+     * Acquire the locks of the cursors in a given checkpoint, unless all
+     * of them are held already.  The queueLock must be held.
+     */
+    void lockCursorsIn_UNLOCKED(Checkpoint *checkpoint);
+    void unlockCursorsIn_UNLOCKED(Checkpoint *checkpoint);
+
+    /**
+     * Add a TAP cursor while all the cursor locks are held, acquiring
+     * its lock too.
+     */
+    void insertTAPCursor_UNLOCKED(const std::string &name,
+                                  const CheckpointCursor &cursor);
+
+    /**
+     * Holds the locks of all the cursors while in scope.
+     */
+    class AllCursorsLockHolder {
+    public:
+        AllCursorsLockHolder(CheckpointManager &m) : manager(m), locked(false) {
+            lock();
+        }
+
+        ~AllCursorsLockHolder() {
+            unlock();
+        }
+
+        void lock() {
+            manager.lockAllCursors_UNLOCKED();
+            locked = true;
+        }
+
+        void unlock() {
+            if (locked) {
+                manager.unlockAllCursors_UNLOCKED();
+                locked = false;
+            }
+        }
+
+    private:
+        CheckpointManager &manager;
+        bool               locked;
+
+        DISALLOW_COPY_AND_ASSIGN(AllCursorsLockHolder);
+    };
+
 
     EPStats                 &stats;
     CheckpointConfig        &checkpointConfig;
@@ -589,6 +963,10 @@ private:
     bool                     checkpointExtension;
     uint64_t                 lastClosedCheckpointId;
     uint64_t                 pCursorPreCheckpointId;
+    // Readers look up their TAP cursors holding just cursorsLock; the map
+    // is only changed holding queueLock and all the cursor locks.
+    SpinLock                 cursorsLock;
+    size_t                   cursorsLockDepth;
     std::map<const std::string, CheckpointCursor> tapCursors;
 };
 
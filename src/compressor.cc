@@ -0,0 +1,213 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "compressor.h"
+
+/*
+ * The LZF encoding is a sequence of runs, each starting with a control
+ * byte c:
+ *
+ *   c < 32   c + 1 literal bytes follow.
+ *   c >= 32  a back reference: the length - 2 is c >> 5, or 7 plus the
+ *            next byte if that is 7, and the offset - 1 is (c & 0x1f)
+ *            followed by the next byte.
+ */
+static const size_t MAX_LITERAL = 32;
+static const size_t MAX_OFFSET = 1 << 13;
+static const size_t MAX_MATCH = 7 + 255 + 2;
+static const size_t MIN_MATCH = 3;
+static const int MAX_HASH_BITS = 13;
+
+static inline uint32_t hashOf(const uint8_t *p, int bits) {
+    uint32_t v = (p[0] << 16) | (p[1] << 8) | p[2];
+    return (v * 2654435761U) >> (32 - bits);
+}
+
+size_t Compressor::compress(const char *in, size_t len,
+                            char *out, size_t outLen) {
+    if (len == 0 || len > 0xffffffffULL || outLen <= HEADER_SIZE) {
+        return 0;
+    }
+
+    // Small values don't need a big table, and clearing it is part of
+    // the cost of every call.
+    int bits = 8;
+    while (bits < MAX_HASH_BITS && (static_cast<size_t>(1) << bits) < len) {
+        ++bits;
+    }
+    uint32_t table[1 << MAX_HASH_BITS];
+    memset(table, 0, sizeof(uint32_t) << bits);
+
+    uint32_t n = static_cast<uint32_t>(len);
+    out[0] = static_cast<char>(n >> 24);
+    out[1] = static_cast<char>(n >> 16);
+    out[2] = static_cast<char>(n >> 8);
+    out[3] = static_cast<char>(n);
+
+    const uint8_t *start = reinterpret_cast<const uint8_t*>(in);
+    const uint8_t *ip = start;
+    const uint8_t *end = start + len;
+    uint8_t *op = reinterpret_cast<uint8_t*>(out) + HEADER_SIZE;
+    uint8_t *oend = reinterpret_cast<uint8_t*>(out) + outLen;
+
+    // op always points past the control byte of the current literal run.
+    size_t lit = 0;
+    ++op;
+
+    while (ip + MIN_MATCH <= end) {
+        uint32_t h = hashOf(ip, bits);
+        const uint8_t *ref = start + table[h];
+        table[h] = static_cast<uint32_t>(ip - start);
+
+        size_t off = ip - ref - 1;
+        if (ref < ip && off < MAX_OFFSET &&
+            ref[0] == ip[0] && ref[1] == ip[1] && ref[2] == ip[2]) {
+            size_t maxLen = end - ip;
+            if (maxLen > MAX_MATCH) {
+                maxLen = MAX_MATCH;
+            }
+            size_t mlen = MIN_MATCH;
+            while (mlen < maxLen && ref[mlen] == ip[mlen]) {
+                ++mlen;
+            }
+
+            // The reference and the next control byte.
+            if (op + 4 > oend) {
+                return 0;
+            }
+            if (lit > 0) {
+                op[-static_cast<ptrdiff_t>(lit) - 1] = static_cast<uint8_t>(lit - 1);
+            } else {
+                --op;
+            }
+            size_t l = mlen - 2;
+            if (l < 7) {
+                *op++ = static_cast<uint8_t>((off >> 8) + (l << 5));
+            } else {
+                *op++ = static_cast<uint8_t>((off >> 8) + (7 << 5));
+                *op++ = static_cast<uint8_t>(l - 7);
+            }
+            *op++ = static_cast<uint8_t>(off);
+            lit = 0;
+            ++op;
+
+            // Index the start of the match's tail so runs are found again.
+            const uint8_t *last = ip + mlen;
+            for (++ip; ip < last; ++ip) {
+                if (ip + MIN_MATCH <= end) {
+                    table[hashOf(ip, bits)] = static_cast<uint32_t>(ip - start);
+                }
+            }
+            continue;
+        }
+
+        if (op >= oend) {
+            return 0;
+        }
+        *op++ = *ip++;
+        if (++lit == MAX_LITERAL) {
+            op[-static_cast<ptrdiff_t>(lit) - 1] = static_cast<uint8_t>(lit - 1);
+            lit = 0;
+            ++op;
+        }
+    }
+
+    while (ip < end) {
+        if (op >= oend) {
+            return 0;
+        }
+        *op++ = *ip++;
+        if (++lit == MAX_LITERAL) {
+            op[-static_cast<ptrdiff_t>(lit) - 1] = static_cast<uint8_t>(lit - 1);
+            lit = 0;
+            ++op;
+        }
+    }
+
+    if (lit > 0) {
+        op[-static_cast<ptrdiff_t>(lit) - 1] = static_cast<uint8_t>(lit - 1);
+    } else {
+        --op;
+    }
+    if (op > oend) {
+        return 0;
+    }
+    return op - reinterpret_cast<uint8_t*>(out);
+}
+
+size_t Compressor::getDecompressedLength(const char *in, size_t len) {
+    if (len <= HEADER_SIZE) {
+        return 0;
+    }
+    const uint8_t *p = reinterpret_cast<const uint8_t*>(in);
+    return (static_cast<size_t>(p[0]) << 24) | (p[1] << 16) |
+        (p[2] << 8) | p[3];
+}
+
+bool Compressor::decompress(const char *in, size_t len,
+                            char *out, size_t outLen) {
+    size_t expected = getDecompressedLength(in, len);
+    if (expected == 0 || expected > outLen) {
+        return false;
+    }
+
+    const uint8_t *ip = reinterpret_cast<const uint8_t*>(in) + HEADER_SIZE;
+    const uint8_t *end = reinterpret_cast<const uint8_t*>(in) + len;
+    uint8_t *start = reinterpret_cast<uint8_t*>(out);
+    uint8_t *op = start;
+    uint8_t *oend = start + expected;
+
+    while (ip < end) {
+        size_t c = *ip++;
+        if (c < MAX_LITERAL) {
+            size_t n = c + 1;
+            if (op + n > oend || ip + n > end) {
+                return false;
+            }
+            memcpy(op, ip, n);
+            op += n;
+            ip += n;
+        } else {
+            size_t n = c >> 5;
+            if (n == 7) {
+                if (ip >= end) {
+                    return false;
+                }
+                n += *ip++;
+            }
+            if (ip >= end) {
+                return false;
+            }
+            size_t off = ((c & 0x1f) << 8) + *ip++ + 1;
+            n += 2;
+            if (off > static_cast<size_t>(op - start) || op + n > oend) {
+                return false;
+            }
+            // The reference may overlap what is being written.
+            const uint8_t *ref = op - off;
+            for (size_t i = 0; i < n; ++i) {
+                op[i] = ref[i];
+            }
+            op += n;
+        }
+    }
+    return op == oend;
+}
@@ -0,0 +1,72 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_COMPRESSOR_H_
+#define SRC_COMPRESSOR_H_ 1
+
+#include "config.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * A fast LZ77 codec for item values, using the LZF encoding.
+ *
+ * Compressed data starts with the length of the original data as a
+ * 32 bit big endian number, so it can be decompressed into a buffer of
+ * the right size without any other information.  Speed matters more
+ * than ratio here: values are compressed on the way out of a TAP
+ * stream and decompressed on the way in.
+ */
+class Compressor {
+public:
+
+    //! Size of the header in front of the compressed data.
+    static const size_t HEADER_SIZE = 4;
+
+    /**
+     * Compress a value.
+     *
+     * @param in the data to compress
+     * @param len the size of the data
+     * @param out where to write the compressed data
+     * @param outLen the size of out; data that wouldn't fit isn't worth
+     *               compressing, so this is usually smaller than len
+     * @return the size of the compressed data, or 0 if it didn't fit
+     */
+    static size_t compress(const char *in, size_t len, char *out, size_t outLen);
+
+    /**
+     * Get the size of the data compressed into the given buffer.
+     *
+     * @return the decompressed size, or 0 if this isn't compressed data
+     */
+    static size_t getDecompressedLength(const char *in, size_t len);
+
+    /**
+     * Decompress data compressed by compress().
+     *
+     * @param in the compressed data
+     * @param len the size of the compressed data
+     * @param out where to write the data, getDecompressedLength() bytes
+     * @param outLen the size of out
+     * @return false if the data is corrupt or doesn't fit in out
+     */
+    static bool decompress(const char *in, size_t len, char *out, size_t outLen);
+};
+
+#endif  // SRC_COMPRESSOR_H_
@@ -33,7 +33,7 @@ static couchstore_error_t cfs_advise(couch_file_handle, cs_off_t, cs_off_t, couc
 static void cfs_destroy(couch_file_handle);
 }
 
-couch_file_ops getCouchstoreStatsOps(CouchstoreStats* stats) {
+couch_file_ops getCouchstoreStatsOps(CouchFileGroup* files) {
     couch_file_ops ops = {
         4,
         cfs_construct,
@@ -45,7 +45,7 @@ couch_file_ops getCouchstoreStatsOps(CouchstoreStats* stats) {
         cfs_sync,
         cfs_advise,
         cfs_destroy,
-        stats
+        files
     };
     return ops;
 }
@@ -54,13 +54,35 @@ struct StatFile {
     const couch_file_ops* orig_ops;
     couch_file_handle orig_handle;
     CouchstoreStats* stats;
+    CouchFileGroup* group;
     cs_off_t last_offs;
 };
 
+static couchstore_error_t syncFile(StatFile* sf) {
+    BlockTimer bt(&sf->stats->syncTimeHisto);
+    ++sf->stats->syncCount;
+    return sf->orig_ops->sync(sf->orig_handle);
+}
+
+couchstore_error_t CouchFileGroup::sync() {
+    couchstore_error_t rv = closeErr;
+    std::set<couch_file_handle>::iterator it;
+    for (it = written.begin(); it != written.end(); ++it) {
+        couchstore_error_t err = syncFile(reinterpret_cast<StatFile*>(*it));
+        if (err != COUCHSTORE_SUCCESS) {
+            rv = err;
+        }
+    }
+    written.clear();
+    closeErr = COUCHSTORE_SUCCESS;
+    return rv;
+}
+
 extern "C" {
 static couch_file_handle cfs_construct(void* cookie) {
     StatFile* sf = new StatFile;
-    sf->stats = static_cast<CouchstoreStats*>(cookie);
+    sf->group = static_cast<CouchFileGroup*>(cookie);
+    sf->stats = sf->group->stats;
     sf->orig_ops = couchstore_get_default_file_ops();
     sf->orig_handle = sf->orig_ops->constructor(sf->orig_ops->cookie);
     sf->last_offs = 0;
@@ -74,6 +96,11 @@ static couchstore_error_t cfs_open(couch_file_handle* h, const char* path, int f
 
 static void cfs_close(couch_file_handle h) {
     StatFile* sf = reinterpret_cast<StatFile*>(h);
+    if (sf->group->removeWritten(h)) {
+        // Closed before the group was synced; the next sync() of the
+        // group reports if this failed.
+        sf->group->closedUnsynced(syncFile(sf));
+    }
     sf->orig_ops->close(sf->orig_handle);
 }
 
@@ -90,6 +117,9 @@ static ssize_t cfs_pread(couch_file_handle h, void* buf, size_t sz, cs_off_t off
 
 static ssize_t cfs_pwrite(couch_file_handle h, const void* buf, size_t sz, cs_off_t off) {
     StatFile* sf = reinterpret_cast<StatFile*>(h);
+    if (sf->group->isGrouping()) {
+        sf->group->addWritten(h);
+    }
     sf->stats->writeSizeHisto.add(sz);
     BlockTimer bt(&sf->stats->writeTimeHisto);
     return sf->orig_ops->pwrite(sf->orig_handle, buf, sz, off);
@@ -102,8 +132,11 @@ static cs_off_t cfs_goto_eof(couch_file_handle h) {
 
 static couchstore_error_t cfs_sync(couch_file_handle h) {
     StatFile* sf = reinterpret_cast<StatFile*>(h);
-    BlockTimer bt(&sf->stats->syncTimeHisto);
-    return sf->orig_ops->sync(sf->orig_handle);
+    if (sf->group->isGrouping()) {
+        // CouchFileGroup::sync() takes care of it.
+        return COUCHSTORE_SUCCESS;
+    }
+    return syncFile(sf);
 }
 
 static couchstore_error_t cfs_advise(couch_file_handle h, cs_off_t offs, cs_off_t len,
@@ -114,6 +147,7 @@ static couchstore_error_t cfs_advise(couch_file_handle h, cs_off_t offs, cs_off_
 
 static void cfs_destroy(couch_file_handle h) {
     StatFile* sf = reinterpret_cast<StatFile*>(h);
+    sf->group->removeWritten(h);
     sf->orig_ops->destructor(sf->orig_handle);
     delete sf;
 }
@@ -22,6 +22,10 @@
 
 #include <libcouchstore/couch_db.h>
 
+#include <set>
+
+#include "atomic.h"
+#include "common.h"
 #include "histo.h"
 
 struct CouchstoreStats {
@@ -43,6 +47,8 @@ public:
     Histogram<size_t> writeSizeHisto;
     //Time spent in sync
     Histogram<hrtime_t> syncTimeHisto;
+    //Number of syncs issued to the filesystem
+    Atomic<size_t> syncCount;
 
     void reset() {
         readTimeHisto.reset();
@@ -51,9 +57,72 @@ public:
         writeTimeHisto.reset();
         writeSizeHisto.reset();
         syncTimeHisto.reset();
+        syncCount.set(0);
+    }
+};
+
+/**
+ * The files opened through one set of stats collecting file ops, and
+ * the state of a group commit over them.
+ *
+ * Between begin() and end() the syncs couchstore asks for are skipped
+ * and the files written are remembered instead; sync() then syncs each
+ * of them, so every file is synced once for the whole group.
+ */
+class CouchFileGroup {
+public:
+    CouchFileGroup(CouchstoreStats *s) :
+        stats(s), grouping(false), closeErr(COUCHSTORE_SUCCESS) { }
+
+    void begin() {
+        grouping = true;
+    }
+
+    /**
+     * Sync every file written since begin() or the last sync().
+     *
+     * @return the error of any file that failed to sync, including
+     *         those closed in the meantime
+     */
+    couchstore_error_t sync();
+
+    void end() {
+        grouping = false;
+        written.clear();
+        closeErr = COUCHSTORE_SUCCESS;
     }
+
+    bool isGrouping() const {
+        return grouping;
+    }
+
+    void addWritten(couch_file_handle h) {
+        written.insert(h);
+    }
+
+    bool removeWritten(couch_file_handle h) {
+        return written.erase(h) > 0;
+    }
+
+    /**
+     * Note how syncing a written file on its close went.
+     */
+    void closedUnsynced(couchstore_error_t err) {
+        if (err != COUCHSTORE_SUCCESS) {
+            closeErr = err;
+        }
+    }
+
+    CouchstoreStats * const stats;
+
+private:
+    bool grouping;
+    couchstore_error_t closeErr;
+    std::set<couch_file_handle> written;
+
+    DISALLOW_COPY_AND_ASSIGN(CouchFileGroup);
 };
 
-couch_file_ops getCouchstoreStatsOps(CouchstoreStats* stats);
+couch_file_ops getCouchstoreStatsOps(CouchFileGroup* files);
 
 #endif  // SRC_COUCH_KVSTORE_COUCH_FS_STATS_H_
@@ -182,10 +182,16 @@ public:
 };
 
 struct LoadResponseCtx {
+    LoadResponseCtx() : limit(0), count(0), lastSeqno(0) { }
+
     shared_ptr<Callback<GetValue> > callback;
     uint16_t vbucketId;
     bool keysonly;
     EPStats *stats;
+    //! Stop after this many documents, 0 for no limit
+    size_t limit;
+    size_t count;
+    uint64_t lastSeqno;
 };
 
 CouchRequest::CouchRequest(const Item &it, uint64_t rev, CouchRequestCallback &cb, bool del) :
@@ -235,10 +241,11 @@ CouchRequest::CouchRequest(const Item &it, uint64_t rev, CouchRequestCallback &c
 CouchKVStore::CouchKVStore(EPStats &stats, Configuration &config, bool read_only) :
     KVStore(read_only), epStats(stats), configuration(config),
     dbname(configuration.getDbname()), couchNotifier(NULL), pendingCommitCnt(0),
-    intransaction(false), dbFileRevMapPopulated(false)
+    intransaction(false), dbFileRevMapPopulated(false),
+    fileGroup(&st.fsStats)
 {
     open();
-    statCollectingFileOps = getCouchstoreStatsOps(&st.fsStats);
+    statCollectingFileOps = getCouchstoreStatsOps(&fileGroup);
 
     // init db file map with default revision number, 1
     numDbFiles = static_cast<uint16_t>(configuration.getMaxVbuckets());
@@ -253,10 +260,11 @@ CouchKVStore::CouchKVStore(const CouchKVStore &copyFrom) :
     dbname(copyFrom.dbname),
     couchNotifier(NULL), dbFileRevMap(copyFrom.dbFileRevMap),
     numDbFiles(copyFrom.numDbFiles), pendingCommitCnt(0),
-    intransaction(false), dbFileRevMapPopulated(true)
+    intransaction(false), dbFileRevMapPopulated(true),
+    fileGroup(&st.fsStats)
 {
     open();
-    statCollectingFileOps = getCouchstoreStatsOps(&st.fsStats);
+    statCollectingFileOps = getCouchstoreStatsOps(&fileGroup);
 }
 
 void CouchKVStore::reset()
@@ -268,6 +276,12 @@ void CouchKVStore::reset()
     couchNotifier->flush(cb);
     cb.waitForValue();
 
+    resetVBuckets();
+}
+
+void CouchKVStore::resetVBuckets()
+{
+    assert(!isReadOnly());
     vbucket_map_t::iterator itor = cachedVBStates.begin();
     for (; itor != cachedVBStates.end(); ++itor) {
         uint16_t vbucket = itor->first;
@@ -395,6 +409,8 @@ void CouchKVStore::getMulti(uint16_t vb, vb_bgfetch_queue_t &itms)
         item2fetch = (*itr).second.front();
         seqIds.push_back(item2fetch->value.getId());
     }
+    // The by-sequence tree is walked once, in order.
+    std::sort(seqIds.begin(), seqIds.end());
 
     GetMultiCbCtx ctx(*this, vb, itms);
     errCode = couchstore_docinfos_by_sequence(db, &seqIds[0], seqIds.size(),
@@ -750,6 +766,48 @@ void CouchKVStore::dump(uint16_t vb, shared_ptr<Callback<GetValue> > cb)
     loadDB(cb, false, &vbids);
 }
 
+uint64_t CouchKVStore::dumpChunk(uint16_t vb, uint64_t startSeqno, size_t limit,
+                                 shared_ptr<Callback<GetValue> > cb)
+{
+    assert(limit > 0);
+    if (!dbFileRevMapPopulated) {
+        std::vector<std::string> files;
+        discoverDbFiles(dbname, files);
+        populateFileNameMap(files);
+    }
+
+    Db *db = NULL;
+    couchstore_error_t errorCode = openDB(vb, dbFileRevMap[vb], &db,
+                                          COUCHSTORE_OPEN_FLAG_RDONLY);
+    if (errorCode != COUCHSTORE_SUCCESS) {
+        LOG(EXTENSION_LOG_WARNING,
+            "Warning: failed to open database for vBucket=%d, error=%s [%s]",
+            vb, couchstore_strerror(errorCode),
+            couchkvstore_strerrno(errorCode).c_str());
+        return 0;
+    }
+
+    LoadResponseCtx ctx;
+    ctx.vbucketId = vb;
+    ctx.keysonly = false;
+    ctx.callback = cb;
+    ctx.stats = &epStats;
+    ctx.limit = limit;
+    errorCode = couchstore_changes_since(db, startSeqno, COUCHSTORE_NO_OPTIONS,
+                                         recordDbDumpC, static_cast<void *>(&ctx));
+    closeDatabaseHandle(db);
+
+    if (errorCode == COUCHSTORE_ERROR_CANCEL && ctx.count == limit) {
+        return ctx.lastSeqno + 1;
+    } else if (errorCode != COUCHSTORE_SUCCESS) {
+        LOG(EXTENSION_LOG_WARNING,
+            "Warning: couchstore_changes_since failed, error=%s [%s]",
+            couchstore_strerror(errorCode),
+            couchkvstore_strerrno(errorCode).c_str());
+    }
+    return 0;
+}
+
 void CouchKVStore::dumpKeys(const std::vector<uint16_t> &vbids,  shared_ptr<Callback<GetValue> > cb)
 {
     (void)vbids;
@@ -797,7 +855,7 @@ void CouchKVStore::addStats(const std::string &prefix,
     addStat(prefix_str, "failure_open",   st.numOpenFailure, add_stat, c);
     addStat(prefix_str, "failure_get",    st.numGetFailure,  add_stat, c);
 
-    if (prefix.compare("rw") == 0) {
+    if (!isReadOnly()) {
         addStat(prefix_str, "failure_set",   st.numSetFailure,   add_stat, c);
         addStat(prefix_str, "failure_del",   st.numDelFailure,   add_stat, c);
         addStat(prefix_str, "failure_vbset", st.numVbSetFailure, add_stat, c);
@@ -805,15 +863,13 @@ void CouchKVStore::addStats(const std::string &prefix,
         addStat(prefix_str, "numCommitRetry", st.numCommitRetry, add_stat, c);
 
         // stats for CouchNotifier
-        if (!isReadOnly()) {
-            couchNotifier->addStats(prefix, add_stat, c);
-        }
+        couchNotifier->addStats(prefix, add_stat, c);
     }
 }
 
 void CouchKVStore::addTimingStats(const std::string &prefix,
                                   ADD_STAT add_stat, const void *c) {
-    if (prefix.compare("rw") != 0) {
+    if (isReadOnly()) {
         return;
     }
     const char *prefix_str = prefix.c_str();
@@ -821,6 +877,7 @@ void CouchKVStore::addTimingStats(const std::string &prefix,
     addStat(prefix_str, "commitRetry", st.commitRetryHisto, add_stat, c);
     addStat(prefix_str, "delete",      st.delTimeHisto,     add_stat, c);
     addStat(prefix_str, "save_documents", st.saveDocsHisto, add_stat, c);
+    addStat(prefix_str, "commitBatchSize", st.commitBatchHisto, add_stat, c);
     addStat(prefix_str, "writeTime",   st.writeTimeHisto,   add_stat, c);
     addStat(prefix_str, "writeSize",   st.writeSizeHisto,   add_stat, c);
     addStat(prefix_str, "bulkSize",    st.batchSize,        add_stat, c);
@@ -829,6 +886,7 @@ void CouchKVStore::addTimingStats(const std::string &prefix,
     addStat(prefix_str, "fsReadTime",  st.fsStats.readTimeHisto,  add_stat, c);
     addStat(prefix_str, "fsWriteTime", st.fsStats.writeTimeHisto, add_stat, c);
     addStat(prefix_str, "fsSyncTime",  st.fsStats.syncTimeHisto,  add_stat, c);
+    addStat(prefix_str, "fsSyncCount", st.fsStats.syncCount,      add_stat, c);
     addStat(prefix_str, "fsReadSize",  st.fsStats.readSizeHisto,  add_stat, c);
     addStat(prefix_str, "fsWriteSize", st.fsStats.writeSizeHisto, add_stat, c);
     addStat(prefix_str, "fsReadSeek",  st.fsStats.readSeekHisto,  add_stat, c);
@@ -1278,7 +1336,10 @@ int CouchKVStore::recordDbDump(Db *db, DocInfo *docinfo, void *ctx)
     couchstore_free_document(doc);
 
     int returnCode = COUCHSTORE_SUCCESS;
-    if (warmup) {
+    loadCtx->lastSeqno = docinfo->db_seq;
+    if (loadCtx->limit != 0 && ++loadCtx->count == loadCtx->limit) {
+        returnCode = COUCHSTORE_ERROR_CANCEL;
+    } else if (warmup) {
         if (stats->warmupComplete.get()) {
             // warmup has completed, return COUCHSTORE_ERROR_CANCEL to
             // cancel remaining data dumps from couchstore
@@ -1291,6 +1352,10 @@ int CouchKVStore::recordDbDump(Db *db, DocInfo *docinfo, void *ctx)
     return returnCode;
 }
 
+static bool compareRequestsByVBucket(CouchRequest *a, CouchRequest *b) {
+    return a->getVBucketId() < b->getVBucketId();
+}
+
 bool CouchKVStore::commit2couchstore(void)
 {
     bool success = true;
@@ -1304,8 +1369,11 @@ bool CouchKVStore::commit2couchstore(void)
     DocInfo **docinfos = new DocInfo *[pendingCommitCnt];
 
     assert(pendingReqsQ[0]);
-    uint16_t vbucket2flush = pendingReqsQ[0]->getVBucketId();
-    uint64_t fileRev = pendingReqsQ[0]->getRevNum();
+    std::stable_sort(pendingReqsQ.begin(), pendingReqsQ.end(),
+                     compareRequestsByVBucket);
+
+    // One batch of documents per vbucket file.
+    std::vector<VBucketDocs> batches;
     int reqIndex = 0;
     for (; pendingCommitCnt > 0; ++reqIndex, --pendingCommitCnt) {
         CouchRequest *req = pendingReqsQ[reqIndex];
@@ -1313,18 +1381,41 @@ bool CouchKVStore::commit2couchstore(void)
         committedReqs[reqIndex] = req;
         docs[reqIndex] = req->getDbDoc();
         docinfos[reqIndex] = req->getDbDocInfo();
-        assert(vbucket2flush == req->getVBucketId());
+        if (batches.empty() || batches.back().vbid != req->getVBucketId()) {
+            VBucketDocs b;
+            b.reqs = committedReqs + reqIndex;
+            b.docs = docs + reqIndex;
+            b.docinfos = docinfos + reqIndex;
+            b.docCount = 0;
+            b.vbid = req->getVBucketId();
+            b.fileRev = req->getRevNum();
+            b.newFileRev = b.fileRev;
+            b.db = NULL;
+            b.errCode = COUCHSTORE_SUCCESS;
+            batches.push_back(b);
+        }
+        ++batches.back().docCount;
     }
+    st.commitBatchHisto.add(batches.size());
 
     // flush all
-    couchstore_error_t errCode = saveDocs(vbucket2flush, fileRev, docs, docinfos, reqIndex);
-    if (errCode) {
-        LOG(EXTENSION_LOG_WARNING,
-            "Warning: commit failed, cannot save CouchDB docs "
-            "for vbucket = %d rev = %llu\n", vbucket2flush, fileRev);
-        ++epStats.commitFailed;
+    if (batches.size() == 1) {
+        batches[0].errCode = saveDocs(batches[0].vbid, batches[0].fileRev,
+                                      docs, docinfos, reqIndex);
+    } else {
+        saveDocsGrouped(batches);
+    }
+
+    std::vector<VBucketDocs>::iterator it;
+    for (it = batches.begin(); it != batches.end(); ++it) {
+        if (it->errCode) {
+            LOG(EXTENSION_LOG_WARNING,
+                "Warning: commit failed, cannot save CouchDB docs "
+                "for vbucket = %d rev = %llu\n", it->vbid, it->fileRev);
+            ++epStats.commitFailed;
+        }
+        commitCallback(it->reqs, it->docCount, it->errCode);
     }
-    commitCallback(committedReqs, reqIndex, errCode);
 
     // clean up
     pendingReqsQ.clear();
@@ -1337,6 +1428,30 @@ bool CouchKVStore::commit2couchstore(void)
     return success;
 }
 
+couchstore_error_t CouchKVStore::updateMaxDeletedSeqno(Db *db, uint16_t vbid,
+                                                       DocInfo **docinfos,
+                                                       int docCount)
+{
+    uint64_t max = computeMaxDeletedSeqNum(docinfos, docCount);
+
+    // update max_deleted_seq in the local doc (vbstate)
+    // before save docs for the given vBucket
+    if (max > 0) {
+        vbucket_map_t::iterator it = cachedVBStates.find(vbid);
+        if (it != cachedVBStates.end() && it->second.maxDeletedSeqno < max) {
+            it->second.maxDeletedSeqno = max;
+            couchstore_error_t errCode = saveVBState(db, it->second);
+            if (errCode != COUCHSTORE_SUCCESS) {
+                LOG(EXTENSION_LOG_WARNING,
+                    "Warning: failed to save local doc for, "
+                    "vBucket = %d numDocs = %d\n", vbid, docCount);
+                return errCode;
+            }
+        }
+    }
+    return COUCHSTORE_SUCCESS;
+}
+
 couchstore_error_t CouchKVStore::saveDocs(uint16_t vbid, uint64_t rev, Doc **docs,
                                           DocInfo **docinfos, int docCount)
 {
@@ -1358,24 +1473,10 @@ couchstore_error_t CouchKVStore::saveDocs(uint16_t vbid, uint64_t rev, Doc **doc
                 "fileRev = %llu numDocs = %d", vbid, fileRev, docCount);
             return errCode;
         } else {
-            uint64_t max = computeMaxDeletedSeqNum(docinfos, docCount);
-
-            // update max_deleted_seq in the local doc (vbstate)
-            // before save docs for the given vBucket
-            if (max > 0) {
-                vbucket_map_t::iterator it =
-                    cachedVBStates.find(vbid);
-                if (it != cachedVBStates.end() && it->second.maxDeletedSeqno < max) {
-                    it->second.maxDeletedSeqno = max;
-                    errCode = saveVBState(db, it->second);
-                    if (errCode != COUCHSTORE_SUCCESS) {
-                        LOG(EXTENSION_LOG_WARNING,
-                            "Warning: failed to save local doc for, "
-                            "vBucket = %d numDocs = %d\n", vbid, docCount);
-                        closeDatabaseHandle(db);
-                        return errCode;
-                    }
-                }
+            errCode = updateMaxDeletedSeqno(db, vbid, docinfos, docCount);
+            if (errCode != COUCHSTORE_SUCCESS) {
+                closeDatabaseHandle(db);
+                return errCode;
             }
 
             hrtime_t cs_begin = gethrtime();
@@ -1453,14 +1554,126 @@ couchstore_error_t CouchKVStore::saveDocs(uint16_t vbid, uint64_t rev, Doc **doc
     return errCode;
 }
 
-void CouchKVStore::queueItem(CouchRequest *req)
+void CouchKVStore::saveDocsGrouped(std::vector<VBucketDocs> &batches)
 {
-    if (pendingCommitCnt &&
-        pendingReqsQ.front()->getVBucketId() != req->getVBucketId()) {
-        // got new request for a different vb, commit pending
-        // pending requests of the current vb firt
-        commit2couchstore();
+    std::vector<VBucketDocs>::iterator it;
+
+    // Write the documents of every vbucket first, and make them durable
+    // with one sync of each file.  couchstore_commit() only
+    // pads a file before writing the new header, so the headers can
+    // then be written and synced together as well.
+    fileGroup.begin();
+    for (it = batches.begin(); it != batches.end(); ++it) {
+        it->errCode = openDB(it->vbid, it->fileRev, &it->db, 0,
+                             &it->newFileRev);
+        if (it->errCode != COUCHSTORE_SUCCESS) {
+            LOG(EXTENSION_LOG_WARNING,
+                "Warning: failed to open database, vbucketId = %d "
+                "fileRev = %llu numDocs = %d", it->vbid, it->fileRev,
+                it->docCount);
+            it->db = NULL;
+            continue;
+        }
+        it->errCode = updateMaxDeletedSeqno(it->db, it->vbid, it->docinfos,
+                                            it->docCount);
+        if (it->errCode == COUCHSTORE_SUCCESS) {
+            hrtime_t cs_begin = gethrtime();
+            it->errCode = couchstore_save_documents(it->db, it->docs,
+                                                    it->docinfos,
+                                                    it->docCount,
+                                                    COMPRESS_DOC_BODIES);
+            st.saveDocsHisto.add((gethrtime() - cs_begin) / 1000);
+            if (it->errCode != COUCHSTORE_SUCCESS) {
+                LOG(EXTENSION_LOG_WARNING,
+                    "Warning: failed to save docs to database, numDocs = %d "
+                    "error=%s [%s]\n", it->docCount,
+                    couchstore_strerror(it->errCode),
+                    couchkvstore_strerrno(it->errCode).c_str());
+            }
+        }
+        if (it->errCode != COUCHSTORE_SUCCESS) {
+            closeDatabaseHandle(it->db);
+            it->db = NULL;
+        }
     }
+
+    couchstore_error_t syncErr = fileGroup.sync();
+    for (it = batches.begin(); syncErr == COUCHSTORE_SUCCESS &&
+             it != batches.end(); ++it) {
+        if (it->db) {
+            hrtime_t cs_begin = gethrtime();
+            it->errCode = couchstore_commit(it->db);
+            st.commitHisto.add((gethrtime() - cs_begin) / 1000);
+            if (it->errCode) {
+                LOG(EXTENSION_LOG_WARNING,
+                    "Warning: couchstore_commit failed, error=%s [%s]",
+                    couchstore_strerror(it->errCode),
+                    couchkvstore_strerrno(it->errCode).c_str());
+                closeDatabaseHandle(it->db);
+                it->db = NULL;
+            }
+        }
+    }
+    if (syncErr == COUCHSTORE_SUCCESS) {
+        syncErr = fileGroup.sync();
+    }
+    fileGroup.end();
+
+    for (it = batches.begin(); it != batches.end(); ++it) {
+        if (!it->db) {
+            continue;
+        }
+        if (syncErr != COUCHSTORE_SUCCESS) {
+            LOG(EXTENSION_LOG_WARNING,
+                "Warning: failed to sync database, vbucketId = %d "
+                "error=%s [%s]", it->vbid, couchstore_strerror(syncErr),
+                couchkvstore_strerrno(syncErr).c_str());
+            it->errCode = syncErr;
+            closeDatabaseHandle(it->db);
+            continue;
+        }
+
+        if (epStats.shutdown.isShutdown) {
+            // shutdown is in progress, no need to notify mccouch
+            // the compactor must have already exited!
+            closeDatabaseHandle(it->db);
+            st.docsCommitted = it->docCount;
+            continue;
+        }
+
+        RememberingCallback<uint16_t> cb;
+        uint64_t newHeaderPos = couchstore_get_header_position(it->db);
+        couchNotifier->notify_headerpos_update(it->vbid, it->newFileRev,
+                                               newHeaderPos, cb);
+        if (cb.val == PROTOCOL_BINARY_RESPONSE_ETMPFAIL) {
+            // The file was compacted meanwhile; save the documents again
+            // on their own, into the new file.
+            LOG(EXTENSION_LOG_WARNING,
+                "Retry notify CouchDB of update, vbucket=%d rev=%llu\n",
+                it->vbid, it->newFileRev);
+            ++st.numCommitRetry;
+            closeDatabaseHandle(it->db);
+            it->errCode = saveDocs(it->vbid, it->newFileRev, it->docs,
+                                   it->docinfos, it->docCount);
+            continue;
+        } else if (cb.val != PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+            LOG(EXTENSION_LOG_WARNING, "Warning: failed to notify "
+                "CouchDB of update for vbucket=%d, error=0x%x\n",
+                it->vbid, cb.val);
+        }
+        st.batchSize.add(it->docCount);
+
+        DbInfo info;
+        couchstore_db_info(it->db, &info);
+        cachedDeleteCount[it->vbid] = info.deleted_count;
+        closeDatabaseHandle(it->db);
+        st.docsCommitted = it->docCount;
+    }
+}
+
+void CouchKVStore::queueItem(CouchRequest *req)
+{
+    // Requests for several vbuckets are committed together.
     pendingReqsQ.push_back(req);
     pendingCommitCnt++;
 }
@@ -75,6 +75,7 @@ public:
         commitRetryHisto.reset();
         saveDocsHisto.reset();
         batchSize.reset();
+        commitBatchHisto.reset();
         fsStats.reset();
     }
 
@@ -116,6 +117,8 @@ public:
     Histogram<hrtime_t> saveDocsHisto;
     // Batch size of saveDocs calls
     Histogram<size_t> batchSize;
+    // Number of vbucket files written by a commit
+    Histogram<size_t> commitBatchHisto;
 
     // Stats from the underlying OS file operations done by couchstore.
     CouchstoreStats fsStats;
@@ -290,6 +293,12 @@ public:
      */
     void reset(void);
 
+    /**
+     * Reset the vbuckets this instance knows the state of, leaving the
+     * rest of the database alone.
+     */
+    void resetVBuckets(void);
+
     /**
      * Begin a transaction (if not already in one).
      *
@@ -417,6 +426,19 @@ public:
      */
     void dump(uint16_t vb, shared_ptr<Callback<GetValue> > cb);
 
+    /**
+     * Retrieve up to limit documents for a given vbucket from the storage
+     * system, walking the by-sequence tree from startSeqno.
+     *
+     * @param vb vbucket id
+     * @param startSeqno the sequence number to start at
+     * @param limit the maximum number of documents to retrieve
+     * @param cb callback instance to process each document retrieved
+     * @return the sequence number to continue at, or 0 if done
+     */
+    uint64_t dumpChunk(uint16_t vb, uint64_t startSeqno, size_t limit,
+                       shared_ptr<Callback<GetValue> > cb);
+
     /**
      * Retrieve all the keys from the underlying storage system.
      *
@@ -517,6 +539,21 @@ protected:
                  ADD_STAT add_stat, const void *c);
 
 private:
+    /**
+     * The documents of one vbucket in a commit.
+     */
+    struct VBucketDocs {
+        CouchRequest **reqs;
+        Doc **docs;
+        DocInfo **docinfos;
+        int docCount;
+        uint16_t vbid;
+        uint64_t fileRev;
+        uint64_t newFileRev;
+        Db *db;
+        couchstore_error_t errCode;
+    };
+
     void operator=(const CouchKVStore &from);
 
     void open();
@@ -535,6 +572,9 @@ private:
                                     Db **db, uint64_t *newFileRev);
     couchstore_error_t saveDocs(uint16_t vbid, uint64_t rev, Doc **docs,
                                 DocInfo **docinfos, int docCount);
+    void saveDocsGrouped(std::vector<VBucketDocs> &batches);
+    couchstore_error_t updateMaxDeletedSeqno(Db *db, uint16_t vbid,
+                                             DocInfo **docinfos, int docCount);
     void commitCallback(CouchRequest **committedReqs, int numReqs,
                         couchstore_error_t errCode);
     couchstore_error_t saveVBState(Db *db, vbucket_state &vbState);
@@ -554,6 +594,7 @@ private:
 
     /* all stats */
     CouchKVStoreStats   st;
+    CouchFileGroup fileGroup;
     couch_file_ops statCollectingFileOps;
     /* vbucket state cache*/
     vbucket_map_t cachedVBStates;
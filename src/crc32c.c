@@ -0,0 +1,148 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#include "crc32c.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <cpuid.h>
+#define CRC32C_HW 1
+/* CPUID leaf 1, ecx */
+#define CPUID_SSE4_2 (1 << 20)
+#endif
+
+/* The Castagnoli polynomial, reversed. */
+#define CRC32C_POLY 0x82f63b78
+
+/*
+ * crc32c_table[k][n] is the CRC of byte n followed by k zero bytes, so
+ * eight bytes can be folded into the CRC with eight independent lookups.
+ */
+static uint32_t crc32c_table[8][256];
+
+typedef uint32_t (*crc32c_fn)(uint32_t crc, const uint8_t *buf, size_t len);
+
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+static crc32c_fn crc32c_impl;
+
+static uint32_t crc32c_sw_update(uint32_t crc, const uint8_t *p, size_t len) {
+    while (len >= 8) {
+        /* Assembled byte by byte so this works on any endianness. */
+        uint32_t lo = crc ^ (p[0] | (p[1] << 8) | (p[2] << 16) |
+                             ((uint32_t)p[3] << 24));
+        uint32_t hi = p[4] | (p[5] << 8) | (p[6] << 16) |
+            ((uint32_t)p[7] << 24);
+        crc = crc32c_table[7][lo & 0xff] ^
+            crc32c_table[6][(lo >> 8) & 0xff] ^
+            crc32c_table[5][(lo >> 16) & 0xff] ^
+            crc32c_table[4][lo >> 24] ^
+            crc32c_table[3][hi & 0xff] ^
+            crc32c_table[2][(hi >> 8) & 0xff] ^
+            crc32c_table[1][(hi >> 16) & 0xff] ^
+            crc32c_table[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+    for (; len; --len, ++p) {
+        crc = crc32c_table[0][(crc ^ *p) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#ifdef CRC32C_HW
+static uint32_t crc32c_hw_update(uint32_t crc, const uint8_t *p, size_t len) {
+    /* The wide instruction is fastest on aligned words. */
+    while (len > 0 && ((uintptr_t)p & 7) != 0) {
+        __asm__("crc32b %1, %0" : "+r"(crc) : "rm"(*p));
+        ++p;
+        --len;
+    }
+#ifdef __x86_64__
+    {
+        uint64_t crc64 = crc;
+        while (len >= 8) {
+            uint64_t v;
+            memcpy(&v, p, sizeof(v));
+            __asm__("crc32q %1, %0" : "+r"(crc64) : "rm"(v));
+            p += 8;
+            len -= 8;
+        }
+        crc = (uint32_t)crc64;
+    }
+#else
+    while (len >= 4) {
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        __asm__("crc32l %1, %0" : "+r"(crc) : "rm"(v));
+        p += 4;
+        len -= 4;
+    }
+#endif
+    for (; len; --len, ++p) {
+        __asm__("crc32b %1, %0" : "+r"(crc) : "rm"(*p));
+    }
+    return crc;
+}
+#endif
+
+static void crc32c_init(void) {
+    uint32_t n, k, crc;
+    for (n = 0; n < 256; ++n) {
+        crc = n;
+        for (k = 0; k < 8; ++k) {
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        crc32c_table[0][n] = crc;
+    }
+    for (n = 0; n < 256; ++n) {
+        crc = crc32c_table[0][n];
+        for (k = 1; k < 8; ++k) {
+            crc = crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+            crc32c_table[k][n] = crc;
+        }
+    }
+
+    crc32c_impl = crc32c_sw_update;
+#ifdef CRC32C_HW
+    {
+        unsigned int eax, ebx, ecx, edx;
+        if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) &&
+            (ecx & CPUID_SSE4_2) != 0) {
+            crc32c_impl = crc32c_hw_update;
+        }
+    }
+#endif
+}
+
+uint32_t crc32c(const uint8_t *buf, size_t len) {
+    pthread_once(&crc32c_once, crc32c_init);
+    return ~crc32c_impl(0xffffffff, buf, len);
+}
+
+uint32_t crc32c_sw(const uint8_t *buf, size_t len) {
+    pthread_once(&crc32c_once, crc32c_init);
+    return ~crc32c_sw_update(0xffffffff, buf, len);
+}
+
+int crc32c_hw_available(void) {
+    pthread_once(&crc32c_once, crc32c_init);
+    return crc32c_impl != crc32c_sw_update;
+}
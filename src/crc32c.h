@@ -0,0 +1,42 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_CRC32C_H_
+#define SRC_CRC32C_H_ 1
+
+#include "config.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Compute the CRC32C (Castagnoli) checksum of a buffer, with the SSE4.2
+ * crc32 instruction when the CPU has it.
+ */
+uint32_t crc32c(const uint8_t *buf, size_t len);
+
+/**
+ * Compute the CRC32C checksum of a buffer in software (slicing-by-8).
+ */
+uint32_t crc32c_sw(const uint8_t *buf, size_t len);
+
+/**
+ * Nonzero if crc32c() uses the crc32 instruction of this CPU.
+ */
+int crc32c_hw_available(void);
+
+#endif  // SRC_CRC32C_H_
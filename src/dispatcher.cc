@@ -25,9 +25,10 @@ extern "C" {
 }
 
 static void* launch_dispatcher_thread(void *arg) {
-    Dispatcher *dispatcher = (Dispatcher*) arg;
+    DispatcherWorker *worker = static_cast<DispatcherWorker*>(arg);
+    Dispatcher *dispatcher = &worker->dispatcher;
     try {
-        dispatcher->run();
+        dispatcher->run(*worker);
     } catch (std::exception& e) {
         LOG(EXTENSION_LOG_WARNING, "%s: Caught an exception: %s\n",
             dispatcher->getName().c_str(), e.what());
@@ -87,43 +88,132 @@ void Task::snooze(const double secs, bool first) {
 
 void Dispatcher::start() {
     assert(state == dispatcher_running);
-    if(pthread_create(&thread, NULL, launch_dispatcher_thread, this) != 0) {
-        std::stringstream ss;
-        ss << getName().c_str() << ": Initialization error!!!";
-        throw std::runtime_error(ss.str().c_str());
+    activeWorkers = workers.size();
+    std::vector<DispatcherWorker*>::iterator it;
+    for (it = workers.begin(); it != workers.end(); ++it) {
+        if (pthread_create(&(*it)->thread, NULL,
+                           launch_dispatcher_thread, *it) != 0) {
+            std::stringstream ss;
+            ss << getName().c_str() << ": Initialization error!!!";
+            throw std::runtime_error(ss.str().c_str());
+        }
     }
 }
 
-TaskId Dispatcher::nextTask() {
-    assert (!empty());
-    return readyQueue.empty() ? futureQueue.top() : readyQueue.top();
+size_t Dispatcher::moveReadyTasks(const struct timeval &tv) {
+    size_t moved = 0;
+    while (!futureQueue.empty()) {
+        const TaskId &tid = futureQueue.top();
+        if (less_tv(tv, tid->waketime)) {
+            // We found all the ready stuff.
+            break;
+        }
+        DispatcherWorker *w = workers[nextWorker++ % workers.size()];
+        LockHolder wlh(w->mutex);
+        w->readyQueue.push(tid);
+        wlh.unlock();
+        futureQueue.pop();
+        ++readyTasks;
+        ++moved;
+    }
+    return moved;
 }
 
-void Dispatcher::popNext() {
-    assert (!empty());
-    readyQueue.empty() ? futureQueue.pop() : readyQueue.pop();
+TaskId Dispatcher::takeReadyTask(DispatcherWorker &worker) {
+    size_t n = workers.size();
+    while (readyTasks.get() > 0) {
+        // Look at the head of every queue, starting with our own so it
+        // wins ties.
+        DispatcherWorker *best = NULL;
+        int bestPriority = 0;
+        for (size_t i = 0; i < n; ++i) {
+            DispatcherWorker *w = workers[(worker.id + i) % n];
+            LockHolder wlh(w->mutex);
+            if (!w->readyQueue.empty() &&
+                (best == NULL || w->readyQueue.top()->priority < bestPriority)) {
+                best = w;
+                bestPriority = w->readyQueue.top()->priority;
+            }
+        }
+        if (best == NULL) {
+            break;
+        }
+
+        LockHolder wlh(best->mutex);
+        if (best->readyQueue.empty() ||
+            best->readyQueue.top()->priority > bestPriority) {
+            // Somebody else got there first, look again.
+            continue;
+        }
+        TaskId task(best->readyQueue.top());
+        best->readyQueue.pop();
+        --readyTasks;
+        if (best != &worker) {
+            ++steals;
+        }
+        return task;
+    }
+    return TaskId();
 }
 
-void Dispatcher::moveReadyTasks(const struct timeval &tv) {
-    if (!readyQueue.empty()) {
+void Dispatcher::runTask(DispatcherWorker &worker, TaskId &task) {
+    LockHolder tlh(task->mutex);
+    if (task->state == task_dead) {
         return;
     }
-    while (!futureQueue.empty()) {
-        const TaskId &tid = futureQueue.top();
-        if (less_tv(tid->waketime, tv)) {
-            readyQueue.push(tid);
-            futureQueue.pop();
-        } else {
-            // We found all the ready stuff.
-            return;
+    tlh.unlock();
+
+    std::string desc(task->getName());
+    hrtime_t start(gethrtime());
+    LockHolder wlh(worker.mutex);
+    worker.taskDesc = desc;
+    worker.taskStart = start;
+    worker.running_task = true;
+    wlh.unlock();
+
+    rel_time_t startReltime = ep_current_time();
+    try {
+        if(task->run(*this, task)) {
+            reschedule(task);
         }
+    } catch (std::exception& e) {
+        LOG(EXTENSION_LOG_WARNING,
+            "%s: Exception caught in task \"%s\": %s",
+            getName().c_str(), desc.c_str(), e.what());
+    } catch(...) {
+        LOG(EXTENSION_LOG_WARNING,
+            "%s: Fatal exception caught in task \"%s\"\n",
+            getName().c_str(), desc.c_str());
+    }
+
+    hrtime_t runtime((gethrtime() - start) / 1000);
+    wlh.lock();
+    worker.running_task = false;
+    wlh.unlock();
+
+    JobLogEntry jle(desc, runtime, startReltime);
+    LockHolder llh(logMutex);
+    joblog.add(jle);
+    if (runtime > task->maxExpectedDuration()) {
+        slowjobs.add(jle);
     }
 }
 
-void Dispatcher::run() {
+void Dispatcher::run(DispatcherWorker &worker) {
     ObjectRegistry::onSwitchThread(&engine);
-    LOG(EXTENSION_LOG_INFO, "%s: Starting", getName().c_str());
+    LOG(EXTENSION_LOG_INFO, "%s: Starting worker %d", getName().c_str(),
+        static_cast<int>(worker.id));
     for (;;) {
+        if (state != dispatcher_running) {
+            break;
+        }
+
+        TaskId task(takeReadyTask(worker));
+        if (task) {
+            runTask(worker, task);
+            continue;
+        }
+
         LockHolder lh(mutex);
         // Having acquired the lock, verify our state and break out if
         // it's changed.
@@ -131,72 +221,46 @@ void Dispatcher::run() {
             break;
         }
 
-        if (empty()) {
-            // Wait forever as long as the state didn't change while
-            // we grabbed the lock.
-            if (state == dispatcher_running) {
-                noTask();
-                mutex.wait();
-            }
-        } else {
-            struct timeval tv;
-            gettimeofday(&tv, NULL);
-
-            // Get any ready tasks out of the due queue.
-            moveReadyTasks(tv);
-
-            TaskId task = nextTask();
-            assert(task);
-            LockHolder tlh(task->mutex);
-            if (task->state == task_dead) {
-                popNext();
-                continue;
-            }
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
 
-            if (less_tv(tv, task->waketime)) {
-                idleTask->setWaketime(task->waketime);
-                idleTask->setDispatcherNotifications(notifications.get());
-                task = static_cast<Task *>(idleTask.get());
-                taskDesc = task->getName();
-            } else {
-                // Otherwise, do the normal thing.
-                popNext();
-                taskDesc = task->getName();
-            }
-            tlh.unlock();
+        // Get any ready tasks out of the due queue, and let the other
+        // workers help if there's more than one.
+        if (moveReadyTasks(tv) > 1) {
+            notify();
+        }
+        if (readyTasks.get() > 0) {
+            continue;
+        }
 
-            taskStart = gethrtime();
+        if (futureQueue.empty()) {
+            // Wait forever; anything scheduled notifies us under the lock.
+            LockHolder wlh(worker.mutex);
+            worker.taskDesc = "none";
+            wlh.unlock();
+            mutex.wait();
+        } else {
+            IdleTask *idle = worker.idleTask.get();
+            idle->setWaketime(futureQueue.top()->waketime);
+            idle->setDispatcherNotifications(notifications.get());
             lh.unlock();
-            rel_time_t startReltime = ep_current_time();
-            try {
-                running_task = true;
-                if(task->run(*this, task)) {
-                    reschedule(task);
-                }
-            } catch (std::exception& e) {
-                LOG(EXTENSION_LOG_WARNING,
-                    "%s: Exception caught in task \"%s\": %s",
-                    getName().c_str(), task->getName().c_str(), e.what());
-            } catch(...) {
-                LOG(EXTENSION_LOG_WARNING,
-                    "%s: Fatal exception caught in task \"%s\"\n",
-                    getName().c_str(), task->getName().c_str());
-            }
-            running_task = false;
-
-            hrtime_t runtime((gethrtime() - taskStart) / 1000);
-            JobLogEntry jle(taskDesc, runtime, startReltime);
-            joblog.add(jle);
-            if (runtime > task->maxExpectedDuration()) {
-                slowjobs.add(jle);
-            }
+            TaskId idleId(static_cast<Task *>(idle));
+            runTask(worker, idleId);
         }
     }
 
-    completeNonDaemonTasks();
-    state = dispatcher_stopped;
-    notify();
-    LOG(EXTENSION_LOG_INFO,"%s: Exited", getName().c_str());
+    LockHolder lh(mutex);
+    LOG(EXTENSION_LOG_INFO, "%s: Worker %d exited", getName().c_str(),
+        static_cast<int>(worker.id));
+    if (--activeWorkers == 0) {
+        // The last worker out finishes whatever must complete.
+        lh.unlock();
+        completeNonDaemonTasks();
+        lh.lock();
+        state = dispatcher_stopped;
+        notify();
+        LOG(EXTENSION_LOG_INFO,"%s: Exited", getName().c_str());
+    }
 }
 
 void Dispatcher::stop(bool force) {
@@ -209,10 +273,26 @@ void Dispatcher::stop(bool force) {
     state = dispatcher_stopping;
     notify();
     lh.unlock();
-    pthread_join(thread, NULL);
+    std::vector<DispatcherWorker*>::iterator it;
+    for (it = workers.begin(); it != workers.end(); ++it) {
+        pthread_join((*it)->thread, NULL);
+    }
     LOG(EXTENSION_LOG_INFO, "%s: Stopped", getName().c_str());
 }
 
+DispatcherState Dispatcher::getDispatcherState() {
+    std::vector<WorkerState> ws;
+    std::vector<DispatcherWorker*>::iterator it;
+    for (it = workers.begin(); it != workers.end(); ++it) {
+        LockHolder wlh((*it)->mutex);
+        ws.push_back(WorkerState((*it)->taskDesc, (*it)->taskStart,
+                                 (*it)->running_task));
+    }
+    LockHolder lh(logMutex);
+    return DispatcherState(state, ws, steals.get(),
+                           joblog.contents(), slowjobs.contents());
+}
+
 void Dispatcher::schedule(shared_ptr<DispatcherCallback> callback,
                           TaskId *outtid,
                           const Priority &priority,
@@ -272,9 +352,26 @@ void Dispatcher::reschedule(TaskId &task) {
 
 void Dispatcher::completeNonDaemonTasks() {
     LockHolder lh(mutex);
-    while (!empty()) {
-        TaskId task = nextTask();
-        popNext();
+    ReadyQueue readyQueue;
+    std::vector<DispatcherWorker*>::iterator it;
+    for (it = workers.begin(); it != workers.end(); ++it) {
+        LockHolder wlh((*it)->mutex);
+        while (!(*it)->readyQueue.empty()) {
+            readyQueue.push((*it)->readyQueue.top());
+            (*it)->readyQueue.pop();
+        }
+    }
+    readyTasks.set(0);
+
+    while (!readyQueue.empty() || !futureQueue.empty()) {
+        TaskId task;
+        if (readyQueue.empty()) {
+            task = futureQueue.top();
+            futureQueue.pop();
+        } else {
+            task = readyQueue.top();
+            readyQueue.pop();
+        }
         assert(task);
         // Skip a daemon task
         if (task->isDaemonTask) {
@@ -247,18 +247,48 @@ public:
     }
 };
 
+/**
+ * Snapshot of what a single dispatcher worker thread is doing.
+ */
+class WorkerState {
+public:
+    WorkerState(const std::string &name, hrtime_t start, bool running)
+        : taskName(name), taskStart(start), running_task(running) {}
+
+    /**
+     * Get the time the current task started.
+     */
+    hrtime_t getTaskStart() const { return taskStart; }
+
+    /**
+     * Get the name of the currently running task.
+     */
+    const std::string getTaskName() const { return taskName; }
+
+    /**
+     * True if the worker is currently running a task.
+     */
+    bool isRunningTask() const { return running_task; }
+
+private:
+    std::string taskName;
+    hrtime_t taskStart;
+    bool running_task;
+};
+
 /**
  * Snapshot of the state of a dispatcher.
  */
 class DispatcherState {
 public:
-    DispatcherState(const std::string &name,
-                    enum dispatcher_state st,
-                    hrtime_t start, bool running,
+    DispatcherState(enum dispatcher_state st,
+                    std::vector<WorkerState> w,
+                    size_t nsteals,
                     std::vector<JobLogEntry> jl,
                     std::vector<JobLogEntry> sj)
-        : joblog(jl), slowjobs(sj), taskName(name),
-          state(st), taskStart(start), running_task(running) {}
+        : joblog(jl), slowjobs(sj), workers(w), state(st), steals(nsteals) {
+        assert(!workers.empty());
+    }
 
     /**
      * Get the name of the current dispatcher state.
@@ -274,19 +304,37 @@ public:
     }
 
     /**
-     * Get the time the current task started.
+     * Get the time the first worker's current task started.
      */
-    hrtime_t getTaskStart() const { return taskStart; }
+    hrtime_t getTaskStart() const { return workers[0].getTaskStart(); }
 
     /**
-     * Get the name of the currently running task.
+     * Get the name of the task the first worker is running.
      */
-    const std::string getTaskName() const { return taskName; }
+    const std::string getTaskName() const { return workers[0].getTaskName(); }
 
     /**
-     * True if the dispatcher is currently running a task.
+     * True if any worker of the dispatcher is currently running a task.
      */
-    bool isRunningTask() const { return running_task; }
+    bool isRunningTask() const {
+        std::vector<WorkerState>::const_iterator it;
+        for (it = workers.begin(); it != workers.end(); ++it) {
+            if (it->isRunningTask()) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * Get the state of each worker thread.
+     */
+    const std::vector<WorkerState> &getWorkers() const { return workers; }
+
+    /**
+     * Get the number of tasks a worker took from another worker's queue.
+     */
+    size_t getSteals() const { return steals; }
 
     /**
      * Retrieve the log of recently completed jobs.
@@ -301,27 +349,68 @@ public:
 private:
     const std::vector<JobLogEntry> joblog;
     const std::vector<JobLogEntry> slowjobs;
-    const std::string taskName;
+    const std::vector<WorkerState> workers;
     const enum dispatcher_state state;
-    const hrtime_t taskStart;
-    const bool running_task;
+    const size_t steals;
 };
 
+typedef std::priority_queue<TaskId, std::deque<TaskId>,
+                            CompareTasksByPriority> ReadyQueue;
+
 /**
- * Schedule and run tasks in another thread.
+ * A thread of a Dispatcher and the ready tasks handed to it.
+ */
+struct DispatcherWorker {
+    DispatcherWorker(Dispatcher &d, size_t i)
+        : dispatcher(d), id(i), idleTask(new IdleTask),
+          taskDesc("none"), taskStart(0), running_task(false) {}
+
+    Dispatcher &dispatcher;
+    const size_t id;
+    pthread_t thread;
+    //! Guards readyQueue and the description of the running task.
+    Mutex mutex;
+    ReadyQueue readyQueue;
+    SingleThreadedRCPtr<IdleTask> idleTask;
+    std::string taskDesc;
+    hrtime_t taskStart;
+    bool running_task;
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(DispatcherWorker);
+};
+
+/**
+ * Schedule and run tasks in a pool of threads.
+ *
+ * Tasks wait in a queue ordered by due date until they are ready, and
+ * are then handed round-robin to the workers' ready queues.  A worker
+ * runs the most urgent task found at the head of its own queue or, if
+ * another worker's queue holds a more urgent one (or its own is
+ * empty), steals that, so priority order holds across the pool.  A
+ * task is only ever queued once, so it never runs on two workers at
+ * the same time.
  */
 class Dispatcher {
 public:
-    Dispatcher(EventuallyPersistentEngine &e, const char *desc = NULL) :
+    Dispatcher(EventuallyPersistentEngine &e, const char *desc = NULL,
+               size_t nworkers = 1) :
         notifications(0), joblog(JOB_LOG_SIZE), slowjobs(JOB_LOG_SIZE),
-        idleTask(new IdleTask), state(dispatcher_running), running_task(false),
+        nextWorker(0), activeWorkers(0), state(dispatcher_running),
         forceTermination(false), engine(e), name(desc ? desc : "Dispatcher")
     {
-        noTask();
+        assert(nworkers > 0);
+        for (size_t i = 0; i < nworkers; ++i) {
+            workers.push_back(new DispatcherWorker(*this, i));
+        }
     }
 
     ~Dispatcher() {
         stop();
+        std::vector<DispatcherWorker*>::iterator it;
+        for (it = workers.begin(); it != workers.end(); ++it) {
+            delete *it;
+        }
     }
 
     /**
@@ -350,7 +439,7 @@ public:
     void wake(TaskId &task);
 
     /**
-     * Start this dispatcher's thread.
+     * Start this dispatcher's threads.
      */
     void start();
     /**
@@ -360,9 +449,9 @@ public:
     void stop(bool force = false);
 
     /**
-     * Dispatcher's main loop.  Don't run this.
+     * A worker's main loop.  Don't run this.
      */
-    void run();
+    void run(DispatcherWorker &worker);
 
     /**
      * Delay a task.
@@ -378,20 +467,24 @@ public:
     void cancel(TaskId &t);
 
     /**
-     * Get the name of the currently executing task.
+     * Get the name of the task executing on the first worker.
      */
-    std::string getCurrentTaskName() { return taskDesc; }
+    std::string getCurrentTaskName() {
+        LockHolder lh(workers[0]->mutex);
+        return workers[0]->taskDesc;
+    }
 
     /**
      * Get the state of the dispatcher.
      */
     enum dispatcher_state getState() { return state; }
 
-    DispatcherState getDispatcherState() {
-        LockHolder lh(mutex);
-        return DispatcherState(taskDesc, state, taskStart, running_task,
-                               joblog.contents(), slowjobs.contents());
-    }
+    DispatcherState getDispatcherState();
+
+    /**
+     * Get the number of worker threads.
+     */
+    size_t getNumWorkers() const { return workers.size(); }
 
     const std::string &getName() { return name; }
 
@@ -399,10 +492,6 @@ private:
 
     friend class IdleTask;
 
-    void noTask() {
-        taskDesc = "none";
-    }
-
     void reschedule(TaskId &task);
 
     void notify() {
@@ -416,34 +505,40 @@ private:
     void completeNonDaemonTasks();
 
     /**
-     * Move all tasks that are ready for execution into the "ready"
-     * priority queue.
+     * Hand all tasks that are ready for execution to the workers'
+     * ready queues.  Must be called with the dispatcher lock held.
+     *
+     * @return the number of tasks handed out
      */
-    void moveReadyTasks(const struct timeval &tv);
-
-    //! True if there are no tasks scheduled.
-    bool empty() { return readyQueue.empty() && futureQueue.empty(); }
+    size_t moveReadyTasks(const struct timeval &tv);
 
-    //! Get the next task.
-    TaskId nextTask();
+    /**
+     * Take the most urgent ready task, preferring the given worker's
+     * own queue among equally urgent ones.
+     *
+     * @return the task, or an empty TaskId if no task is ready
+     */
+    TaskId takeReadyTask(DispatcherWorker &worker);
 
-    //! Remove the next task.
-    void popNext();
+    /**
+     * Run a task on the given worker and record it in the job logs.
+     */
+    void runTask(DispatcherWorker &worker, TaskId &task);
 
-    std::string taskDesc;
-    pthread_t thread;
     SyncObject mutex;
     Atomic<size_t> notifications;
-    std::priority_queue<TaskId, std::deque<TaskId >,
-                        CompareTasksByPriority> readyQueue;
+    std::vector<DispatcherWorker*> workers;
+    //! Number of tasks in the workers' ready queues.
+    Atomic<size_t> readyTasks;
+    Atomic<size_t> steals;
     std::priority_queue<TaskId, std::deque<TaskId >,
                         CompareTasksByDueDate> futureQueue;
+    Mutex logMutex;
     RingBuffer<JobLogEntry> joblog;
     RingBuffer<JobLogEntry> slowjobs;
-    SingleThreadedRCPtr<IdleTask> idleTask;
+    size_t nextWorker;
+    size_t activeWorkers;
     enum dispatcher_state state;
-    hrtime_t taskStart;
-    bool running_task;
     bool forceTermination;
 
     EventuallyPersistentEngine &engine;
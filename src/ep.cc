@@ -30,6 +30,7 @@
 #include <vector>
 
 #include "access_scanner.h"
+#include "backfill.h"
 #include "checkpoint_remover.h"
 #include "dispatcher.h"
 #include "ep.h"
@@ -196,11 +197,12 @@ private:
  */
 class SnapshotVBucketsCallback : public DispatcherCallback {
 public:
-    SnapshotVBucketsCallback(EventuallyPersistentStore *e, const Priority &p)
-        : ep(e), priority(p) { }
+    SnapshotVBucketsCallback(EventuallyPersistentStore *e, const Priority &p,
+                             FlusherShard *s)
+        : ep(e), priority(p), shard(s) { }
 
     bool callback(Dispatcher &, TaskId &) {
-        ep->snapshotVBuckets(priority);
+        ep->snapshotVBuckets(priority, shard);
         return false;
     }
 
@@ -210,6 +212,7 @@ public:
 private:
     EventuallyPersistentStore *ep;
     const Priority &priority;
+    FlusherShard *shard;
 };
 
 class VBucketMemoryDeletionCallback : public DispatcherCallback {
@@ -282,12 +285,42 @@ EventuallyPersistentStore::EventuallyPersistentStore(EventuallyPersistentEngine
     auxUnderlying = engine.newKVStore(true);
     auxIODispatcher = new Dispatcher(theEngine, "AUXIO_Dispatcher");
 
-    nonIODispatcher = new Dispatcher(theEngine, "NONIO_Dispatcher");
-    flusher = new Flusher(this, dispatcher);
+    // The IO dispatchers each drive a single KVStore instance, so only
+    // the non-IO work is spread over several threads.
+    Configuration &cfg = theEngine.getConfiguration();
+    nonIODispatcher = new Dispatcher(theEngine, "NONIO_Dispatcher",
+                                     cfg.getNonioWorkers());
+
+    // The first shard writes through the store we were given, on the
+    // RW dispatcher; every other one gets a store and thread of its own.
+    size_t nshards = cfg.getFlusherShards();
+    if (nshards > 1 && mutationLog.isEnabled()) {
+        LOG(EXTENSION_LOG_WARNING, "The mutation log needs a single "
+            "flusher, ignoring flusher_shards=%d", static_cast<int>(nshards));
+        nshards = 1;
+    }
+    shardLocks = new Mutex[nshards];
+    for (size_t i = 0; i < nshards; ++i) {
+        FlusherShard *shard;
+        if (i == 0) {
+            shard = new FlusherShard(i, rwUnderlying, dispatcher,
+                                     shardLocks[i]);
+        } else {
+            std::stringstream ss;
+            ss << "RW_Dispatcher_" << i;
+            shard = new FlusherShard(i, engine.newKVStore(),
+                                     new Dispatcher(theEngine, ss.str().c_str()),
+                                     shardLocks[i]);
+        }
+        shard->flusher = new Flusher(this, shard);
+        shards.push_back(shard);
+    }
 
     if (multiBGFetchEnabled()) {
-        bgFetcher = new BgFetcher(this, roDispatcher, stats);
+        bgFetcher = new BgFetcher(this, roDispatcher, stats,
+                                  cfg.getBgFetchReaders());
     }
+    backfillExecutor = new BackfillExecutor(this, cfg.getBackfillReaders());
 
     stats.memOverhead = sizeof(EventuallyPersistentStore);
 
@@ -479,16 +512,32 @@ EventuallyPersistentStore::~EventuallyPersistentStore() {
     dispatcher->stop(stats.forceShutdown);
     roDispatcher->stop(stats.forceShutdown);
     auxIODispatcher->stop(stats.forceShutdown);
+    backfillExecutor->stop();
     nonIODispatcher->stop(stats.forceShutdown);
+    for (size_t i = 1; i < shards.size(); ++i) {
+        shards[i]->dispatcher->stop(stats.forceShutdown);
+    }
 
-    delete flusher;
+    for (size_t i = 0; i < shards.size(); ++i) {
+        delete shards[i]->flusher;
+    }
     delete bgFetcher;
     delete warmupTask;
 
     delete dispatcher;
     delete roDispatcher;
     delete auxIODispatcher;
+    // The backfills left in the dispatchers are gone, so is their executor.
+    delete backfillExecutor;
     delete nonIODispatcher;
+    for (size_t i = 1; i < shards.size(); ++i) {
+        delete shards[i]->dispatcher;
+        delete shards[i]->rwUnderlying;
+    }
+    for (size_t i = 0; i < shards.size(); ++i) {
+        delete shards[i];
+    }
+    delete []shardLocks;
 
     delete roUnderlying;
     delete auxUnderlying;
@@ -498,6 +547,10 @@ void EventuallyPersistentStore::startDispatcher() {
     dispatcher->start();
     roDispatcher->start();
     auxIODispatcher->start();
+    backfillExecutor->start();
+    for (size_t i = 1; i < shards.size(); ++i) {
+        shards[i]->dispatcher->start();
+    }
 }
 
 void EventuallyPersistentStore::startNonIODispatcher() {
@@ -505,7 +558,7 @@ void EventuallyPersistentStore::startNonIODispatcher() {
 }
 
 const Flusher* EventuallyPersistentStore::getFlusher() {
-    return flusher;
+    return shards[0]->flusher;
 }
 
 Warmup* EventuallyPersistentStore::getWarmup(void) const {
@@ -514,27 +567,45 @@ Warmup* EventuallyPersistentStore::getWarmup(void) const {
 
 
 void EventuallyPersistentStore::startFlusher() {
-    flusher->start();
+    for (size_t i = 0; i < shards.size(); ++i) {
+        shards[i]->flusher->start();
+    }
 }
 
 void EventuallyPersistentStore::stopFlusher() {
-    bool rv = flusher->stop(stats.forceShutdown);
-    if (rv && !stats.forceShutdown) {
-        flusher->wait();
+    // Stop them all before waiting, they drain the queue together.
+    std::vector<bool> stopped;
+    for (size_t i = 0; i < shards.size(); ++i) {
+        stopped.push_back(shards[i]->flusher->stop(stats.forceShutdown));
+    }
+    for (size_t i = 0; i < shards.size(); ++i) {
+        if (stopped[i] && !stats.forceShutdown) {
+            shards[i]->flusher->wait();
+        }
     }
 }
 
 bool EventuallyPersistentStore::pauseFlusher() {
-    return flusher->pause();
+    bool rv = true;
+    for (size_t i = 0; i < shards.size(); ++i) {
+        rv = shards[i]->flusher->pause() && rv;
+    }
+    return rv;
 }
 
 bool EventuallyPersistentStore::resumeFlusher() {
-    return flusher->resume();
+    bool rv = true;
+    for (size_t i = 0; i < shards.size(); ++i) {
+        rv = shards[i]->flusher->resume() && rv;
+    }
+    return rv;
 }
 
 void EventuallyPersistentStore::wakeUpFlusher() {
     if (stats.diskQueueSize.get() == 0) {
-        flusher->wake();
+        for (size_t i = 0; i < shards.size(); ++i) {
+            shards[i]->flusher->wake();
+        }
     }
 }
 
@@ -590,13 +661,15 @@ public:
         RCPtr<VBucket> vb = e->getVBucket(vk.first);
         if (vb) {
             int bucket_num(0);
+            uint8_t tag(0);
             e->incExpirationStat(vb);
-            LockHolder lh = vb->ht.getLockedBucket(vk.second, &bucket_num);
-            StoredValue *v = vb->ht.unlocked_find(vk.second, bucket_num, true, false);
+            LockHolder lh = vb->ht.getLockedBucket(vk.second, &bucket_num, &tag);
+            StoredValue *v = vb->ht.unlocked_find(vk.second, bucket_num, tag,
+                                                  true, false);
             if (v && v->isTempItem()) {
                 // This is a temporary item whose background fetch for metadata
                 // has completed.
-                bool deleted = vb->ht.unlocked_del(vk.second, bucket_num);
+                bool deleted = vb->ht.unlocked_del(vk.second, bucket_num, tag);
                 assert(deleted);
             } else if (v && v->isExpired(startTime) && !v->isDeleted()) {
                 vb->ht.unlocked_softDelete(v, 0);
@@ -622,10 +695,12 @@ EventuallyPersistentStore::deleteExpiredItems(std::list<std::pair<uint16_t, std:
 StoredValue *EventuallyPersistentStore::fetchValidValue(RCPtr<VBucket> &vb,
                                                         const std::string &key,
                                                         int bucket_num,
+                                                        uint8_t tag,
                                                         bool wantDeleted,
                                                         bool trackReference,
                                                         bool queueExpired) {
-    StoredValue *v = vb->ht.unlocked_find(key, bucket_num, wantDeleted, trackReference);
+    StoredValue *v = vb->ht.unlocked_find(key, bucket_num, tag, wantDeleted,
+                                          trackReference);
     if (v && !v->isDeleted()) { // In the deleted case, we ignore expiration time.
         if (v->isExpired(ep_real_time())) {
             incExpirationStat(vb, false);
@@ -638,6 +713,11 @@ StoredValue *EventuallyPersistentStore::fetchValidValue(RCPtr<VBucket> &vb,
             }
             return NULL;
         }
+        if (trackReference && v->isCompressed()) {
+            // The value isn't cold anymore; don't pay to decompress it
+            // on every access.
+            v->decompressValue(stats, vb->ht);
+        }
     }
     return v;
 }
@@ -653,8 +733,9 @@ protocol_binary_response_status EventuallyPersistentStore::evictKey(const std::s
     }
 
     int bucket_num(0);
-    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
-    StoredValue *v = fetchValidValue(vb, key, bucket_num, force, false);
+    uint8_t tag(0);
+    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num, &tag);
+    StoredValue *v = fetchValidValue(vb, key, bucket_num, tag, force, false);
 
     protocol_binary_response_status rv(PROTOCOL_BINARY_RESPONSE_SUCCESS);
 
@@ -809,13 +890,107 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::addTAPBackfillItem(const Item &itm,
     return ret;
 }
 
+void EventuallyPersistentStore::setTAPMulti(uint16_t vbucket,
+                                            const std::vector<Item*> &items,
+                                            const std::vector<uint8_t> &nrus,
+                                            bool meta, bool backfill,
+                                            std::vector<ENGINE_ERROR_CODE> &results) {
+    assert(items.size() == nrus.size());
+    results.assign(items.size(), ENGINE_SUCCESS);
+    RCPtr<VBucket> vb = getVBucket(vbucket);
+    if (!vb ||
+        vb->getState() == vbucket_state_dead ||
+        (backfill && vb->getState() == vbucket_state_active &&
+         !engine.getCheckpointConfig().isInconsistentSlaveCheckpoint())) {
+        stats.numNotMyVBuckets.incr(items.size());
+        results.assign(items.size(), ENGINE_NOT_MY_VBUCKET);
+        return;
+    }
 
-void EventuallyPersistentStore::snapshotVBuckets(const Priority &priority) {
+    // Store the items grouped by the lock of their hash table bucket.
+    // Items of the same stripe keep their order, so a key received
+    // twice ends up with its latest value.
+    std::vector<std::pair<int, size_t> > order;
+    std::vector<uint64_t> hashes;
+    order.reserve(items.size());
+    hashes.reserve(items.size());
+    for (size_t i = 0; i < items.size(); ++i) {
+        hashes.push_back(vb->ht.hash(items[i]->getKey()));
+        order.push_back(std::make_pair(vb->ht.getLockForHash(hashes[i]), i));
+    }
+    std::sort(order.begin(), order.end());
+
+    std::vector<bool> dirty(items.size(), false);
+    size_t i = 0;
+    while (i < order.size()) {
+        int bucket_num(0);
+        LockHolder lh = vb->ht.getLockedBucket(hashes[order[i].second],
+                                               &bucket_num);
+        int lock_num = order[i].first;
+        for (; i < order.size() && order[i].first == lock_num; ++i) {
+            size_t idx = order[i].second;
+            Item &itm = *items[idx];
+            if (!vb->ht.hasAvailableSpace(itm)) {
+                results[idx] = ENGINE_ENOMEM;
+                continue;
+            }
+            bucket_num = vb->ht.getBucketForLockedHash(hashes[idx]);
+            uint64_t cas = meta ? 0 : itm.getCas();
+            switch (vb->ht.unlocked_set(itm, cas, true, meta, nrus[idx],
+                                        bucket_num,
+                                        KeyHash::tag(hashes[idx]))) {
+            case NOMEM:
+                results[idx] = ENGINE_ENOMEM;
+                break;
+            case INVALID_CAS:
+            case IS_LOCKED:
+                results[idx] = ENGINE_KEY_EEXISTS;
+                break;
+            case WAS_DIRTY:
+                // A backfill item already dirty isn't queued again.
+                dirty[idx] = !backfill;
+                break;
+            case NOT_FOUND:
+                if (!backfill && (meta || cas != 0)) {
+                    results[idx] = ENGINE_KEY_ENOENT;
+                    break;
+                }
+                // FALLTHROUGH
+            case WAS_CLEAN:
+                dirty[idx] = true;
+                break;
+            case INVALID_VBUCKET:
+                results[idx] = ENGINE_NOT_MY_VBUCKET;
+                break;
+            }
+        }
+    }
+
+    std::vector<queued_item> queued;
+    queued.reserve(items.size());
+    for (size_t idx = 0; idx < items.size(); ++idx) {
+        if (dirty[idx]) {
+            queued.push_back(queued_item(new QueuedItem(items[idx]->getKey(),
+                                                        vbucket, queue_op_set,
+                                                        items[idx]->getSeqno())));
+        }
+    }
+    queueDirtyMulti(vb, queued, backfill);
+}
+
+
+void EventuallyPersistentStore::snapshotVBuckets(const Priority &priority,
+                                                 FlusherShard *shard) {
 
     class VBucketStateVisitor : public VBucketVisitor {
     public:
-        VBucketStateVisitor(VBucketMap &vb_map) : vbuckets(vb_map) { }
+        VBucketStateVisitor(EventuallyPersistentStore &st, VBucketMap &vb_map,
+                            FlusherShard *s)
+            : store(st), vbuckets(vb_map), shard(s) { }
         bool visitBucket(RCPtr<VBucket> &vb) {
+            if (store.getFlusherShard(vb->getId()) != shard) {
+                return false;
+            }
             vbucket_state vb_state;
             vb_state.state = vb->getState();
             vb_state.checkpointId = vbuckets.getPersistenceCheckpointId(vb->getId());
@@ -831,23 +1006,26 @@ void EventuallyPersistentStore::snapshotVBuckets(const Priority &priority) {
         std::map<uint16_t, vbucket_state> states;
 
     private:
+        EventuallyPersistentStore &store;
         VBucketMap &vbuckets;
+        FlusherShard *shard;
     };
 
     if (priority == Priority::VBucketPersistHighPriority) {
         vbMap.setHighPriorityVbSnapshotFlag(false);
         size_t numVBs = vbMap.getSize();
-        for (size_t i = 0; i < numVBs; ++i) {
+        for (size_t i = shard->id; i < numVBs; i += shards.size()) {
             vbMap.setBucketCreation(static_cast<uint16_t>(i), false);
         }
     } else {
         vbMap.setLowPriorityVbSnapshotFlag(false);
     }
 
-    VBucketStateVisitor v(vbMap);
+    VBucketStateVisitor v(*this, vbMap, shard);
     visit(v);
     hrtime_t start = gethrtime();
-    if (!rwUnderlying->snapshotVBuckets(v.states)) {
+    LockHolder lh(shard->mutex);
+    if (!shard->rwUnderlying->snapshotVBuckets(v.states)) {
         LOG(EXTENSION_LOG_WARNING,
             "VBucket snapshot task failed!!! Rescheduling");
         scheduleVBSnapshot(priority);
@@ -900,8 +1078,11 @@ void EventuallyPersistentStore::scheduleVBSnapshot(const Priority &p) {
             return;
         }
     }
-    dispatcher->schedule(shared_ptr<DispatcherCallback>(new SnapshotVBucketsCallback(this, p)),
-                         NULL, p, 0, false);
+    for (size_t i = 0; i < shards.size(); ++i) {
+        shared_ptr<DispatcherCallback> cb(new SnapshotVBucketsCallback(this, p,
+                                                                       shards[i]));
+        shards[i]->dispatcher->schedule(cb, NULL, p, 0, false);
+    }
 }
 
 bool EventuallyPersistentStore::completeVBucketDeletion(uint16_t vbid,
@@ -914,7 +1095,10 @@ bool EventuallyPersistentStore::completeVBucketDeletion(uint16_t vbid,
     RCPtr<VBucket> vb = vbMap.getBucket(vbid);
     if (!vb || vb->getState() == vbucket_state_dead || vbMap.isBucketDeletion(vbid)) {
         lh.unlock();
+        FlusherShard *shard = getFlusherShard(vbid);
+        LockHolder slh(shard->mutex);
         // Clean up the vbucket outgoing flush queue.
+        vb_flush_queue_t &rejectQueues = shard->rejectQueues;
         vb_flush_queue_t::iterator it = rejectQueues.find(vbid);
         if (it != rejectQueues.end()) {
             std::queue<queued_item> &vb_queue = it->second;
@@ -922,7 +1106,7 @@ bool EventuallyPersistentStore::completeVBucketDeletion(uint16_t vbid,
             assert(stats.diskQueueSize < GIGANTOR);
             rejectQueues.erase(vbid);
         }
-        if (rwUnderlying->delVBucket(vbid, recreate)) {
+        if (shard->rwUnderlying->delVBucket(vbid, recreate)) {
             vbMap.setBucketDeletion(vbid, false);
             mutationLog.deleteAll(vbid);
             // This is happening in an independent transaction, so
@@ -965,7 +1149,7 @@ void EventuallyPersistentStore::scheduleVBDeletion(RCPtr<VBucket> &vb,
                                                                       vb->getId(),
                                                                       cookie,
                                                                       recreate));
-        dispatcher->schedule(cb,
+        getFlusherShard(vb->getId())->dispatcher->schedule(cb,
                              NULL, Priority::VBucketDeletionPriority,
                              delay, false);
     }
@@ -1094,8 +1278,11 @@ void EventuallyPersistentStore::completeBGFetch(const std::string &key,
     RCPtr<VBucket> vb = getVBucket(vbucket);
     if (vb && vb->getState() == vbucket_state_active) {
         int bucket_num(0);
-        LockHolder hlh = vb->ht.getLockedBucket(key, &bucket_num);
-        StoredValue *v = fetchValidValue(vb, key, bucket_num, true);
+        uint8_t tag(0);
+        LockHolder hlh = vb->ht.getLockedBucket(key, &bucket_num, &tag);
+        // Not a read of its own; the request waiting for it is retried.
+        StoredValue *v = fetchValidValue(vb, key, bucket_num, tag, true,
+                                         false);
         if (BG_FETCH_METADATA == type) {
             if (v && !v->isResident()) {
                 if (v->unlocked_restoreMeta(gcb.val.getValue(),
@@ -1159,8 +1346,10 @@ void EventuallyPersistentStore::completeBGFetchMulti(uint16_t vbId,
 
         if (vb->getState() == vbucket_state_active) {
             int bucket = 0;
-            LockHolder blh = vb->ht.getLockedBucket(key, &bucket);
-            StoredValue *v = fetchValidValue(vb, key, bucket, true);
+            uint8_t tag(0);
+            LockHolder blh = vb->ht.getLockedBucket(key, &bucket, &tag);
+            StoredValue *v = fetchValidValue(vb, key, bucket, tag, true,
+                                             false);
             if (v && !v->isResident()) {
                 if (status == ENGINE_SUCCESS) {
                     v->unlocked_restoreValue(fetchedValue, stats, vb->ht);
@@ -1255,11 +1444,14 @@ GetValue EventuallyPersistentStore::getInternal(const std::string &key,
     }
 
     int bucket_num(0);
-    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
-    StoredValue *v = fetchValidValue(vb, key, bucket_num, false, trackReference);
+    uint8_t tag(0);
+    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num, &tag);
+    StoredValue *v = fetchValidValue(vb, key, bucket_num, tag, false, false);
 
     if (v) {
-        // If the value is not resident, wait for it...
+        // If the value is not resident, wait for it...  The retry once
+        // it's fetched counts as the reference, so reading an ejected
+        // value once doesn't look like it was reused.
         if (!v->isResident()) {
             if (queueBG) {
                 bgFetch(key, vbucket, v->getId(), cookie);
@@ -1268,6 +1460,9 @@ GetValue EventuallyPersistentStore::getInternal(const std::string &key,
                             v->getNRUValue());
         }
 
+        if (trackReference) {
+            v->referenced();
+        }
         GetValue rv(v->toItem(v->isLocked(ep_current_time()), vbucket),
                     ENGINE_SUCCESS, v->getId(), false, v->getNRUValue());
         return rv;
@@ -1277,6 +1472,59 @@ GetValue EventuallyPersistentStore::getInternal(const std::string &key,
     }
 }
 
+void EventuallyPersistentStore::getMulti(uint16_t vbucket,
+                                         const std::vector<queued_item> &items,
+                                         std::vector<GetValue> &values) {
+    values.assign(items.size(), GetValue());
+    RCPtr<VBucket> vb = getVBucket(vbucket);
+    if (!vb) {
+        stats.numNotMyVBuckets.incr(items.size());
+        for (size_t i = 0; i < values.size(); ++i) {
+            values[i].setStatus(ENGINE_NOT_MY_VBUCKET);
+        }
+        return;
+    }
+
+    // Visit the keys grouped by the lock of their hash table bucket.
+    std::vector<std::pair<int, size_t> > order;
+    std::vector<uint64_t> hashes;
+    order.reserve(items.size());
+    hashes.reserve(items.size());
+    for (size_t i = 0; i < items.size(); ++i) {
+        hashes.push_back(vb->ht.hash(items[i]->getKey()));
+        order.push_back(std::make_pair(vb->ht.getLockForHash(hashes[i]), i));
+    }
+    std::sort(order.begin(), order.end());
+
+    size_t i = 0;
+    while (i < order.size()) {
+        int bucket_num(0);
+        LockHolder lh = vb->ht.getLockedBucket(hashes[order[i].second],
+                                               &bucket_num);
+        int lock_num = order[i].first;
+        for (; i < order.size() && order[i].first == lock_num; ++i) {
+            size_t idx = order[i].second;
+            bucket_num = vb->ht.getBucketForLockedHash(hashes[idx]);
+            const std::string &key = items[idx]->getKey();
+            StoredValue *v = fetchValidValue(vb, key, bucket_num,
+                                             KeyHash::tag(hashes[idx]),
+                                             false, false);
+            if (!v) {
+                continue;
+            }
+            if (!v->isResident()) {
+                values[idx] = GetValue(NULL, ENGINE_EWOULDBLOCK, v->getId(),
+                                       true, v->getNRUValue());
+            } else {
+                values[idx] = GetValue(v->toItem(v->isLocked(ep_current_time()),
+                                                 vbucket),
+                                       ENGINE_SUCCESS, v->getId(), false,
+                                       v->getNRUValue());
+            }
+        }
+    }
+}
+
 ENGINE_ERROR_CODE EventuallyPersistentStore::getMetaData(const std::string &key,
                                                          uint16_t vbucket,
                                                          const void *cookie,
@@ -1293,9 +1541,11 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::getMetaData(const std::string &key,
     }
 
     int bucket_num(0);
+    uint8_t tag(0);
     deleted = 0;
-    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
-    StoredValue *v = vb->ht.unlocked_find(key, bucket_num, true, trackReferenced);
+    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num, &tag);
+    StoredValue *v = vb->ht.unlocked_find(key, bucket_num, tag, true,
+                                          trackReferenced);
 
     if (v) {
         stats.numOpsGetMeta++;
@@ -1320,7 +1570,7 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::getMetaData(const std::string &key,
         // persistent store. The item's state will be updated after the fetch
         // completes and the item will automatically expire after a pre-
         // determined amount of time.
-        add_type_t rv = vb->ht.unlocked_addTempDeletedItem(bucket_num, key);
+        add_type_t rv = vb->ht.unlocked_addTempDeletedItem(bucket_num, tag, key);
         switch(rv) {
         case ADD_NOMEM:
             return ENGINE_ENOMEM;
@@ -1406,8 +1656,9 @@ GetValue EventuallyPersistentStore::getAndUpdateTtl(const std::string &key,
     }
 
     int bucket_num(0);
-    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
-    StoredValue *v = fetchValidValue(vb, key, bucket_num);
+    uint8_t tag(0);
+    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num, &tag);
+    StoredValue *v = fetchValidValue(vb, key, bucket_num, tag);
 
     if (v) {
         if (v->isLocked(ep_current_time())) {
@@ -1457,8 +1708,9 @@ EventuallyPersistentStore::statsVKey(const std::string &key,
     }
 
     int bucket_num(0);
-    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
-    StoredValue *v = fetchValidValue(vb, key, bucket_num);
+    uint8_t tag(0);
+    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num, &tag);
+    StoredValue *v = fetchValidValue(vb, key, bucket_num, tag);
 
     if (v) {
         shared_ptr<VKeyStatBGFetchCallback> dcb(new VKeyStatBGFetchCallback(this, key,
@@ -1509,8 +1761,9 @@ bool EventuallyPersistentStore::getLocked(const std::string &key,
     }
 
     int bucket_num(0);
-    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
-    StoredValue *v = fetchValidValue(vb, key, bucket_num);
+    uint8_t tag(0);
+    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num, &tag);
+    StoredValue *v = fetchValidValue(vb, key, bucket_num, tag);
 
     if (v) {
 
@@ -1567,8 +1820,9 @@ StoredValue* EventuallyPersistentStore::getStoredValue(const std::string &key,
     }
 
     int bucket_num(0);
-    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
-    return fetchValidValue(vb, key, bucket_num);
+    uint8_t tag(0);
+    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num, &tag);
+    return fetchValidValue(vb, key, bucket_num, tag);
 }
 
 ENGINE_ERROR_CODE
@@ -1585,8 +1839,9 @@ EventuallyPersistentStore::unlockKey(const std::string &key,
     }
 
     int bucket_num(0);
-    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
-    StoredValue *v = fetchValidValue(vb, key, bucket_num);
+    uint8_t tag(0);
+    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num, &tag);
+    StoredValue *v = fetchValidValue(vb, key, bucket_num, tag);
 
     if (v) {
         if (v->isLocked(currentTime)) {
@@ -1613,8 +1868,9 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::getKeyStats(const std::string &key,
     }
 
     int bucket_num(0);
-    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
-    StoredValue *v = fetchValidValue(vb, key, bucket_num, wantsDeleted);
+    uint8_t tag(0);
+    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num, &tag);
+    StoredValue *v = fetchValidValue(vb, key, bucket_num, tag, wantsDeleted);
 
     if (v) {
         kstats.logically_deleted = v->isDeleted();
@@ -1632,9 +1888,10 @@ std::string EventuallyPersistentStore::validateKey(const std::string &key,
                                                    uint16_t vbucket,
                                                    Item &diskItem) {
     int bucket_num(0);
+    uint8_t tag(0);
     RCPtr<VBucket> vb = getVBucket(vbucket);
-    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
-    StoredValue *v = fetchValidValue(vb, key, bucket_num, false,
+    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num, &tag);
+    StoredValue *v = fetchValidValue(vb, key, bucket_num, tag, false,
                                      false, true);
 
     if (v) {
@@ -1643,7 +1900,7 @@ std::string EventuallyPersistentStore::validateKey(const std::string &key,
         } else if (diskItem.getFlags() != v->getFlags()) {
             return "flags_mismatch";
         } else if (v->isResident() && memcmp(diskItem.getData(),
-                                             v->getValue()->getData(),
+                                             v->getUncompressedValue()->getData(),
                                              diskItem.getNBytes())) {
             return "data_mismatch";
         } else {
@@ -1683,11 +1940,12 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::deleteItem(const std::string &key,
     }
 
     int bucket_num(0);
-    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
+    uint8_t tag(0);
+    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num, &tag);
     // If use_meta is true (delete_with_meta), we'd like to look for the key
     // with the wantsDeleted flag set to true in case a prior get_meta has
     // created a temporary item for the key.
-    StoredValue *v = vb->ht.unlocked_find(key, bucket_num, use_meta, false);
+    StoredValue *v = vb->ht.unlocked_find(key, bucket_num, tag, use_meta, false);
     if (!v) {
         if (vb->getState() != vbucket_state_active && force) {
             queueDirty(vb, key, vbucket, queue_op_del, newSeqno, tapBackfill);
@@ -1763,9 +2021,12 @@ public:
             RCPtr<VBucket> vb = store->getVBucket(queuedItem->getVBucketId());
             if (vb) {
                 int bucket_num(0);
-                LockHolder lh = vb->ht.getLockedBucket(queuedItem->getKey(), &bucket_num);
+                uint8_t tag(0);
+                LockHolder lh = vb->ht.getLockedBucket(queuedItem->getKey(),
+                                                       &bucket_num, &tag);
                 StoredValue *v = store->fetchValidValue(vb, queuedItem->getKey(),
-                                                        bucket_num, true, false);
+                                                        bucket_num, tag,
+                                                        true, false);
                 if (v && value.second > 0) {
                     if (v->isPendingId()) {
                         mutationLog->newItem(queuedItem->getVBucketId(), queuedItem->getKey(),
@@ -1790,9 +2051,12 @@ public:
             RCPtr<VBucket> vb = store->getVBucket(queuedItem->getVBucketId());
             if (vb && value.first == 0) {
                 int bucket_num(0);
-                LockHolder lh = vb->ht.getLockedBucket(queuedItem->getKey(), &bucket_num);
+                uint8_t tag(0);
+                LockHolder lh = vb->ht.getLockedBucket(queuedItem->getKey(),
+                                                       &bucket_num, &tag);
                 StoredValue *v = store->fetchValidValue(vb, queuedItem->getKey(),
-                                                        bucket_num, true, false);
+                                                        bucket_num, tag,
+                                                        true, false);
                 if (v) {
                     std::stringstream ss;
                     ss << "Persisting ``" << queuedItem->getKey() << "'' on vb"
@@ -1834,12 +2098,15 @@ public:
             // may now remove it from the hash table.
             if (vb) {
                 int bucket_num(0);
-                LockHolder lh = vb->ht.getLockedBucket(queuedItem->getKey(), &bucket_num);
+                uint8_t tag(0);
+                LockHolder lh = vb->ht.getLockedBucket(queuedItem->getKey(),
+                                                       &bucket_num, &tag);
                 StoredValue *v = store->fetchValidValue(vb, queuedItem->getKey(),
-                                                        bucket_num, true, false);
+                                                        bucket_num, tag,
+                                                        true, false);
                 if (v && v->isDeleted()) {
                     bool deleted = vb->ht.unlocked_del(queuedItem->getKey(),
-                                                       bucket_num);
+                                                       bucket_num, tag);
                     assert(deleted);
                 } else if (v) {
                     v->clearId();
@@ -1884,7 +2151,13 @@ private:
 };
 
 void EventuallyPersistentStore::flushOneDeleteAll() {
+    // Called by the first shard; keep the others from writing while
+    // their vbuckets are reset too.
+    MultiLockHolder mlh(shardLocks + 1, shards.size() - 1);
     rwUnderlying->reset();
+    for (size_t i = 1; i < shards.size(); ++i) {
+        shards[i]->rwUnderlying->resetVBuckets();
+    }
     // Log a flush of every known vbucket.
     std::vector<int> vbs(vbMap.getBuckets());
     for (std::vector<int>::iterator it(vbs.begin()); it != vbs.end(); ++it) {
@@ -1899,17 +2172,34 @@ void EventuallyPersistentStore::flushOneDeleteAll() {
     assert(stats.diskQueueSize < GIGANTOR);
 }
 
-int EventuallyPersistentStore::flushVBucket(uint16_t vbid) {
+int EventuallyPersistentStore::flushVBuckets(FlusherShard *shard,
+                                             const std::vector<uint16_t> &vbids) {
+    LockHolder slh(shard->mutex);
     if (diskFlushAll) {
+        if (shard->id != 0) {
+            // Don't write to files about to be reset.
+            return 0;
+        }
         flushOneDeleteAll();
     }
 
     int items_flushed = 0;
     bool schedule_vb_snapshot = false;
     rel_time_t flush_start = ep_current_time();
-    RCPtr<VBucket> vb = vbMap.getBucket(vbid);
-    if (vb && !vbMap.isBucketCreation(vbid)) {
-        std::vector<queued_item> items;
+    vb_flush_queue_t &rejectQueues = shard->rejectQueues;
+    std::vector<queued_item> items;
+    std::map<uint16_t, RCPtr<VBucket> > vbs;
+
+    std::vector<uint16_t>::const_iterator vit;
+    for (vit = vbids.begin(); vit != vbids.end(); ++vit) {
+        uint16_t vbid = *vit;
+        RCPtr<VBucket> vb = vbMap.getBucket(vbid);
+        if (!vb || vbMap.isBucketCreation(vbid) || vbs.count(vbid)) {
+            continue;
+        }
+        assert(getFlusherShard(vbid) == shard);
+        vbs[vbid] = vb;
+        size_t queued = items.size();
 
         uint64_t chkid = vb->checkpointManager.getPersistenceCursorPreChkId();
         if (rejectQueues[vbid].empty()) {
@@ -1928,70 +2218,80 @@ int EventuallyPersistentStore::flushVBucket(uint16_t vbid) {
 
         vb->getBackfillItems(items);
         vb->checkpointManager.getAllItemsForPersistence(items);
+        if (items.size() > queued) {
+            shard->queueDepthHisto.add(items.size() - queued);
+        }
+    }
 
-        if (!items.empty()) {
-            while (!rwUnderlying->begin()) {
-                ++stats.beginFailed;
-                LOG(EXTENSION_LOG_WARNING, "Failed to start a transaction!!! "
-                    "Retry in 1 sec ...");
-                sleep(1);
+    if (!items.empty()) {
+        KVStore *rwUnderlying = shard->rwUnderlying;
+        while (!rwUnderlying->begin()) {
+            ++stats.beginFailed;
+            LOG(EXTENSION_LOG_WARNING, "Failed to start a transaction!!! "
+                "Retry in 1 sec ...");
+            sleep(1);
+        }
+        rwUnderlying->optimizeWrites(items);
+
+        QueuedItem *prev = NULL;
+        RCPtr<VBucket> vb;
+        std::list<PersistenceCallback*> pcbs;
+        std::vector<queued_item>::iterator it = items.begin();
+        for(; it != items.end(); ++it) {
+            if (!vb || vb->getId() != (*it)->getVBucketId()) {
+                vb = vbs[(*it)->getVBucketId()];
+                prev = NULL;
             }
-            rwUnderlying->optimizeWrites(items);
-
-            QueuedItem *prev = NULL;
-            std::list<PersistenceCallback*> pcbs;
-            std::vector<queued_item>::iterator it = items.begin();
-            for(; it != items.end(); ++it) {
-                if ((*it)->getOperation() != queue_op_set &&
-                    (*it)->getOperation() != queue_op_del &&
-                    (*it)->getOperation() != queue_op_empty) {
-                    continue;
-                } else if (!prev || prev->getKey() != (*it)->getKey()) {
-                    prev = (*it).get();
-                    ++items_flushed;
-                    PersistenceCallback *cb = flushOneDelOrSet(*it, vb);
-                    if (cb) {
-                        pcbs.push_back(cb);
-                    }
-                    ++stats.flusher_todo;
-                } else {
-                    --stats.diskQueueSize;
-                    vb->doStatsForFlushing(*(*it), (*it)->size());
-                    assert(stats.diskQueueSize < GIGANTOR);
+            if ((*it)->getOperation() != queue_op_set &&
+                (*it)->getOperation() != queue_op_del &&
+                (*it)->getOperation() != queue_op_empty) {
+                continue;
+            } else if (!prev || prev->getKey() != (*it)->getKey()) {
+                prev = (*it).get();
+                ++items_flushed;
+                PersistenceCallback *cb = flushOneDelOrSet(*it, vb, shard);
+                if (cb) {
+                    pcbs.push_back(cb);
                 }
+                ++stats.flusher_todo;
+            } else {
+                --stats.diskQueueSize;
+                vb->doStatsForFlushing(*(*it), (*it)->size());
+                assert(stats.diskQueueSize < GIGANTOR);
             }
+        }
 
-            BlockTimer timer(&stats.diskCommitHisto, "disk_commit",
-                             stats.timingLog);
-            hrtime_t start = gethrtime();
+        BlockTimer timer(&stats.diskCommitHisto, "disk_commit",
+                         stats.timingLog);
+        hrtime_t start = gethrtime();
 
-            mutationLog.commit1();
-            while (!rwUnderlying->commit()) {
-                ++stats.commitFailed;
-                LOG(EXTENSION_LOG_WARNING, "Flusher commit failed!!! Retry in "
-                    "1 sec...\n");
-                sleep(1);
-            }
+        mutationLog.commit1();
+        while (!rwUnderlying->commit()) {
+            ++stats.commitFailed;
+            LOG(EXTENSION_LOG_WARNING, "Flusher commit failed!!! Retry in "
+                "1 sec...\n");
+            sleep(1);
+        }
 
-            while (!pcbs.empty()) {
-                delete pcbs.front();
-                pcbs.pop_front();
-            }
+        while (!pcbs.empty()) {
+            delete pcbs.front();
+            pcbs.pop_front();
+        }
 
-            mutationLog.commit2();
-            ++stats.flusherCommits;
-            hrtime_t end = gethrtime();
-            uint64_t commit_time = (end - start) / 1000000;
-            uint64_t trans_time = (end - flush_start) / 1000000;
+        mutationLog.commit2();
+        ++stats.flusherCommits;
+        hrtime_t end = gethrtime();
+        shard->commitHisto.add((end - start) / 1000);
+        uint64_t commit_time = (end - start) / 1000000;
+        uint64_t trans_time = (end - flush_start) / 1000000;
 
-            lastTransTimePerItem = (items_flushed == 0) ? 0 :
-                static_cast<double>(trans_time) /
-                static_cast<double>(items_flushed);
-            stats.commit_time.set(commit_time);
-            stats.cumulativeCommitTime.incr(commit_time);
-            stats.cumulativeFlushTime.incr(ep_current_time() - flush_start);
-            stats.flusher_todo.set(0);
-        }
+        lastTransTimePerItem = (items_flushed == 0) ? 0 :
+            static_cast<double>(trans_time) /
+            static_cast<double>(items_flushed);
+        stats.commit_time.set(commit_time);
+        stats.cumulativeCommitTime.incr(commit_time);
+        stats.cumulativeFlushTime.incr(ep_current_time() - flush_start);
+        stats.flusher_todo.set(0);
     }
 
     if (schedule_vb_snapshot || snapshotVBState) {
@@ -2006,7 +2306,11 @@ int EventuallyPersistentStore::flushVBucket(uint16_t vbid) {
 // based on what's in memory.
 PersistenceCallback*
 EventuallyPersistentStore::flushOneDelOrSet(const queued_item &qi,
-                                            RCPtr<VBucket> &vb) {
+                                            RCPtr<VBucket> &vb,
+                                            FlusherShard *shard) {
+
+    vb_flush_queue_t &rejectQueues = shard->rejectQueues;
+    KVStore *rwUnderlying = shard->rwUnderlying;
 
     if (!vb) {
         --stats.diskQueueSize;
@@ -2015,8 +2319,10 @@ EventuallyPersistentStore::flushOneDelOrSet(const queued_item &qi,
     }
 
     int bucket_num(0);
-    LockHolder lh = vb->ht.getLockedBucket(qi->getKey(), &bucket_num);
-    StoredValue *v = fetchValidValue(vb, qi->getKey(), bucket_num, true, false, false);
+    uint8_t tag(0);
+    LockHolder lh = vb->ht.getLockedBucket(qi->getKey(), &bucket_num, &tag);
+    StoredValue *v = fetchValidValue(vb, qi->getKey(), bucket_num, tag,
+                                     true, false, false);
 
     size_t itemBytes = qi->size();
     vb->doStatsForFlushing(*qi, itemBytes);
@@ -2030,7 +2336,7 @@ EventuallyPersistentStore::flushOneDelOrSet(const queued_item &qi,
     Item itm(qi->getKey(),
              found ? v->getFlags() : 0,
              found ? v->getExptime() : 0,
-             found ? v->getValue() : value_t(NULL),
+             found ? v->getUncompressedValue() : value_t(NULL),
              found ? v->getCas() : Item::nextCas(),
              rowid,
              qi->getVBucketId(),
@@ -2140,9 +2446,8 @@ void EventuallyPersistentStore::queueDirty(RCPtr<VBucket> &vb,
             bool rv = tapBackfill ? vb->queueBackfillItem(itm) :
                                     vb->checkpointManager.queueDirty(itm, vb);
             if (rv) {
-                if (++stats.diskQueueSize == 1) {
-                    flusher->wake();
-                }
+                ++stats.diskQueueSize;
+                getFlusherShard(vbid)->flusher->notifyMutation();
                 ++stats.totalEnqueued;
             } else {
                 vb->doStatsForFlushing(*itm, itm->size());
@@ -2151,6 +2456,43 @@ void EventuallyPersistentStore::queueDirty(RCPtr<VBucket> &vb,
     }
 }
 
+void EventuallyPersistentStore::queueDirtyMulti(RCPtr<VBucket> &vb,
+                                                const std::vector<queued_item> &items,
+                                                bool tapBackfill) {
+    if (!doPersistence || !vb || items.empty()) {
+        return;
+    }
+
+    std::vector<queued_item>::const_iterator it;
+    for (it = items.begin(); it != items.end(); ++it) {
+        vb->doStatsForQueueing(**it, (*it)->size());
+    }
+
+    std::vector<bool> queued;
+    if (tapBackfill) {
+        queued.reserve(items.size());
+        for (it = items.begin(); it != items.end(); ++it) {
+            queued.push_back(vb->queueBackfillItem(*it));
+        }
+    } else {
+        vb->checkpointManager.queueDirty(items, vb, queued);
+    }
+
+    size_t numQueued = 0;
+    for (size_t i = 0; i < items.size(); ++i) {
+        if (queued[i]) {
+            ++numQueued;
+        } else {
+            vb->doStatsForFlushing(*items[i], items[i]->size());
+        }
+    }
+    if (numQueued > 0) {
+        stats.diskQueueSize.incr(numQueued);
+        getFlusherShard(vb->getId())->flusher->notifyMutation();
+        stats.totalEnqueued.incr(numQueued);
+    }
+}
+
 std::map<uint16_t, vbucket_state> EventuallyPersistentStore::loadVBucketState() {
     return roUnderlying->listPersistedVbuckets();
 }
@@ -2500,7 +2842,7 @@ bool EventuallyPersistentStore::compactMutationLog(size_t& sleeptime) {
 VBCBAdaptor::VBCBAdaptor(EventuallyPersistentStore *s,
                          shared_ptr<VBucketVisitor> v,
                          const char *l, double sleep) :
-    store(s), visitor(v), label(l), sleepTime(sleep), currentvb(0)
+    store(s), visitor(v), label(l), sleepTime(sleep), currentvb(0), stripe(0)
 {
     const VBucketFilter &vbFilter = visitor->getVBucketFilter();
     size_t maxSize = store->vbMap.getSize();
@@ -2523,10 +2865,13 @@ bool VBCBAdaptor::callback(Dispatcher & d, TaskId &t) {
                 d.snooze(t, sleepTime);
                 return true;
             }
-            if (visitor->visitBucket(vb)) {
-                vb->ht.visit(*visitor);
+            if ((stripe > 0 || visitor->visitBucket(vb)) &&
+                !vb->ht.visit(*visitor, stripe)) {
+                // The visitor yielded; the rest of the vbucket is next.
+                return true;
             }
         }
+        stripe = 0;
         vbList.pop();
     }
 
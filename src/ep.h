@@ -112,6 +112,7 @@ protected:
 typedef std::map<uint16_t, std::queue<queued_item> > vb_flush_queue_t;
 
 // Forward declaration
+class BackfillExecutor;
 class Flusher;
 class Warmup;
 class TapBGFetchCallback;
@@ -119,6 +120,40 @@ class EventuallyPersistentStore;
 
 class PersistenceCallback;
 
+/**
+ * A partition of the vbuckets that is persisted independently of the
+ * others.
+ *
+ * vbucket vbid belongs to shard vbid % (number of shards).  Everything
+ * written to a shard's vbucket files (items, vbucket states and
+ * deletions) goes through the shard's own KVStore on the shard's own
+ * dispatcher, so every file has a single writer and the shards commit
+ * in parallel.
+ */
+class FlusherShard {
+public:
+    FlusherShard(size_t i, KVStore *kv, Dispatcher *d, Mutex &m) :
+        id(i), rwUnderlying(kv), dispatcher(d), flusher(NULL), mutex(m),
+        queueDepthHisto(ExponentialGenerator<size_t>(1, 2), 25),
+        commitHisto(GrowingWidthGenerator<hrtime_t>(0, ONE_SECOND, 1.4), 25) {}
+
+    const size_t      id;
+    KVStore          *rwUnderlying;
+    Dispatcher       *dispatcher;
+    Flusher          *flusher;
+    //! Held while writing through rwUnderlying.
+    Mutex            &mutex;
+    //! Items to persist again, by vbucket.
+    vb_flush_queue_t  rejectQueues;
+    //! Number of items found queued when flushing one of the vbuckets.
+    Histogram<size_t> queueDepthHisto;
+    //! Time spent committing a vbucket's items.
+    Histogram<hrtime_t> commitHisto;
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(FlusherShard);
+};
+
 /**
  * VBucket visitor callback adaptor.
  */
@@ -143,6 +178,8 @@ private:
     const char                 *label;
     double                      sleepTime;
     uint16_t                    currentvb;
+    //! The lock stripe of currentvb to resume from.
+    size_t                      stripe;
 
     DISALLOW_COPY_AND_ASSIGN(VBCBAdaptor);
 };
@@ -193,6 +230,25 @@ public:
     ENGINE_ERROR_CODE addTAPBackfillItem(const Item &item, bool meta,
                                          uint8_t nru = 0xff);
 
+    /**
+     * Store a batch of mutations received over TAP for one vbucket.
+     *
+     * Each item is stored as addTAPBackfillItem (backfill) or as a
+     * forced set/setWithMeta (meta) would, but the hash table locks are
+     * taken once per lock stripe and the items are queued for
+     * persistence in their original order in one go.
+     *
+     * @param vbucket the vbucket all the items belong to
+     * @param items the mutations, in the order they were received
+     * @param nrus the nru bit for each item
+     * @param meta the items carry their meta data
+     * @param backfill the vbucket is in the backfill phase
+     * @param results receives the result for each item, in the same order
+     */
+    void setTAPMulti(uint16_t vbucket, const std::vector<Item*> &items,
+                     const std::vector<uint8_t> &nrus, bool meta,
+                     bool backfill, std::vector<ENGINE_ERROR_CODE> &results);
+
     /**
      * Retrieve a value.
      *
@@ -228,6 +284,20 @@ public:
                            vbucket_state_replica);
     }
 
+    /**
+     * Retrieve the values of a run of mutations of a vbucket for a TAP
+     * stream.  Like get() without honoring the vbucket state, queueing
+     * background fetches or tracking references, but the vbucket is
+     * looked up once and keys sharing a hash table lock are looked up
+     * under a single acquisition of it.
+     *
+     * @param vbucket the vbucket from which to retrieve the keys
+     * @param items the mutations whose keys to fetch
+     * @param values receives a GetValue per mutation, in the same order
+     */
+    void getMulti(uint16_t vbucket, const std::vector<queued_item> &items,
+                  std::vector<GetValue> &values);
+
 
     /**
      * Retrieve the meta data for an item
@@ -466,7 +536,10 @@ public:
         return vbMap.getPersistenceCheckpointId(vb);
     }
 
-    void snapshotVBuckets(const Priority &priority);
+    /**
+     * Persist the states of a shard's vbuckets.
+     */
+    void snapshotVBuckets(const Priority &priority, FlusherShard *shard);
     ENGINE_ERROR_CODE setVBucketState(uint16_t vbid, vbucket_state_t state);
 
     /**
@@ -549,6 +622,24 @@ public:
         return rwUnderlying;
     }
 
+    /**
+     * Get the read-write KVStore a vbucket is persisted through.
+     */
+    KVStore* getRWUnderlying(uint16_t vbid) {
+        return getFlusherShard(vbid)->rwUnderlying;
+    }
+
+    /**
+     * Get the shard a vbucket is persisted by.
+     */
+    FlusherShard* getFlusherShard(uint16_t vbid) {
+        return shards[vbid % shards.size()];
+    }
+
+    const std::vector<FlusherShard*> &getFlusherShards() {
+        return shards;
+    }
+
     KVStore* getROUnderlying() {
         // This method might also be called leakAbstraction()
         return roUnderlying;
@@ -559,6 +650,13 @@ public:
         return auxUnderlying;
     }
 
+    /**
+     * Get the executor running the TAP disk backfills.
+     */
+    BackfillExecutor* getBackfillExecutor() {
+        return backfillExecutor;
+    }
+
     void deleteExpiredItems(std::list<std::pair<uint16_t, std::string> > &);
 
     /**
@@ -648,11 +746,13 @@ public:
     bool compactMutationLog(size_t &sleeptime);
 
     /**
-     * Flushes all items waiting for persistence in a given vbucket
-     * @param vbid The id of the vbucket to flush
+     * Flushes all items waiting for persistence in the given vbuckets,
+     * committing them in a single transaction
+     * @param shard The shard flushing (the vbuckets', if there are any)
+     * @param vbids The ids of the vbuckets to flush
      * @return The amount of items flushed
      */
-    int flushVBucket(uint16_t vbid);
+    int flushVBuckets(FlusherShard *shard, const std::vector<uint16_t> &vbids);
 
 protected:
     // During the warmup phase we might want to enable external traffic
@@ -687,6 +787,11 @@ private:
                     uint64_t seqno,
                     bool tapBackfill = false);
 
+    /* Queue the given items of a vbucket to be written to persistent layer. */
+    void queueDirtyMulti(RCPtr<VBucket> &vb,
+                         const std::vector<queued_item> &items,
+                         bool tapBackfill);
+
     /**
      * Retrieve a StoredValue and invoke a method on it.
      *
@@ -709,8 +814,9 @@ private:
         }
 
         int bucket_num(0);
-        LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
-        StoredValue *v = vb->ht.unlocked_find(key, bucket_num, true);
+        uint8_t tag(0);
+        LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num, &tag);
+        StoredValue *v = vb->ht.unlocked_find(key, bucket_num, tag, true);
 
         if (v) {
             std::mem_fun(f)(v);
@@ -720,10 +826,12 @@ private:
 
     void flushOneDeleteAll(void);
     PersistenceCallback* flushOneDelOrSet(const queued_item &qi,
-                                          RCPtr<VBucket> &vb);
+                                          RCPtr<VBucket> &vb,
+                                          FlusherShard *shard);
 
     StoredValue *fetchValidValue(RCPtr<VBucket> &vb, const std::string &key,
-                                 int bucket_num, bool wantsDeleted=false,
+                                 int bucket_num, uint8_t tag,
+                                 bool wantsDeleted=false,
                                  bool trackReference=true, bool queueExpired=true);
 
     GetValue getInternal(const std::string &key, uint16_t vbucket,
@@ -755,8 +863,10 @@ private:
     Dispatcher                     *roDispatcher;
     Dispatcher                     *auxIODispatcher;
     Dispatcher                     *nonIODispatcher;
-    Flusher                        *flusher;
+    std::vector<FlusherShard*>      shards;
+    Mutex                          *shardLocks;
     BgFetcher                      *bgFetcher;
+    BackfillExecutor               *backfillExecutor;
     Warmup                         *warmupTask;
     VBucketMap                      vbMap;
     SyncObject                      mutex;
@@ -765,7 +875,6 @@ private:
     MutationLogCompactorConfig      mlogCompactorConfig;
     MutationLog                     accessLog;
 
-    vb_flush_queue_t rejectQueues;
     Atomic<size_t> bgFetchQueue;
     Atomic<bool> diskFlushAll;
     Mutex vbsetMutex;
@@ -36,6 +36,7 @@
 #include "ep_engine.h"
 #include "htresizer.h"
 #include "memory_tracker.h"
+#include "slab_allocator.h"
 #include "stats-info.h"
 #include "statsnap.h"
 
@@ -276,6 +277,14 @@ extern "C" {
             } else if (strcmp(keyz, "tap_throttle_cap_pcnt") == 0) {
                 checkNumeric(valz);
                 e->getConfiguration().setTapThrottleCapPcnt(v);
+            } else if (strcmp(keyz, "tap_backfill_disk_rate") == 0) {
+                checkNumeric(valz);
+                validate(v, 0, std::numeric_limits<int>::max());
+                e->getConfiguration().setTapBackfillDiskRate(v);
+            } else if (strcmp(keyz, "tap_compression_threshold") == 0) {
+                checkNumeric(valz);
+                validate(v, 0, std::numeric_limits<int>::max());
+                e->getConfiguration().setTapCompressionThreshold(v);
             } else {
                 *msg = "Unknown config param";
                 rv = PROTOCOL_BINARY_RESPONSE_KEY_ENOENT;
@@ -443,6 +452,13 @@ extern "C" {
             } else if (strcmp(keyz, "pager_active_vb_pcnt") == 0) {
                 checkNumeric(valz);
                 e->getConfiguration().setPagerActiveVbPcnt(v);
+            } else if (strcmp(keyz, "cold_compression_threshold") == 0) {
+                char *ptr = NULL;
+                checkNumeric(valz);
+                uint64_t vsize = strtoull(valz, &ptr, 10);
+                validate(vsize, static_cast<uint64_t>(0),
+                         std::numeric_limits<uint64_t>::max());
+                e->getConfiguration().setColdCompressionThreshold((size_t)vsize);
             } else if (strcmp(keyz, "warmup_min_memory_threshold") == 0) {
                 checkNumeric(valz);
                 validate(v, 0, std::numeric_limits<int>::max());
@@ -1323,7 +1339,13 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::initialize(const char* config) {
     // Start updating the variables from the config!
     HashTable::setDefaultNumBuckets(configuration.getHtSize());
     HashTable::setDefaultNumLocks(configuration.getHtLocks());
+    HashTable::setDefaultHashPolicy(configuration.getHtHash());
+    HashTable::setDefaultBucketLayout(configuration.getHtLayout());
     StoredValue::setMutationMemoryThreshold(configuration.getMutationMemThreshold());
+    if (configuration.isSlabAlloc()) {
+        // Shared by all buckets in the process.
+        SlabAllocator::setEnabled(true);
+    }
 
     if (configuration.getMaxSize() == 0) {
         configuration.setMaxSize(std::numeric_limits<size_t>::max());
@@ -1766,6 +1788,9 @@ tap_event_t EventuallyPersistentEngine::walkTapQueue(const void *cookie,
                 if (connection->haveTapFlagByteorderSupport()) {
                     *flags |= TAP_FLAG_NETWORK_BYTE_ORDER;
                 }
+                if (connection->compressValue(*static_cast<Item*>(*itm))) {
+                    *flags |= TAP_FLAG_COMPRESSED;
+                }
             }
         }
     }
@@ -1937,6 +1962,18 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::tapNotify(const void *cookie,
     std::string k(static_cast<const char*>(key), nkey);
     ENGINE_ERROR_CODE ret = ENGINE_SUCCESS;
 
+    if (tap_event != TAP_MUTATION) {
+        // Mutations batched so far must be applied before anything that
+        // follows them in the stream.
+        TapConsumer *tc = dynamic_cast<TapConsumer*>(connection);
+        if (tc && tc->isBatching()) {
+            ret = tc->applyBatch();
+            if (ret != ENGINE_SUCCESS) {
+                return ret;
+            }
+        }
+    }
+
     if (tap_event == TAP_MUTATION || tap_event == TAP_DELETION) {
         if (!tapThrottle->shouldProcess()) {
             ++stats.tapThrottled;
@@ -2048,7 +2085,18 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::tapNotify(const void *cookie,
         {
             BlockTimer timer(&stats.tapMutationHisto);
             TapConsumer *tc = dynamic_cast<TapConsumer*>(connection);
-            value_t vblob(Blob::New(static_cast<const char*>(data), ndata));
+            value_t vblob;
+            if ((tap_flags & TAP_FLAG_COMPRESSED) && tc) {
+                vblob.reset(tc->decompressValue(data, ndata));
+                if (!vblob) {
+                    LOG(EXTENSION_LOG_WARNING, "%s Received a corrupt "
+                        "compressed value. Force disconnect\n",
+                        connection->logHeader());
+                    return ENGINE_DISCONNECT;
+                }
+            } else {
+                vblob.reset(Blob::New(static_cast<const char*>(data), ndata));
+            }
             Item *itm = new Item(k, flags, exptime, vblob);
             itm->setVBucketId(vbucket);
 
@@ -2064,7 +2112,22 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::tapNotify(const void *cookie,
                     meta = true;
                 }
 
-                if (tc->isBackfillPhase(vbucket)) {
+                if (tc->isBatching()) {
+                    RCPtr<VBucket> vb = getVBucket(vbucket);
+                    if (vb && vb->getState() != vbucket_state_dead &&
+                        vb->ht.hasAvailableSpace(*itm)) {
+                        ret = tc->batchMutation(itm, meta, nru,
+                                                tap_flags & TAP_FLAG_ACK);
+                        itm = NULL;
+                    } else {
+                        // Let the failure be answered as it is right now.
+                        ret = tc->applyBatch();
+                    }
+                }
+
+                if (!itm || ret != ENGINE_SUCCESS) {
+                    // Batched, or an earlier mutation failed.
+                } else if (tc->isBackfillPhase(vbucket)) {
                     ret = epstore->addTAPBackfillItem(*itm, meta, nru);
                 } else {
                     if (meta) {
@@ -2091,10 +2154,10 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::tapNotify(const void *cookie,
                 }
             }
 
-            delete itm;
-            if (tc && !tc->supportsCheckpointSync()) {
+            if (itm && tc && !tc->supportsCheckpointSync()) {
                 tc->checkVBOpenCheckpoint(vbucket);
             }
+            delete itm;
 
             if (ret == ENGINE_DISCONNECT) {
                 LOG(EXTENSION_LOG_WARNING, "%s Failed to apply tap mutation. "
@@ -2593,6 +2656,20 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doEngineStats(const void *cookie,
                     cookie);
     add_casted_stat("ep_num_eject_failures", epstats.numFailedEjects, add_stat,
                     cookie);
+    add_casted_stat("ep_num_value_compressions", epstats.numValueCompressions,
+                    add_stat, cookie);
+    add_casted_stat("ep_num_value_decompressions",
+                    epstats.numValueDecompressions, add_stat, cookie);
+    add_casted_stat("ep_num_compressed_values", epstats.numCompressedValues,
+                    add_stat, cookie);
+    add_casted_stat("ep_compressed_value_size", epstats.compressedValueSize,
+                    add_stat, cookie);
+    size_t compressIn = epstats.valueCompressBytesIn.get();
+    add_casted_stat("ep_value_compression_ratio",
+                    compressIn == 0 ? 0.0 :
+                    static_cast<double>(epstats.valueCompressBytesOut.get()) /
+                    static_cast<double>(compressIn),
+                    add_stat, cookie);
     add_casted_stat("ep_num_not_my_vbuckets", epstats.numNotMyVBuckets, add_stat,
                     cookie);
 
@@ -2667,6 +2744,10 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doEngineStats(const void *cookie,
                     add_stat, cookie);
     add_casted_stat("ep_access_scanner_num_items", epstats.alogNumItems,
                     add_stat, cookie);
+    add_casted_stat("ep_access_scanner_bytes_written",
+                    epstats.alogBytesWritten, add_stat, cookie);
+    add_casted_stat("ep_access_scanner_full_bytes", epstats.alogFullBytes,
+                    add_stat, cookie);
 
     char timestr[20];
     struct tm alogTim = *gmtime((time_t *)&epstats.alogTime);
@@ -2709,11 +2790,39 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doEngineStats(const void *cookie,
 
 ENGINE_ERROR_CODE EventuallyPersistentEngine::doMemoryStats(const void *cookie,
                                                            ADD_STAT add_stat) {
+    VBucketCountAggregator aggregator;
+    VBucketCountVisitor activeCountVisitor(vbucket_state_active);
+    aggregator.addVisitor(&activeCountVisitor);
+    VBucketCountVisitor replicaCountVisitor(vbucket_state_replica);
+    aggregator.addVisitor(&replicaCountVisitor);
+    VBucketCountVisitor pendingCountVisitor(vbucket_state_pending);
+    aggregator.addVisitor(&pendingCountVisitor);
+    epstore->visit(aggregator);
+
     add_casted_stat("bytes", stats.getTotalMemoryUsed(), add_stat, cookie);
     add_casted_stat("mem_used", stats.getTotalMemoryUsed(), add_stat, cookie);
     add_casted_stat("ep_kv_size", stats.currentSize, add_stat, cookie);
     add_casted_stat("ep_value_size", stats.totalValueSize, add_stat, cookie);
     add_casted_stat("ep_overhead", stats.memOverhead, add_stat, cookie);
+
+    size_t numItems = activeCountVisitor.getNumItems() +
+        activeCountVisitor.getNumTempItems() +
+        replicaCountVisitor.getNumItems() +
+        replicaCountVisitor.getNumTempItems() +
+        pendingCountVisitor.getNumItems() +
+        pendingCountVisitor.getNumTempItems();
+    size_t metaDataMemory = activeCountVisitor.getMetaDataMemory() +
+        replicaCountVisitor.getMetaDataMemory() +
+        pendingCountVisitor.getMetaDataMemory();
+    size_t externalMemory = stats.numExternalFields * sizeof(StoredValueFields);
+    add_casted_stat("ep_meta_data_memory", metaDataMemory, add_stat, cookie);
+    add_casted_stat("ep_item_overhead",
+                    numItems ? (metaDataMemory + externalMemory) / numItems : 0,
+                    add_stat, cookie);
+    add_casted_stat("ep_item_header_size", StoredValue::headerSize(),
+                    add_stat, cookie);
+    add_casted_stat("ep_item_external_fields", stats.numExternalFields,
+                    add_stat, cookie);
     add_casted_stat("ep_max_data_size", stats.getMaxDataSize(), add_stat, cookie);
     add_casted_stat("ep_mem_low_wat", stats.mem_low_wat, add_stat, cookie);
     add_casted_stat("ep_mem_high_wat", stats.mem_high_wat, add_stat, cookie);
@@ -2722,6 +2831,15 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doMemoryStats(const void *cookie,
     add_casted_stat("ep_mem_tracker_enabled",
                     stats.memoryTrackerEnabled ? "true" : "false",
                     add_stat, cookie);
+    add_casted_stat("ep_slab_alloc",
+                    SlabAllocator::isEnabled() ? "true" : "false",
+                    add_stat, cookie);
+    add_casted_stat("ep_slab_reserved", SlabAllocator::getReservedBytes(),
+                    add_stat, cookie);
+    add_casted_stat("ep_slab_free", SlabAllocator::getFreeBytes(),
+                    add_stat, cookie);
+    add_casted_stat("ep_slab_cached", SlabAllocator::getCachedBytes(),
+                    add_stat, cookie);
 
     std::map<std::string, size_t> alloc_stats;
     MemoryTracker::getInstance()->getAllocatorStats(alloc_stats);
@@ -2788,6 +2906,8 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doHashStats(const void *cookie,
             add_casted_stat(buf, vb->ht.getSize(), add_stat, cookie);
             snprintf(buf, sizeof(buf), "vb_%d:locks", vbid);
             add_casted_stat(buf, vb->ht.getNumLocks(), add_stat, cookie);
+            snprintf(buf, sizeof(buf), "vb_%d:layout", vbid);
+            add_casted_stat(buf, vb->ht.getBucketLayoutName(), add_stat, cookie);
             snprintf(buf, sizeof(buf), "vb_%d:min_depth", vbid);
             add_casted_stat(buf, depthVisitor.min == -1 ? 0 : depthVisitor.min,
                             add_stat, cookie);
@@ -2801,6 +2921,10 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doHashStats(const void *cookie,
             add_casted_stat(buf, depthVisitor.size, add_stat, cookie);
             snprintf(buf, sizeof(buf), "vb_%d:resized", vbid);
             add_casted_stat(buf, vb->ht.getNumResizes(), add_stat, cookie);
+            snprintf(buf, sizeof(buf), "vb_%d:resize_remaining", vbid);
+            add_casted_stat(buf, vb->ht.getMigrationRemaining(), add_stat, cookie);
+            snprintf(buf, sizeof(buf), "vb_%d:resize_max_pause", vbid);
+            add_casted_stat(buf, vb->ht.getMaxResizePause() / 1000, add_stat, cookie);
             snprintf(buf, sizeof(buf), "vb_%d:mem_size", vbid);
             add_casted_stat(buf, vb->ht.memSize, add_stat, cookie);
             snprintf(buf, sizeof(buf), "vb_%d:mem_size_counted", vbid);
@@ -3050,6 +3174,20 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doTapStats(const void *cookie,
                     add_stat, cookie);
     add_casted_stat("ep_tap_total_backlog_size", aggregator.tap_totalBacklogSize,
                     add_stat, cookie);
+    add_casted_stat("ep_tap_backfill_queue", aggregator.tap_backfillQueue,
+                    add_stat, cookie);
+    add_casted_stat("ep_tap_backfill_disk_bytes", aggregator.tap_backfillDiskBytes,
+                    add_stat, cookie);
+    add_casted_stat("ep_tap_backfill_disk_rate", aggregator.tap_backfillDiskRate,
+                    add_stat, cookie);
+    add_casted_stat("ep_tap_backfill_readers",
+                    epstore->getBackfillExecutor()->getNumReaders(),
+                    add_stat, cookie);
+    add_casted_stat("ep_tap_backfill_max_disk_rate",
+                    tapConfig->getBackfillDiskRate(), add_stat, cookie);
+    add_casted_stat("ep_tap_compression_threshold",
+                    tapConfig->getCompressionThreshold(), add_stat, cookie);
+    epstore->getBackfillExecutor()->addStats(add_stat, cookie);
     add_casted_stat("ep_tap_ack_window_size", tapConfig->getAckWindowSize(),
                     add_stat, cookie);
     add_casted_stat("ep_tap_ack_interval", tapConfig->getAckInterval(),
@@ -3175,7 +3313,10 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doTimingStats(const void *cookie,
     add_casted_stat("tap_mutation", stats.tapMutationHisto, add_stat, cookie);
     // Misc
     add_casted_stat("notify_io", stats.notifyIOHisto, add_stat, cookie);
+    add_casted_stat("value_decompress", stats.valueDecompressHisto,
+                    add_stat, cookie);
     add_casted_stat("batch_read", stats.getMultiHisto, add_stat, cookie);
+    add_casted_stat("batch_read_size", stats.bgFetchBatchHisto, add_stat, cookie);
 
     // Disk stats
     add_casted_stat("disk_insert", stats.diskInsertHisto, add_stat, cookie);
@@ -3198,10 +3339,24 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doTimingStats(const void *cookie,
                         add_stat, cookie);
         add_casted_stat("klogSyncTime", mutationLog->syncTimeHisto,
                         add_stat, cookie);
+        add_casted_stat("klogWriteTime", mutationLog->writeTimeHisto,
+                        add_stat, cookie);
         add_casted_stat("klogCompactorTime", stats.mlogCompactorHisto,
                         add_stat, cookie);
     }
 
+    // Flusher shards
+    const std::vector<FlusherShard*> &shards(epstore->getFlusherShards());
+    for (size_t i = 0; i < shards.size(); ++i) {
+        char statname[80] = {0};
+        snprintf(statname, sizeof(statname), "flusher_shard_%d_queue_depth",
+                 static_cast<int>(i));
+        add_casted_stat(statname, shards[i]->queueDepthHisto, add_stat, cookie);
+        snprintf(statname, sizeof(statname), "flusher_shard_%d_commit",
+                 static_cast<int>(i));
+        add_casted_stat(statname, shards[i]->commitHisto, add_stat, cookie);
+    }
+
     return ENGINE_SUCCESS;
 }
 
@@ -3235,14 +3390,44 @@ static void doDispatcherStat(const char *prefix, const DispatcherState &ds,
     add_casted_stat(statname, ds.isRunningTask() ? "running" : "idle",
                     add_stat, cookie);
 
-    if (ds.isRunningTask()) {
-        snprintf(statname, sizeof(statname), "%s:task", prefix);
-        add_casted_stat(statname, ds.getTaskName().c_str(),
-                        add_stat, cookie);
+    const std::vector<WorkerState> &workers(ds.getWorkers());
+    if (workers.size() == 1) {
+        if (ds.isRunningTask()) {
+            snprintf(statname, sizeof(statname), "%s:task", prefix);
+            add_casted_stat(statname, ds.getTaskName().c_str(),
+                            add_stat, cookie);
 
-        snprintf(statname, sizeof(statname), "%s:runtime", prefix);
-        add_casted_stat(statname, (gethrtime() - ds.getTaskStart()) / 1000,
-                        add_stat, cookie);
+            snprintf(statname, sizeof(statname), "%s:runtime", prefix);
+            add_casted_stat(statname, (gethrtime() - ds.getTaskStart()) / 1000,
+                            add_stat, cookie);
+        }
+    } else {
+        snprintf(statname, sizeof(statname), "%s:workers", prefix);
+        add_casted_stat(statname, workers.size(), add_stat, cookie);
+
+        snprintf(statname, sizeof(statname), "%s:steals", prefix);
+        add_casted_stat(statname, ds.getSteals(), add_stat, cookie);
+
+        for (size_t i = 0; i < workers.size(); ++i) {
+            const WorkerState &ws(workers[i]);
+            int id(static_cast<int>(i));
+            snprintf(statname, sizeof(statname), "%s:worker_%d:status",
+                     prefix, id);
+            add_casted_stat(statname, ws.isRunningTask() ? "running" : "idle",
+                            add_stat, cookie);
+            if (ws.isRunningTask()) {
+                snprintf(statname, sizeof(statname), "%s:worker_%d:task",
+                         prefix, id);
+                add_casted_stat(statname, ws.getTaskName().c_str(),
+                                add_stat, cookie);
+
+                snprintf(statname, sizeof(statname), "%s:worker_%d:runtime",
+                         prefix, id);
+                add_casted_stat(statname,
+                                (gethrtime() - ws.getTaskStart()) / 1000,
+                                add_stat, cookie);
+            }
+        }
     }
 
     showJobLog(prefix, "log", ds.getLog(), cookie, add_stat);
@@ -3263,6 +3448,14 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doDispatcherStats(const void *cook
     DispatcherState nds(epstore->getNonIODispatcher()->getDispatcherState());
     doDispatcherStat("nio_dispatcher", nds, cookie, add_stat);
 
+    const std::vector<FlusherShard*> &shards(epstore->getFlusherShards());
+    for (size_t i = 1; i < shards.size(); ++i) {
+        std::stringstream prefix;
+        prefix << "dispatcher_" << i;
+        DispatcherState sds(shards[i]->dispatcher->getDispatcherState());
+        doDispatcherStat(prefix.str().c_str(), sds, cookie, add_stat);
+    }
+
     return ENGINE_SUCCESS;
 }
 
@@ -3278,6 +3471,12 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doKlogStats(const void* cookie,
             add_casted_stat(key, v, add_stat, cookie);
         }
     }
+    if (mutationLog->isEnabled()) {
+        add_casted_stat("write_time", mutationLog->writeTimeHisto,
+                        add_stat, cookie);
+        add_casted_stat("sync_time", mutationLog->syncTimeHisto,
+                        add_stat, cookie);
+    }
     return ENGINE_SUCCESS;
 }
 
@@ -3350,10 +3549,24 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::getStats(const void* cookie,
     } else if (nkey == 9 && strncmp(stat_key, "kvtimings", 9) == 0) {
         getEpStore()->getROUnderlying()->addTimingStats("ro", add_stat, cookie);
         getEpStore()->getRWUnderlying()->addTimingStats("rw", add_stat, cookie);
+        const std::vector<FlusherShard*> &shards(epstore->getFlusherShards());
+        for (size_t i = 1; i < shards.size(); ++i) {
+            std::stringstream prefix;
+            prefix << "rw_" << i;
+            shards[i]->rwUnderlying->addTimingStats(prefix.str(),
+                                                    add_stat, cookie);
+        }
         rv = ENGINE_SUCCESS;
     } else if (nkey == 7 && strncmp(stat_key, "kvstore", 7) == 0) {
         getEpStore()->getROUnderlying()->addStats("ro", add_stat, cookie);
         getEpStore()->getRWUnderlying()->addStats("rw", add_stat, cookie);
+        const std::vector<FlusherShard*> &shards(epstore->getFlusherShards());
+        for (size_t i = 1; i < shards.size(); ++i) {
+            std::stringstream prefix;
+            prefix << "rw_" << i;
+            shards[i]->rwUnderlying->addStats(prefix.str(),
+                                              add_stat, cookie);
+        }
         rv = ENGINE_SUCCESS;
     } else if (nkey == 6 && strncmp(stat_key, "warmup", 6) == 0) {
         epstore->getWarmup()->addStats(add_stat, cookie);
@@ -4063,7 +4276,7 @@ EventuallyPersistentEngine::doTapVbTakeoverStats(const void *cookie,
     std::string name("eq_tapq:");
     name.append(key);
     size_t vb_items = vb->ht.getNumItems();
-    size_t del_items = epstore->getRWUnderlying()->getNumPersistedDeletes(vbid);
+    size_t del_items = epstore->getRWUnderlying(vbid)->getNumPersistedDeletes(vbid);
 
     add_casted_stat("name", name, add_stat, cookie);
 
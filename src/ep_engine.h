@@ -269,8 +269,11 @@ public:
     void resetStats() {
         stats.reset();
         if (epstore) {
-            if (epstore->getRWUnderlying()) {
-                epstore->getRWUnderlying()->resetStats();
+            const std::vector<FlusherShard*> &shards(epstore->getFlusherShards());
+            for (size_t i = 0; i < shards.size(); ++i) {
+                shards[i]->rwUnderlying->resetStats();
+                shards[i]->queueDepthHisto.reset();
+                shards[i]->commitHisto.reset();
             }
             if (epstore->getROUnderlying()) {
                 epstore->getROUnderlying()->resetStats();
@@ -664,10 +667,13 @@ private:
     friend void *EvpNotifyPendingConns(void*arg);
     void notifyPendingConnections(void);
 
+    friend class BackfillExecutor;
     friend class BackFillVisitor;
     friend class TapBGFetchCallback;
     friend class TapConnMap;
     friend class EventuallyPersistentStore;
+    friend class BgFetcher;
+    friend class Warmup;
 
     bool enableTraffic(bool enable) {
         return trafficEnabled.cas(!enable, enable);
@@ -0,0 +1,158 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <list>
+#include <utility>
+
+#include "epoch.h"
+#include "objectregistry.h"
+
+//! Retired objects that make retire() try to reclaim them.
+static const size_t RECLAIM_THRESHOLD(64);
+
+/**
+ * The read-side state of a thread.  Records are never freed; the
+ * record of an exited thread is handed to the next new one.
+ */
+struct EpochRecord {
+    EpochRecord() : active(0), nesting(0), inUse(true), next(NULL) { }
+
+    //! The epoch the thread entered, or 0 outside of a critical section.
+    volatile uint64_t active;
+    size_t           nesting;
+    bool             inUse;
+    EpochRecord     *next;
+};
+
+typedef std::pair<uint64_t, Retired*> retired_t;
+
+static Atomic<uint64_t> globalEpoch(1);
+static SpinLock recordsLock;
+static EpochRecord *records;
+static SpinLock retiredLock;
+static std::list<retired_t> retiredList;
+static Atomic<size_t> numRetired;
+
+extern "C" {
+    static void releaseEpochRecord(void *p) {
+        EpochRecord *r = static_cast<EpochRecord*>(p);
+        SpinLockHolder lh(&recordsLock);
+        r->inUse = false;
+    }
+}
+
+static ThreadLocal<EpochRecord*> *epochRecords;
+
+class EpochInstaller {
+public:
+    EpochInstaller() {
+        epochRecords = new ThreadLocal<EpochRecord*>(releaseEpochRecord);
+    }
+} epochInstaller;
+
+static EpochRecord *getRecord() {
+    EpochRecord *r = epochRecords->get();
+    if (r == NULL) {
+        SpinLockHolder lh(&recordsLock);
+        for (r = records; r != NULL && r->inUse; r = r->next) {
+        }
+        if (r == NULL) {
+            // The record outlives any engine the thread works for.
+            EventuallyPersistentEngine *engine =
+                ObjectRegistry::onSwitchThread(NULL, true);
+            r = new EpochRecord;
+            ObjectRegistry::onSwitchThread(engine);
+            r->next = records;
+            records = r;
+        }
+        r->inUse = true;
+        lh.unlock();
+        epochRecords->set(r);
+    }
+    return r;
+}
+
+/**
+ * Get the oldest epoch a thread is reading in, or the current epoch if
+ * no thread is.
+ */
+static uint64_t oldestActiveEpoch() {
+    uint64_t oldest = globalEpoch.get();
+    SpinLockHolder lh(&recordsLock);
+    for (EpochRecord *r = records; r != NULL; r = r->next) {
+        uint64_t e = r->active;
+        if (e != 0 && e < oldest) {
+            oldest = e;
+        }
+    }
+    return oldest;
+}
+
+void Epoch::enter() {
+    EpochRecord *r = getRecord();
+    if (r->nesting++ == 0) {
+        r->active = globalEpoch.get();
+        // The reads protected by this section can't be done before the
+        // epoch is published.
+        ep_sync_synchronize();
+    }
+}
+
+void Epoch::exit() {
+    EpochRecord *r = getRecord();
+    assert(r->nesting > 0);
+    if (--r->nesting == 0) {
+        ep_sync_synchronize();
+        r->active = 0;
+    }
+}
+
+void Epoch::retire(Retired *r) {
+    SpinLockHolder lh(&retiredLock);
+    // Readers entering from now on can't see r anymore.
+    retiredList.push_back(retired_t(globalEpoch.incr(1), r));
+    bool full = ++numRetired >= RECLAIM_THRESHOLD;
+    lh.unlock();
+    if (full) {
+        reclaim();
+    }
+}
+
+void Epoch::reclaim() {
+    std::list<retired_t> ready;
+    SpinLockHolder lh(&retiredLock);
+    uint64_t oldest = oldestActiveEpoch();
+    std::list<retired_t>::iterator it = retiredList.begin();
+    while (it != retiredList.end()) {
+        std::list<retired_t>::iterator cur = it++;
+        if (cur->first < oldest) {
+            ready.splice(ready.end(), retiredList, cur);
+        }
+    }
+    numRetired.decr(ready.size());
+    lh.unlock();
+
+    for (it = ready.begin(); it != ready.end(); ++it) {
+        delete it->second;
+    }
+}
+
+size_t Epoch::getNumRetired() {
+    return numRetired.get();
+}
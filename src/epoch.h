@@ -0,0 +1,111 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_EPOCH_H_
+#define SRC_EPOCH_H_ 1
+
+#include "config.h"
+
+#include "atomic.h"
+#include "common.h"
+
+/**
+ * Something unlinked from a structure readers walk without a lock,
+ * waiting in Epoch to be destroyed.
+ */
+class Retired {
+public:
+    virtual ~Retired() { }
+};
+
+/**
+ * A retired array allocated with new[].
+ */
+template <typename T>
+class RetiredArray : public Retired {
+public:
+    RetiredArray(T *a) : array(a) { }
+
+    ~RetiredArray() {
+        delete []array;
+    }
+
+private:
+    T *array;
+
+    DISALLOW_COPY_AND_ASSIGN(RetiredArray);
+};
+
+/**
+ * Epoch based reclamation.
+ *
+ * Readers bracket every access to shared memory that may be unlinked
+ * under them with an EpochGuard.  A writer that unlinks such memory
+ * hands it to retire(), tagged with the current epoch, and advances the
+ * epoch.  It is destroyed once every thread that was inside a guard at
+ * that point has left it, so readers never take a lock and writers
+ * never wait for readers.
+ */
+class Epoch {
+public:
+
+    /**
+     * Enter a read-side critical section.  Sections nest.
+     */
+    static void enter();
+
+    /**
+     * Leave a read-side critical section.
+     */
+    static void exit();
+
+    /**
+     * Destroy an object once no reader can still be using it.  The
+     * object must already be unreachable for new readers.
+     */
+    static void retire(Retired *r);
+
+    /**
+     * Destroy the retired objects no reader can be using anymore.
+     */
+    static void reclaim();
+
+    /**
+     * Get the number of retired objects not destroyed yet.
+     */
+    static size_t getNumRetired();
+};
+
+/**
+ * Keeps the current thread in a read-side critical section for its
+ * lifetime.
+ */
+class EpochGuard {
+public:
+    EpochGuard() {
+        Epoch::enter();
+    }
+
+    ~EpochGuard() {
+        Epoch::exit();
+    }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(EpochGuard);
+};
+
+#endif  // SRC_EPOCH_H_
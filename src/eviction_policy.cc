@@ -0,0 +1,98 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <cstdlib>
+
+#include "eviction_policy.h"
+
+static double randomShare() {
+    return static_cast<double>(std::rand()) / static_cast<double>(RAND_MAX);
+}
+
+EvictionPolicy *EvictionPolicy::create(const std::string &name,
+                                       double protectedShare) {
+    if (name == "nru") {
+        return new NRUEvictionPolicy();
+    } else if (name == "slru") {
+        return new SLRUEvictionPolicy(protectedShare);
+    }
+    return NULL;
+}
+
+eviction_decision_t NRUEvictionPolicy::decide(StoredValue *v, double percent) {
+    // always evict unreferenced items, or randomly evict referenced item
+    if (phase == PAGING_UNREFERENCED) {
+        return v->getNRUValue() == MAX_NRU_VALUE ? EVICT_COLD : EVICT_KEEP;
+    }
+    double r = randomShare();
+    if (v->incrNRUValue() == MAX_NRU_VALUE && r <= percent) {
+        return EVICT_VICTIM;
+    }
+    return EVICT_KEEP;
+}
+
+void NRUEvictionPolicy::complete(bool finished) {
+    if (finished) {
+        phase = phase == PAGING_UNREFERENCED ? PAGING_RANDOM : PAGING_UNREFERENCED;
+    }
+}
+
+void SLRUEvictionPolicy::begin() {
+    visited = 0;
+    protectedCount = 0;
+}
+
+bool SLRUEvictionPolicy::protectedFull() const {
+    return static_cast<double>(protectedCount) >=
+        protectedShare * static_cast<double>(visited);
+}
+
+eviction_decision_t SLRUEvictionPolicy::decide(StoredValue *v, double percent) {
+    if (!v->isResident()) {
+        return EVICT_KEEP;
+    }
+    ++visited;
+    uint8_t prev = v->getNRUValue();
+    // Referenced more often than the walk aged it since it came in.
+    bool reused = prev < INITIAL_NRU_VALUE;
+    v->incrNRUValue();
+
+    if (v->isPromoted()) {
+        if (!reused && protectedFull()) {
+            // Back on probation, but only ejected from the next run on.
+            v->setPromoted(false);
+        } else {
+            ++protectedCount;
+        }
+        return EVICT_KEEP;
+    }
+
+    if (reused && !protectedFull()) {
+        v->setPromoted(true);
+        ++protectedCount;
+        return EVICT_KEEP;
+    }
+
+    if (prev == MAX_NRU_VALUE) {
+        return EVICT_COLD;
+    }
+    // The probationary values are all that's left to meet the target
+    // with, including those the full protected segment turned away.
+    return randomShare() <= percent ? EVICT_VICTIM : EVICT_KEEP;
+}
@@ -0,0 +1,155 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_EVICTION_POLICY_H_
+#define SRC_EVICTION_POLICY_H_ 1
+
+#include "config.h"
+
+#include <string>
+
+#include "common.h"
+#include "stored-value.h"
+
+/**
+ * What the item pager should do with a value it visits.
+ */
+typedef enum {
+    EVICT_KEEP,  //!< Leave the value in memory.
+    EVICT_COLD,  //!< Cold: compress the value, or eject it.
+    EVICT_VICTIM //!< Eject the value to meet the eviction target.
+} eviction_decision_t;
+
+/**
+ * The item pager phase
+ */
+typedef enum {
+    PAGING_UNREFERENCED,
+    PAGING_RANDOM
+} item_pager_phase;
+
+/**
+ * Picks the values the item pager ejects as it walks the hash tables.
+ *
+ * A policy only sees the values the walk hands it, so whatever it
+ * remembers about a value lives in the value's NRU bits and its
+ * promoted bit.  The pager calls it from a single thread.
+ */
+class EvictionPolicy {
+public:
+
+    virtual ~EvictionPolicy() {}
+
+    /**
+     * Create the policy of the given name (see eviction_policy in
+     * configuration.json).
+     *
+     * @param name the name of the policy
+     * @param protectedShare the share (0-1) of the values a segmented
+     *                       policy may keep in its protected segment
+     * @return the new policy, or NULL if there's no such policy
+     */
+    static EvictionPolicy *create(const std::string &name,
+                                  double protectedShare);
+
+    virtual const char *getName() const = 0;
+
+    /**
+     * Called before a pager run visits any value.
+     */
+    virtual void begin() {}
+
+    /**
+     * Decide what to do with a value, with the lock of its key held.
+     *
+     * @param v a value that is neither expired nor temporary
+     * @param percent the share (0-1) of the values in this vbucket to
+     *                eject, already biased by the vbucket state
+     */
+    virtual eviction_decision_t decide(StoredValue *v, double percent) = 0;
+
+    /**
+     * Called when a pager run is over.
+     *
+     * @param finished false if the run stopped early because memory
+     *                 usage fell below the low watermark
+     */
+    virtual void complete(bool finished) {
+        (void)finished;
+    }
+};
+
+/**
+ * The original policy: one run ejects the values that stayed
+ * unreferenced for a while, the next ages every value and ejects a
+ * random share of those that turn cold.
+ */
+class NRUEvictionPolicy : public EvictionPolicy {
+public:
+
+    NRUEvictionPolicy() : phase(PAGING_UNREFERENCED) {}
+
+    const char *getName() const { return "nru"; }
+
+    eviction_decision_t decide(StoredValue *v, double percent);
+
+    void complete(bool finished);
+
+    item_pager_phase getPhase() const {
+        return phase;
+    }
+
+private:
+    item_pager_phase phase;
+};
+
+/**
+ * A segmented LRU approximated by the hash table walk, in the manner
+ * of CLOCK.
+ *
+ * New values start on probation.  A value referenced again before the
+ * walk comes back to it is promoted to the protected segment, which
+ * is never ejected from.  Once the segment outgrows its share, the
+ * walk demotes the protected values not reused since it last came by
+ * back to probation.  Values touched once, as by a scan, so go before
+ * the values that are actually reused.
+ */
+class SLRUEvictionPolicy : public EvictionPolicy {
+public:
+
+    /**
+     * @param share the share (0-1) of the values the protected segment
+     *              may hold
+     */
+    SLRUEvictionPolicy(double share) :
+        protectedShare(share), visited(0), protectedCount(0) {}
+
+    const char *getName() const { return "slru"; }
+
+    void begin();
+
+    eviction_decision_t decide(StoredValue *v, double percent);
+
+private:
+    bool protectedFull() const;
+
+    double protectedShare;
+    size_t visited;
+    size_t protectedCount;
+};
+
+#endif  // SRC_EVICTION_POLICY_H_
@@ -24,8 +24,15 @@
 #include <map>
 #include <vector>
 
+#include "ep_engine.h"
 #include "flusher.h"
 
+Flusher::Flusher(EventuallyPersistentStore *st, FlusherShard *s) :
+    store(st), shard(s), _state(initializing), dispatcher(s->dispatcher),
+    minSleepTime(0.1), forceShutdownReceived(false), doHighPriority(false),
+    numHighPriority(0), passFlushed(0), lastPassFlushed(0),
+    groupSize(st->getEPEngine().getConfiguration().getGroupCommitVbuckets()) { }
+
 bool FlusherStepper::callback(Dispatcher &d, TaskId &t) {
     return flusher->step(d, t);
 }
@@ -206,8 +213,16 @@ void Flusher::completeFlush() {
 }
 
 double Flusher::computeMinSleepTime() {
-    if (store->stats.diskQueueSize.get() > 0 ||
-        store->stats.highPriorityChks.get() > 0) {
+    bool busy;
+    if (store->getFlusherShards().size() == 1) {
+        busy = store->stats.diskQueueSize.get() > 0 || !idle.get();
+    } else {
+        // The queue size is shared by all the shards, so only keep going
+        // while our own vbuckets had or got something to write.
+        busy = !lpVbs.empty() || !idle.get() || lastPassFlushed > 0 ||
+               store->diskFlushAll.get();
+    }
+    if (busy || store->stats.highPriorityChks.get() > 0) {
         minSleepTime = DEFAULT_MIN_SLEEP_TIME;
         return 0;
     }
@@ -216,18 +231,34 @@ double Flusher::computeMinSleepTime() {
 }
 
 void Flusher::doFlush() {
-    uint16_t nextVb = getNextVb();
-    if (nextVb != NO_VBUCKETS_INSTANTIATED || store->diskFlushAll) {
-        store->flushVBucket(nextVb);
+    // Take up to groupSize vbuckets, without starting a new pass.
+    std::vector<uint16_t> vbs;
+    do {
+        uint16_t nextVb = getNextVb();
+        if (nextVb == NO_VBUCKETS_INSTANTIATED) {
+            break;
+        }
+        if (std::find(vbs.begin(), vbs.end(), nextVb) == vbs.end()) {
+            vbs.push_back(nextVb);
+        }
+    } while (vbs.size() < groupSize && !lpVbs.empty());
+
+    if (!vbs.empty() || (store->diskFlushAll && shard->id == 0)) {
+        passFlushed += store->flushVBuckets(shard, vbs);
     }
 }
 
 uint16_t Flusher::getNextVb() {
     if (lpVbs.empty()) {
+        lastPassFlushed = passFlushed;
+        passFlushed = 0;
+        idle.set(lastPassFlushed == 0);
         std::vector<int> vbs = store->getVBuckets().getBucketsSortedByState();
         std::vector<int>::iterator itr = vbs.begin();
         for (; itr != vbs.end(); ++itr) {
-            lpVbs.push(static_cast<uint16_t>(*itr));
+            if (store->getFlusherShard(*itr) == shard) {
+                lpVbs.push(static_cast<uint16_t>(*itr));
+            }
         }
     }
 
@@ -235,13 +266,17 @@ uint16_t Flusher::getNextVb() {
         hpVbs.empty()) {
         std::vector<int> vbs = store->getVBuckets().getBuckets();
         std::vector<int>::iterator itr = vbs.begin();
+        numHighPriority = 0;
         for (; itr != vbs.end(); ++itr) {
+            if (store->getFlusherShard(*itr) != shard) {
+                continue;
+            }
+            ++numHighPriority;
             RCPtr<VBucket> vb = store->getVBucket(*itr);
             if (vb && vb->getHighPriorityChkSize() > 0) {
                 hpVbs.push(static_cast<uint16_t>(*itr));
             }
         }
-        numHighPriority = vbs.size();
         doHighPriority = true;
     }
 
@@ -74,10 +74,7 @@ private:
 class Flusher {
 public:
 
-    Flusher(EventuallyPersistentStore *st, Dispatcher *d) :
-        store(st), _state(initializing), dispatcher(d), minSleepTime(0.1),
-        forceShutdownReceived(false), doHighPriority(false),
-        numHighPriority(0) { }
+    Flusher(EventuallyPersistentStore *st, FlusherShard *s);
 
     ~Flusher() {
         if (_state != stopped) {
@@ -96,6 +93,19 @@ public:
 
     void start(void);
     void wake(void);
+
+    /**
+     * Called when an item of one of our vbuckets was queued; wakes the
+     * flusher only when it has found its shard's queue empty, so a
+     * flusher that is still busy is left alone and the mutation just
+     * reads the flag.
+     */
+    void notifyMutation(void) {
+        if (idle.get() && idle.cas(true, false)) {
+            wake();
+        }
+    }
+
     bool step(Dispatcher&, TaskId &);
 
     enum flusher_state state() const;
@@ -113,6 +123,7 @@ private:
     uint16_t getNextVb();
 
     EventuallyPersistentStore   *store;
+    FlusherShard                *shard;
     volatile enum flusher_state  _state;
     Mutex                        taskMutex;
     TaskId                       task;
@@ -125,6 +136,12 @@ private:
     std::queue<uint16_t> lpVbs;
     bool doHighPriority;
     int numHighPriority;
+    //! Set while a pass follows one that found nothing to write.
+    Atomic<bool> idle;
+    size_t passFlushed;
+    size_t lastPassFlushed;
+    //! Most vbuckets to commit together.
+    const size_t groupSize;
 
     DISALLOW_COPY_AND_ASSIGN(Flusher);
 };
@@ -23,25 +23,59 @@
 
 static const double FREQUENCY(60.0);
 
+//! Old buckets moved per lock held while a resize is migrating.
+static const size_t MIGRATION_SLICE(64);
+
+//! Time (ns) spent migrating a vbucket per run.
+static const hrtime_t MIGRATION_TIME(5000000);
+
 /**
  * Look at all the hash tables and make sure they're sized appropriately.
  */
 class ResizingVisitor : public VBucketVisitor {
 public:
 
-    ResizingVisitor() { }
+    ResizingVisitor(HashtableResizer *r) : resizer(r), pending(false) { }
 
     bool visitBucket(RCPtr<VBucket> &vb) {
-        vb->ht.resize();
+        // Another resize would finish the migration in progress at once.
+        if (vb->ht.getMigrationRemaining() == 0) {
+            vb->ht.resize();
+        }
+        // Move the values a slice at a time and for a bounded time per
+        // run, so neither front-end operations on this vbucket nor the
+        // dispatcher wait for the whole table.
+        if (vb->ht.migrate(MIGRATION_SLICE, MIGRATION_TIME) > 0) {
+            pending = true;
+        }
         return false;
     }
 
+    void complete() {
+        resizer->visitComplete(pending);
+    }
+
+private:
+    HashtableResizer *resizer;
+    bool pending;
 };
 
 bool HashtableResizer::callback(Dispatcher &d, TaskId &t) {
-    shared_ptr<ResizingVisitor> pv(new ResizingVisitor);
-    store->visit(pv, "Hashtable resizer", &d, Priority::ItemPagerPriority);
+    if (available) {
+        available = false;
+        dispatcher = &d;
+        task = t;
+        shared_ptr<ResizingVisitor> pv(new ResizingVisitor(this));
+        store->visit(pv, "Hashtable resizer", &d, Priority::ItemPagerPriority);
+    }
 
     d.snooze(t, FREQUENCY);
     return true;
 }
+
+void HashtableResizer::visitComplete(bool migrating) {
+    available = true;
+    if (migrating) {
+        dispatcher->wake(task);
+    }
+}
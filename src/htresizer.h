@@ -33,16 +33,27 @@ class EventuallyPersistentStore;
 class HashtableResizer : public DispatcherCallback {
 public:
 
-    HashtableResizer(EventuallyPersistentStore *s) : store(s) {}
+    HashtableResizer(EventuallyPersistentStore *s) :
+        store(s), dispatcher(NULL), available(true) {}
 
     bool callback(Dispatcher &d, TaskId &t);
 
+    /**
+     * Called when a visit is over; comes back right away if resizes
+     * are still migrating values.
+     */
+    void visitComplete(bool migrating);
+
     std::string description() {
         return std::string("Adjusting hash table sizes.");
     }
 
 private:
     EventuallyPersistentStore *store;
+    Dispatcher *dispatcher;
+    TaskId task;
+    //! False while a visit is running.
+    bool available;
 };
 
 #endif  // SRC_HTRESIZER_H_
@@ -30,6 +30,7 @@
 #include "locks.h"
 #include "mutex.h"
 #include "objectregistry.h"
+#include "slab_allocator.h"
 #include "stats.h"
 
 /**
@@ -50,7 +51,8 @@ public:
      */
     static Blob* New(const char *start, const size_t len) {
         size_t total_len = len + sizeof(Blob);
-        Blob *t = new (::operator new(total_len)) Blob(start, len);
+        bool slabbed;
+        Blob *t = new (allocate(total_len, slabbed)) Blob(start, len, slabbed);
         assert(t->length() == len);
         return t;
     }
@@ -75,11 +77,26 @@ public:
      */
     static Blob* New(const size_t len) {
         size_t total_len = len + sizeof(Blob);
-        Blob *t = new (::operator new(total_len)) Blob(len);
+        bool slabbed;
+        Blob *t = new (allocate(total_len, slabbed)) Blob(len, slabbed);
         assert(t->length() == len);
         return t;
     }
 
+    /**
+     * Destroy a Blob created by one of the New() functions.
+     */
+    static void Destroy(Blob *b) {
+        size_t total_len = b->getSize();
+        bool slabbed = b->slabbed;
+        b->~Blob();
+        if (slabbed) {
+            SlabAllocator::deallocate(b, total_len);
+        } else {
+            ::operator delete(b);
+        }
+    }
+
     // Actual accessorish things.
 
     /**
@@ -110,36 +127,48 @@ public:
         return std::string(data, size);
     }
 
-    // This is necessary for making C++ happy when I'm doing a
-    // placement new on fairly "normal" c++ heap allocations, just
-    // with variable-sized objects.
-    void operator delete(void* p) { ::operator delete(p); }
-
     ~Blob() {
         ObjectRegistry::onDeleteBlob(this);
     }
 
 private:
 
-    explicit Blob(const char *start, const size_t len) :
-        size(static_cast<uint32_t>(len))
+    static void *allocate(size_t total_len, bool &slabbed) {
+        void *p = SlabAllocator::allocate(total_len);
+        slabbed = p != NULL;
+        return slabbed ? p : ::operator new(total_len);
+    }
+
+    // Blobs are released with Destroy(), as they may live in a slab.
+    void operator delete(void* p) { ::operator delete(p); }
+
+    explicit Blob(const char *start, const size_t len, bool s) :
+        size(static_cast<uint32_t>(len)), slabbed(s)
     {
         std::memcpy(data, start, len);
         ObjectRegistry::onCreateBlob(this);
     }
 
-    explicit Blob(const size_t len) :
-        size(static_cast<uint32_t>(len))
+    explicit Blob(const size_t len, bool s) :
+        size(static_cast<uint32_t>(len)), slabbed(s)
     {
         ObjectRegistry::onCreateBlob(this);
     }
 
     const uint32_t size;
+    const bool slabbed;
     char data[1];
 
     DISALLOW_COPY_AND_ASSIGN(Blob);
 };
 
+/**
+ * Release a Blob whose last reference went away.
+ */
+inline void rcRelease(Blob *b) {
+    Blob::Destroy(b);
+}
+
 typedef SingleThreadedRCPtr<Blob> value_t;
 
 const uint64_t DEFAULT_REV_SEQ_NUM = 1;
@@ -214,6 +243,21 @@ public:
         ObjectRegistry::onCreateItem(this);
     }
 
+    /**
+     * Create an item sharing an existing value, e.g. to hand a value
+     * from the hash table to the front end.  The value is pinned by its
+     * refcount rather than copied, and the key is copied just once.
+     */
+    Item(const value_t &val, const void *k, uint16_t nk, const uint32_t fl,
+         const time_t exp, uint64_t theCas, int64_t i, uint16_t vbid,
+         uint64_t sno) :
+         metaData(theCas, sno, fl, exp), value(val), id(i), vbucketId(vbid)
+    {
+        assert(id != 0);
+        key.assign(static_cast<const char*>(k), nk);
+        ObjectRegistry::onCreateItem(this);
+    }
+
     ~Item() {
         ObjectRegistry::onDeleteItem(this);
     }
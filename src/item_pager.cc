@@ -17,7 +17,6 @@
 
 #include "config.h"
 
-#include <cstdlib>
 #include <iostream>
 #include <limits>
 #include <list>
@@ -48,15 +47,25 @@ public:
      * @param sfin pointer to a bool to be set to true after run completes
      * @param pause flag indicating if PagingVisitor can pause between vbucket visits
      * @param bias active vbuckets eviction probability bias multiplier (0-1)
-     * @param phase pointer to an item_pager_phase to be set
+     * @param pol the policy picking the values to eject, or NULL to
+     *            only purge expired values
+     * @param compress smallest unreferenced value to compress rather than
+     *                 eject, or 0 to always eject
      */
     PagingVisitor(EventuallyPersistentStore &s, EPStats &st, double pcnt,
                   bool *sfin, bool pause = false,
-                  double bias = 1, item_pager_phase *phase = NULL)
+                  double bias = 1,
+                  shared_ptr<EvictionPolicy> pol = shared_ptr<EvictionPolicy>(),
+                  size_t compress = 0)
       : store(s), stats(st), percent(pcnt),
-        activeBias(bias), ejected(0), totalEjected(0), totalEjectionAttempts(0),
+        activeBias(bias), ejected(0), compressed(0), totalEjected(0),
+        totalEjectionAttempts(0), compressMinSize(compress),
         startTime(ep_real_time()), stateFinalizer(sfin), canPause(pause),
-        completePhase(true), pager_phase(phase) {}
+        completePhase(true), policy(pol) {
+        if (policy) {
+            policy->begin();
+        }
+    }
 
     void visit(StoredValue *v) {
         // Remember expired objects -- we're going to delete them.
@@ -66,19 +75,23 @@ public:
         }
 
         // return if not ItemPager, which uses valid eviction percentage
-        if (percent <= 0 || !pager_phase) {
+        if (percent <= 0 || !policy) {
             return;
         }
 
-        // always evict unreferenced items, or randomly evict referenced item
-        double r = *pager_phase == PAGING_UNREFERENCED ?
-            1 : static_cast<double>(std::rand()) / static_cast<double>(RAND_MAX);
-
-        if (*pager_phase == PAGING_UNREFERENCED && v->getNRUValue() == MAX_NRU_VALUE) {
-            doEviction(v);
-        } else if (*pager_phase == PAGING_RANDOM && v->incrNRUValue() == MAX_NRU_VALUE &&
-                   r <= percent) {
+        switch (policy->decide(v, percent)) {
+        case EVICT_COLD:
+            // Cold values are compressed first, and only ejected if
+            // they're still cold the next time around.
+            if (!doCompression(v)) {
+                doEviction(v);
+            }
+            break;
+        case EVICT_VICTIM:
             doEviction(v);
+            break;
+        case EVICT_KEEP:
+            break;
         }
     }
 
@@ -86,7 +99,7 @@ public:
         update();
 
         // fast path for expiry item pager
-        if (percent <= 0 || !pager_phase) {
+        if (percent <= 0 || !policy) {
             return VBucketVisitor::visitBucket(vb);
         }
 
@@ -117,6 +130,10 @@ public:
             LOG(EXTENSION_LOG_INFO, "Paged out %ld values", numEjected());
         }
 
+        if (compressed > 0) {
+            LOG(EXTENSION_LOG_INFO, "Compressed %ld values", compressed);
+        }
+
         size_t num_expired = expired.size();
         if (num_expired > 0) {
             LOG(EXTENSION_LOG_INFO, "Purged %ld expired items", num_expired);
@@ -124,6 +141,7 @@ public:
 
         totalEjected += (ejected + num_expired);
         ejected = 0;
+        compressed = 0;
         expired.clear();
     }
 
@@ -138,12 +156,8 @@ public:
             *stateFinalizer = true;
         }
 
-        if (pager_phase && completePhase) {
-            if (*pager_phase == PAGING_UNREFERENCED) {
-                *pager_phase = PAGING_RANDOM;
-            } else {
-                *pager_phase = PAGING_UNREFERENCED;
-            }
+        if (policy) {
+            policy->complete(completePhase);
         }
     }
 
@@ -177,6 +191,15 @@ private:
         }
     }
 
+    bool doCompression(StoredValue *v) {
+        if (compressMinSize == 0 ||
+            !v->compressValue(stats, currentBucket->ht, compressMinSize)) {
+            return false;
+        }
+        ++compressed;
+        return true;
+    }
+
     void doEviction(StoredValue *v) {
         ++totalEjectionAttempts;
         if (!v->eligibleForEviction()) {
@@ -197,15 +220,26 @@ private:
     double percent;
     double activeBias;
     size_t ejected;
+    size_t compressed;
     size_t totalEjected;
     size_t totalEjectionAttempts;
+    size_t compressMinSize;
     time_t startTime;
     bool *stateFinalizer;
     bool canPause;
     bool completePhase;
-    item_pager_phase *pager_phase;
+    shared_ptr<EvictionPolicy> policy;
 };
 
+ItemPager::ItemPager(EventuallyPersistentStore *s, EPStats &st) :
+    store(*s), stats(st), available(true)
+{
+    Configuration &cfg = store.getEPEngine().getConfiguration();
+    double share = static_cast<double>(cfg.getEvictionProtectedPcnt()) / 100;
+    policy.reset(EvictionPolicy::create(cfg.getEvictionPolicy(), share));
+    assert(policy);
+}
+
 bool ItemPager::callback(Dispatcher &d, TaskId &t) {
     double current = static_cast<double>(stats.getTotalMemoryUsed());
     double upper = static_cast<double>(stats.mem_high_wat);
@@ -229,7 +263,8 @@ bool ItemPager::callback(Dispatcher &d, TaskId &t) {
         available = false;
         shared_ptr<PagingVisitor> pv(new PagingVisitor(store, stats, toKill,
                                                        &available,
-                                                       false, bias, &phase));
+                                                       false, bias, policy,
+                                                       cfg.getColdCompressionThreshold()));
         store.visit(pv, "Item pager", &d, Priority::ItemPagerPriority);
     }
 
@@ -244,7 +279,7 @@ bool ExpiredItemPager::callback(Dispatcher &d, TaskId &t) {
         available = false;
         shared_ptr<PagingVisitor> pv(new PagingVisitor(store, stats, -1,
                                                        &available,
-                                                       true, 1, NULL));
+                                                       true, 1));
         store.visit(pv, "Expired item remover", &d, Priority::ItemPagerPriority,
                     true, 10);
     }
@@ -28,6 +28,7 @@
 
 #include "common.h"
 #include "dispatcher.h"
+#include "eviction_policy.h"
 #include "stats.h"
 
 typedef std::pair<int64_t, int64_t> row_range_t;
@@ -35,14 +36,6 @@ typedef std::pair<int64_t, int64_t> row_range_t;
 // Forward declaration.
 class EventuallyPersistentStore;
 
-/**
- * The item pager phase
- */
-typedef enum {
-    PAGING_UNREFERENCED,
-    PAGING_RANDOM
-} item_pager_phase;
-
 /**
  * Dispatcher job responsible for periodically pushing data out of
  * memory.
@@ -56,19 +49,10 @@ public:
      * @param s the store (where we'll visit)
      * @param st the stats
      */
-    ItemPager(EventuallyPersistentStore *s, EPStats &st) :
-        store(*s), stats(st), available(true), phase(PAGING_UNREFERENCED) {}
+    ItemPager(EventuallyPersistentStore *s, EPStats &st);
 
     bool callback(Dispatcher &d, TaskId &t);
 
-    item_pager_phase getPhase() const {
-        return phase;
-    }
-
-    void setPhase(item_pager_phase item_phase) {
-        phase = item_phase;
-    }
-
     std::string description() { return std::string("Paging out items."); }
 
 private:
@@ -76,7 +60,7 @@ private:
     EventuallyPersistentStore &store;
     EPStats &stats;
     bool available;
-    item_pager_phase phase;
+    shared_ptr<EvictionPolicy> policy;
 };
 
 /**
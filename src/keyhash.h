@@ -0,0 +1,160 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_KEYHASH_H_
+#define SRC_KEYHASH_H_ 1
+
+#include "config.h"
+
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * Key hash functions used to place items in the HashTable.
+ */
+class KeyHash {
+public:
+
+    /**
+     * The original byte-at-a-time DJB style hash.
+     *
+     * @param str the beginning of the key
+     * @param len the number of bytes in the key
+     * @return the hash value (only the lower 32 bits are significant)
+     */
+    static inline uint64_t djb(const char *str, size_t len) {
+        int h = 5381;
+        for (size_t i = 0; i < len; ++i) {
+            h = ((h << 5) + h) ^ str[i];
+        }
+        return static_cast<uint32_t>(h);
+    }
+
+    /**
+     * A seeded 64-bit hash consuming the key eight bytes at a time
+     * (xxHash64 construction).  Keys of 32 bytes or more are run
+     * through four independent lanes so the multiplies pipeline.
+     *
+     * @param str the beginning of the key
+     * @param len the number of bytes in the key
+     * @param seed the per-process seed
+     * @return the hash value
+     */
+    static inline uint64_t xx64(const char *str, size_t len, uint64_t seed) {
+        const char *p = str;
+        const char *end = str + len;
+        uint64_t h;
+
+        if (len >= 32) {
+            const char *limit = end - 32;
+            uint64_t v1 = seed + PRIME1 + PRIME2;
+            uint64_t v2 = seed + PRIME2;
+            uint64_t v3 = seed;
+            uint64_t v4 = seed - PRIME1;
+            do {
+                v1 = mix(v1, read64(p));
+                v2 = mix(v2, read64(p + 8));
+                v3 = mix(v3, read64(p + 16));
+                v4 = mix(v4, read64(p + 24));
+                p += 32;
+            } while (p <= limit);
+
+            h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+            h = merge(h, v1);
+            h = merge(h, v2);
+            h = merge(h, v3);
+            h = merge(h, v4);
+        } else {
+            h = seed + PRIME5;
+        }
+
+        h += static_cast<uint64_t>(len);
+
+        while (p + 8 <= end) {
+            h ^= mix(0, read64(p));
+            h = rotl(h, 27) * PRIME1 + PRIME4;
+            p += 8;
+        }
+        if (p + 4 <= end) {
+            h ^= static_cast<uint64_t>(read32(p)) * PRIME1;
+            h = rotl(h, 23) * PRIME2 + PRIME3;
+            p += 4;
+        }
+        while (p < end) {
+            h ^= static_cast<uint64_t>(static_cast<uint8_t>(*p)) * PRIME5;
+            h = rotl(h, 11) * PRIME1;
+            ++p;
+        }
+
+        h ^= h >> 33;
+        h *= PRIME2;
+        h ^= h >> 29;
+        h *= PRIME3;
+        h ^= h >> 32;
+        return h;
+    }
+
+    /**
+     * A one byte tag of a key, taken from its full hash so it depends
+     * on every byte of the key.  Equal keys always have equal tags; it
+     * is used to skip most full key comparisons.  The hash is
+     * multiplied through first, as the bits choosing the bucket are
+     * the same within a bucket and djb leaves the high bits empty.
+     *
+     * @param h the hash of the key
+     * @return the tag
+     */
+    static inline uint8_t tag(uint64_t h) {
+        return static_cast<uint8_t>((h * PRIME1) >> 56);
+    }
+
+private:
+    static const uint64_t PRIME1 = 11400714785074694791ULL;
+    static const uint64_t PRIME2 = 14029467366897019727ULL;
+    static const uint64_t PRIME3 =  1609587929392839161ULL;
+    static const uint64_t PRIME4 =  9650029242287828579ULL;
+    static const uint64_t PRIME5 =  2870177450012600261ULL;
+
+    static inline uint64_t rotl(uint64_t x, int r) {
+        return (x << r) | (x >> (64 - r));
+    }
+
+    static inline uint64_t read64(const char *p) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    static inline uint32_t read32(const char *p) {
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    static inline uint64_t mix(uint64_t acc, uint64_t input) {
+        acc += input * PRIME2;
+        acc = rotl(acc, 31);
+        return acc * PRIME1;
+    }
+
+    static inline uint64_t merge(uint64_t acc, uint64_t val) {
+        acc ^= mix(0, val);
+        return acc * PRIME1 + PRIME4;
+    }
+};
+
+#endif  // SRC_KEYHASH_H_
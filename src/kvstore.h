@@ -154,6 +154,15 @@ public:
      */
     virtual void reset() = 0;
 
+    /**
+     * Reset only the vbuckets written through this instance, for when
+     * the vbuckets are spread over several instances and reset() has
+     * already been called on one of them.
+     */
+    virtual void resetVBuckets() {
+        reset();
+    }
+
     /**
      * Begin a transaction (if not already in one).
      *
@@ -247,6 +256,31 @@ public:
      */
     virtual void dump(uint16_t vbid, shared_ptr<Callback<GetValue> > cb) = 0;
 
+    /**
+     * Pass the stored data for the given vbucket through the given
+     * callback in sequence number order, at most limit documents at a
+     * time.
+     *
+     * Stores that can't resume a dump pass everything through on the
+     * first call.
+     *
+     * @param vbid the vbucket to dump
+     * @param startSeqno the sequence number to start at, 0 for the
+     *                   beginning of the vbucket
+     * @param limit the maximum number of documents to dump
+     * @param cb the callback to fire for each document
+     * @return the sequence number to continue at, or 0 once the whole
+     *         vbucket was dumped
+     */
+    virtual uint64_t dumpChunk(uint16_t vbid, uint64_t startSeqno, size_t limit,
+                               shared_ptr<Callback<GetValue> > cb) {
+        (void)limit;
+        if (startSeqno == 0) {
+            dump(vbid, cb);
+        }
+        return 0;
+    }
+
     /**
      * Check if the kv-store supports a dumping all of the keys
      * @return true you may call dumpKeys() to do a prefetch
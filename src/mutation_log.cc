@@ -18,16 +18,23 @@
 #include "config.h"
 
 #include <sys/stat.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
 
 #include <algorithm>
+#include <deque>
 #include <string>
 #include <utility>
+#include <vector>
 
 extern "C" {
 #include "crc32.h"
+#include "crc32c.h"
 }
 #include "ep_engine.h"
 #include "mutation_log.h"
+#include "syncobject.h"
 
 const char *mutation_log_type_names[] = {
     "new", "del", "del_all", "commit1", "commit2", NULL
@@ -67,6 +74,145 @@ static void writeFully(int fd, const uint8_t *buf, size_t nbytes) {
     }
 }
 
+extern "C" {
+    static void* launch_log_writer(void *arg);
+}
+
+/**
+ * Writes the full blocks of a MutationLog, in order, on a thread of
+ * its own.  Blocks are numbered from 1 as they are queued.
+ */
+class MutationLogWriter {
+public:
+    MutationLogWriter(MutationLog &ml, int fd, size_t bs)
+        : log(ml), file(fd), queued(0), written(0), syncRequested(0),
+          synced(0), shutdown(false) {
+        for (size_t i = 0; i < LOG_WRITE_BUFFERS; ++i) {
+            uint8_t *buf = static_cast<uint8_t*>(calloc(bs, 1));
+            assert(buf);
+            buffers.push_back(buf);
+            freeBuffers.push_back(buf);
+        }
+        blockSize = bs;
+        if (pthread_create(&thread, NULL, launch_log_writer, this) != 0) {
+            throw std::runtime_error("Error creating mutation log writer");
+        }
+    }
+
+    ~MutationLogWriter() {
+        LockHolder lh(mutex);
+        shutdown = true;
+        mutex.notify();
+        lh.unlock();
+        int rc = pthread_join(thread, NULL);
+        assert(rc == 0);
+        // Everything queued was written before the thread exited.
+        assert(written == queued);
+        std::vector<uint8_t*>::iterator it;
+        for (it = buffers.begin(); it != buffers.end(); ++it) {
+            free(*it);
+        }
+    }
+
+    /**
+     * Get a buffer to fill, waiting for one to be written if need be.
+     */
+    uint8_t *getBuffer() {
+        LockHolder lh(mutex);
+        while (freeBuffers.empty()) {
+            mutex.wait();
+        }
+        uint8_t *buf = freeBuffers.front();
+        freeBuffers.pop_front();
+        return buf;
+    }
+
+    /**
+     * Queue a full buffer to be written.
+     *
+     * @return the sequence number of the block
+     */
+    uint64_t write(uint8_t *buf) {
+        LockHolder lh(mutex);
+        pending.push_back(buf);
+        ++queued;
+        mutex.notify();
+        return queued;
+    }
+
+    /**
+     * Wait until a block and the blocks before it are written, and
+     * synced to disk if asked to.
+     */
+    void waitFor(uint64_t seqno, bool doSync) {
+        LockHolder lh(mutex);
+        if (doSync && syncRequested < seqno) {
+            syncRequested = seqno;
+            mutex.notify();
+        }
+        while (written < seqno || (doSync && synced < seqno)) {
+            mutex.wait();
+        }
+    }
+
+    void run() {
+        LockHolder lh(mutex);
+        for (;;) {
+            if (!pending.empty()) {
+                uint8_t *buf = pending.front();
+                pending.pop_front();
+                lh.unlock();
+                {
+                    BlockTimer timer(&log.writeTimeHisto);
+                    writeFully(file, buf, blockSize);
+                }
+                lh.lock();
+                ++written;
+                freeBuffers.push_back(buf);
+                mutex.notify();
+            } else if (syncRequested > synced) {
+                uint64_t target(written);
+                lh.unlock();
+                {
+                    BlockTimer timer(&log.syncTimeHisto);
+                    int fsyncResult = doFsync(file);
+                    assert(fsyncResult != -1);
+                }
+                lh.lock();
+                synced = target;
+                mutex.notify();
+            } else if (shutdown) {
+                return;
+            } else {
+                mutex.wait();
+            }
+        }
+    }
+
+private:
+    MutationLog           &log;
+    int                    file;
+    size_t                 blockSize;
+    SyncObject             mutex;
+    std::vector<uint8_t*>  buffers;
+    std::deque<uint8_t*>   freeBuffers;
+    std::deque<uint8_t*>   pending;
+    uint64_t               queued;
+    uint64_t               written;
+    uint64_t               syncRequested;
+    uint64_t               synced;
+    bool                   shutdown;
+    pthread_t              thread;
+
+    DISALLOW_COPY_AND_ASSIGN(MutationLogWriter);
+};
+
+static void* launch_log_writer(void *arg) {
+    MutationLogWriter *writer = static_cast<MutationLogWriter*>(arg);
+    writer->run();
+    return NULL;
+}
+
 uint64_t MutationLogEntry::rowid() const {
     return ntohll(_rowid);
 }
@@ -80,12 +226,13 @@ MutationLog::MutationLog(const std::string &path,
     file(-1),
     entries(0),
     entryBuffer(static_cast<uint8_t*>(calloc(MutationLogEntry::len(256), 1))),
-    blockBuffer(static_cast<uint8_t*>(calloc(bs, 1))),
+    blockBuffer(NULL),
     syncConfig(DEFAULT_SYNC_CONF),
-    readOnly(false)
+    readOnly(false),
+    writer(NULL),
+    lastBlock(0)
 {
     assert(entryBuffer);
-    assert(blockBuffer);
     if (logPath == "") {
         file = DISABLED_FD;
     }
@@ -95,7 +242,6 @@ MutationLog::~MutationLog() {
     flush();
     close();
     free(entryBuffer);
-    free(blockBuffer);
 }
 
 void MutationLog::disable() {
@@ -131,9 +277,13 @@ void MutationLog::deleteAll(uint16_t vbucket) {
 
 void MutationLog::sync() {
     assert(isOpen());
-    BlockTimer timer(&syncTimeHisto);
-    int fsyncResult = doFsync(file);
-    assert(fsyncResult != -1);
+    if (writer) {
+        writer->waitFor(lastBlock, true);
+    } else {
+        BlockTimer timer(&syncTimeHisto);
+        int fsyncResult = doFsync(file);
+        assert(fsyncResult != -1);
+    }
 }
 
 void MutationLog::commit1() {
@@ -169,6 +319,7 @@ void MutationLog::writeInitialBlock() {
     assert(isEnabled());
     assert(isOpen());
     headerBlock.set(blockSize);
+    blockPos = headerBlock.blockHeaderSize();
 
     writeFully(file, (uint8_t*)&headerBlock, sizeof(headerBlock));
 
@@ -190,9 +341,17 @@ void MutationLog::readInitialBlock() {
     }
 
     headerBlock.set(buf, sizeof(buf));
+    blockPos = headerBlock.blockHeaderSize();
 
+    // Logs written before CRC32C checksums are still read and appended to
+    // in their own format.
+    if (headerBlock.version() != LOG_VERSION &&
+        headerBlock.version() != LOG_VERSION_CRC16) {
+        std::stringstream ss;
+        ss << "Unsupported log version: " << headerBlock.version();
+        throw ReadException(ss.str());
+    }
     // These are reserved for future use.
-    assert(headerBlock.version() == LOG_VERSION);
     assert(headerBlock.blockCount() == 1);
 
     blockSize = headerBlock.blockSize();
@@ -291,10 +450,10 @@ void MutationLog::open(bool _readOnly) {
     } else {
         try {
             readInitialBlock();
-        } catch (ShortReadException &e) {
+        } catch (ReadException &e) {
             close();
             file = DISABLED_FD;
-            throw ShortReadException();
+            throw;
         }
 
         if (!readOnly) {
@@ -304,6 +463,10 @@ void MutationLog::open(bool _readOnly) {
     }
 
     prepareWrites();
+    if (!readOnly) {
+        writer = new MutationLogWriter(*this, file, blockSize);
+        blockBuffer = writer->getBuffer();
+    }
     assert(isOpen());
 }
 
@@ -315,6 +478,10 @@ void MutationLog::close() {
     if (!readOnly) {
         flush();
         sync();
+        delete writer;
+        writer = NULL;
+        blockBuffer = NULL;
+        lastBlock = 0;
         headerBlock.setRdwr(0);
         updateInitialBlock();
     }
@@ -373,10 +540,21 @@ bool MutationLog::replaceWith(MutationLog &mlog) {
 }
 
 void MutationLog::flush() {
-    if (isEnabled() && blockPos > HEADER_RESERVED) {
+    if (isEnabled() && isOpen() && writer) {
+        BlockTimer timer(&flushTimeHisto);
+        queueBlock();
+        writer->waitFor(lastBlock, false);
+    }
+}
+
+/**
+ * Hand the current block to the writer, if it has any entries.
+ */
+void MutationLog::queueBlock() {
+    size_t reserved(headerBlock.blockHeaderSize());
+    if (isEnabled() && blockPos > reserved) {
         assert(isOpen());
         needWriteAccess();
-        BlockTimer timer(&flushTimeHisto);
 
         if (blockPos < blockSize) {
             size_t padding(blockSize - blockPos);
@@ -385,16 +563,25 @@ void MutationLog::flush() {
         }
 
         entries = htons(entries);
-        memcpy(blockBuffer + 2, &entries, sizeof(entries));
-
-        uint32_t crc32(crc32buf(blockBuffer + 2, blockSize - 2));
-        uint16_t crc16(htons(crc32 & 0xffff));
-        memcpy(blockBuffer, &crc16, sizeof(crc16));
+        if (headerBlock.version() == LOG_VERSION_CRC16) {
+            memcpy(blockBuffer + 2, &entries, sizeof(entries));
+
+            uint32_t crc32(crc32buf(blockBuffer + 2, blockSize - 2));
+            uint16_t crc16(htons(crc32 & 0xffff));
+            memcpy(blockBuffer, &crc16, sizeof(crc16));
+        } else {
+            memcpy(blockBuffer + 4, &entries, sizeof(entries));
+            memset(blockBuffer + 6, 0, reserved - 6);
+
+            uint32_t crc(htonl(crc32c(blockBuffer + 4, blockSize - 4)));
+            memcpy(blockBuffer, &crc, sizeof(crc));
+        }
 
-        writeFully(file, blockBuffer, blockSize);
+        lastBlock = writer->write(blockBuffer);
+        blockBuffer = writer->getBuffer();
         logSize += blockSize;
 
-        blockPos = HEADER_RESERVED;
+        blockPos = reserved;
         entries = 0;
     }
 }
@@ -406,7 +593,7 @@ void MutationLog::writeEntry(MutationLogEntry *mle) {
 
     size_t len(mle->len());
     if (blockPos + len > blockSize) {
-        flush();
+        queueBlock();
     }
     assert(len < blockSize);
 
@@ -550,23 +737,40 @@ void MutationLog::iterator::nextBlock() {
     }
     offset += bytesread;
 
-    uint32_t crc32(crc32buf(buf + 2, log->header().blockSize() - 2));
-    uint16_t computed_crc16(crc32 & 0xffff);
-    uint16_t retrieved_crc16;
-    memcpy(&retrieved_crc16, buf, sizeof(retrieved_crc16));
-    retrieved_crc16 = ntohs(retrieved_crc16);
-    if (computed_crc16 != retrieved_crc16) {
-        throw CRCReadException();
-    }
+    items = log->checkBlock(buf);
 
-    memcpy(&items, buf + 2, 2);
-    items = ntohs(items);
-
-    p = p + 4;
+    p = p + log->header().blockHeaderSize();
 
     prepItem();
 }
 
+uint16_t MutationLog::checkBlock(const uint8_t *buf) const {
+    uint16_t items;
+    if (headerBlock.version() == LOG_VERSION_CRC16) {
+        uint32_t crc32(crc32buf(const_cast<uint8_t*>(buf) + 2,
+                                headerBlock.blockSize() - 2));
+        uint16_t computed_crc16(crc32 & 0xffff);
+        uint16_t retrieved_crc16;
+        memcpy(&retrieved_crc16, buf, sizeof(retrieved_crc16));
+        retrieved_crc16 = ntohs(retrieved_crc16);
+        if (computed_crc16 != retrieved_crc16) {
+            throw CRCReadException();
+        }
+
+        memcpy(&items, buf + 2, 2);
+    } else {
+        uint32_t computed_crc(crc32c(buf + 4, headerBlock.blockSize() - 4));
+        uint32_t retrieved_crc;
+        memcpy(&retrieved_crc, buf, sizeof(retrieved_crc));
+        if (computed_crc != ntohl(retrieved_crc)) {
+            throw CRCReadException();
+        }
+
+        memcpy(&items, buf + 4, 2);
+    }
+    return ntohs(items);
+}
+
 void MutationLog::resetCounts(size_t *items) {
     for (int i(0); i < MUTATION_LOG_TYPES; ++i) {
         itemsLogged[i] = items[i];
@@ -577,66 +781,209 @@ void MutationLog::resetCounts(size_t *items) {
 // Reading entries
 // ----------------------------------------------------------------------
 
+#ifdef HAVE_SYS_MMAN_H
+extern "C" {
+    static void* launch_block_checker(void *arg);
+}
+
+/**
+ * Verifies a range of the blocks of a mapped log, recording the number
+ * of entries of each good block and -1 for each damaged one.
+ */
+struct BlockChecker {
+    const MutationLog *log;
+    const uint8_t     *blocks;
+    size_t             first;
+    size_t             last;
+    std::vector<int>  *items;
+    pthread_t          thread;
+    bool               running;
+
+    void run() {
+        size_t bs(log->header().blockSize());
+        for (size_t b = first; b < last; ++b) {
+            try {
+                (*items)[b] = log->checkBlock(blocks + b * bs);
+            } catch (MutationLog::CRCReadException &) {
+                (*items)[b] = -1;
+            }
+        }
+    }
+};
+
+static void* launch_block_checker(void *arg) {
+    static_cast<BlockChecker*>(arg)->run();
+    return NULL;
+}
+#endif
+
+/**
+ * Load the log through a read only mapping of the file.
+ *
+ * The block CRCs are verified by several threads at once, then the
+ * entries are replayed in log order straight from the mapping, so the
+ * outcome (exceptions included) is that of reading it block by block.
+ *
+ * @return false if the log could not be mapped
+ */
+bool MutationLogHarvester::loadMapped(bool &clean,
+                                      std::set<uint16_t> &shouldClear) {
+#ifdef HAVE_SYS_MMAN_H
+    if (!mlog.isOpen()) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(mlog.fd(), &st) != 0) {
+        return false;
+    }
+    size_t bs(mlog.header().blockSize());
+    size_t start(bs * mlog.header().blockCount());
+    size_t size(st.st_size);
+    if (size <= start) {
+        return true;
+    }
+
+    void *m = mmap(NULL, size, PROT_READ, MAP_SHARED, mlog.fd(), 0);
+    if (m == MAP_FAILED) {
+        return false;
+    }
+    madvise(m, size, MADV_WILLNEED);
+
+    const uint8_t *blocks = static_cast<const uint8_t*>(m) + start;
+    size_t nblocks((size - start) / bs);
+    std::vector<int> items(nblocks, 0);
+    size_t nthreads(std::max(static_cast<size_t>(1),
+                             std::min(readers, nblocks)));
+    std::vector<BlockChecker> checkers(nthreads);
+    for (size_t i = 0; i < nthreads; ++i) {
+        BlockChecker &c(checkers[i]);
+        c.log = &mlog;
+        c.blocks = blocks;
+        c.first = nblocks * i / nthreads;
+        c.last = nblocks * (i + 1) / nthreads;
+        c.items = &items;
+        c.running = pthread_create(&c.thread, NULL,
+                                   launch_block_checker, &c) == 0;
+        if (!c.running) {
+            c.run();
+        }
+    }
+    for (size_t i = 0; i < nthreads; ++i) {
+        if (checkers[i].running) {
+            int rc = pthread_join(checkers[i].thread, NULL);
+            assert(rc == 0);
+        }
+    }
+
+    // Entries are copied out as the iterator does, to keep them aligned.
+    uint64_t entryBuf[LOG_ENTRY_BUF_SIZE / sizeof(uint64_t)];
+    try {
+        for (size_t b = 0; b < nblocks; ++b) {
+            if (items[b] < 0) {
+                throw MutationLog::CRCReadException();
+            }
+            const uint8_t *block = blocks + b * bs;
+            const uint8_t *p = block + mlog.header().blockHeaderSize();
+            for (int i = 0; i < items[b]; ++i) {
+                const MutationLogEntry *e =
+                    MutationLogEntry::newEntry(const_cast<uint8_t*>(p),
+                                               bs - (p - block));
+                memcpy(entryBuf, p, e->len());
+                p += e->len();
+                const MutationLogEntry *le = MutationLogEntry::newEntry(
+                    reinterpret_cast<uint8_t*>(entryBuf), sizeof(entryBuf));
+                clean = processEntry(le, shouldClear);
+            }
+        }
+        if ((size - start) % bs != 0) {
+            throw MutationLog::ShortReadException();
+        }
+    } catch (...) {
+        munmap(m, size);
+        throw;
+    }
+    munmap(m, size);
+    return true;
+#else
+    (void)clean;
+    (void)shouldClear;
+    return false;
+#endif
+}
+
 bool MutationLogHarvester::load() {
     bool clean(false);
     std::set<uint16_t> shouldClear;
+    if (readers > 1 && loadMapped(clean, shouldClear)) {
+        return clean;
+    }
     for (MutationLog::iterator it(mlog.begin()); it != mlog.end(); ++it) {
-        const MutationLogEntry *le = *it;
-        ++itemsSeen[le->type()];
-        clean = false;
-
-        switch (le->type()) {
-        case ML_DEL:
-            // FALLTHROUGH
-        case ML_NEW:
-            if (vbid_set.find(le->vbucket()) != vbid_set.end()) {
-                loading[le->vbucket()][le->key()] = std::make_pair(le->rowid(), le->type());
-            }
-            break;
-        case ML_COMMIT2: {
-            clean = true;
-            for (std::set<uint16_t>::iterator vit(shouldClear.begin()); vit != shouldClear.end(); ++vit) {
-                committed[*vit].clear();
-            }
-            shouldClear.clear();
-
-            for (std::set<uint16_t>::const_iterator vit = vbid_set.begin(); vit != vbid_set.end(); ++vit) {
-                uint16_t vb(*vit);
-
-                unordered_map<std::string, mutation_log_event_t>::iterator copyit2;
-                for (copyit2 = loading[vb].begin();
-                     copyit2 != loading[vb].end();
-                     ++copyit2) {
-
-                    mutation_log_event_t t = copyit2->second;
-
-                    switch (t.second) {
-                    case ML_NEW:
-                        committed[vb][copyit2->first] = t.first;
-                        break;
-                    case ML_DEL:
-                        committed[vb].erase(copyit2->first);
-                        break;
-                    default:
-                        abort();
-                    }
+        clean = processEntry(*it, shouldClear);
+    }
+    return clean;
+}
+
+/**
+ * Replay one entry.
+ *
+ * @return true if the entry committed everything before it
+ */
+bool MutationLogHarvester::processEntry(const MutationLogEntry *le,
+                                        std::set<uint16_t> &shouldClear) {
+    bool clean(false);
+    ++itemsSeen[le->type()];
+
+    switch (le->type()) {
+    case ML_DEL:
+        // FALLTHROUGH
+    case ML_NEW:
+        if (vbid_set.find(le->vbucket()) != vbid_set.end()) {
+            loading[le->vbucket()][le->key()] = std::make_pair(le->rowid(), le->type());
+        }
+        break;
+    case ML_COMMIT2: {
+        clean = true;
+        for (std::set<uint16_t>::iterator vit(shouldClear.begin()); vit != shouldClear.end(); ++vit) {
+            committed[*vit].clear();
+        }
+        shouldClear.clear();
+
+        for (std::set<uint16_t>::const_iterator vit = vbid_set.begin(); vit != vbid_set.end(); ++vit) {
+            uint16_t vb(*vit);
+
+            unordered_map<std::string, mutation_log_event_t>::iterator copyit2;
+            for (copyit2 = loading[vb].begin();
+                 copyit2 != loading[vb].end();
+                 ++copyit2) {
+
+                mutation_log_event_t t = copyit2->second;
+
+                switch (t.second) {
+                case ML_NEW:
+                    committed[vb][copyit2->first] = t.first;
+                    break;
+                case ML_DEL:
+                    committed[vb].erase(copyit2->first);
+                    break;
+                default:
+                    abort();
                 }
             }
         }
-            loading.clear();
-            break;
-        case ML_COMMIT1:
-            // nothing in particular
-            break;
-        case ML_DEL_ALL:
-            if (vbid_set.find(le->vbucket()) != vbid_set.end()) {
-                loading[le->vbucket()].clear();
-                shouldClear.insert(le->vbucket());
-            }
-            break;
-        default:
-            abort();
+    }
+        loading.clear();
+        break;
+    case ML_COMMIT1:
+        // nothing in particular
+        break;
+    case ML_DEL_ALL:
+        if (vbid_set.find(le->vbucket()) != vbid_set.end()) {
+            loading[le->vbucket()].clear();
+            shouldClear.insert(le->vbucket());
         }
+        break;
+    default:
+        abort();
     }
     return clean;
 }
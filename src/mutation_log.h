@@ -47,9 +47,15 @@ const int MUTATION_LOG_COMPACTOR_FREQ(3600);
 
 const size_t MIN_LOG_HEADER_SIZE(4096);
 const uint8_t MUTATION_LOG_MAGIC(0x45);
-const size_t HEADER_RESERVED(4);
-const uint32_t LOG_VERSION(1);
+//! Blocks of this version start with 16 bits of a CRC32 and the entry count.
+const uint32_t LOG_VERSION_CRC16(1);
+const size_t HEADER_RESERVED_CRC16(4);
+//! Blocks of this version start with a CRC32C, the entry count and padding.
+const uint32_t LOG_VERSION(2);
+const size_t HEADER_RESERVED(8);
 const size_t LOG_ENTRY_BUF_SIZE(512);
+//! Blocks that can be filled while earlier ones are being written.
+const size_t LOG_WRITE_BUFFERS(4);
 const int DISABLED_FD(-3);
 
 const uint8_t SYNC_COMMIT_1(1);
@@ -71,6 +77,7 @@ public:
     }
 
     void set(uint32_t bs, uint32_t bc=1) {
+        _version = htonl(LOG_VERSION);
         _blockSize = htonl(bs);
         _blockCount = htonl(bc);
     }
@@ -96,6 +103,14 @@ public:
         return ntohl(_blockSize);
     }
 
+    /**
+     * Get the number of bytes in front of the entries of each block.
+     */
+    size_t blockHeaderSize() const {
+        return version() == LOG_VERSION_CRC16 ? HEADER_RESERVED_CRC16
+                                              : HEADER_RESERVED;
+    }
+
     uint32_t blockCount() const {
         return ntohl(_blockCount);
     }
@@ -289,10 +304,16 @@ private:
 
 std::ostream& operator <<(std::ostream &out, const MutationLogEntry &mle);
 
+class MutationLogWriter;
+
 
 /**
  * The MutationLog records major key events to allow ep-engine to more
  * quickly restore the server to its previous state upon restart.
+ *
+ * Full blocks are written by a thread of the log's own, so logging
+ * only waits for the disk when a commit is flushed or synced, and then
+ * only for the blocks up to the commit.
  */
 class MutationLog {
 public:
@@ -349,6 +370,15 @@ public:
 
     const std::string &getLogFile() const { return logPath; }
 
+    /**
+     * Verify the CRC of a block read back from this log.
+     *
+     * @param buf a block of getBlockSize() bytes
+     * @return the number of entries in the block
+     * @throws CRCReadException if the block is damaged
+     */
+    uint16_t checkBlock(const uint8_t *buf) const;
+
     /**
      * Open and initialize the log.
      *
@@ -484,16 +514,21 @@ public:
     Histogram<hrtime_t> flushTimeHisto;
     //! Sync time histogram.
     Histogram<hrtime_t> syncTimeHisto;
+    //! Block write time histogram.
+    Histogram<hrtime_t> writeTimeHisto;
     //! Size of the log
     Atomic<size_t> logSize;
 
 private:
+    friend class MutationLogHarvester;
+
     void needWriteAccess(void) {
         if (readOnly) {
             throw WriteException("Invalid access (file opened read only)");
         }
     }
     void writeEntry(MutationLogEntry *mle);
+    void queueBlock();
 
     void writeInitialBlock();
     void readInitialBlock();
@@ -513,6 +548,9 @@ private:
     uint8_t           *blockBuffer;
     uint8_t            syncConfig;
     bool               readOnly;
+    MutationLogWriter *writer;
+    //! Sequence number of the last block handed to the writer.
+    uint64_t           lastBlock;
 
     DISALLOW_COPY_AND_ASSIGN(MutationLog);
 };
@@ -550,7 +588,7 @@ class EventuallyPersistentEngine;
 class MutationLogHarvester {
 public:
     MutationLogHarvester(MutationLog &ml, EventuallyPersistentEngine *e = NULL) :
-        mlog(ml), engine(e)
+        mlog(ml), engine(e), readers(1)
     {
         memset(itemsSeen, 0, sizeof(itemsSeen));
     }
@@ -562,6 +600,16 @@ public:
         vbid_set.insert(vb);
     }
 
+    /**
+     * Set the number of threads checking blocks while loading.
+     *
+     * With more than one, the log is mapped into memory and its block
+     * CRCs are verified in parallel before the entries are replayed.
+     */
+    void setReaders(size_t n) {
+        readers = n;
+    }
+
     /**
      * Load the entries from the file.
      *
@@ -594,9 +642,14 @@ public:
 
 private:
 
+    bool loadMapped(bool &clean, std::set<uint16_t> &shouldClear);
+    bool processEntry(const MutationLogEntry *le,
+                      std::set<uint16_t> &shouldClear);
+
     MutationLog &mlog;
     EventuallyPersistentEngine *engine;
     std::set<uint16_t> vbid_set;
+    size_t readers;
 
     unordered_map<uint16_t, unordered_map<std::string, uint64_t> > committed;
     unordered_map<uint16_t, unordered_map<std::string, mutation_log_event_t> > loading;
@@ -112,6 +112,28 @@ void ObjectRegistry::onDeleteItem(Item *pItem)
    }
 }
 
+void ObjectRegistry::onCreateStoredValueFields(size_t size)
+{
+   EventuallyPersistentEngine *engine = th->get();
+   if (verifyEngine(engine)) {
+       EPStats &stats = engine->getEpStats();
+       stats.memOverhead.incr(size);
+       stats.numExternalFields.incr(1);
+       assert(stats.memOverhead.get() < GIGANTOR);
+   }
+}
+
+void ObjectRegistry::onDeleteStoredValueFields(size_t size)
+{
+   EventuallyPersistentEngine *engine = th->get();
+   if (verifyEngine(engine)) {
+       EPStats &stats = engine->getEpStats();
+       stats.memOverhead.decr(size);
+       stats.numExternalFields.decr(1);
+       assert(stats.memOverhead.get() < GIGANTOR);
+   }
+}
+
 EventuallyPersistentEngine *ObjectRegistry::getCurrentEngine() {
     return th->get();
 }
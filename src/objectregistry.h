@@ -19,8 +19,11 @@
 
 #include "config.h"
 
+#include "atomic.h"
+
 class EventuallyPersistentEngine;
 class Blob;
+class Item;
 class QueuedItem;
 
 class ObjectRegistry {
@@ -34,6 +37,9 @@ public:
     static void onCreateItem(Item *pItem);
     static void onDeleteItem(Item *pItem);
 
+    static void onCreateStoredValueFields(size_t size);
+    static void onDeleteStoredValueFields(size_t size);
+
     static EventuallyPersistentEngine *getCurrentEngine();
 
     static EventuallyPersistentEngine *onSwitchThread(EventuallyPersistentEngine *engine,
@@ -0,0 +1,148 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_SHARDED_COUNTER_H_
+#define SRC_SHARDED_COUNTER_H_ 1
+
+#include "config.h"
+
+#include "atomic.h"
+#include "common.h"
+
+//! Number of slots a ShardedCounter spreads its updates over.
+#define COUNTER_SHARDS 16
+//! Assumed size of a cache line.
+#define COUNTER_CACHE_LINE 64
+
+/**
+ * Assigns the calling thread the counter slot it updates.
+ *
+ * Threads are handed out slots round robin the first time they update
+ * any ShardedCounter and keep using the same slot index for all of
+ * them.
+ */
+class CounterShard {
+public:
+    static size_t current() {
+        static ThreadLocal<void*> slot;
+        static Atomic<size_t> nextSlot;
+        size_t rv = reinterpret_cast<size_t>(slot.get());
+        if (rv == 0) {
+            rv = (nextSlot++ % COUNTER_SHARDS) + 1;
+            slot.set(reinterpret_cast<void*>(rv));
+        }
+        return rv - 1;
+    }
+};
+
+/**
+ * A statistics counter for values updated far more often than read.
+ *
+ * Instead of a single Atomic every thread updates its own slot, each
+ * on a cache line of its own, so threads bumping the same counter do
+ * not keep stealing the line from each other.  get() adds all the
+ * slots up, so it is meant for stats requests rather than hot paths.
+ *
+ * T must be an unsigned integer type: a slot only decremented by a
+ * thread wraps around and cancels out when added up with the others.
+ */
+template <typename T>
+class ShardedCounter {
+public:
+
+    ShardedCounter() {}
+
+    /**
+     * Get the value of the counter, adding up all the slots.
+     */
+    T get() const {
+        T rv = total.get();
+        for (size_t i = 0; i < COUNTER_SHARDS; ++i) {
+            rv += slots[i].value.get();
+        }
+        return rv;
+    }
+
+    /**
+     * Set the counter.  Updates racing with this may be lost.
+     */
+    void set(const T &newValue) {
+        for (size_t i = 0; i < COUNTER_SHARDS; ++i) {
+            slots[i].value.set(0);
+        }
+        total.set(newValue);
+    }
+
+    void incr(const T &by) {
+        add(by);
+    }
+
+    void decr(const T &by) {
+        add(static_cast<T>(0) - by);
+    }
+
+    void operator ++() {
+        add(1);
+    }
+
+    void operator ++(int) {
+        add(1);
+    }
+
+    void operator --() {
+        add(static_cast<T>(0) - 1);
+    }
+
+    void operator --(int) {
+        add(static_cast<T>(0) - 1);
+    }
+
+    void operator +=(const T &by) {
+        add(by);
+    }
+
+    void operator -=(const T &by) {
+        add(static_cast<T>(0) - by);
+    }
+
+    void operator =(const T &newValue) {
+        set(newValue);
+    }
+
+    operator T() const {
+        return get();
+    }
+
+private:
+
+    void add(T delta) {
+        slots[CounterShard::current()].value += delta;
+    }
+
+    struct Slot {
+        Atomic<T> value;
+        char padding[COUNTER_CACHE_LINE - sizeof(Atomic<T>)];
+    };
+
+    Atomic<T> total;
+    char padding[COUNTER_CACHE_LINE - sizeof(Atomic<T>)];
+    Slot slots[COUNTER_SHARDS];
+
+    DISALLOW_COPY_AND_ASSIGN(ShardedCounter);
+};
+
+#endif  // SRC_SHARDED_COUNTER_H_
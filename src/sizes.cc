@@ -67,11 +67,13 @@ int main(int, char **) {
 
     display("GIGANTOR", GIGANTOR);
     display("Stored Value", sizeof(StoredValue));
+    display("Stored Value Fields", sizeof(StoredValueFields));
 
     display("Stored Value Factory", sizeof(StoredValueFactory));
     display("Blob", sizeof(Blob));
     display("value_t", sizeof(value_t));
     display("HashTable", sizeof(HashTable));
+    display("StoredValueGroup", sizeof(StoredValueGroup));
     display("Item", sizeof(Item));
     display("QueuedItem", sizeof(QueuedItem));
     display("VBucket", sizeof(VBucket));
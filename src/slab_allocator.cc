@@ -0,0 +1,261 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <cassert>
+
+#include "objectregistry.h"
+#include "slab_allocator.h"
+
+Atomic<bool>   SlabAllocator::enabled;
+Atomic<size_t> SlabAllocator::reservedBytes;
+Atomic<size_t> SlabAllocator::freeBytes;
+Atomic<size_t> SlabAllocator::cachedBytes;
+
+//! Chunk sizes are multiples of this (and chunks aligned to it).
+static const size_t CHUNK_ALIGN(16);
+//! Upper bound of the number of size classes.
+static const size_t MAX_CLASSES(64);
+//! Memory a thread cache may hold per size class.
+static const size_t THREAD_CACHE_BYTES(64 * 1024);
+
+/**
+ * A free chunk; the link lives in the chunk itself.
+ */
+struct FreeChunk {
+    FreeChunk *next;
+};
+
+/**
+ * The shared state of a single size class.
+ */
+class SlabClass {
+public:
+
+    SlabClass() : chunkSize(0), cacheLimit(0), freeList(NULL),
+                  carve(NULL), carveEnd(NULL) { }
+
+    void setChunkSize(size_t s) {
+        chunkSize = s;
+        cacheLimit = std::max(static_cast<size_t>(8), THREAD_CACHE_BYTES / s);
+    }
+
+    /**
+     * Move up to n free chunks onto the given list.
+     *
+     * @return the number of chunks moved (0 if out of memory)
+     */
+    size_t take(FreeChunk **head, size_t n) {
+        SpinLockHolder lh(&lock);
+        size_t moved = 0;
+        for (; moved < n; ++moved) {
+            FreeChunk *c = freeList;
+            if (c) {
+                freeList = c->next;
+            } else {
+                if (carve == carveEnd && !newSlab()) {
+                    break;
+                }
+                c = reinterpret_cast<FreeChunk*>(carve);
+                carve += chunkSize;
+            }
+            c->next = *head;
+            *head = c;
+        }
+        SlabAllocator::freeBytes.decr(moved * chunkSize);
+        SlabAllocator::cachedBytes.incr(moved * chunkSize);
+        return moved;
+    }
+
+    /**
+     * Give back a list of n free chunks from first to last.
+     */
+    void give(FreeChunk *first, FreeChunk *last, size_t n) {
+        SpinLockHolder lh(&lock);
+        last->next = freeList;
+        freeList = first;
+        SlabAllocator::cachedBytes.decr(n * chunkSize);
+        SlabAllocator::freeBytes.incr(n * chunkSize);
+    }
+
+    size_t     chunkSize;
+    size_t     cacheLimit;
+
+private:
+
+    bool newSlab() {
+        // The slab isn't any particular engine's memory.
+        EventuallyPersistentEngine *engine =
+            ObjectRegistry::onSwitchThread(NULL, true);
+        char *slab = static_cast<char*>(malloc(SlabAllocator::SLAB_SIZE));
+        ObjectRegistry::onSwitchThread(engine);
+        if (slab == NULL) {
+            return false;
+        }
+        size_t nchunks = SlabAllocator::SLAB_SIZE / chunkSize;
+        carve = slab;
+        carveEnd = slab + nchunks * chunkSize;
+        SlabAllocator::reservedBytes.incr(SlabAllocator::SLAB_SIZE);
+        SlabAllocator::freeBytes.incr(nchunks * chunkSize);
+        return true;
+    }
+
+    SpinLock   lock;
+    FreeChunk *freeList;
+    char      *carve;
+    char      *carveEnd;
+};
+
+/**
+ * A thread's private freelists.
+ */
+struct ThreadCache {
+    FreeChunk *heads[MAX_CLASSES];
+    size_t     counts[MAX_CLASSES];
+};
+
+static SlabClass slabClasses[MAX_CLASSES];
+static size_t numClasses;
+//! Size class of each request size, indexed by len / CHUNK_ALIGN.
+static uint8_t classOfSize[SlabAllocator::MAX_CHUNK_SIZE / CHUNK_ALIGN + 1];
+
+static void flushThreadCache(ThreadCache *tc, size_t cls, size_t keep) {
+    size_t n = tc->counts[cls] - keep;
+    if (n == 0) {
+        return;
+    }
+    FreeChunk *first = tc->heads[cls];
+    FreeChunk *last = first;
+    for (size_t i = 1; i < n; ++i) {
+        last = last->next;
+    }
+    tc->heads[cls] = last->next;
+    tc->counts[cls] = keep;
+    slabClasses[cls].give(first, last, n);
+}
+
+extern "C" {
+    static void destroyThreadCache(void *p) {
+        ThreadCache *tc = static_cast<ThreadCache*>(p);
+        for (size_t i = 0; i < numClasses; ++i) {
+            flushThreadCache(tc, i, 0);
+        }
+        free(tc);
+    }
+}
+
+static ThreadLocal<ThreadCache*> *threadCaches;
+
+/**
+ * Sets up the size classes: 32 bytes and up, each about 1.25 times
+ * the previous one.
+ */
+class SlabClassInstaller {
+public:
+    SlabClassInstaller() {
+        size_t size = 32;
+        size_t len = 0;
+        while (true) {
+            assert(numClasses < MAX_CLASSES);
+            slabClasses[numClasses].setChunkSize(size);
+            for (; len <= size && len <= SlabAllocator::MAX_CHUNK_SIZE;
+                 len += CHUNK_ALIGN) {
+                classOfSize[len / CHUNK_ALIGN] = static_cast<uint8_t>(numClasses);
+            }
+            ++numClasses;
+            if (size >= SlabAllocator::MAX_CHUNK_SIZE) {
+                break;
+            }
+            size_t next = size + size / 4;
+            next = (next + CHUNK_ALIGN - 1) & ~(CHUNK_ALIGN - 1);
+            size = std::min(next, SlabAllocator::MAX_CHUNK_SIZE);
+        }
+        threadCaches = new ThreadLocal<ThreadCache*>(destroyThreadCache);
+    }
+} slabClassInstaller;
+
+static inline size_t classFor(size_t len) {
+    return classOfSize[(len + CHUNK_ALIGN - 1) / CHUNK_ALIGN];
+}
+
+static ThreadCache *getThreadCache() {
+    ThreadCache *tc = threadCaches->get();
+    if (tc == NULL) {
+        tc = static_cast<ThreadCache*>(calloc(1, sizeof(ThreadCache)));
+        if (tc != NULL) {
+            threadCaches->set(tc);
+        }
+    }
+    return tc;
+}
+
+void *SlabAllocator::allocate(size_t len) {
+    if (len > MAX_CHUNK_SIZE || !enabled.get()) {
+        return NULL;
+    }
+    ThreadCache *tc = getThreadCache();
+    if (tc == NULL) {
+        return NULL;
+    }
+
+    size_t cls = classFor(len);
+    SlabClass &sc = slabClasses[cls];
+    if (tc->counts[cls] == 0) {
+        tc->counts[cls] = sc.take(&tc->heads[cls], sc.cacheLimit / 2);
+        if (tc->counts[cls] == 0) {
+            return NULL;
+        }
+    }
+
+    FreeChunk *c = tc->heads[cls];
+    tc->heads[cls] = c->next;
+    --tc->counts[cls];
+    cachedBytes.decr(sc.chunkSize);
+    ObjectRegistry::memoryAllocated(sc.chunkSize);
+    return c;
+}
+
+void SlabAllocator::deallocate(void *p, size_t len) {
+    assert(len <= MAX_CHUNK_SIZE);
+    size_t cls = classFor(len);
+    SlabClass &sc = slabClasses[cls];
+    ObjectRegistry::memoryDeallocated(sc.chunkSize);
+
+    FreeChunk *c = static_cast<FreeChunk*>(p);
+    ThreadCache *tc = getThreadCache();
+    if (tc == NULL) {
+        c->next = NULL;
+        cachedBytes.incr(sc.chunkSize);
+        sc.give(c, c, 1);
+        return;
+    }
+
+    c->next = tc->heads[cls];
+    tc->heads[cls] = c;
+    cachedBytes.incr(sc.chunkSize);
+    if (++tc->counts[cls] > sc.cacheLimit) {
+        flushThreadCache(tc, cls, sc.cacheLimit / 2);
+    }
+}
+
+size_t SlabAllocator::getChunkSize(size_t len) {
+    if (len > MAX_CHUNK_SIZE) {
+        return len;
+    }
+    return slabClasses[classFor(len)].chunkSize;
+}
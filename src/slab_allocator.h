@@ -0,0 +1,108 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_SLAB_ALLOCATOR_H_
+#define SRC_SLAB_ALLOCATOR_H_ 1
+
+#include "config.h"
+
+#include <stdlib.h>
+
+#include "atomic.h"
+
+/**
+ * Size-classed slab allocator for StoredValue headers and Blob bodies.
+ *
+ * Requests of up to MAX_CHUNK_SIZE bytes are rounded up to one of the
+ * size classes and carved out of SLAB_SIZE slabs.  Freed chunks go to
+ * a per-thread cache for their class, which trades batches of chunks
+ * with the class' shared freelist so the shared lock is rarely taken.
+ * Slab memory is never handed back to the system.
+ *
+ * Chunk sizes are reported to the current engine's memory tracking
+ * through ObjectRegistry as they are handed out and returned; the
+ * slabs themselves are not attributed to any engine.
+ */
+class SlabAllocator {
+public:
+
+    //! The largest request served from slabs.
+    static const size_t MAX_CHUNK_SIZE = 16384;
+
+    //! The amount of memory carved into chunks at a time.
+    static const size_t SLAB_SIZE = 1024 * 1024;
+
+    /**
+     * Allocate memory for an object.
+     *
+     * @param len the number of bytes needed
+     * @return the memory, or NULL if the allocator is disabled or the
+     *         request is too large; the caller is expected to fall back
+     *         to ::operator new then
+     */
+    static void *allocate(size_t len);
+
+    /**
+     * Return memory obtained from allocate().
+     *
+     * @param p the memory
+     * @param len the number of bytes that were requested
+     */
+    static void deallocate(void *p, size_t len);
+
+    /**
+     * Get the number of bytes actually used to serve a request.
+     */
+    static size_t getChunkSize(size_t len);
+
+    /**
+     * Enable or disable serving new requests from slabs.  Memory
+     * already handed out may still be returned either way.
+     */
+    static void setEnabled(bool to) {
+        enabled.set(to);
+    }
+
+    static bool isEnabled() {
+        return enabled.get();
+    }
+
+    //! Bytes of slabs allocated from the system.
+    static size_t getReservedBytes() {
+        return reservedBytes.get();
+    }
+
+    //! Bytes of chunks free in the shared freelists and slab tails.
+    static size_t getFreeBytes() {
+        return freeBytes.get();
+    }
+
+    //! Bytes of free chunks held in per-thread caches.
+    static size_t getCachedBytes() {
+        return cachedBytes.get();
+    }
+
+private:
+    friend class SlabClass;
+
+    static Atomic<bool>   enabled;
+    static Atomic<size_t> reservedBytes;
+    static Atomic<size_t> freeBytes;
+    static Atomic<size_t> cachedBytes;
+};
+
+#endif  // SRC_SLAB_ALLOCATOR_H_
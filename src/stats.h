@@ -29,6 +29,7 @@
 #include "histo.h"
 #include "memory_tracker.h"
 #include "mutex.h"
+#include "sharded_counter.h"
 
 #ifndef DEFAULT_MAX_DATA_SIZE
 /* Something something something ought to be enough for anybody */
@@ -47,6 +48,7 @@ public:
                 dirtyAgeHisto(GrowingWidthGenerator<hrtime_t>(0, ONE_SECOND, 1.4), 25),
                 diskCommitHisto(GrowingWidthGenerator<hrtime_t>(0, ONE_SECOND, 1.4), 25),
                 mlogCompactorHisto(GrowingWidthGenerator<hrtime_t>(0, ONE_SECOND, 1.4), 25),
+                bgFetchBatchHisto(ExponentialGenerator<size_t>(1, 2), 25),
                 timingLog(NULL), maxDataSize(DEFAULT_MAX_DATA_SIZE) {}
 
     ~EPStats() {
@@ -111,7 +113,7 @@ public:
     //! Number of items persisted.
     Atomic<size_t> totalPersisted;
     //! Cumulative number of items added to the queue.
-    Atomic<size_t> totalEnqueued;
+    ShardedCounter<size_t> totalEnqueued;
     //! Number of new items created in the DB.
     Atomic<size_t> newItems;
     //! Number of items removed from the DB.
@@ -121,7 +123,7 @@ public:
     //! Number of times an item is not flushed due to the item's expiry
     Atomic<size_t> flushExpired;
     //! Number of times an object was expired on access.
-    Atomic<size_t> expired_access;
+    ShardedCounter<size_t> expired_access;
     //! Number of times an object was expired by pager.
     Atomic<size_t> expired_pager;
     //! Number of times we failed to start a transaction
@@ -155,14 +157,28 @@ public:
     Atomic<size_t> numValueEjects;
     //! Number of times a value could not be ejected
     Atomic<size_t> numFailedEjects;
+    //! Number of times a cold value was compressed in memory
+    Atomic<size_t> numValueCompressions;
+    //! Number of times a compressed value was accessed and decompressed
+    Atomic<size_t> numValueDecompressions;
+    //! Size of the values compressed in memory before compression
+    Atomic<size_t> valueCompressBytesIn;
+    //! Size of the values compressed in memory after compression
+    Atomic<size_t> valueCompressBytesOut;
+    //! Number of values currently held compressed in memory
+    Atomic<size_t> numCompressedValues;
+    //! Memory used by the values currently held compressed
+    Atomic<size_t> compressedValueSize;
     //! Number of times "Not my bucket" happened
-    Atomic<size_t> numNotMyVBuckets;
+    ShardedCounter<size_t> numNotMyVBuckets;
     //! Total size of stored objects.
     Atomic<size_t> currentSize;
     //! Total memory overhead to store values for resident keys.
     Atomic<size_t> totalValueSize;
     //! Amount of memory used to track items and what-not.
     Atomic<size_t> memOverhead;
+    //! Number of items whose fields were moved out of line.
+    Atomic<size_t> numExternalFields;
     //! The total amount of memory used by this bucket (From memory tracking)
     Atomic<size_t> totalMemory;
     //! True if the memory usage tracker is enabled.
@@ -197,7 +213,7 @@ public:
     Histogram<hrtime_t> pendingOpsHisto;
 
     //! Number of times background fetches occurred.
-    Atomic<size_t> bg_fetched;
+    ShardedCounter<size_t> bg_fetched;
     //! Number of times meta background fetches occurred.
     Atomic<size_t> bg_meta_fetched;
     //! Number of remaining bg fetch jobs.
@@ -276,11 +292,11 @@ public:
     Histogram<hrtime_t> tapBgLoadHisto;
 
     //! The number of get with meta operations
-    Atomic<size_t>  numOpsGetMeta;
+    ShardedCounter<size_t>  numOpsGetMeta;
     //! The number of set with meta operations
-    Atomic<size_t>  numOpsSetMeta;
+    ShardedCounter<size_t>  numOpsSetMeta;
     //! The number of delete with meta operations
-    Atomic<size_t>  numOpsDelMeta;
+    ShardedCounter<size_t>  numOpsDelMeta;
 
     //! The number of tiems the mutation log compactor is exectued
     Atomic<size_t> mlogCompactorRuns;
@@ -292,6 +308,10 @@ public:
     Atomic<hrtime_t> alogTime;
     //! The number of seconds that the last access scanner task took
     Atomic<rel_time_t> alogRuntime;
+    //! Bytes the last access scanner task wrote to the access log
+    Atomic<size_t> alogBytesWritten;
+    //! Bytes a full rewrite of the access log would have taken instead
+    Atomic<size_t> alogFullBytes;
 
     //! Histogram of queue processing dirty age.
     Histogram<hrtime_t> dirtyAgeHisto;
@@ -339,6 +359,9 @@ public:
     //! Histogram of wait_for_checkpoint_persistence command
     Histogram<hrtime_t> chkPersistenceHisto;
 
+    //! Time spent decompressing a cold value on access.
+    Histogram<hrtime_t> valueDecompressHisto;
+
     //
     // DB timers.
     //
@@ -367,6 +390,9 @@ public:
     //! Historgram of batch reads
     Histogram<hrtime_t> getMultiHisto;
 
+    //! Histogram of the number of items read by a batch read
+    Histogram<size_t> bgFetchBatchHisto;
+
     //! Reset all stats to reasonable values.
     void reset() {
         tooYoung.set(0);
@@ -378,6 +404,10 @@ public:
         itemsRemovedFromCheckpoints.set(0);
         numValueEjects.set(0);
         numFailedEjects.set(0);
+        numValueCompressions.set(0);
+        numValueDecompressions.set(0);
+        valueCompressBytesIn.set(0);
+        valueCompressBytesOut.set(0);
         numNotMyVBuckets.set(0);
         io_num_read.set(0);
         io_num_write.set(0);
@@ -426,6 +456,7 @@ public:
         notifyIOHisto.reset();
         getStatsCmdHisto.reset();
         chkPersistenceHisto.reset();
+        valueDecompressHisto.reset();
         diskInsertHisto.reset();
         diskUpdateHisto.reset();
         diskDelHisto.reset();
@@ -436,6 +467,7 @@ public:
         dirtyAgeHisto.reset();
         mlogCompactorHisto.reset();
         getMultiHisto.reset();
+        bgFetchBatchHisto.reset();
     }
 
     // Used by stats logging infrastructure.
@@ -52,6 +52,12 @@ void add_casted_stat(const char *k, const Atomic<T> &v,
     add_casted_stat(k, v.get(), add_stat, cookie);
 }
 
+template <typename T>
+void add_casted_stat(const char *k, const ShardedCounter<T> &v,
+                            ADD_STAT add_stat, const void *cookie) {
+    add_casted_stat(k, v.get(), add_stat, cookie);
+}
+
 /// @cond DETAILS
 /**
  * Convert a histogram into a bunch of calls to add stats.
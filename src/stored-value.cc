@@ -18,8 +18,11 @@
 #include "config.h"
 
 #include <cassert>
+#include <algorithm>
 #include <limits>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include "stored-value.h"
 
@@ -27,14 +30,33 @@
 #define DEFAULT_HT_SIZE 1531
 #endif
 
+/**
+ * Pick the per-process key hash seed so bucket placement can't be
+ * predicted (and deliberately skewed) from the outside.
+ */
+static uint64_t generateHashSeed() {
+    uint64_t seed = static_cast<uint64_t>(gethrtime());
+    seed ^= static_cast<uint64_t>(getpid()) << 32;
+    seed ^= reinterpret_cast<uintptr_t>(&seed);
+    // splitmix64 finalizer
+    seed = (seed ^ (seed >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    seed = (seed ^ (seed >> 27)) * 0x94d049bb133111ebULL;
+    return seed ^ (seed >> 31);
+}
+
 size_t HashTable::defaultNumBuckets = DEFAULT_HT_SIZE;
 size_t HashTable::defaultNumLocks = 193;
+hash_policy_t HashTable::defaultHashPolicy = HASH_XX;
+bucket_layout_t HashTable::defaultBucketLayout = CHAINED_BUCKETS;
+const uint64_t HashTable::hashSeed = generateHashSeed();
 double StoredValue::mutation_mem_threshold = 0.9;
 const int64_t StoredValue::state_id_cleared = -1;
 const int64_t StoredValue::state_id_pending = -2;
 const int64_t StoredValue::state_deleted_key = -3;
 const int64_t StoredValue::state_non_existent_key = -4;
 const int64_t StoredValue::state_temp_init = -5;
+const size_t StoredValue::ID_RESERVE;
+const size_t StoredValue::SEQNO_RESERVE;
 
 static ssize_t prime_size_table[] = {
     3, 7, 13, 23, 47, 97, 193, 383, 769, 1531, 3067, 6143, 12289, 24571, 49157,
@@ -50,6 +72,7 @@ bool StoredValue::ejectValue(EPStats &stats, HashTable &ht) {
         blobval uval;
         uval.len = valLength();
         value_t sp(Blob::New(uval.chlen, sizeof(uval)));
+        uncountCompressed(stats);
         resident = false;
         value = sp;
         size_t newsize = size();
@@ -78,6 +101,92 @@ bool StoredValue::ejectValue(EPStats &stats, HashTable &ht) {
     return false;
 }
 
+/**
+ * Decompress a value held compressed by a StoredValue.
+ */
+static Blob *inflate(const value_t &value) {
+    size_t len = Compressor::getDecompressedLength(value->getData(),
+                                                   value->length());
+    Blob *blob = Blob::New(len);
+    bool inflated = Compressor::decompress(value->getData(), value->length(),
+                                           const_cast<char*>(blob->getData()),
+                                           len);
+    // We compressed it ourselves, so it can't be corrupt.
+    assert(inflated);
+    (void)inflated;
+    return blob;
+}
+
+bool StoredValue::compressValue(EPStats &stats, HashTable &ht,
+                                size_t minSize) {
+    if (compressed || !eligibleForEviction() || value->length() < minSize) {
+        return false;
+    }
+
+    size_t oldsize = size();
+    size_t old_valsize = value->length();
+    std::vector<char> buf(old_valsize - old_valsize / 8);
+    size_t n = Compressor::compress(value->getData(), old_valsize,
+                                    &buf[0], buf.size());
+    if (n == 0) {
+        return false;
+    }
+    value = value_t(Blob::New(&buf[0], n));
+    compressed = true;
+    valueResized(stats, ht, oldsize, old_valsize);
+
+    ++stats.numValueCompressions;
+    stats.valueCompressBytesIn.incr(old_valsize);
+    stats.valueCompressBytesOut.incr(n);
+    ++stats.numCompressedValues;
+    stats.compressedValueSize.incr(n);
+    return true;
+}
+
+bool StoredValue::decompressValue(EPStats &stats, HashTable &ht) {
+    if (!compressed) {
+        return false;
+    }
+
+    hrtime_t start = gethrtime();
+    size_t oldsize = size();
+    size_t old_valsize = value->length();
+    Blob *blob = inflate(value);
+    uncountCompressed(stats);
+    value = value_t(blob);
+    valueResized(stats, ht, oldsize, old_valsize);
+
+    ++stats.numValueDecompressions;
+    stats.valueDecompressHisto.add((gethrtime() - start) / 1000);
+    return true;
+}
+
+value_t StoredValue::getUncompressedValue() const {
+    if (!compressed) {
+        return value;
+    }
+    return value_t(inflate(value));
+}
+
+void StoredValue::valueResized(EPStats &stats, HashTable &ht,
+                               size_t oldsize, size_t old_valsize) {
+    size_t newsize = size();
+    size_t new_valsize = value->length();
+    if (oldsize < newsize) {
+        increaseCacheSize(ht, newsize - oldsize);
+    } else if (newsize < oldsize) {
+        reduceCacheSize(ht, oldsize - newsize);
+    }
+    // Add or substract the key/meta data overhead differenece.
+    size_t old_keymeta_overhead = (oldsize - old_valsize);
+    size_t new_keymeta_overhead = (newsize - new_valsize);
+    if (old_keymeta_overhead < new_keymeta_overhead) {
+        increaseCurrentSize(stats, new_keymeta_overhead - old_keymeta_overhead);
+    } else if (new_keymeta_overhead < old_keymeta_overhead) {
+        reduceCurrentSize(stats, old_keymeta_overhead - new_keymeta_overhead);
+    }
+}
+
 void StoredValue::referenced() {
     if (nru > MIN_NRU_VALUE) {
         --nru;
@@ -109,9 +218,6 @@ bool StoredValue::unlocked_restoreValue(Item *itm, EPStats &stats,
     // this as an unexpected size change.
     if (getCas() == 0) {
         cas = itm->getCas();
-        flags = itm->getFlags();
-        exptime = itm->getExptime();
-        seqno = itm->getSeqno();
         setValue(*itm, stats, ht, true);
         if (!isResident()) {
             --ht.numNonResidentItems;
@@ -168,17 +274,62 @@ mutation_type_t HashTable::insert(const Item &itm, bool eject, bool partial) {
     assert(itm.getCas() != static_cast<uint64_t>(-1));
 
     int bucket_num(0);
-    LockHolder lh = getLockedBucket(itm.getKey(), &bucket_num);
-    StoredValue *v = unlocked_find(itm.getKey(), bucket_num, true, false);
+    uint8_t tag(0);
+    LockHolder lh = getLockedBucket(itm.getKey(), &bucket_num, &tag);
+    return unlocked_insert(itm, eject, partial, bucket_num, tag);
+}
+
+void HashTable::insertMulti(const std::vector<Item*> &items, bool eject,
+                            bool partial,
+                            std::vector<mutation_type_t> &results) {
+    assert(isActive());
+    results.assign(items.size(), NOT_FOUND);
+
+    // Items of the same stripe keep their order, so a key loaded twice
+    // fails the same way it would one at a time.
+    std::vector<std::pair<int, size_t> > order;
+    std::vector<uint64_t> hashes;
+    order.reserve(items.size());
+    hashes.reserve(items.size());
+    for (size_t i = 0; i < items.size(); ++i) {
+        assert(items[i]->getCas() != static_cast<uint64_t>(-1));
+        hashes.push_back(hash(items[i]->getKey()));
+        order.push_back(std::make_pair(getLockForHash(hashes[i]), i));
+    }
+    std::sort(order.begin(), order.end());
+
+    size_t i = 0;
+    while (i < order.size()) {
+        int bucket_num(0);
+        LockHolder lh = getLockedBucket(hashes[order[i].second], &bucket_num);
+        int lock_num = order[i].first;
+        for (; i < order.size() && order[i].first == lock_num; ++i) {
+            size_t idx = order[i].second;
+            if (!StoredValue::hasAvailableSpace(stats, *items[idx])) {
+                results[idx] = NOMEM;
+                continue;
+            }
+            bucket_num = getBucketForLockedHash(hashes[idx]);
+            results[idx] = unlocked_insert(*items[idx], eject, partial,
+                                           bucket_num,
+                                           KeyHash::tag(hashes[idx]));
+        }
+    }
+}
+
+mutation_type_t HashTable::unlocked_insert(const Item &itm, bool eject,
+                                           bool partial, int bucket_num,
+                                           uint8_t tag) {
+    StoredValue *v = unlocked_find(itm.getKey(), bucket_num, tag, true, false);
 
     if (v == NULL) {
-        v = valFact(itm, values[bucket_num], *this);
+        v = valFact(itm, NULL, *this);
         v->markClean();
         if (partial) {
             v->resident = false;
             ++numNonResidentItems;
         }
-        values[bucket_num] = v;
+        link(v, bucket_num, tag);
         ++numItems;
     } else {
         if (partial) {
@@ -190,9 +341,6 @@ mutation_type_t HashTable::insert(const Item &itm, bool eject, bool partial) {
         if (v->getCas() != itm.getCas()) {
             if (v->getCas() == 0) {
                 v->cas = itm.getCas();
-                v->flags = itm.getFlags();
-                v->exptime = itm.getExptime();
-                v->seqno = itm.getSeqno();
             } else {
                 return INVALID_CAS;
             }
@@ -220,7 +368,7 @@ bool StoredValue::unlocked_restoreMeta(Item *itm, ENGINE_ERROR_CODE status) {
         assert(0 == itm->getValue()->length());
         setSeqno(itm->getSeqno());
         setCas(itm->getCas());
-        flags = itm->getFlags();
+        setFlags(itm->getFlags());
         setExptime(itm->getExptime());
         setStoredValueState(state_deleted_key);
         return true;
@@ -264,6 +412,118 @@ void HashTable::setDefaultNumLocks(size_t to) {
     }
 }
 
+/**
+ * Set the default key hash function.
+ */
+void HashTable::setDefaultHashPolicy(const std::string &name) {
+    if (name.compare("xxhash") == 0) {
+        defaultHashPolicy = HASH_XX;
+    } else if (name.compare("djb") == 0) {
+        defaultHashPolicy = HASH_DJB;
+    }
+}
+
+/**
+ * Set the default bucket layout.
+ */
+void HashTable::setDefaultBucketLayout(const std::string &name) {
+    if (name.compare("chained") == 0) {
+        defaultBucketLayout = CHAINED_BUCKETS;
+    } else if (name.compare("grouped") == 0) {
+        defaultBucketLayout = GROUPED_BUCKETS;
+    }
+}
+
+HashBucketArray::HashBucketArray(size_t s, bucket_layout_t l)
+    : size(s), layout(l), values(NULL), groups(NULL), groupsAlloc(NULL) {
+    if (layout == GROUPED_BUCKETS) {
+        // Align the groups so each one sits on a single cache line.
+        groupsAlloc = calloc(1, size * sizeof(StoredValueGroup) + CACHE_LINE_SIZE);
+        if (groupsAlloc) {
+            uintptr_t p = reinterpret_cast<uintptr_t>(groupsAlloc);
+            p = (p + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1);
+            groups = reinterpret_cast<StoredValueGroup*>(p);
+        }
+    } else {
+        values = static_cast<StoredValue**>(calloc(size, sizeof(StoredValue*)));
+    }
+}
+
+HashBucketArray::~HashBucketArray() {
+    free(values);
+    free(groupsAlloc);
+}
+
+HashBucketArray::Iterator::Iterator(HashBucketArray &a, int bucket_num)
+    : slots(NULL), slot(0), used(0), chain(NULL) {
+    if (a.layout == GROUPED_BUCKETS) {
+        StoredValueGroup &g = a.groups[bucket_num];
+        slots = g.slots;
+        used = g.used;
+        chain = g.overflow;
+    } else {
+        chain = a.values[bucket_num];
+    }
+}
+
+void HashBucketArray::unlink(StoredValue *v, int bucket_num) {
+    StoredValue **p;
+    if (layout == GROUPED_BUCKETS) {
+        StoredValueGroup &g = groups[bucket_num];
+        for (size_t i = 0; i < g.used; ++i) {
+            if (g.slots[i] == v) {
+                // Keep the slots dense by moving the last one into the
+                // hole.  The overflow chain stays where it is, as the
+                // tags of its keys would take hashing them again; the
+                // slots fill up again from the next links.
+                --g.used;
+                g.slots[i] = g.slots[g.used];
+                g.tags[i] = g.tags[g.used];
+                g.slots[g.used] = NULL;
+                g.tags[g.used] = 0;
+                return;
+            }
+        }
+        p = &g.overflow;
+    } else {
+        p = &values[bucket_num];
+    }
+
+    while (*p) {
+        if (*p == v) {
+            *p = v->next;
+            v->next = NULL;
+            return;
+        }
+        p = &(*p)->next;
+    }
+    abort();
+}
+
+StoredValue *HashBucketArray::pop(int bucket_num) {
+    StoredValue **p;
+    if (layout == GROUPED_BUCKETS) {
+        StoredValueGroup &g = groups[bucket_num];
+        if (!g.overflow && g.used > 0) {
+            --g.used;
+            StoredValue *v = g.slots[g.used];
+            g.slots[g.used] = NULL;
+            g.tags[g.used] = 0;
+            return v;
+        }
+        p = &g.overflow;
+    } else {
+        p = &values[bucket_num];
+    }
+
+    StoredValue *v = *p;
+    if (v) {
+        *p = v->next;
+        v->next = NULL;
+    }
+    return v;
+}
+
 HashTableStatVisitor HashTable::clear(bool deactivate) {
     HashTableStatVisitor rv;
 
@@ -275,12 +535,25 @@ HashTableStatVisitor HashTable::clear(bool deactivate) {
     if (deactivate) {
         setActiveState(false);
     }
-    for (int i = 0; i < (int)size; i++) {
-        while (values[i]) {
-            StoredValue *v = values[i];
-            rv.visit(v);
-            values[i] = v->next;
-            delete v;
+    for (size_t l = 0; l < n_locks; ++l) {
+        HashTableStripe &st = stripes[l];
+        StoredValue *v;
+        if (st.oldBuckets) {
+            for (size_t i = st.migrated; i < st.oldBuckets->getSize(); ++i) {
+                while ((v = st.oldBuckets->pop(i)) != NULL) {
+                    rv.visit(v);
+                    v->uncountCompressed(stats);
+                    StoredValueFactory::destroy(v);
+                }
+            }
+            releaseOldBuckets(st);
+        }
+        for (size_t i = 0; i < st.buckets->getSize(); ++i) {
+            while ((v = st.buckets->pop(i)) != NULL) {
+                rv.visit(v);
+                v->uncountCompressed(stats);
+                StoredValueFactory::destroy(v);
+            }
         }
     }
 
@@ -292,6 +565,7 @@ HashTableStatVisitor HashTable::clear(bool deactivate) {
     numNonResidentItems.set(0);
     memSize.set(0);
     cacheSize.set(0);
+    metaDataMemory.set(0);
 
     return rv;
 }
@@ -305,54 +579,122 @@ void HashTable::resize(size_t newSize) {
         return;
     }
 
-    // Don't resize to the same size, either.
-    if (newSize == size) {
+    // Don't resize to the same size, either, nor below one bucket per
+    // lock.
+    if (newSize == size || newSize < n_locks) {
         return;
     }
 
-    MultiLockHolder mlh(mutexes, n_locks);
-    if (visitors.get() > 0) {
-        // Do not allow a resize while any visitors are actually
-        // processing.  The next attempt will have to pick it up.  New
-        // visitors cannot start doing meaningful work (we own all
-        // locks at this point).
+    LockHolder rlh(resizeLock);
+    if (visitors.get() > 0 || newSize == size) {
+        // Do not start a resize while any visitors are actually
+        // processing.  The next attempt will have to pick it up.
         return;
     }
 
-    // Get a place for the new items.
-    StoredValue **newValues = static_cast<StoredValue**>(calloc(newSize,
-                                                                sizeof(StoredValue*)));
-    // If we can't allocate memory, don't move stuff around.
-    if (!newValues) {
-        return;
+    ++numResizes;
+    for (size_t l = 0; l < n_locks; ++l) {
+        // Allocate before taking the lock, it's the expensive part.
+        HashBucketArray *newBuckets = new HashBucketArray(stripeSize(newSize, l),
+                                                          layout);
+        // If we can't allocate memory, leave this stripe as it is.
+        if (!newBuckets->isValid()) {
+            delete newBuckets;
+            continue;
+        }
+        bucketMemory.incr(newBuckets->memorySize());
+        stats.memOverhead.incr(newBuckets->memorySize());
+        assert(stats.memOverhead.get() < GIGANTOR);
+
+        LockHolder lh(mutexes[l]);
+        hrtime_t start = gethrtime();
+        HashTableStripe &st = stripes[l];
+        if (st.oldBuckets) {
+            // Still migrating from the previous resize; finish that first.
+            migrateBuckets(st, st.oldBuckets->getSize());
+        }
+        size = size - st.buckets->getSize() + newBuckets->getSize();
+        st.oldBuckets = st.buckets;
+        st.buckets = newBuckets;
+        st.migrated = 0;
+        migrationRemaining.incr(st.oldBuckets->getSize());
+        notePause(start);
     }
+}
 
-    stats.memOverhead.decr(memorySize());
-    ++numResizes;
+size_t HashTable::migrate(size_t nbuckets, hrtime_t maxTime) {
+    hrtime_t begin = gethrtime();
+    while (migrationRemaining.get() > 0) {
+        for (size_t l = 0; l < n_locks; ++l) {
+            if (!stripes[l].oldBuckets) {
+                continue;
+            }
+            LockHolder lh(mutexes[l]);
+            if (stripes[l].oldBuckets) {
+                hrtime_t start = gethrtime();
+                migrateBuckets(stripes[l], nbuckets);
+                notePause(start);
+            }
+        }
+        if (gethrtime() - begin >= maxTime) {
+            break;
+        }
+    }
+    return migrationRemaining.get();
+}
 
-    // Set the new size so all the hashy stuff works.
-    size_t oldSize = size;
-    size = newSize;
-    ep_sync_synchronize();
+/**
+ * Move the values of the key's old bucket, and a few more, before
+ * handing out a bucket of the new array.
+ */
+void HashTable::migrateOnAccess(HashTableStripe &st, uint64_t h) {
+    hrtime_t start = gethrtime();
+    size_t old_bucket = (h / n_locks) % st.oldBuckets->getSize();
+    if (old_bucket >= st.migrated) {
+        migrateBucket(st, old_bucket);
+    }
+    migrateBuckets(st, MIGRATE_ON_ACCESS);
+    notePause(start);
+}
 
-    // Move existing records into the new space.
-    for (size_t i = 0; i < oldSize; i++) {
-        while (values[i]) {
-            StoredValue *v = values[i];
-            values[i] = v->next;
+void HashTable::migrateBucket(HashTableStripe &st, size_t old_bucket) {
+    StoredValue *v;
+    while ((v = st.oldBuckets->pop(old_bucket)) != NULL) {
+        uint64_t h = hash(v->getKeyBytes(), v->getKeyLen());
+        st.buckets->link(v, (h / n_locks) % st.buckets->getSize(),
+                         KeyHash::tag(h));
+    }
+}
 
-            int newBucket = getBucketForHash(hash(v->getKeyBytes(), v->getKeyLen()));
-            v->next = newValues[newBucket];
-            newValues[newBucket] = v;
-        }
+/**
+ * Advance the migration cursor of the stripe, releasing the old
+ * bucket array once everything was moved out of it.
+ */
+void HashTable::migrateBuckets(HashTableStripe &st, size_t nbuckets) {
+    size_t n = std::min(nbuckets, st.oldBuckets->getSize() - st.migrated);
+    for (size_t i = 0; i < n; ++i) {
+        migrateBucket(st, st.migrated + i);
     }
+    st.migrated += n;
+    migrationRemaining.decr(n);
 
-    // values still points to the old (now empty) table.
-    free(values);
-    values = newValues;
+    if (st.migrated == st.oldBuckets->getSize()) {
+        releaseOldBuckets(st);
+    }
+}
 
-    stats.memOverhead.incr(memorySize());
+void HashTable::releaseOldBuckets(HashTableStripe &st) {
+    migrationRemaining.decr(st.oldBuckets->getSize() - st.migrated);
+    bucketMemory.decr(st.oldBuckets->memorySize());
+    stats.memOverhead.decr(st.oldBuckets->memorySize());
     assert(stats.memOverhead.get() < GIGANTOR);
+    delete st.oldBuckets;
+    st.oldBuckets = NULL;
+    st.migrated = 0;
+}
+
+void HashTable::notePause(hrtime_t start) {
+    maxResizePause.setIfBigger(gethrtime() - start);
 }
 
 static size_t distance(size_t a, size_t b) {
@@ -403,59 +745,90 @@ void HashTable::visit(HashTableVisitor &visitor) {
     }
     VisitorTracker vt(&visitors);
     bool aborted = !visitor.shouldContinue();
-    size_t visited = 0;
     for (int l = 0; isActive() && !aborted && l < static_cast<int>(n_locks); l++) {
-        LockHolder lh(mutexes[l]);
-        for (int i = l; i < static_cast<int>(size); i+= n_locks) {
-            assert(l == mutexForBucket(i));
-            StoredValue *v = values[i];
-            assert(v == NULL || i == getBucketForHash(hash(v->getKeyBytes(),
-                                                           v->getKeyLen())));
-            while (v) {
+        visitStripe(visitor, l);
+        aborted = !visitor.shouldContinue();
+    }
+}
+
+bool HashTable::visit(HashTableVisitor &visitor, size_t &stripe) {
+    if ((numItems.get() + numTempItems.get()) == 0 || !isActive()) {
+        stripe = 0;
+        return true;
+    }
+    VisitorTracker vt(&visitors);
+    while (isActive() && stripe < n_locks && visitor.shouldContinue()) {
+        visitStripe(visitor, static_cast<int>(stripe));
+        if (++stripe < n_locks && visitor.shouldYield()) {
+            return false;
+        }
+    }
+    stripe = 0;
+    return true;
+}
+
+void HashTable::visitStripe(HashTableVisitor &visitor, int l) {
+    LockHolder lh(mutexes[l]);
+    HashTableStripe &st = stripes[l];
+    StoredValue *v;
+    for (size_t i = 0; i < st.buckets->getSize(); ++i) {
+        HashBucketArray::Iterator it(*st.buckets, i);
+        while ((v = it.next()) != NULL) {
+            visitor.visit(v);
+        }
+    }
+    // Values a resize in progress didn't move yet.
+    if (st.oldBuckets) {
+        for (size_t i = st.migrated; i < st.oldBuckets->getSize(); ++i) {
+            HashBucketArray::Iterator it(*st.oldBuckets, i);
+            while ((v = it.next()) != NULL) {
                 visitor.visit(v);
-                v = v->next;
             }
-            ++visited;
         }
-        lh.unlock();
-        aborted = !visitor.shouldContinue();
     }
-    assert(aborted || visited == size);
 }
 
 void HashTable::visitDepth(HashTableDepthVisitor &visitor) {
     if (numItems.get() == 0 || !isActive()) {
         return;
     }
-    size_t visited = 0;
     VisitorTracker vt(&visitors);
 
     for (int l = 0; l < static_cast<int>(n_locks); l++) {
         LockHolder lh(mutexes[l]);
-        for (int i = l; i < static_cast<int>(size); i+= n_locks) {
+        HashTableStripe &st = stripes[l];
+        for (size_t i = 0; i < st.buckets->getSize(); ++i) {
             size_t depth = 0;
-            StoredValue *p = values[i];
-            assert(p == NULL || i == getBucketForHash(hash(p->getKeyBytes(),
-                                                           p->getKeyLen())));
+            HashBucketArray::Iterator it(*st.buckets, i);
+            StoredValue *p;
             size_t mem(0);
-            while (p) {
+            while ((p = it.next()) != NULL) {
                 depth++;
                 mem += p->size();
-                p = p->next;
             }
-            visitor.visit(i, depth, mem);
-            ++visited;
+            visitor.visit(static_cast<int>(i * n_locks) + l, depth, mem);
+        }
+        if (st.oldBuckets) {
+            for (size_t i = st.migrated; i < st.oldBuckets->getSize(); ++i) {
+                size_t depth = 0;
+                HashBucketArray::Iterator it(*st.oldBuckets, i);
+                StoredValue *p;
+                size_t mem(0);
+                while ((p = it.next()) != NULL) {
+                    depth++;
+                    mem += p->size();
+                }
+                visitor.visit(-1, depth, mem);
+            }
         }
     }
-
-    assert(visited == size);
 }
 
-add_type_t HashTable::unlocked_add(int &bucket_num,
+add_type_t HashTable::unlocked_add(int &bucket_num, uint8_t tag,
                                    const Item &val,
                                    bool isDirty,
                                    bool storeVal) {
-    StoredValue *v = unlocked_find(val.getKey(), bucket_num,
+    StoredValue *v = unlocked_find(val.getKey(), bucket_num, tag,
                                    true, false);
     add_type_t rv = ADD_SUCCESS;
     if (v && !v->isDeleted() && !v->isExpired(ep_real_time())) {
@@ -475,8 +848,8 @@ add_type_t HashTable::unlocked_add(int &bucket_num,
                 v->markClean();
             }
         } else {
-            v = valFact(itm, values[bucket_num], *this, isDirty);
-            values[bucket_num] = v;
+            v = valFact(itm, NULL, *this, isDirty);
+            link(v, bucket_num, tag);
 
             if (v->isTempItem()) {
                 ++numTempItems;
@@ -506,6 +879,7 @@ add_type_t HashTable::unlocked_add(int &bucket_num,
 }
 
 add_type_t HashTable::unlocked_addTempDeletedItem(int &bucket_num,
+                                                  uint8_t tag,
                                                   const std::string &key) {
 
     assert(isActive());
@@ -516,7 +890,7 @@ add_type_t HashTable::unlocked_addTempDeletedItem(int &bucket_num,
     // the value cuz normally a new item added is considered resident which does
     // not apply for temp item.
 
-    return unlocked_add(bucket_num, itm,
+    return unlocked_add(bucket_num, tag, itm,
                         false,  // isDirty
                         true);   // storeVal
 }
@@ -569,14 +943,83 @@ void StoredValue::reduceMetaDataSize(HashTable &ht, size_t by) {
  */
 bool StoredValue::hasAvailableSpace(EPStats &st, const Item &itm) {
     double newSize = static_cast<double>(st.getTotalMemoryUsed() +
-                                         sizeof(StoredValue) + itm.getNKey());
+                                         StoredValue::headerSize() +
+                                         StoredValueFactory::fieldAreaSize(itm) +
+                                         itm.getNKey());
     double maxSize=  static_cast<double>(st.getMaxDataSize()) * mutation_mem_threshold;
     return newSize <= maxSize;
 }
 
 Item* StoredValue::toItem(bool lck, uint16_t vbucket) const {
-    return new Item(getKey(), getFlags(), getExptime(),
-                    value,
+    StoredValueFields f;
+    getFields(f);
+    return new Item(getUncompressedValue(), getKeyBytes(), getKeyLen(),
+                    f.flags, f.exptime,
                     lck ? static_cast<uint64_t>(-1) : getCas(),
-                    id, vbucket, getSeqno());
+                    f.id, vbucket, f.seqno);
+}
+
+void StoredValue::getFields(StoredValueFields &f) const {
+    if (external) {
+        f = *getExternalFields();
+        return;
+    }
+    const char *p = data;
+    f.id = unzigzag(readVarint(p));
+    f.seqno = readVarint(p);
+    f.exptime = f.flags = f.lock_expiry = 0;
+    if (fields & FIELD_EXPTIME) {
+        std::memcpy(&f.exptime, p, 4);
+        p += 4;
+    }
+    if (fields & FIELD_FLAGS) {
+        std::memcpy(&f.flags, p, 4);
+        p += 4;
+    }
+    if (fields & FIELD_LOCK) {
+        std::memcpy(&f.lock_expiry, p, 4);
+    }
+}
+
+static char *writeVarint(char *p, uint64_t v) {
+    while (v >= 0x80) {
+        *p++ = static_cast<char>(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = static_cast<char>(v);
+    return p;
+}
+
+void StoredValue::setFields(const StoredValueFields &f) {
+    if (external) {
+        *getExternalFields() = f;
+        return;
+    }
+    if (encodedSize(f) > extlen) {
+        // Doesn't fit anymore, so keep the fields out of line from now
+        // on.  The area is at least pointer sized.
+        StoredValueFields *ext = new StoredValueFields(f);
+        ObjectRegistry::onCreateStoredValueFields(sizeof(StoredValueFields));
+        std::memcpy(data, &ext, sizeof(ext));
+        external = true;
+        fields = 0;
+        return;
+    }
+    char *p = writeVarint(data, zigzag(f.id));
+    p = writeVarint(p, f.seqno);
+    fields = 0;
+    if (f.exptime) {
+        std::memcpy(p, &f.exptime, 4);
+        p += 4;
+        fields |= FIELD_EXPTIME;
+    }
+    if (f.flags) {
+        std::memcpy(p, &f.flags, 4);
+        p += 4;
+        fields |= FIELD_FLAGS;
+    }
+    if (f.lock_expiry) {
+        std::memcpy(p, &f.lock_expiry, 4);
+        fields |= FIELD_LOCK;
+    }
 }
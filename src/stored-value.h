@@ -24,13 +24,17 @@
 #include <climits>
 #include <cstring>
 #include <string>
+#include <vector>
 
 #include "common.h"
+#include "compressor.h"
 #include "ep_time.h"
 #include "histo.h"
 #include "item.h"
+#include "keyhash.h"
 #include "locks.h"
 #include "queueditem.h"
+#include "slab_allocator.h"
 #include "stats.h"
 
 // Max value for NRU bits
@@ -52,16 +56,29 @@ union blobval {
     char     chlen[4];          //!< The length as a four byte integer
 };
 
+/**
+ * The per-item fields a StoredValue keeps in its variable sized field
+ * area (or out of line, once they no longer fit there).
+ */
+struct StoredValueFields {
+    int64_t    id;
+    uint64_t   seqno;
+    uint32_t   exptime;
+    uint32_t   flags;
+    rel_time_t lock_expiry;
+};
+
 /**
  * In-memory storage for an item.
+ *
+ * Only the value, chain pointer, CAS and a few bytes of state have a
+ * fixed place.  The remaining fields are varint encoded or left out
+ * entirely when zero, in a field area sized by the StoredValueFactory
+ * when the item is created.
  */
 class StoredValue {
 public:
 
-    void operator delete(void* p) {
-        ::operator delete(p);
-     }
-
     uint8_t getNRUValue();
 
     void setNRUValue(uint8_t nru_val);
@@ -136,7 +153,7 @@ public:
      * Get the pointer to the beginning of the key.
      */
     const char* getKeyBytes() const {
-        return keybytes;
+        return data + extlen;
     }
 
     /**
@@ -166,22 +183,35 @@ public:
 
     /**
      * Get this item's value.
+     *
+     * This is the compressed form of the value if isCompressed().
      */
     const value_t &getValue() const {
         return value;
     }
 
+    /**
+     * Get this item's value as it was stored, decompressing a copy of
+     * it if it's held compressed.
+     */
+    value_t getUncompressedValue() const;
+
     /**
      * Get the expiration time of this item.
      *
      * @return the expiration time for feature items, 0 for small items
      */
     time_t getExptime() const {
-        return exptime;
+        StoredValueFields f;
+        getFields(f);
+        return f.exptime;
     }
 
     void setExptime(time_t tim) {
-        exptime = tim;
+        StoredValueFields f;
+        getFields(f);
+        f.exptime = static_cast<uint32_t>(tim);
+        setFields(f);
         markDirty();
     }
 
@@ -191,14 +221,19 @@ public:
      * @return the flags for feature items, 0 for small items
      */
     uint32_t getFlags() const {
-        return flags;
+        StoredValueFields f;
+        getFields(f);
+        return f.flags;
     }
 
     /**
      * Set the client-defined flags for this item.
      */
     void setFlags(uint32_t fl) {
-        flags = fl;
+        StoredValueFields f;
+        getFields(f);
+        f.flags = fl;
+        setFields(f);
     }
 
     /**
@@ -213,18 +248,22 @@ public:
         size_t currSize = size();
         reduceCacheSize(ht, currSize);
         reduceCurrentSize(stats, isDeleted() ? currSize : currSize - value->length());
+        uncountCompressed(stats);
         value = itm.getValue();
         setResident();
-        flags = itm.getFlags();
 
+        StoredValueFields f;
+        getFields(f);
+        f.flags = itm.getFlags();
+        f.exptime = itm.getExptime();
         cas = itm.getCas();
-        exptime = itm.getExptime();
         if (preserveSeqno) {
-            seqno = itm.getSeqno();
+            f.seqno = itm.getSeqno();
         } else {
-            ++seqno;
-            itm.setSeqno(seqno);
+            ++f.seqno;
+            itm.setSeqno(f.seqno);
         }
+        setFields(f);
 
         markDirty();
         size_t newSize = size();
@@ -245,6 +284,9 @@ public:
     size_t valLength() {
         if (isDeleted()) {
             return 0;
+        } else if (compressed) {
+            return Compressor::getDecompressedLength(value->getData(),
+                                                     value->length());
         } else if (isResident()) {
             return value->length();
         } else {
@@ -267,6 +309,27 @@ public:
      */
     bool ejectValue(EPStats &stats, HashTable &ht);
 
+    /**
+     * Compress an item value in memory.  Only clean values are
+     * compressed, and only if that saves at least an eighth of their
+     * size.
+     *
+     * @param stats the global stat instance
+     * @param ht the hashtable that contains this StoredValue instance
+     * @param minSize the smallest value worth compressing
+     * @return true if the value is now held compressed
+     */
+    bool compressValue(EPStats &stats, HashTable &ht, size_t minSize);
+
+    /**
+     * Replace a compressed item value with the value it holds.
+     *
+     * @param stats the global stat instance
+     * @param ht the hashtable that contains this StoredValue instance
+     * @return true if the value was compressed
+     */
+    bool decompressValue(EPStats &stats, HashTable &ht);
+
     /**
      * Restore the value for this item.
      * @param itm the item to be restored
@@ -309,14 +372,17 @@ public:
      * This is a NOOP for small item types.
      */
     void lock(rel_time_t expiry) {
-        lock_expiry = expiry;
+        StoredValueFields f;
+        getFields(f);
+        f.lock_expiry = expiry;
+        setFields(f);
     }
 
     /**
      * Unlock this item.
      */
     void unlock() {
-        lock_expiry = 0;
+        lock(0);
     }
 
     /**
@@ -324,8 +390,8 @@ public:
      *
      * An item always has an ID after it's been persisted.
      */
-    bool hasId() {
-        return id > 0;
+    bool hasId() const {
+        return getId() > 0;
     }
 
     /**
@@ -333,8 +399,12 @@ public:
      *
      * @return the ID for the item; 0 if the item has no ID
      */
-    int64_t getId() {
-        return id;
+    int64_t getId() const {
+        if (external) {
+            return getExternalFields()->id;
+        }
+        const char *p = data;
+        return unzigzag(readVarint(p));
     }
 
     /**
@@ -345,7 +415,7 @@ public:
      * It is an error to set an ID on an item that already has one.
      */
     void setId(int64_t to) {
-        id = to;
+        storeId(to);
         assert(hasId());
     }
 
@@ -353,7 +423,7 @@ public:
      * Clear the ID (after disk deletion when an object was reused).
      */
     void clearId() {
-        id = state_id_cleared;
+        storeId(state_id_cleared);
         assert(!hasId());
     }
 
@@ -365,8 +435,8 @@ public:
      *
      * @return true if the item is waiting for an ID.
      */
-    bool isPendingId() {
-        return id == state_id_pending;
+    bool isPendingId() const {
+        return getId() == state_id_pending;
     }
 
     /**
@@ -375,7 +445,7 @@ public:
     void setPendingId() {
         assert(!hasId());
         assert(!isPendingId());
-        id = state_id_pending;
+        storeId(state_id_pending);
     }
 
     /**
@@ -383,7 +453,7 @@ public:
      */
     void clearPendingId() {
         if (isPendingId()) {
-            id = state_id_cleared;
+            storeId(state_id_cleared);
         }
     }
 
@@ -392,7 +462,7 @@ public:
      */
     void setStoredValueState(const int64_t to) {
         assert(to == state_deleted_key || to == state_non_existent_key);
-        id = to;
+        storeId(to);
     }
 
     /**
@@ -443,15 +513,34 @@ public:
         if (vallen % sizeof(void*) != 0) {
             valign = sizeof(void*) - vallen % sizeof(void*);
         }
+        size_t metalen = metaDataSize();
         size_t kalign = 0;
-        if (getKeyLen() % sizeof(void*) != 0) {
-            kalign = sizeof(void*) - getKeyLen() % sizeof(void*);
+        if (metalen % sizeof(void*) != 0) {
+            kalign = sizeof(void*) - metalen % sizeof(void*);
         }
-        return sizeof(StoredValue) + getKeyLen() + vallen + valign + kalign;
+        return metalen + vallen + valign + kalign;
     }
 
-    size_t metaDataSize() {
-        return sizeof(StoredValue) + getKeyLen();
+    /**
+     * Get the size of the header, field area and key of this item.
+     */
+    size_t metaDataSize() const {
+        return headerSize() + extlen + getKeyLen();
+    }
+
+    /**
+     * True if this item's fields outgrew its field area and were
+     * moved out of line.
+     */
+    bool hasExternalFields() const {
+        return external;
+    }
+
+    /**
+     * Get the size of the fixed part of a StoredValue.
+     */
+    static size_t headerSize() {
+        return sizeof(StoredValue) - sizeof(reinterpret_cast<StoredValue*>(0)->data);
     }
 
     /**
@@ -461,8 +550,14 @@ public:
      * @return true if the item is locked
      */
     bool isLocked(rel_time_t curtime) {
-        if (lock_expiry == 0 || (curtime > lock_expiry)) {
-            lock_expiry = 0;
+        StoredValueFields f;
+        getFields(f);
+        if (f.lock_expiry == 0) {
+            return false;
+        }
+        if (curtime > f.lock_expiry) {
+            f.lock_expiry = 0;
+            setFields(f);
             return false;
         }
         return true;
@@ -475,6 +570,38 @@ public:
         return resident;
     }
 
+    /**
+     * True if this value is resident in memory, but compressed.
+     */
+    bool isCompressed() const {
+        return compressed;
+    }
+
+    /**
+     * True if the last access scan logged this key as being hot.
+     *
+     * Only the access scanner sets this, with the lock of the key held.
+     */
+    bool isInAccessLog() const {
+        return inAccessLog;
+    }
+
+    void setInAccessLog(bool to) {
+        inAccessLog = to;
+    }
+
+    /**
+     * True if the SLRU eviction policy moved this value to its
+     * protected segment.
+     */
+    bool isPromoted() const {
+        return promoted;
+    }
+
+    void setPromoted(bool to) {
+        promoted = to;
+    }
+
     /**
      * True if this object is logically deleted.
      */
@@ -493,6 +620,7 @@ public:
         size_t oldsize = size();
         size_t old_valsize = value->length();
 
+        uncountCompressed(stats);
         resetValue();
         markDirty();
         if (!isMetaDelete) {
@@ -517,7 +645,12 @@ public:
 
 
     uint64_t getSeqno() const {
-        return seqno;
+        if (external) {
+            return getExternalFields()->seqno;
+        }
+        const char *p = data;
+        readVarint(p);
+        return readVarint(p);
     }
 
     /**
@@ -526,12 +659,17 @@ public:
      * This is a NOOP for small item types.
      */
     void setSeqno(uint64_t s) {
-        seqno = s;
+        StoredValueFields f;
+        getFields(f);
+        f.seqno = s;
+        setFields(f);
     }
 
 
     /**
-     * Generate a new Item out of this object.
+     * Generate a new Item out of this object.  The item shares this
+     * object's value rather than copying it, unless the value is held
+     * compressed.
      *
      * @param lck if true, the new item will return a locked CAS ID.
      * @param vbucket the vbucket containing this item.
@@ -560,15 +698,24 @@ public:
 private:
 
     StoredValue(const Item &itm, StoredValue *n, EPStats &stats, HashTable &ht,
-                bool setDirty = true) :
-        value(itm.getValue()), next(n), id(itm.getId()), flags(itm.getFlags()) {
-        cas = itm.getCas();
-        exptime = itm.getExptime();
+                size_t fieldAreaSize, bool setDirty = true) :
+        value(itm.getValue()), next(n), cas(itm.getCas()) {
         resident = true;
         nru = INITIAL_NRU_VALUE;
-        lock_expiry = 0;
-        keylen = itm.getKey().length();
-        seqno = itm.getSeqno();
+        slabbed = false;
+        external = false;
+        compressed = false;
+        inAccessLog = false;
+        promoted = false;
+        fields = 0;
+        extlen = static_cast<uint8_t>(fieldAreaSize);
+        keylen = static_cast<uint8_t>(itm.getKey().length());
+        std::memcpy(data + extlen, itm.getKey().data(), keylen);
+
+        StoredValueFields f;
+        fieldsOf(itm, f);
+        assert(encodedSize(f) <= extlen);
+        setFields(f);
 
         if (setDirty) {
             markDirty();
@@ -585,22 +732,119 @@ private:
         resident = true;
     }
 
+    /**
+     * Drop the compressed value of this item from the stats, before
+     * it's replaced or released.
+     */
+    void uncountCompressed(EPStats &stats) {
+        if (compressed) {
+            --stats.numCompressedValues;
+            stats.compressedValueSize.decr(value->length());
+            compressed = false;
+        }
+    }
+
+    void valueResized(EPStats &stats, HashTable &ht,
+                      size_t oldsize, size_t old_valsize);
+
     friend class HashTable;
+    friend class HashBucketArray;
     friend class StoredValueFactory;
 
-    value_t            value;          // 16 bytes
+    // StoredValues are released with StoredValueFactory::destroy().
+    void operator delete(void* p) {
+        ::operator delete(p);
+    }
+
+    /*
+     * The field area in front of the key holds, in order, the id as a
+     * zigzag varint, the seqno as a varint, then exptime, flags and
+     * lock_expiry as four bytes each, but only those present in
+     * fields.  If the encoding outgrows the area, the area holds a
+     * pointer to a StoredValueFields instead.
+     */
+    static const uint8_t FIELD_EXPTIME = 0x01;
+    static const uint8_t FIELD_FLAGS   = 0x02;
+    static const uint8_t FIELD_LOCK    = 0x04;
+
+    //! Room left for the id to grow into (ids below 2^34).
+    static const size_t ID_RESERVE = 5;
+    //! Room left for the seqno to grow into (seqnos below 2^21).
+    static const size_t SEQNO_RESERVE = 3;
+
+    static uint64_t zigzag(int64_t v) {
+        return (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63);
+    }
+
+    static int64_t unzigzag(uint64_t v) {
+        return static_cast<int64_t>(v >> 1) ^ -static_cast<int64_t>(v & 1);
+    }
+
+    static size_t varintSize(uint64_t v) {
+        size_t n = 1;
+        while (v >= 0x80) {
+            v >>= 7;
+            ++n;
+        }
+        return n;
+    }
+
+    static uint64_t readVarint(const char *&p) {
+        uint64_t v = 0;
+        int shift = 0;
+        uint8_t b;
+        do {
+            b = static_cast<uint8_t>(*p++);
+            v |= static_cast<uint64_t>(b & 0x7f) << shift;
+            shift += 7;
+        } while (b & 0x80);
+        return v;
+    }
+
+    static size_t encodedSize(const StoredValueFields &f) {
+        return varintSize(zigzag(f.id)) + varintSize(f.seqno) +
+            (f.exptime ? 4 : 0) + (f.flags ? 4 : 0) + (f.lock_expiry ? 4 : 0);
+    }
+
+    static void fieldsOf(const Item &itm, StoredValueFields &f) {
+        f.id = itm.getId();
+        f.seqno = itm.getSeqno();
+        f.exptime = static_cast<uint32_t>(itm.getExptime());
+        f.flags = itm.getFlags();
+        f.lock_expiry = 0;
+    }
+
+    StoredValueFields *getExternalFields() const {
+        StoredValueFields *f;
+        std::memcpy(&f, data, sizeof(f));
+        return f;
+    }
+
+    void getFields(StoredValueFields &f) const;
+    void setFields(const StoredValueFields &f);
+
+    void storeId(int64_t to) {
+        StoredValueFields f;
+        getFields(f);
+        f.id = to;
+        setFields(f);
+    }
+
+    value_t            value;          // 8 bytes
     StoredValue        *next;          // 8 bytes
     uint64_t           cas;            //!< CAS identifier.
-    uint64_t           seqno;          //!< Revision id sequence number
-    int64_t            id;             // 8 bytes
-    rel_time_t         lock_expiry;    //!< getl lock expiration
-    uint32_t           exptime;        //!< Expiration time of this item.
-    uint32_t           flags;          // 4 bytes
     bool               _isDirty  :  1; // 1 bit
     bool               resident  :  1; //!< True if this object's value is in memory.
     uint8_t            nru       :  2; //!< True if referenced since last sweep
+    bool               slabbed   :  1; //!< True if allocated by SlabAllocator.
+    bool               external  :  1; //!< True if the field area holds a pointer.
+    bool               compressed:  1; //!< True if the value is compressed.
+    bool               inAccessLog: 1; //!< True if in the access log.
+    uint8_t            fields    :  3; //!< The optional fields present.
+    bool               promoted  :  1; //!< True if in the protected segment.
+    uint8_t            extlen;         //!< The size of the field area.
     uint8_t            keylen;
-    char               keybytes[1];    //!< The key itself.
+    char               data[4];        //!< The field area, then the key.
 
     static void increaseMetaDataSize(HashTable &ht, size_t by);
     static void reduceMetaDataSize(HashTable &ht, size_t by);
@@ -640,6 +884,22 @@ typedef enum {
     ADD_UNDEL                   //!< Undeletes an existing dirty item
 } add_type_t;
 
+/**
+ * Key hash functions a HashTable can use.
+ */
+typedef enum {
+    HASH_XX,                    //!< Seeded 64-bit word-at-a-time hash
+    HASH_DJB                    //!< Legacy byte-at-a-time DJB hash
+} hash_policy_t;
+
+/**
+ * Memory layouts a HashTable can keep its buckets in.
+ */
+typedef enum {
+    CHAINED_BUCKETS,            //!< A linked StoredValue chain per bucket
+    GROUPED_BUCKETS             //!< A cache line of tagged slots per bucket
+} bucket_layout_t;
+
 /**
  * Base class for visiting a hash table.
  */
@@ -660,6 +920,14 @@ public:
      * to visit items.
      */
     virtual bool shouldContinue() { return true; }
+
+    /**
+     * True if a resumable visit should stop for now, e.g. to end the
+     * dispatcher slice of a VBCBAdaptor, which resumes it in the next.
+     *
+     * This is checked between the lock stripes of the table.
+     */
+    virtual bool shouldYield() { return false; }
 };
 
 /**
@@ -672,7 +940,8 @@ public:
     /**
      * Called once for each hashtable bucket with its depth.
      *
-     * @param bucket the index of the hashtable bucket
+     * @param bucket the index of the hashtable bucket (-1 for a bucket
+     *        a resize in progress has yet to migrate)
      * @param depth the number of entries in this hashtable bucket
      * @param mem counted memory used by this hash table
      */
@@ -785,25 +1054,252 @@ public:
         return newStoredValue(itm, n, ht, setDirty);
     }
 
+    /**
+     * Release a StoredValue created by a StoredValueFactory.
+     */
+    static void destroy(StoredValue *v) {
+        size_t len = v->metaDataSize();
+        bool slabbed = v->slabbed;
+        if (v->external) {
+            delete v->getExternalFields();
+            ObjectRegistry::onDeleteStoredValueFields(sizeof(StoredValueFields));
+        }
+        v->~StoredValue();
+        if (slabbed) {
+            SlabAllocator::deallocate(v, len);
+        } else {
+            ::operator delete(v);
+        }
+    }
+
+    /**
+     * Size the field area for the given item: its current fields plus
+     * room for the id and seqno to grow, and never less than what the
+     * out of line pointer needs.
+     */
+    static size_t fieldAreaSize(const Item &itm) {
+        StoredValueFields f;
+        StoredValue::fieldsOf(itm, f);
+        size_t need = StoredValue::encodedSize(f);
+        size_t idlen = StoredValue::varintSize(StoredValue::zigzag(f.id));
+        size_t seqlen = StoredValue::varintSize(f.seqno);
+        need += std::max(idlen, StoredValue::ID_RESERVE) - idlen;
+        need += std::max(seqlen, StoredValue::SEQNO_RESERVE) - seqlen;
+        return std::max(need, sizeof(StoredValueFields*));
+    }
+
 private:
 
     StoredValue* newStoredValue(const Item &itm, StoredValue *n, HashTable &ht,
                                 bool setDirty) {
-        size_t base = sizeof(StoredValue);
-
         const std::string &key = itm.getKey();
         assert(key.length() < 256);
-        size_t len = key.length() + base;
+        size_t area = fieldAreaSize(itm);
+        size_t len = StoredValue::headerSize() + area + key.length();
 
-        StoredValue *t = new (::operator new(len))
-        StoredValue(itm, n, *stats, ht, setDirty);
-        std::memcpy(t->keybytes, key.data(), key.length());
+        void *p = SlabAllocator::allocate(len);
+        bool slabbed = p != NULL;
+        if (!slabbed) {
+            p = ::operator new(len);
+        }
+        StoredValue *t = new (p) StoredValue(itm, n, *stats, ht, area, setDirty);
+        t->slabbed = slabbed;
         return t;
     }
 
     EPStats                *stats;
 };
 
+/**
+ * A bucket of the grouped layout, sized to fit a 64 byte cache line.
+ *
+ * Up to SLOTS values of the bucket are kept here along with a one
+ * byte tag of their key hashes, so a lookup normally reads this line
+ * and only compares keys whose tag matches.  Values that don't fit are
+ * chained off overflow through StoredValue::next.
+ */
+struct StoredValueGroup {
+    static const size_t SLOTS = 6;
+
+    uint8_t      tags[SLOTS];
+    uint8_t      used;
+    uint8_t      unused;
+    StoredValue *slots[SLOTS];
+    StoredValue *overflow;
+};
+
+/**
+ * The bucket array of a HashTable in one of the bucket layouts.
+ *
+ * This class does no locking; the caller must hold the lock covering
+ * the bucket it operates on.
+ */
+class HashBucketArray {
+public:
+
+    /**
+     * Walks the values of a single bucket.
+     */
+    class Iterator {
+    public:
+        Iterator(HashBucketArray &a, int bucket_num);
+
+        /**
+         * Get the next value of the bucket, or NULL when done.
+         */
+        StoredValue *next() {
+            if (slot < used) {
+                return slots[slot++];
+            }
+            StoredValue *rv = chain;
+            if (rv) {
+                chain = rv->next;
+            }
+            return rv;
+        }
+
+    private:
+        StoredValue **slots;
+        size_t        slot;
+        size_t        used;
+        StoredValue  *chain;
+    };
+
+    HashBucketArray(size_t s, bucket_layout_t l);
+
+    ~HashBucketArray();
+
+    /**
+     * True if the bucket storage could be allocated.
+     */
+    bool isValid() const {
+        return values != NULL || groups != NULL;
+    }
+
+    bucket_layout_t getLayout() const {
+        return layout;
+    }
+
+    /**
+     * Get the number of buckets.
+     */
+    size_t getSize() const {
+        return size;
+    }
+
+    /**
+     * Get the number of bytes used for the buckets.
+     */
+    size_t memorySize() const {
+        if (layout == GROUPED_BUCKETS) {
+            return size * sizeof(StoredValueGroup) + CACHE_LINE_SIZE;
+        }
+        return size * sizeof(StoredValue*);
+    }
+
+    /**
+     * Find the value with the given key in a bucket, deleted or not.
+     *
+     * @param tag the KeyHash::tag() of the key's hash
+     */
+    StoredValue *find(const std::string &key, int bucket_num, uint8_t tag) {
+        StoredValue *v;
+        if (layout == GROUPED_BUCKETS) {
+            StoredValueGroup &g = groups[bucket_num];
+            if (tagMatch(g, tag)) {
+                for (size_t i = 0; i < g.used; ++i) {
+                    if (g.tags[i] == tag && g.slots[i]->hasKey(key)) {
+                        return g.slots[i];
+                    }
+                }
+            }
+            v = g.overflow;
+        } else {
+            v = values[bucket_num];
+        }
+
+        while (v) {
+            if (v->hasKey(key)) {
+                return v;
+            }
+            v = v->next;
+        }
+        return NULL;
+    }
+
+    /**
+     * Add a value to a bucket.
+     *
+     * @param tag the KeyHash::tag() of the hash of the value's key
+     */
+    void link(StoredValue *v, int bucket_num, uint8_t tag) {
+        if (layout == GROUPED_BUCKETS) {
+            StoredValueGroup &g = groups[bucket_num];
+            if (g.used < StoredValueGroup::SLOTS) {
+                g.tags[g.used] = tag;
+                g.slots[g.used] = v;
+                ++g.used;
+                v->next = NULL;
+                return;
+            }
+            v->next = g.overflow;
+            g.overflow = v;
+        } else {
+            v->next = values[bucket_num];
+            values[bucket_num] = v;
+        }
+    }
+
+    /**
+     * Remove the given value from a bucket.
+     */
+    void unlink(StoredValue *v, int bucket_num);
+
+    /**
+     * Remove and return any value of a bucket, or NULL if it's empty.
+     */
+    StoredValue *pop(int bucket_num);
+
+private:
+    static const size_t CACHE_LINE_SIZE = 64;
+
+    /**
+     * Check all of a group's tag bytes against the given tag at once.
+     * May report a match that isn't one, never misses a real one.
+     */
+    static bool tagMatch(const StoredValueGroup &g, uint8_t tag) {
+        const uint64_t lows(0x0101010101010101ULL);
+        const uint64_t highs(0x8080808080808080ULL);
+        uint64_t word;
+        std::memcpy(&word, &g, sizeof(word));
+        word ^= lows * tag;
+        return ((word - lows) & ~word & highs) != 0;
+    }
+
+    size_t              size;
+    bucket_layout_t     layout;
+    StoredValue       **values;
+    StoredValueGroup   *groups;
+    void               *groupsAlloc;
+
+    DISALLOW_COPY_AND_ASSIGN(HashBucketArray);
+};
+
+/**
+ * The buckets of a HashTable covered by one of its locks.
+ *
+ * While a resize of the stripe is in progress, values not migrated yet
+ * are still in oldBuckets; the old buckets below the migrated cursor
+ * are known to be empty.
+ */
+struct HashTableStripe {
+    HashTableStripe() : buckets(NULL), oldBuckets(NULL), migrated(0) { }
+
+    HashBucketArray *buckets;
+    HashBucketArray *oldBuckets;
+    size_t           migrated;
+};
+
 /**
  * A container of StoredValue instances.
  */
@@ -819,13 +1315,21 @@ public:
      */
     HashTable(EPStats &st, size_t s = 0, size_t l = 0) : stats(st), valFact(st) {
         size = HashTable::getNumBuckets(s);
-        n_locks = HashTable::getNumLocks(l);
+        // Every lock covers at least one bucket.
+        n_locks = std::min(HashTable::getNumLocks(l), size);
         assert(size > 0);
         assert(n_locks > 0);
         assert(visitors == 0);
-        values = static_cast<StoredValue**>(calloc(size, sizeof(StoredValue*)));
+        layout = defaultBucketLayout;
+        stripes = new HashTableStripe[n_locks];
+        for (size_t i = 0; i < n_locks; ++i) {
+            stripes[i].buckets = new HashBucketArray(stripeSize(size, i), layout);
+            assert(stripes[i].buckets->isValid());
+            bucketMemory.incr(stripes[i].buckets->memorySize());
+        }
         mutexes = new Mutex[n_locks];
         activeState = true;
+        hashPolicy = defaultHashPolicy;
     }
 
     ~HashTable() {
@@ -835,14 +1339,18 @@ public:
             usleep(100);
         }
         delete []mutexes;
-        free(values);
-        values = NULL;
+        for (size_t i = 0; i < n_locks; ++i) {
+            delete stripes[i].buckets;
+        }
+        delete []stripes;
+        stripes = NULL;
     }
 
     size_t memorySize() {
         return sizeof(HashTable)
-            + (size * sizeof(StoredValue*))
-            + (n_locks * sizeof(Mutex));
+            + bucketMemory.get()
+            + (n_locks * (sizeof(Mutex) + sizeof(HashTableStripe)
+                          + sizeof(HashBucketArray)));
     }
 
     /**
@@ -901,9 +1409,39 @@ public:
 
     /**
      * Resize to the specified size.
+     *
+     * Each lock's stripe of buckets is switched to a new bucket array
+     * holding only that lock; values are then moved over a few buckets
+     * at a time by subsequent accesses and by migrate().
      */
     void resize(size_t to);
 
+    /**
+     * Move values of a resize in progress to their new buckets.
+     *
+     * Passes over all the stripes still migrating, moving a slice of
+     * each, until the migration is done or the time is up.  Holds one
+     * lock at a time for at most a slice, so front-end operations are
+     * only briefly delayed.
+     *
+     * @param nbuckets the number of old buckets in a slice
+     * @param maxTime the time (ns) after which no further pass starts
+     * @return the number of old buckets still to be migrated
+     */
+    size_t migrate(size_t nbuckets, hrtime_t maxTime);
+
+    /**
+     * Get the number of old buckets not yet migrated by resizes in
+     * progress.
+     */
+    size_t getMigrationRemaining() { return migrationRemaining; }
+
+    /**
+     * Get the longest time (in ns) a lock was held to resize or
+     * migrate buckets.
+     */
+    hrtime_t getMaxResizePause() { return maxResizePause; }
+
     /**
      * Find the item with the given key.
      *
@@ -913,8 +1451,9 @@ public:
     StoredValue *find(std::string &key, bool trackReference=true) {
         assert(isActive());
         int bucket_num(0);
-        LockHolder lh = getLockedBucket(key, &bucket_num);
-        return unlocked_find(key, bucket_num, false, trackReference);
+        uint8_t tag(0);
+        LockHolder lh = getLockedBucket(key, &bucket_num, &tag);
+        return unlocked_find(key, bucket_num, tag, false, trackReference);
     }
 
     /**
@@ -924,16 +1463,16 @@ public:
      */
     bool unlocked_restoreItem(const Item &itm,
                               enum queue_operation op,
-                              int bucket_num)
+                              int bucket_num, uint8_t tag)
     {
-        if (unlocked_find(itm.getKey(), bucket_num, true)) {
+        if (unlocked_find(itm.getKey(), bucket_num, tag, true)) {
             // it's already there...
             return false;
         }
 
-        StoredValue *v = valFact(itm, values[bucket_num], *this);
+        StoredValue *v = valFact(itm, NULL, *this);
         assert(v);
-        values[bucket_num] = v;
+        link(v, bucket_num, tag);
         ++numItems;
         if (op == queue_op_del) {
             unlocked_softDelete(v, itm.getCas());
@@ -974,10 +1513,40 @@ public:
             return NOMEM;
         }
 
-        mutation_type_t rv = NOT_FOUND;
         int bucket_num(0);
-        LockHolder lh = getLockedBucket(val.getKey(), &bucket_num);
-        StoredValue *v = unlocked_find(val.getKey(), bucket_num, true, false);
+        uint8_t tag(0);
+        LockHolder lh = getLockedBucket(val.getKey(), &bucket_num, &tag);
+        return unlocked_set(val, cas, allowExisting, hasMetaData, nru,
+                            bucket_num, tag);
+    }
+
+    /**
+     * Is there enough memory left to store the given item?
+     */
+    bool hasAvailableSpace(const Item &itm) {
+        return StoredValue::hasAvailableSpace(stats, itm);
+    }
+
+    /**
+     * Set an Item into the this hashtable while already holding the lock
+     * of its bucket.  Memory isn't checked; that is up to the caller.
+     *
+     * @param val the Item to store
+     * @param cas This is the cas value for the item <b>in</b> the cache
+     * @param allowExisting should we allow existing items or not
+     * @param hasMetaData should we keep the seqno the same or increment it
+     * @param nru the nru bit for the item
+     * @param bucket_num the locked bucket the key hashes to
+     * @param tag the tag of the key from getLockedBucket()
+     * @return a result indicating the status of the store
+     */
+    mutation_type_t unlocked_set(const Item &val, uint64_t cas,
+                                 bool allowExisting, bool hasMetaData,
+                                 uint8_t nru, int bucket_num, uint8_t tag) {
+        Item &itm = const_cast<Item&>(val);
+        mutation_type_t rv = NOT_FOUND;
+        StoredValue *v = unlocked_find(val.getKey(), bucket_num, tag,
+                                       true, false);
 
         /*
          * prior to checking for the lock, we should check if this object
@@ -1037,8 +1606,8 @@ public:
             if (!hasMetaData) {
                 itm.setCas();
             }
-            v = valFact(itm, values[bucket_num], *this);
-            values[bucket_num] = v;
+            v = valFact(itm, NULL, *this);
+            link(v, bucket_num, tag);
             ++numItems;
             if (nru <= MAX_NRU_VALUE && !v->isTempItem()) {
                 v->setNRUValue(nru);
@@ -1071,6 +1640,27 @@ public:
      */
     mutation_type_t insert(const Item &itm, bool eject, bool partial);
 
+    /**
+     * Insert several items from the backfill, locking each stripe of
+     * the hash table once for all the items it guards.
+     *
+     * @param items the Items to insert
+     * @param eject true if we should eject the values immediately
+     * @param partial are these complete items, or just the keys and meta-data
+     * @param results where to put the status of each store
+     */
+    void insertMulti(const std::vector<Item*> &items, bool eject, bool partial,
+                     std::vector<mutation_type_t> &results);
+
+    /**
+     * Insert an item from the backfill while already holding the lock
+     * of its bucket.  Memory isn't checked; that is up to the caller.
+     *
+     * @see insert()
+     */
+    mutation_type_t unlocked_insert(const Item &itm, bool eject, bool partial,
+                                    int bucket_num, uint8_t tag);
+
     /**
      * Add an item to the hash table iff it doesn't already exist.
      *
@@ -1082,20 +1672,22 @@ public:
     add_type_t add(const Item &val, bool isDirty = true, bool storeVal = true) {
         assert(isActive());
         int bucket_num(0);
-        LockHolder lh = getLockedBucket(val.getKey(), &bucket_num);
-        return unlocked_add(bucket_num, val, isDirty, storeVal);
+        uint8_t tag(0);
+        LockHolder lh = getLockedBucket(val.getKey(), &bucket_num, &tag);
+        return unlocked_add(bucket_num, tag, val, isDirty, storeVal);
     }
 
     /**
      * Unlocked version of the add() method.
      *
      * @param bucket_num the locked partition where the key belongs
+     * @param tag the tag of the key from getLockedBucket()
      * @param val the item to store
      * @param isDirty true if the item should be marked dirty on store
      * @param storeVal true if the value should be stored (paged-in)
      * @return an indication of what happened
      */
-    add_type_t unlocked_add(int &bucket_num,
+    add_type_t unlocked_add(int &bucket_num, uint8_t tag,
                             const Item &val,
                             bool isDirty = true,
                             bool storeVal = true);
@@ -1107,10 +1699,11 @@ public:
      *       bucket/partition lock.
      *
      * @param bucket_num the locked partition where the key belongs
+     * @param tag the tag of the key from getLockedBucket()
      * @param key the key for which a temporary item needs to be added
      * @return an indication of what happened
      */
-    add_type_t unlocked_addTempDeletedItem(int &bucket_num,
+    add_type_t unlocked_addTempDeletedItem(int &bucket_num, uint8_t tag,
                                            const std::string &key);
 
     /**
@@ -1123,8 +1716,9 @@ public:
     mutation_type_t softDelete(const std::string &key, uint64_t cas) {
         assert(isActive());
         int bucket_num(0);
-        LockHolder lh = getLockedBucket(key, &bucket_num);
-        StoredValue *v = unlocked_find(key, bucket_num, false, false);
+        uint8_t tag(0);
+        LockHolder lh = getLockedBucket(key, &bucket_num, &tag);
+        StoredValue *v = unlocked_find(key, bucket_num, tag, false, false);
         return unlocked_softDelete(v, cas);
     }
 
@@ -1197,25 +1791,23 @@ public:
      *
      * @param key the key of the item to find
      * @param bucket_num the bucket number
+     * @param tag the tag of the key from getLockedBucket()
      * @param wantsDeleted true if soft deleted items should be returned
      *
      * @return a pointer to a StoredValue -- NULL if not found
      */
     StoredValue *unlocked_find(const std::string &key, int bucket_num,
-                               bool wantsDeleted=false, bool trackReference=true) {
-        StoredValue *v = values[bucket_num];
-        while (v) {
-            if (v->hasKey(key)) {
-                if (trackReference && !v->isDeleted()) {
-                    v->referenced();
-                }
-                if (wantsDeleted || !v->isDeleted()) {
-                    return v;
-                } else {
-                    return NULL;
-                }
+                               uint8_t tag, bool wantsDeleted=false,
+                               bool trackReference=true) {
+        StoredValue *v = getBuckets(bucket_num).find(key, bucketIndex(bucket_num),
+                                                     tag);
+        if (v) {
+            if (trackReference && !v->isDeleted()) {
+                v->referenced();
+            }
+            if (wantsDeleted || !v->isDeleted()) {
+                return v;
             }
-            v = v->next;
         }
         return NULL;
     }
@@ -1228,15 +1820,12 @@ public:
      *
      * @return the hash value
      */
-    inline int hash(const char *str, const size_t len) {
+    inline uint64_t hash(const char *str, const size_t len) {
         assert(isActive());
-        int h=5381;
-
-        for(size_t i=0; i < len; i++) {
-            h = ((h << 5) + h) ^ str[i];
+        if (hashPolicy == HASH_DJB) {
+            return KeyHash::djb(str, len);
         }
-
-        return h;
+        return KeyHash::xx64(str, len, hashSeed);
     }
 
     /**
@@ -1245,7 +1834,7 @@ public:
      * @param s the string
      * @return the hash value
      */
-    inline int hash(const std::string &s) {
+    inline uint64_t hash(const std::string &s) {
         return hash(s.data(), s.length());
     }
 
@@ -1257,15 +1846,33 @@ public:
      * @param bucket output parameter to receive a bucket
      * @return a locked LockHolder
      */
-    inline LockHolder getLockedBucket(int h, int *bucket) {
-        while (true) {
-            assert(isActive());
-            *bucket = getBucketForHash(h);
-            LockHolder rv(mutexes[mutexForBucket(*bucket)]);
-            if (*bucket == getBucketForHash(h)) {
-                return rv;
-            }
+    inline LockHolder getLockedBucket(uint64_t h, int *bucket) {
+        assert(isActive());
+        LockHolder rv(mutexes[getLockForHash(h)]);
+        *bucket = getBucketForLockedHash(h);
+        return rv;
+    }
+
+    /**
+     * Get the number of the lock guarding the bucket for a hash.
+     */
+    inline int getLockForHash(uint64_t h) {
+        return static_cast<int>(h % n_locks);
+    }
+
+    /**
+     * Get the bucket for a hash whose lock the caller already holds,
+     * e.g. through getLockedBucket() for another hash of the same lock.
+     *
+     * @param h the input hash
+     * @return the bucket for the hash
+     */
+    inline int getBucketForLockedHash(uint64_t h) {
+        int lock_num = getLockForHash(h);
+        if (stripes[lock_num].oldBuckets) {
+            migrateOnAccess(stripes[lock_num], h);
         }
+        return getBucketForHash(h);
     }
 
     /**
@@ -1275,10 +1882,15 @@ public:
      * @param s the start of the key
      * @param n the size of the key
      * @param bucket output parameter to receive a bucket
+     * @param tag output parameter to receive the tag of the key, for
+     *            the unlocked_ lookups
      * @return a locked LockHolder
      */
-    inline LockHolder getLockedBucket(const char *s, size_t n, int *bucket) {
-        return getLockedBucket(hash(s, n), bucket);
+    inline LockHolder getLockedBucket(const char *s, size_t n, int *bucket,
+                                      uint8_t *tag) {
+        uint64_t h = hash(s, n);
+        *tag = KeyHash::tag(h);
+        return getLockedBucket(h, bucket);
     }
 
     /**
@@ -1287,10 +1899,13 @@ public:
      *
      * @param s the key
      * @param bucket output parameter to receive a bucket
+     * @param tag output parameter to receive the tag of the key, for
+     *            the unlocked_ lookups
      * @return a locked LockHolder
      */
-    inline LockHolder getLockedBucket(const std::string &s, int *bucket) {
-        return getLockedBucket(hash(s.data(), s.size()), bucket);
+    inline LockHolder getLockedBucket(const std::string &s, int *bucket,
+                                      uint8_t *tag) {
+        return getLockedBucket(s.data(), s.size(), bucket, tag);
     }
 
     /**
@@ -1300,64 +1915,35 @@ public:
      *
      * @param key the key to delete
      * @param bucket_num the bucket to look in (must already be locked)
+     * @param tag the tag of the key from getLockedBucket()
      * @return true if an object was deleted, false otherwise
      */
-    bool unlocked_del(const std::string &key, int bucket_num) {
+    bool unlocked_del(const std::string &key, int bucket_num, uint8_t tag) {
         assert(isActive());
-        StoredValue *v = values[bucket_num];
-
-        // Special case empty bucket.
+        HashBucketArray &b = getBuckets(bucket_num);
+        StoredValue *v = b.find(key, bucketIndex(bucket_num), tag);
         if (!v) {
             return false;
         }
 
-        // Special case the first one
-        if (v->hasKey(key)) {
-            if (!v->isDeleted() && v->isLocked(ep_current_time())) {
-                return false;
-            }
-
-            values[bucket_num] = v->next;
-            size_t currSize = v->size();
-            StoredValue::reduceCacheSize(*this, currSize);
-            StoredValue::reduceCurrentSize(stats, v->isDeleted() ? currSize
-                                           : currSize - v->getValue()->length());
-            StoredValue::reduceMetaDataSize(*this, v->metaDataSize());
-            if (v->isTempItem()) {
-                --numTempItems;
-            } else {
-                --numItems;
-            }
-            delete v;
-            return true;
+        if (!v->isDeleted() && v->isLocked(ep_current_time())) {
+            return false;
         }
 
-        while (v->next) {
-            if (v->next->hasKey(key)) {
-                StoredValue *tmp = v->next;
-                if (!tmp->isDeleted() && tmp->isLocked(ep_current_time())) {
-                    return false;
-                }
-
-                v->next = v->next->next;
-                size_t currSize = tmp->size();
-                StoredValue::reduceCacheSize(*this, currSize);
-                StoredValue::reduceCurrentSize(stats, tmp->isDeleted() ? currSize
-                                               : currSize - tmp->getValue()->length());
-                StoredValue::reduceMetaDataSize(*this, tmp->metaDataSize());
-                if (tmp->isTempItem()) {
-                    --numTempItems;
-                } else {
-                    --numItems;
-                }
-                delete tmp;
-                return true;
-            } else {
-                v = v->next;
-            }
+        b.unlink(v, bucketIndex(bucket_num));
+        size_t currSize = v->size();
+        StoredValue::reduceCacheSize(*this, currSize);
+        StoredValue::reduceCurrentSize(stats, v->isDeleted() ? currSize
+                                       : currSize - v->getValue()->length());
+        StoredValue::reduceMetaDataSize(*this, v->metaDataSize());
+        if (v->isTempItem()) {
+            --numTempItems;
+        } else {
+            --numItems;
         }
-
-        return false;
+        v->uncountCompressed(stats);
+        StoredValueFactory::destroy(v);
+        return true;
     }
 
     /**
@@ -1369,8 +1955,9 @@ public:
     bool del(const std::string &key) {
         assert(isActive());
         int bucket_num(0);
-        LockHolder lh = getLockedBucket(key, &bucket_num);
-        return unlocked_del(key, bucket_num);
+        uint8_t tag(0);
+        LockHolder lh = getLockedBucket(key, &bucket_num, &tag);
+        return unlocked_del(key, bucket_num, tag);
     }
 
     /**
@@ -1378,6 +1965,19 @@ public:
      */
     void visit(HashTableVisitor &visitor);
 
+    /**
+     * Visit the items of the lock stripes from the given one on, until
+     * they're all visited or the visitor yields.  Items keep their
+     * stripe when the table is resized, so a visit resumed later sees
+     * each item once.
+     *
+     * @param visitor the visitor
+     * @param stripe the stripe to start from, and upon return the one
+     *        to resume from
+     * @return true once the table is done with
+     */
+    bool visit(HashTableVisitor &visitor, size_t &stripe);
+
     /**
      * Visit all items within this call with a depth visitor.
      */
@@ -1407,6 +2007,34 @@ public:
      */
     static void setDefaultNumLocks(size_t);
 
+    /**
+     * Set the key hash function used by newly created hash tables.
+     *
+     * @param name "xxhash" or "djb"; unknown names are ignored
+     */
+    static void setDefaultHashPolicy(const std::string &name);
+
+    /**
+     * Set the bucket layout used by newly created hash tables.
+     *
+     * @param name "chained" or "grouped"; unknown names are ignored
+     */
+    static void setDefaultBucketLayout(const std::string &name);
+
+    /**
+     * Get the name of the bucket layout this hash table uses.
+     */
+    const char *getBucketLayoutName() const {
+        return layout == GROUPED_BUCKETS ? "grouped" : "chained";
+    }
+
+    /**
+     * Get the name of the key hash function this hash table uses.
+     */
+    const char *getHashPolicyName() const {
+        return hashPolicy == HASH_DJB ? "djb" : "xxhash";
+    }
+
     /**
      * Get the max deleted seqno seen so far.
      */
@@ -1442,25 +2070,73 @@ private:
     inline bool isActive() const { return activeState; }
     inline void setActiveState(bool newv) { activeState = newv; }
 
+    void visitStripe(HashTableVisitor &visitor, int l);
+
     size_t               size;
     size_t               n_locks;
-    StoredValue        **values;
+    HashTableStripe     *stripes;
+    bucket_layout_t      layout;
     Mutex               *mutexes;
     EPStats&             stats;
     StoredValueFactory   valFact;
     Atomic<size_t>       visitors;
     Atomic<size_t>       numItems;
     Atomic<size_t>       numResizes;
+    Mutex                resizeLock;
+    Atomic<size_t>       bucketMemory;
+    Atomic<size_t>       migrationRemaining;
+    Atomic<hrtime_t>     maxResizePause;
     Atomic<size_t>       numTempItems;
     bool                 activeState;
+    hash_policy_t        hashPolicy;
 
     static size_t                 defaultNumBuckets;
     static size_t                 defaultNumLocks;
+    static hash_policy_t          defaultHashPolicy;
+    static bucket_layout_t        defaultBucketLayout;
+    static const uint64_t         hashSeed;
 
-    int getBucketForHash(int h) {
-        return abs(h % static_cast<int>(size));
+    /**
+     * Get the number of buckets lock l covers in a table of s buckets.
+     */
+    size_t stripeSize(size_t s, size_t l) const {
+        return s / n_locks + (l < s % n_locks ? 1 : 0);
     }
 
+    /**
+     * Get the bucket for the given hash.  The caller must hold the
+     * lock of the hash's stripe.
+     *
+     * Buckets are numbered so that bucket b is covered by lock
+     * b % n_locks, and is bucket b / n_locks within that stripe.
+     */
+    int getBucketForHash(uint64_t h) {
+        int lock_num = static_cast<int>(h % n_locks);
+        size_t index = (h / n_locks) % stripes[lock_num].buckets->getSize();
+        return static_cast<int>(index * n_locks) + lock_num;
+    }
+
+    HashBucketArray &getBuckets(int bucket_num) {
+        return *stripes[mutexForBucket(bucket_num)].buckets;
+    }
+
+    int bucketIndex(int bucket_num) const {
+        return bucket_num / static_cast<int>(n_locks);
+    }
+
+    void link(StoredValue *v, int bucket_num, uint8_t tag) {
+        getBuckets(bucket_num).link(v, bucketIndex(bucket_num), tag);
+    }
+
+    void migrateOnAccess(HashTableStripe &s, uint64_t h);
+    void migrateBucket(HashTableStripe &s, size_t old_bucket);
+    void migrateBuckets(HashTableStripe &s, size_t nbuckets);
+    void releaseOldBuckets(HashTableStripe &s);
+    void notePause(hrtime_t start);
+
+    //! Old buckets migrated along with each access to a resizing stripe.
+    static const size_t MIGRATE_ON_ACCESS = 2;
+
     inline int mutexForBucket(int bucket_num) {
         assert(isActive());
         assert(bucket_num >= 0);
@@ -19,6 +19,7 @@
 
 #include <limits>
 
+#include "compressor.h"
 #include "dispatcher.h"
 #include "ep_engine.h"
 #define STATWRITER_NAMESPACE tap
@@ -155,6 +156,10 @@ public:
             config.setBgMaxPending(value);
         } else if (key.compare("tap_backlog_limit") == 0) {
             config.setBackfillBacklogLimit(value);
+        } else if (key.compare("tap_backfill_disk_rate") == 0) {
+            config.setBackfillDiskRate(value);
+        } else if (key.compare("tap_compression_threshold") == 0) {
+            config.setCompressionThreshold(value);
         }
     }
 
@@ -185,6 +190,8 @@ TapConfig::TapConfig(EventuallyPersistentEngine &e)
     requeueSleepTime = config.getTapRequeueSleepTime();
     backfillBacklogLimit = config.getTapBacklogLimit();
     backfillResidentThreshold = config.getTapBackfillResident();
+    backfillDiskRate = config.getTapBackfillDiskRate();
+    compressionThreshold = config.getTapCompressionThreshold();
 }
 
 void TapConfig::addConfigChangeListener(EventuallyPersistentEngine &engine) {
@@ -207,6 +214,10 @@ void TapConfig::addConfigChangeListener(EventuallyPersistentEngine &engine) {
                               new TapConfigChangeListener(engine.getTapConfig()));
     configuration.addValueChangedListener("tap_backfill_resident",
                               new TapConfigChangeListener(engine.getTapConfig()));
+    configuration.addValueChangedListener("tap_backfill_disk_rate",
+                              new TapConfigChangeListener(engine.getTapConfig()));
+    configuration.addValueChangedListener("tap_compression_threshold",
+                              new TapConfigChangeListener(engine.getTapConfig()));
 }
 
 TapProducer::TapProducer(EventuallyPersistentEngine &theEngine,
@@ -228,7 +239,6 @@ TapProducer::TapProducer(EventuallyPersistentEngine &theEngine,
     doRunBackfill(false),
     backfillCompleted(true),
     pendingBackfillCounter(0),
-    diskBackfillCounter(0),
     totalBackfillBacklogs(0),
     vbucketFilter(),
     queueMemSize(0),
@@ -245,8 +255,12 @@ TapProducer::TapProducer(EventuallyPersistentEngine &theEngine,
     isSeqNumRotated(false),
     numNoops(0),
     tapFlagByteorderSupport(false),
+    tapFlagCompressSupport(false),
     specificData(NULL),
-    backfillTimestamp(0)
+    backfillTimestamp(0),
+    diskBackfillBytes(0),
+    diskBackfillStart(0),
+    diskBackfillLast(0)
 {
     evaluateFlags();
     queue = new std::list<queued_item>;
@@ -615,6 +629,10 @@ void TapProducer::clearQueues_UNLOCKED() {
     mem_overhead += (queueSize * sizeof(queued_item));
     queueSize = 0;
     queueMemSize = 0;
+    while (!fetchedItems.empty()) {
+        delete fetchedItems.front().gv.getValue();
+        fetchedItems.pop();
+    }
 
     // Clear bg-fetched items.
     while (!backfilledItems.empty()) {
@@ -1093,9 +1111,11 @@ public:
             RCPtr<VBucket> vb = epstore->getVBucket(vbucket);
             if (vb) {
                 int bucket_num(0);
-                LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
+                uint8_t tag(0);
+                LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num, &tag);
                 StoredValue *v = epstore->fetchValidValue(vb, key, bucket_num,
-                                                          false, false, true);
+                                                          tag, false, false,
+                                                          true);
                 if (v) {
                     rowid = v->getId();
                     lh.unlock();
@@ -1192,6 +1212,13 @@ void TapProducer::completeBGFetchJob(Item *itm, uint16_t vbid, bool implicitEnqu
         if (it != tapCheckpointState.end()) {
             ++(it->second.bgJobIssued);
         }
+        if (itm) {
+            diskBackfillLast = gethrtime();
+            if (diskBackfillStart == 0) {
+                diskBackfillStart = diskBackfillLast;
+            }
+            diskBackfillBytes += itm->getNKey() + itm->getNBytes();
+        }
     }
     ++bgJobCompleted;
     if (it != tapCheckpointState.end()) {
@@ -1253,7 +1280,8 @@ void TapProducer::addStats(ADD_STAT add_stat, const void *c) {
     addStat("suspended", isSuspended(), add_stat, c);
     addStat("paused", paused, add_stat, c);
     addStat("pending_backfill", isPendingBackfill_UNLOCKED(), add_stat, c);
-    addStat("pending_disk_backfill", diskBackfillCounter > 0, add_stat, c);
+    addStat("pending_disk_backfill", !diskBackfillVBuckets.empty(), add_stat, c);
+    addStat("disk_backfill_vbuckets", diskBackfillVBuckets.size(), add_stat, c);
     addStat("backfill_completed", isBackfillCompleted_UNLOCKED(), add_stat, c);
     addStat("backfill_start_timestamp", backfillTimestamp, add_stat, c);
 
@@ -1263,6 +1291,9 @@ void TapProducer::addStats(ADD_STAT add_stat, const void *c) {
     addStat("queue_backoff", getQueueBackoff(), add_stat, c);
     addStat("queue_backfillremaining", getBackfillRemaining_UNLOCKED(), add_stat, c);
     addStat("queue_itemondisk", bgJobIssued - bgJobCompleted, add_stat, c);
+    addStat("queue_backfill_occupancy", getBackfillOccupancy_UNLOCKED(), add_stat, c);
+    addStat("backfill_disk_bytes", diskBackfillBytes, add_stat, c);
+    addStat("backfill_disk_rate", getDiskBackfillRate_UNLOCKED(), add_stat, c);
     addStat("total_backlog_size",
             getBackfillRemaining_UNLOCKED() + getRemainingOnCheckpoints_UNLOCKED(),
             add_stat, c);
@@ -1290,6 +1321,19 @@ void TapProducer::addStats(ADD_STAT add_stat, const void *c) {
         addStat("flag_byteorder_support", true, add_stat, c);
     }
 
+    if (tapFlagCompressSupport) {
+        addStat("flag_compress_support", true, add_stat, c);
+        addStat("compressed_items", numCompressed, add_stat, c);
+        addStat("compressed_bytes_in", compressBytesIn, add_stat, c);
+        addStat("compressed_bytes_out", compressBytesOut, add_stat, c);
+        size_t in = compressBytesIn;
+        if (in > 0) {
+            addStat("compression_ratio", compressBytesOut * 100 / in,
+                    add_stat, c);
+        }
+        addStat("compress_time", compressTime / 1000, add_stat, c);
+    }
+
     std::set<uint16_t> vbs = vbucketFilter.getVBSet();
     if (vbs.empty()) {
         std::vector<int> ids = engine.getEpStore()->getVBuckets().getBuckets();
@@ -1309,6 +1353,29 @@ void TapProducer::addStats(ADD_STAT add_stat, const void *c) {
     }
 }
 
+bool TapProducer::compressValue(Item &itm) {
+    const value_t &value = itm.getValue();
+    if (!tapFlagCompressSupport || !value ||
+        value->length() < engine.getTapConfig().getCompressionThreshold()) {
+        return false;
+    }
+
+    hrtime_t start = gethrtime();
+    size_t len = value->length();
+    // Not worth sending the compressed form if it saves less than 1/8th.
+    compressBuffer.resize(len - len / 8);
+    size_t n = Compressor::compress(value->getData(), len,
+                                    &compressBuffer[0], compressBuffer.size());
+    if (n > 0) {
+        itm.setValue(value_t(Blob::New(&compressBuffer[0], n)));
+        ++numCompressed;
+        compressBytesIn.incr(len);
+        compressBytesOut.incr(n);
+    }
+    compressTime.incr(gethrtime() - start);
+    return n > 0;
+}
+
 void TapProducer::aggregateQueueStats(TapCounter* aggregator) {
     LockHolder lh(queueLock);
     if (!aggregator) {
@@ -1322,6 +1389,9 @@ void TapProducer::aggregateQueueStats(TapCounter* aggregator) {
     aggregator->tap_queueBackoff += numTapNack;
     aggregator->tap_queueBackfillRemaining += getBackfillRemaining_UNLOCKED();
     aggregator->tap_queueItemOnDisk += (bgJobIssued - bgJobCompleted);
+    aggregator->tap_backfillQueue += getBackfillQueueSize_UNLOCKED();
+    aggregator->tap_backfillDiskBytes += diskBackfillBytes;
+    aggregator->tap_backfillDiskRate += getDiskBackfillRate_UNLOCKED();
     aggregator->tap_totalBacklogSize += getBackfillRemaining_UNLOCKED() +
                                         getRemainingOnCheckpoints_UNLOCKED();
 }
@@ -1335,12 +1405,109 @@ void TapProducer::processedEvent(tap_event_t event, ENGINE_ERROR_CODE)
 TapConsumer::TapConsumer(EventuallyPersistentEngine &theEngine,
                          const void *c,
                          const std::string &n) :
-    TapConnection(theEngine, c, n)
+    TapConnection(theEngine, c, n), batchVBucket(0), batchMeta(false),
+    batchBackfill(false), batchFailed(false),
+    batchSize(theEngine.getConfiguration().getTapConsumerBatchSize())
 {
     setSupportAck(true);
     setLogHeader("TAP (Consumer) " + getName() + " -");
 }
 
+TapConsumer::~TapConsumer() {
+    std::vector<Item*>::iterator it;
+    for (it = batch.begin(); it != batch.end(); ++it) {
+        delete *it;
+    }
+}
+
+ENGINE_ERROR_CODE TapConsumer::batchMutation(Item *itm, bool meta,
+                                             uint8_t nru, bool ack) {
+    uint16_t vbucket = itm->getVBucketId();
+    bool backfill = isBackfillPhase(vbucket);
+
+    LockHolder lh(batchLock);
+    if (!batch.empty() && (batchVBucket != vbucket || batchMeta != meta ||
+                           batchBackfill != backfill)) {
+        ENGINE_ERROR_CODE ret = applyBatch_UNLOCKED(false);
+        if (ret != ENGINE_SUCCESS) {
+            delete itm;
+            return ret;
+        }
+    }
+
+    batch.push_back(itm);
+    batchNRUs.push_back(nru);
+    batchVBucket = vbucket;
+    batchMeta = meta;
+    batchBackfill = backfill;
+
+    if (ack || batch.size() >= batchSize || batchFailed) {
+        return applyBatch_UNLOCKED(true);
+    }
+    return ENGINE_SUCCESS;
+}
+
+Blob *TapConsumer::decompressValue(const void *data, size_t ndata) {
+    hrtime_t start = gethrtime();
+    const char *in = static_cast<const char*>(data);
+    size_t len = Compressor::getDecompressedLength(in, ndata);
+    if (len == 0 || len > engine.getConfiguration().getMaxItemSize()) {
+        return NULL;
+    }
+    Blob *blob = Blob::New(len);
+    if (!Compressor::decompress(in, ndata, const_cast<char*>(blob->getData()),
+                                len)) {
+        Blob::Destroy(blob);
+        return NULL;
+    }
+    ++numDecompressed;
+    decompressTime.incr(gethrtime() - start);
+    return blob;
+}
+
+ENGINE_ERROR_CODE TapConsumer::applyBatch() {
+    LockHolder lh(batchLock);
+    return applyBatch_UNLOCKED(false);
+}
+
+ENGINE_ERROR_CODE TapConsumer::applyBatch_UNLOCKED(bool reportLast) {
+    ENGINE_ERROR_CODE ret = ENGINE_SUCCESS;
+    if (!batch.empty() && !batchFailed) {
+        std::vector<ENGINE_ERROR_CODE> results;
+        engine.getEpStore()->setTAPMulti(batchVBucket, batch, batchNRUs,
+                                         batchMeta, batchBackfill, results);
+        ++numBatches;
+        // The last mutation may still be answered with its own result.
+        size_t answered = reportLast ? batch.size() - 1 : batch.size();
+        for (size_t i = 0; i < answered; ++i) {
+            if (results[i] != ENGINE_SUCCESS) {
+                ++numMutationFailed;
+                batchFailed = true;
+            }
+        }
+        if (reportLast) {
+            ret = results.back();
+        }
+        if (!supportsCheckpointSync()) {
+            checkVBOpenCheckpoint(batchVBucket);
+        }
+    }
+
+    std::vector<Item*>::iterator it;
+    for (it = batch.begin(); it != batch.end(); ++it) {
+        delete *it;
+    }
+    batch.clear();
+    batchNRUs.clear();
+
+    if (batchFailed) {
+        LOG(EXTENSION_LOG_WARNING, "%s Failed to apply a batch of tap "
+            "mutations. Force disconnect\n", logHeader());
+        ret = ENGINE_DISCONNECT;
+    }
+    return ret;
+}
+
 void TapConsumer::addStats(ADD_STAT add_stat, const void *c) {
     TapConnection::addStats(add_stat, c);
     addStat("num_delete", numDelete, add_stat, c);
@@ -1358,6 +1525,13 @@ void TapConsumer::addStats(ADD_STAT add_stat, const void *c) {
     addStat("num_checkpoint_end", numCheckpointEnd, add_stat, c);
     addStat("num_checkpoint_end_failed", numCheckpointEndFailed, add_stat, c);
     addStat("num_unknown", numUnknown, add_stat, c);
+    if (isBatching()) {
+        addStat("num_batches", numBatches, add_stat, c);
+    }
+    if (numDecompressed > 0) {
+        addStat("decompressed_items", numDecompressed, add_stat, c);
+        addStat("decompress_time", decompressTime / 1000, add_stat, c);
+    }
 }
 
 void TapConsumer::setBackfillPhase(bool isBackfill, uint16_t vbucket) {
@@ -1559,6 +1733,18 @@ queued_item TapProducer::nextFgFetched_UNLOCKED(bool &shouldPause) {
                 continue;
             }
 
+            // Take a run of mutations under a single acquisition of the
+            // cursor where we can, and one at a time otherwise.
+            std::vector<queued_item> items;
+            if (vb->checkpointManager.nextItems(name, items, TAP_FETCH_BATCH) > 0) {
+                it->second.lastItem = false;
+                std::vector<queued_item>::iterator ii = items.begin();
+                for (; ii != items.end(); ++ii) {
+                    addEvent_UNLOCKED(*ii);
+                }
+                continue;
+            }
+
             bool isLastItem = false;
             queued_item qi = vb->checkpointManager.nextItem(name, isLastItem);
             switch(qi->getOperation()) {
@@ -1632,18 +1818,7 @@ queued_item TapProducer::nextFgFetched_UNLOCKED(bool &shouldPause) {
     }
 
     if (!queue->empty()) {
-        queued_item qi = queue->front();
-        queue->pop_front();
-        queueSize = queue->empty() ? 0 : queueSize - 1;
-        if (queueMemSize > sizeof(queued_item)) {
-            queueMemSize.decr(sizeof(queued_item));
-        } else {
-            queueMemSize.set(0);
-        }
-        stats.memOverhead.decr(sizeof(queued_item));
-        assert(stats.memOverhead.get() < GIGANTOR);
-        ++recordsFetched;
-        return qi;
+        return popQueue_UNLOCKED();
     }
 
     if (!isBackfillCompleted_UNLOCKED()) {
@@ -1653,6 +1828,57 @@ queued_item TapProducer::nextFgFetched_UNLOCKED(bool &shouldPause) {
     return empty_item;
 }
 
+queued_item TapProducer::popQueue_UNLOCKED() {
+    queued_item qi = queue->front();
+    queue->pop_front();
+    queueSize = queue->empty() ? 0 : queueSize - 1;
+    if (queueMemSize > sizeof(queued_item)) {
+        queueMemSize.decr(sizeof(queued_item));
+    } else {
+        queueMemSize.set(0);
+    }
+    stats.memOverhead.decr(sizeof(queued_item));
+    assert(stats.memOverhead.get() < GIGANTOR);
+    ++recordsFetched;
+    return qi;
+}
+
+void TapProducer::fetchBatch_UNLOCKED(const queued_item &first) {
+    uint16_t vbid = first->getVBucketId();
+    if (!vbucketFilter(vbid)) {
+        return;
+    }
+
+    std::vector<queued_item> items(1, first);
+    while (items.size() < TAP_FETCH_BATCH && !queue->empty() &&
+           queue->front()->getVBucketId() == vbid) {
+        items.push_back(popQueue_UNLOCKED());
+    }
+
+    // Only mutations need their values.
+    std::vector<queued_item> sets;
+    std::vector<queued_item>::iterator it = items.begin();
+    for (; it != items.end(); ++it) {
+        if ((*it)->getOperation() == queue_op_set) {
+            sets.push_back(*it);
+        }
+    }
+    std::vector<GetValue> values;
+    if (!sets.empty()) {
+        engine.getEpStore()->getMulti(vbid, sets, values);
+    }
+
+    std::vector<GetValue>::iterator vit = values.begin();
+    for (it = items.begin(); it != items.end(); ++it) {
+        if ((*it)->getOperation() == queue_op_set) {
+            fetchedItems.push(TapFetchedItem(*it, *vit));
+            ++vit;
+        } else {
+            fetchedItems.push(TapFetchedItem(*it, GetValue()));
+        }
+    }
+}
+
 size_t TapProducer::getRemainingOnCheckpoints_UNLOCKED() {
     size_t numItems = 0;
     const VBucketMap &vbuckets = engine.getEpStore()->getVBuckets();
@@ -1850,21 +2076,31 @@ Item* TapProducer::getNextItem(const void *c, uint16_t *vbucket, tap_event_t &re
             return NULL;
         }
 
-        bool shouldPause = false;
-        qi = nextFgFetched_UNLOCKED(shouldPause);
-        if (qi.get() == NULL) {
-            ret = shouldPause ? TAP_PAUSE : TAP_NOOP;
-            return NULL;
+        if (fetchedItems.empty()) {
+            bool shouldPause = false;
+            qi = nextFgFetched_UNLOCKED(shouldPause);
+            if (qi.get() == NULL) {
+                ret = shouldPause ? TAP_PAUSE : TAP_NOOP;
+                return NULL;
+            }
+            fetchBatch_UNLOCKED(qi);
+            if (fetchedItems.empty()) {
+                ret = TAP_NOOP;
+                return NULL;
+            }
         }
+
+        qi = fetchedItems.front().qi;
+        GetValue gv(fetchedItems.front().gv);
+        fetchedItems.pop();
         *vbucket = qi->getVBucketId();
         if (!vbucketFilter(*vbucket)) {
+            delete gv.getValue();
             ret = TAP_NOOP;
             return NULL;
         }
 
         if (qi->getOperation() == queue_op_set) {
-            GetValue gv(engine.getEpStore()->get(qi->getKey(), qi->getVBucketId(),
-                                                 c, false, false, false));
             ENGINE_ERROR_CODE r = gv.getStatus();
             if (r == ENGINE_SUCCESS) {
                 itm = gv.getValue();
@@ -2052,10 +2288,24 @@ size_t TapProducer::getBackfillQueueSize_UNLOCKED() {
     return backfillCompleted ? 0 : getQueueSize_UNLOCKED();
 }
 
+size_t TapProducer::getBackfillOccupancy_UNLOCKED() {
+    size_t limit = engine.getTapConfig().getBackfillBacklogLimit();
+    return limit == 0 ? 0 : getBackfillQueueSize_UNLOCKED() * 100 / limit;
+}
+
+size_t TapProducer::getDiskBackfillRate_UNLOCKED() {
+    hrtime_t elapsed = diskBackfillLast - diskBackfillStart;
+    if (elapsed < 1000000) {
+        return 0;
+    }
+    return static_cast<size_t>(diskBackfillBytes * 1000000000.0 / elapsed);
+}
+
 size_t TapProducer::getQueueSize_UNLOCKED() {
     bgResultSize = backfilledItems.empty() ? 0 : bgResultSize.get();
     queueSize = queue->empty() ? 0 : queueSize;
-    return bgResultSize + (bgJobIssued - bgJobCompleted) + queueSize;
+    return bgResultSize + (bgJobIssued - bgJobCompleted) + queueSize +
+        fetchedItems.size();
 }
 
 void TapProducer::incrBackfillRemaining(size_t incr) {
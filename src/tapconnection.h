@@ -28,11 +28,22 @@
 #include <vector>
 
 #include "atomic.h"
+#include "callbacks.h"
 #include "common.h"
 #include "locks.h"
 #include "mutex.h"
 #include "vbucket.h"
 
+/**
+ * TAP_CONNECT flag asking the producer to compress the values it sends.
+ */
+#define TAP_CONNECT_COMPRESS_VALUES 0x200
+
+/**
+ * Flag of a TAP_MUTATION whose value is compressed (see Compressor).
+ */
+#define TAP_FLAG_COMPRESSED 0x08
+
 // forward decl
 class EventuallyPersistentEngine;
 class TapConnMap;
@@ -49,6 +60,7 @@ struct PopulateEventsBody;
 
 #define MAX_TAP_KEEP_ALIVE 3600
 #define MAX_TAKEOVER_TAP_LOG_SIZE 10
+#define TAP_FETCH_BATCH 64
 #define MINIMUM_BACKFILL_RESIDENT_THRESHOLD 0.7
 #define DEFAULT_BACKFILL_RESIDENT_THRESHOLD 0.9
 
@@ -136,7 +148,8 @@ struct TapCounter {
     TapCounter()
         : tap_queue(0), totalTaps(0),
           tap_queueFill(0), tap_queueDrain(0), tap_queueBackoff(0),
-          tap_queueBackfillRemaining(0), tap_queueItemOnDisk(0), tap_totalBacklogSize(0)
+          tap_queueBackfillRemaining(0), tap_queueItemOnDisk(0), tap_totalBacklogSize(0),
+          tap_backfillQueue(0), tap_backfillDiskBytes(0), tap_backfillDiskRate(0)
     {}
 
     size_t      tap_queue;
@@ -148,6 +161,10 @@ struct TapCounter {
     size_t      tap_queueBackfillRemaining;
     size_t      tap_queueItemOnDisk;
     size_t      tap_totalBacklogSize;
+
+    size_t      tap_backfillQueue;
+    size_t      tap_backfillDiskBytes;
+    size_t      tap_backfillDiskRate;
 };
 
 typedef enum {
@@ -193,6 +210,18 @@ public:
     tap_checkpoint_state state;
 };
 
+/**
+ * A live stream mutation whose value was looked up along with the rest
+ * of its batch, waiting to be sent.
+ */
+class TapFetchedItem {
+public:
+    TapFetchedItem(const queued_item &q, const GetValue &v) : qi(q), gv(v) {}
+
+    queued_item qi;
+    GetValue gv;
+};
+
 /**
  * A class containing the config parameters for TAP module.
  */
@@ -235,6 +264,14 @@ public:
         return backfillResidentThreshold;
     }
 
+    size_t getBackfillDiskRate() const {
+        return backfillDiskRate;
+    }
+
+    size_t getCompressionThreshold() const {
+        return compressionThreshold;
+    }
+
 protected:
     friend class TapConfigChangeListener;
     friend class EventuallyPersistentEngine;
@@ -278,6 +315,14 @@ protected:
         backfillResidentThreshold = value;
     }
 
+    void setBackfillDiskRate(size_t value) {
+        backfillDiskRate = value;
+    }
+
+    void setCompressionThreshold(size_t value) {
+        compressionThreshold = value;
+    }
+
     static void addConfigChangeListener(EventuallyPersistentEngine &engine);
 
 private:
@@ -300,6 +345,10 @@ private:
     // Parameters to control the backfill
     size_t backfillBacklogLimit;
     double backfillResidentThreshold;
+    size_t backfillDiskRate;
+
+    //! Smallest value a producer compresses for clients asking for it
+    size_t compressionThreshold;
 
     EventuallyPersistentEngine &engine;
 };
@@ -549,11 +598,73 @@ private:
     Atomic<size_t> numCheckpointEnd;
     Atomic<size_t> numCheckpointEndFailed;
     Atomic<size_t> numUnknown;
+    Atomic<size_t> numBatches;
+    Atomic<size_t> numDecompressed;
+    Atomic<hrtime_t> decompressTime;
+
+    //! Mutations received but not applied yet, all for the same vbucket.
+    Mutex batchLock;
+    std::vector<Item*> batch;
+    std::vector<uint8_t> batchNRUs;
+    uint16_t batchVBucket;
+    bool batchMeta;
+    bool batchBackfill;
+    //! A mutation already answered with success failed to apply.
+    bool batchFailed;
+    const size_t batchSize;
+
+    ENGINE_ERROR_CODE applyBatch_UNLOCKED(bool reportLast);
 
 public:
     TapConsumer(EventuallyPersistentEngine &theEngine,
                 const void *c,
                 const std::string &n);
+    virtual ~TapConsumer();
+
+    /**
+     * Are mutations applied in batches rather than as they arrive?
+     */
+    bool isBatching() const {
+        return batchSize > 1;
+    }
+
+    /**
+     * Add a mutation to the batch of its vbucket, taking ownership of
+     * the item.  A batch for another vbucket is applied first.  The
+     * batch is applied when it is full, or right away if the producer
+     * expects an ack for this mutation.
+     *
+     * A mutation may be answered with success before it is applied.
+     * Should it fail later on, the connection is disconnected so the
+     * producer resends everything it didn't get an ack for.
+     *
+     * @param itm the mutation
+     * @param meta the item carries its meta data
+     * @param nru the nru bit for the item
+     * @param ack the producer expects an ack for this mutation
+     * @return the result of this mutation if it was applied,
+     *         ENGINE_SUCCESS if it was only buffered, or
+     *         ENGINE_DISCONNECT if an earlier mutation failed
+     */
+    ENGINE_ERROR_CODE batchMutation(Item *itm, bool meta, uint8_t nru,
+                                    bool ack);
+
+    /**
+     * Apply the mutations buffered so far.
+     *
+     * @return ENGINE_DISCONNECT if any buffered mutation failed
+     */
+    ENGINE_ERROR_CODE applyBatch();
+
+    /**
+     * Decompress the value of a mutation sent with TAP_FLAG_COMPRESSED.
+     *
+     * @param data the compressed value
+     * @param ndata the size of the compressed value
+     * @return the value, or NULL if it is corrupt
+     */
+    Blob *decompressValue(const void *data, size_t ndata);
+
     virtual void processedEvent(tap_event_t event, ENGINE_ERROR_CODE ret);
     virtual void addStats(ADD_STAT add_stat, const void *c);
     virtual const char *getType() const { return "consumer"; };
@@ -593,17 +704,20 @@ public:
         completeBackfillCommon_UNLOCKED();
     }
 
-    void scheduleDiskBackfill() {
+    void scheduleDiskBackfill(uint16_t vbid) {
         LockHolder lh(queueLock);
-        ++diskBackfillCounter;
+        diskBackfillVBuckets.insert(vbid);
     }
 
-    void completeDiskBackfill() {
+    void completeDiskBackfill(uint16_t vbid) {
         LockHolder lh(queueLock);
-        if (diskBackfillCounter > 0) {
-            --diskBackfillCounter;
+        std::multiset<uint16_t>::iterator it = diskBackfillVBuckets.find(vbid);
+        if (it != diskBackfillVBuckets.end()) {
+            diskBackfillVBuckets.erase(it);
+        }
+        if (!checkBackfillCompletion_UNLOCKED()) {
+            completeBackfillCommon_UNLOCKED();
         }
-        completeBackfillCommon_UNLOCKED();
     }
 
     /**
@@ -646,6 +760,23 @@ public:
         return tapFlagByteorderSupport;
     }
 
+    void setTapFlagCompressSupport(bool enable) {
+        tapFlagCompressSupport = enable;
+    }
+    bool haveTapFlagCompressSupport(void) const {
+        return tapFlagCompressSupport;
+    }
+
+    /**
+     * Replace the value of a mutation about to be sent with its
+     * compressed form, if the client asked for compressed values and
+     * compressing it is worth it.
+     *
+     * @param itm the mutation being sent
+     * @return true if the value was compressed
+     */
+    bool compressValue(Item &itm);
+
     bool isReconnected() const {
         return reconnects > 0;
     }
@@ -750,6 +881,18 @@ private:
      */
     queued_item nextFgFetched_UNLOCKED(bool &shouldPause);
 
+    /**
+     * Take the next item off the live stream queue.
+     */
+    queued_item popQueue_UNLOCKED();
+
+    /**
+     * Look up the values of an item fetched from memory and of the
+     * items of the same vbucket queued right behind it in one go, and
+     * move them to fetchedItems.
+     */
+    void fetchBatch_UNLOCKED(const queued_item &first);
+
     void addVBucketHighPriority_UNLOCKED(TapVBucketEvent &ev) {
         vBucketHighPriority.push(ev);
     }
@@ -821,7 +964,8 @@ private:
     }
 
     bool hasItemFromVBHashtable_UNLOCKED() {
-        return !queue->empty() || hasNextFromCheckpoints_UNLOCKED();
+        return !fetchedItems.empty() || !queue->empty() ||
+               hasNextFromCheckpoints_UNLOCKED();
     }
 
     bool hasItemFromDisk_UNLOCKED() {
@@ -862,6 +1006,18 @@ private:
 
     size_t getBackfillQueueSize_UNLOCKED();
 
+    /**
+     * Get how full the backfill queue is, in percent of the backfill
+     * backlog limit.
+     */
+    size_t getBackfillOccupancy_UNLOCKED();
+
+    /**
+     * Get the rate in bytes/sec at which items were read from disk for
+     * the backfill.
+     */
+    size_t getDiskBackfillRate_UNLOCKED();
+
     size_t getQueueSize_UNLOCKED();
 
     size_t getQueueMemory() {
@@ -918,14 +1074,15 @@ private:
 
     bool isPendingDiskBackfill() {
         LockHolder lh(queueLock);
-        return diskBackfillCounter > 0;
+        return !diskBackfillVBuckets.empty();
     }
 
     /**
      * A backfill is pending if the backfill thread is still running
      */
     bool isPendingBackfill_UNLOCKED() {
-        return doRunBackfill || pendingBackfillCounter > 0 || diskBackfillCounter > 0;
+        return doRunBackfill || pendingBackfillCounter > 0 ||
+            !diskBackfillVBuckets.empty();
     }
 
     bool isPendingBackfill() {
@@ -1080,6 +1237,8 @@ private:
     std::list<queued_item> *queue;
     //! Live stream queue size
     size_t queueSize;
+    //! Live stream items taken off the queue with their values looked up
+    std::queue<TapFetchedItem> fetchedItems;
     //! Queue of items backfilled from disk
     std::queue<Item*> backfilledItems;
     //! List of items that are waiting for acks from the client
@@ -1126,8 +1285,9 @@ private:
     bool backfillCompleted;
     //! Number of pending backfill tasks
     size_t pendingBackfillCounter;
-    //! Number of vbuckets that are currently scheduled for disk backfill.
-    size_t diskBackfillCounter;
+    //! Vbuckets that are currently scheduled for disk backfill, once
+    //! for every read scheduled.
+    std::multiset<uint16_t> diskBackfillVBuckets;
     //! Total backfill backlogs
     size_t totalBackfillBacklogs;
 
@@ -1185,11 +1345,26 @@ private:
     //! Does the Tap Consumer know about the byteorder bug for the flags
     bool tapFlagByteorderSupport;
 
+    //! Does the Tap Consumer want compressed values
+    bool tapFlagCompressSupport;
+    //! Scratch space values are compressed into
+    std::vector<char> compressBuffer;
+    Atomic<size_t> numCompressed;
+    Atomic<size_t> compressBytesIn;
+    Atomic<size_t> compressBytesOut;
+    Atomic<hrtime_t> compressTime;
+
     //! EP-engine specific item info
     uint8_t *specificData;
     //! Timestamp of backfill start
     time_t backfillTimestamp;
 
+    //! Bytes of keys and values received from disk backfills
+    Atomic<size_t> diskBackfillBytes;
+    //! When the first and the latest item were received from disk
+    hrtime_t diskBackfillStart;
+    hrtime_t diskBackfillLast;
+
     DISALLOW_COPY_AND_ASSIGN(TapProducer);
 };
 
@@ -94,6 +94,21 @@ TapConnMap::TapConnMap(EventuallyPersistentEngine &theEngine) :
 }
 
 void TapConnMap::disconnect(const void *cookie, int tapKeepAlive) {
+    // Apply what a consumer batched before it goes away, outside of
+    // notifySync.  It stays in the map until below, so it isn't reaped
+    // in the meantime.
+    TapConsumer *consumer = NULL;
+    {
+        LockHolder lh(notifySync);
+        std::map<const void*, TapConnection*>::iterator iter(map.find(cookie));
+        if (iter != map.end()) {
+            consumer = dynamic_cast<TapConsumer*>(iter->second);
+        }
+    }
+    if (consumer && consumer->isBatching()) {
+        consumer->applyBatch();
+    }
+
     LockHolder lh(notifySync);
     std::map<const void*, TapConnection*>::iterator iter(map.find(cookie));
     if (iter != map.end()) {
@@ -315,6 +330,7 @@ TapProducer *TapConnMap::newProducer(const void* cookie,
     }
 
     tap->setTapFlagByteorderSupport((flags & TAP_CONNECT_TAP_FIX_FLAG_BYTEORDER) != 0);
+    tap->setTapFlagCompressSupport((flags & TAP_CONNECT_COMPRESS_VALUES) != 0);
     tap->setBackfillAge(backfillAge, reconnect);
     tap->setRegisteredClient(isRegistered);
     tap->setClosedCheckpointOnlyFlag(closedCheckpointOnly);
@@ -478,6 +494,7 @@ void TapConnMap::notifyIOThreadMain() {
     }
 
     std::list<TapConnection*> deadClients;
+    std::list<TapConsumer*> batching;
 
     LockHolder lh(notifySync);
     // We should pause unless we purged some connections or
@@ -497,6 +514,12 @@ void TapConnMap::notifyIOThreadMain() {
             } else if (addNoop) {
                 tp->setTimeForNoop();
             }
+        } else {
+            // Don't let batched mutations wait for a stream gone quiet.
+            TapConsumer *tc = dynamic_cast<TapConsumer*>(iter->second);
+            if (tc && tc->isBatching()) {
+                batching.push_back(tc);
+            }
         }
     }
 
@@ -514,6 +537,13 @@ void TapConnMap::notifyIOThreadMain() {
 
     lh.unlock();
 
+    // Connections are only reaped by this thread, further down, so the
+    // consumers stay valid without the lock.
+    std::list<TapConsumer*>::iterator ci;
+    for (ci = batching.begin(); ci != batching.end(); ++ci) {
+        (*ci)->applyBatch();
+    }
+
     engine.notifyIOComplete(toNotify, ENGINE_SUCCESS);
 
     // Delete all of the dead clients
@@ -610,11 +640,11 @@ void CompleteBackfillTapOperation::perform(TapProducer *tc, void *) {
 }
 
 void CompleteDiskBackfillTapOperation::perform(TapProducer *tc, void *) {
-    tc->completeDiskBackfill();
+    tc->completeDiskBackfill(vbid);
 }
 
 void ScheduleDiskBackfillTapOperation::perform(TapProducer *tc, void *) {
-    tc->scheduleDiskBackfill();
+    tc->scheduleDiskBackfill(vbid);
 }
 
 void CompletedBGFetchTapOperation::perform(TapProducer *tc, Item *arg) {
@@ -625,6 +655,20 @@ void CompletedBGFetchTapOperation::perform(TapProducer *tc, Item *arg) {
     tc->completeBGFetchJob(arg, vbid, implicitEnqueue);
 }
 
+void CompletedDiskBackfillTapOperation::perform(TapProducer *tc,
+                                                std::vector<Item*> *arg) {
+    bool valid = connToken == tc->getConnectionToken() || tc->isReconnected();
+    std::vector<Item*>::iterator it = arg->begin();
+    for (; it != arg->end(); ++it) {
+        if (valid) {
+            tc->completeBGFetchJob(*it, vbid, true);
+        } else {
+            delete *it;
+        }
+    }
+    arg->clear();
+}
+
 bool TAPSessionStats::wasReplicationCompleted(const std::string &name) const {
     bool rv = true;
 
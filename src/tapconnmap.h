@@ -65,7 +65,11 @@ public:
  */
 class ScheduleDiskBackfillTapOperation : public TapOperation<void*> {
 public:
+    ScheduleDiskBackfillTapOperation(uint16_t vb) : vbid(vb) {}
+
     void perform(TapProducer *tc, void* arg);
+private:
+    uint16_t vbid;
 };
 
 /**
@@ -73,7 +77,11 @@ public:
  */
 class CompleteDiskBackfillTapOperation : public TapOperation<void*> {
 public:
+    CompleteDiskBackfillTapOperation(uint16_t vb) : vbid(vb) {}
+
     void perform(TapProducer *tc, void* arg);
+private:
+    uint16_t vbid;
 };
 
 /**
@@ -91,6 +99,21 @@ private:
     bool implicitEnqueue;
 };
 
+/**
+ * Hand a batch of items read from disk for the backfill to a producer.
+ * The items that can't be queued are freed, so the vector is left empty.
+ */
+class CompletedDiskBackfillTapOperation : public TapOperation<std::vector<Item*>*> {
+public:
+    CompletedDiskBackfillTapOperation(hrtime_t token, uint16_t vb) :
+        connToken(token), vbid(vb) {}
+
+    void perform(TapProducer *tc, std::vector<Item*> *arg);
+private:
+    hrtime_t connToken;
+    uint16_t vbid;
+};
+
 class TAPSessionStats {
 public:
     TAPSessionStats() : normalShutdown(true) {}
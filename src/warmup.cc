@@ -17,6 +17,8 @@
 
 #include "config.h"
 
+#include <algorithm>
+#include <deque>
 #include <limits>
 #include <list>
 #include <map>
@@ -43,49 +45,97 @@ struct WarmupCookie {
     size_t error;
 };
 
-static void batchWarmupCallback(uint16_t vbId,
-                                std::vector<std::pair<std::string, uint64_t> > &fetches,
-                                void *arg)
+struct WarmupBatches {
+    WarmupBatches(std::deque<warmup_batch_t> &q, size_t s) :
+        queue(q), batchSize(s)
+    { /* EMPTY */ }
+    std::deque<warmup_batch_t> &queue;
+    size_t batchSize;
+};
+
+static bool byRowid(const std::pair<std::string, uint64_t> &a,
+                    const std::pair<std::string, uint64_t> &b)
 {
-    WarmupCookie *c = static_cast<WarmupCookie *>(arg);
-    EPStats *stats = c->stats;
+    return a.second < b.second;
+}
 
-    if (!stats->warmupComplete.get()) {
-        vb_bgfetch_queue_t items2fetch;
-        std::vector<std::pair<std::string, uint64_t> >::iterator itm = fetches.begin();
-        for (; itm != fetches.end(); itm++) {
-            // ignore duplicate Doc seq_id, if any in access log
-            if (items2fetch.find((*itm).second) == items2fetch.end()) {
-                continue;
-            }
-            VBucketBGFetchItem *fit =
-                new VBucketBGFetchItem((*itm).first, (*itm).second, NULL);
-            items2fetch[(*itm).second].push_back(fit);
+/**
+ * Split the keys of a vbucket into batches, in the order of their
+ * rowids, which is the order they're found on disk.
+ */
+static void queueWarmupBatches(uint16_t vbId,
+                               std::vector<std::pair<std::string, uint64_t> > &fetches,
+                               void *arg)
+{
+    WarmupBatches *batches = static_cast<WarmupBatches *>(arg);
+    size_t batchSize = batches->batchSize;
+    std::sort(fetches.begin(), fetches.end(), byRowid);
+    for (size_t i = 0; i < fetches.size(); i += batchSize) {
+        size_t end = std::min(fetches.size(), i + batchSize);
+        batches->queue.push_back(warmup_batch_t(vbId,
+            std::vector<std::pair<std::string, uint64_t> >(fetches.begin() + i,
+                                                           fetches.begin() + end)));
+    }
+}
+
+/**
+ * Fetch a batch of keys with a single getMulti.
+ *
+ * @return the number of values handed to the callback
+ */
+static size_t fetchBatch(KVStore *kvstore, const warmup_batch_t &batch,
+                         Callback<GetValue> &cb)
+{
+    uint16_t vbId = batch.first;
+    vb_bgfetch_queue_t items2fetch;
+    std::vector<std::pair<std::string, uint64_t> >::const_iterator itm;
+    for (itm = batch.second.begin(); itm != batch.second.end(); ++itm) {
+        // ignore duplicate Doc seq_id, if any in access log
+        if (items2fetch.find((*itm).second) != items2fetch.end()) {
+            continue;
         }
+        VBucketBGFetchItem *fit =
+            new VBucketBGFetchItem((*itm).first, (*itm).second, NULL);
+        items2fetch[(*itm).second].push_back(fit);
+    }
 
-        c->store->getMulti(vbId, items2fetch);
-
-        vb_bgfetch_queue_t::iterator items = items2fetch.begin();
-        for (; items != items2fetch.end(); items++) {
-           VBucketBGFetchItem * fetchedItem = (*items).second.back();
-           GetValue &val = fetchedItem->value;
-           if (val.getStatus() == ENGINE_SUCCESS) {
-                c->loaded++;
-                c->cb.callback(val);
-           } else {
-                LOG(EXTENSION_LOG_WARNING, "Warning: warmup failed to load data"
-                    " for vBucket = %d key = %s error = %X\n", vbId,
-                    fetchedItem->key.c_str(), val.getStatus());
-                c->error++;
-
-          }
-          delete fetchedItem;
+    kvstore->getMulti(vbId, items2fetch);
+
+    size_t loaded = 0;
+    vb_bgfetch_queue_t::iterator items = items2fetch.begin();
+    for (; items != items2fetch.end(); items++) {
+        VBucketBGFetchItem * fetchedItem = (*items).second.back();
+        GetValue &val = fetchedItem->value;
+        if (val.getStatus() == ENGINE_SUCCESS) {
+            loaded++;
+            cb.callback(val);
+        } else {
+            LOG(EXTENSION_LOG_WARNING, "Warning: warmup failed to load data"
+                " for vBucket = %d key = %s error = %X\n", vbId,
+                fetchedItem->key.c_str(), val.getStatus());
         }
-    } else {
-        c->skipped++;
+        delete fetchedItem;
     }
+    return loaded;
 }
 
+/**
+ * Orders the batches of the active vbuckets before the others.
+ */
+class IsActiveBatch {
+public:
+    IsActiveBatch(const std::map<uint16_t, vbucket_state> &m) : vbmap(m) { }
+
+    bool operator()(const warmup_batch_t &batch) const {
+        std::map<uint16_t, vbucket_state>::const_iterator it;
+        it = vbmap.find(batch.first);
+        return it != vbmap.end() && it->second.state == vbucket_state_active;
+    }
+
+private:
+    const std::map<uint16_t, vbucket_state> &vbmap;
+};
+
 static void warmupCallback(void *arg, uint16_t vb,
                            const std::string &key, uint64_t rowid)
 {
@@ -204,33 +254,58 @@ std::ostream& operator <<(std::ostream &out, const WarmupState &state)
 //                                                                          //
 //////////////////////////////////////////////////////////////////////////////
 
+//! Items a full dump stores in the hash table at a time.
+static const size_t DUMP_BATCH_SIZE(64);
+
+//! Seconds between checks of a parallel load for completion.
+static const double LOAD_POLL_INTERVAL(0.1);
+
 /**
  * Helper class used to insert items into the storage by using
  * the KVStore::dump method to load items from the database
+ *
+ * With a batch size above one, the items of a vbucket are stored a
+ * batch at a time, with a lock per hash table stripe instead of per
+ * item.  The last batch is stored by flush().
  */
 class LoadStorageKVPairCallback : public Callback<GetValue> {
 public:
     LoadStorageKVPairCallback(EventuallyPersistentStore *ep,
-                              bool _maybeEnableTraffic, int _warmupState)
+                              bool _maybeEnableTraffic, int _warmupState,
+                              size_t _batchSize = 1)
         : vbuckets(ep->vbMap), stats(ep->getEPEngine().getEpStats()),
           epstore(ep), startTime(ep_real_time()),
           hasPurged(false), maybeEnableTraffic(_maybeEnableTraffic),
-          warmupState(_warmupState)
+          warmupState(_warmupState), batchSize(_batchSize),
+          batchPartial(false)
     {
         assert(epstore);
     }
 
+    ~LoadStorageKVPairCallback() {
+        flush();
+    }
+
     void initVBucket(uint16_t vbid,
                      const vbucket_state &vbstate);
 
     void callback(GetValue &val);
 
+    /**
+     * Store the items batched so far.
+     */
+    void flush();
+
 private:
 
     bool shouldEject() {
         return stats.getTotalMemoryUsed() >= stats.mem_low_wat;
     }
 
+    RCPtr<VBucket> getVBucket(uint16_t vbid);
+
+    bool store(RCPtr<VBucket> &vb, Item *i, bool partial, mutation_type_t rv);
+
     void purge();
 
     VBucketMap &vbuckets;
@@ -240,6 +315,10 @@ private:
     bool        hasPurged;
     bool        maybeEnableTraffic;
     int         warmupState;
+    size_t      batchSize;
+    //! Items of a single vbucket waiting to be stored
+    std::vector<Item*> batch;
+    bool        batchPartial;
 };
 
 void LoadStorageKVPairCallback::initVBucket(uint16_t vbid,
@@ -261,81 +340,39 @@ void LoadStorageKVPairCallback::initVBucket(uint16_t vbid,
     vbuckets.setPersistenceCheckpointId(vbid, vbs.checkpointId - 1);
 }
 
+RCPtr<VBucket> LoadStorageKVPairCallback::getVBucket(uint16_t vbid) {
+    RCPtr<VBucket> vb = vbuckets.getBucket(vbid);
+    if (!vb) {
+        vb.reset(new VBucket(vbid, vbucket_state_dead, stats,
+                             epstore->getEPEngine().getCheckpointConfig()));
+        vbuckets.addBucket(vb);
+    }
+    return vb;
+}
+
 void LoadStorageKVPairCallback::callback(GetValue &val) {
     Item *i = val.getValue();
     if (i != NULL) {
-        RCPtr<VBucket> vb = vbuckets.getBucket(i->getVBucketId());
-        if (!vb) {
-            vb.reset(new VBucket(i->getVBucketId(), vbucket_state_dead, stats,
-                                 epstore->getEPEngine().getCheckpointConfig()));
-            vbuckets.addBucket(vb);
-        }
-        bool succeeded(false);
-        int retry = 2;
-        do {
-            switch (vb->ht.insert(*i, shouldEject(), val.isPartial())) {
-            case NOMEM:
-                if (retry == 2) {
-                    if (hasPurged) {
-                        if (++stats.warmOOM == 1) {
-                            LOG(EXTENSION_LOG_WARNING,
-                                "Warmup dataload failure: max_size too low.");
-                        }
-                    } else {
-                        LOG(EXTENSION_LOG_WARNING,
-                            "Emergency startup purge to free space for load.");
-                        purge();
-                    }
-                } else {
-                    LOG(EXTENSION_LOG_WARNING,
-                        "Cannot store an item after emergency purge.");
-                    ++stats.warmOOM;
-                }
-                break;
-            case INVALID_CAS:
-                if (epstore->getROUnderlying()->isKeyDumpSupported()) {
-                    LOG(EXTENSION_LOG_DEBUG,
-                        "Value changed in memory before restore from disk. "
-                        "Ignored disk value for: %s.", i->getKey().c_str());
-                } else {
-                    LOG(EXTENSION_LOG_WARNING,
-                        "Warmup dataload error: Duplicate key: %s.",
-                        i->getKey().c_str());
-                }
-                ++stats.warmDups;
-                succeeded = true;
-                break;
-            case NOT_FOUND:
-                succeeded = true;
-                break;
-            default:
-                abort();
-            }
-        } while (!succeeded && retry-- > 0);
-
-        bool expired = i->isExpired(startTime);
-        if (succeeded && expired) {
-            ItemMetaData itemMeta;
-
-            ++stats.warmupExpired;
-            epstore->incExpirationStat(vb, false);
-            LOG(EXTENSION_LOG_WARNING, "Item was expired at load:  %s",
-                i->getKey().c_str());
-            uint64_t cas = 0;
-            epstore->deleteItem(i->getKey(),
-                                &cas,
-                                i->getVBucketId(), NULL,
-                                true, false, // force, use_meta
-                                &itemMeta);
-        }
-        if (succeeded && epstore->warmupTask->doReconstructLog() && !expired) {
-            epstore->mutationLog.newItem(i->getVBucketId(), i->getKey(), i->getId());
-        }
-        delete i;
         val.setValue(NULL);
-
-        if (maybeEnableTraffic) {
-            epstore->maybeEnableTraffic();
+        if (batchSize <= 1) {
+            RCPtr<VBucket> vb = getVBucket(i->getVBucketId());
+            bool partial = val.isPartial();
+            if (store(vb, i, partial,
+                      vb->ht.insert(*i, shouldEject(), partial))) {
+                epstore->warmupTask->logNewItems(std::vector<Item*>(1, i));
+            }
+            delete i;
+        } else {
+            if (!batch.empty() &&
+                (batch.front()->getVBucketId() != i->getVBucketId() ||
+                 batchPartial != val.isPartial())) {
+                flush();
+            }
+            batchPartial = val.isPartial();
+            batch.push_back(i);
+            if (batch.size() >= batchSize) {
+                flush();
+            }
         }
     }
 
@@ -354,6 +391,107 @@ void LoadStorageKVPairCallback::callback(GetValue &val) {
     }
 }
 
+void LoadStorageKVPairCallback::flush() {
+    if (batch.empty()) {
+        return;
+    }
+
+    RCPtr<VBucket> vb = getVBucket(batch.front()->getVBucketId());
+    std::vector<mutation_type_t> results;
+    vb->ht.insertMulti(batch, shouldEject(), batchPartial, results);
+
+    std::vector<Item*> stored;
+    for (size_t n = 0; n < batch.size(); ++n) {
+        if (store(vb, batch[n], batchPartial, results[n])) {
+            stored.push_back(batch[n]);
+        }
+    }
+    epstore->warmupTask->logNewItems(stored);
+
+    std::vector<Item*>::iterator it;
+    for (it = batch.begin(); it != batch.end(); ++it) {
+        delete *it;
+    }
+    batch.clear();
+}
+
+/**
+ * Handle the result of inserting an item, retrying if it didn't fit.
+ *
+ * @return true if the item should be in the mutation log
+ */
+bool LoadStorageKVPairCallback::store(RCPtr<VBucket> &vb, Item *i,
+                                      bool partial, mutation_type_t rv) {
+    bool succeeded(false);
+    int retry = 2;
+    for (;;) {
+        switch (rv) {
+        case NOMEM:
+            if (retry == 2) {
+                if (hasPurged) {
+                    if (++stats.warmOOM == 1) {
+                        LOG(EXTENSION_LOG_WARNING,
+                            "Warmup dataload failure: max_size too low.");
+                    }
+                } else {
+                    LOG(EXTENSION_LOG_WARNING,
+                        "Emergency startup purge to free space for load.");
+                    purge();
+                }
+            } else {
+                LOG(EXTENSION_LOG_WARNING,
+                    "Cannot store an item after emergency purge.");
+                ++stats.warmOOM;
+            }
+            break;
+        case INVALID_CAS:
+            if (epstore->getROUnderlying()->isKeyDumpSupported()) {
+                LOG(EXTENSION_LOG_DEBUG,
+                    "Value changed in memory before restore from disk. "
+                    "Ignored disk value for: %s.", i->getKey().c_str());
+            } else {
+                LOG(EXTENSION_LOG_WARNING,
+                    "Warmup dataload error: Duplicate key: %s.",
+                    i->getKey().c_str());
+            }
+            ++stats.warmDups;
+            succeeded = true;
+            break;
+        case NOT_FOUND:
+            succeeded = true;
+            break;
+        default:
+            abort();
+        }
+        if (succeeded || retry-- <= 0) {
+            break;
+        }
+        rv = vb->ht.insert(*i, shouldEject(), partial);
+    }
+
+    bool expired = i->isExpired(startTime);
+    if (succeeded && expired) {
+        ItemMetaData itemMeta;
+
+        ++stats.warmupExpired;
+        epstore->incExpirationStat(vb, false);
+        LOG(EXTENSION_LOG_WARNING, "Item was expired at load:  %s",
+            i->getKey().c_str());
+        uint64_t cas = 0;
+        epstore->deleteItem(i->getKey(),
+                            &cas,
+                            i->getVBucketId(), NULL,
+                            true, false, // force, use_meta
+                            &itemMeta);
+    }
+
+    if (maybeEnableTraffic) {
+        epstore->maybeEnableTraffic();
+    }
+
+    return succeeded && !expired;
+}
+
 void LoadStorageKVPairCallback::purge() {
     class EmergencyPurgeVisitor : public VBucketVisitor {
     public:
@@ -379,6 +517,65 @@ void LoadStorageKVPairCallback::purge() {
     hasPurged = true;
 }
 
+/**
+ * Dumps vbuckets for a parallel load until there are none left.
+ */
+class WarmupReader : public DispatcherCallback {
+public:
+    WarmupReader(Warmup *w, KVStore *kv, LoadStorageKVPairCallback *cb)
+        : warmup(w), kvstore(kv), loadCb(cb) { }
+
+    bool callback(Dispatcher &, TaskId &) {
+        uint16_t vbid;
+        if (warmup->nextVBucket(vbid)) {
+            kvstore->dump(vbid, loadCb);
+            loadCb->flush();
+            return true;
+        }
+        warmup->readerDone();
+        return false;
+    }
+
+    std::string description() {
+        return std::string("Loading vbuckets for warmup.");
+    }
+
+private:
+    Warmup                               *warmup;
+    KVStore                              *kvstore;
+    shared_ptr<LoadStorageKVPairCallback> loadCb;
+};
+
+/**
+ * Fetches batches of the keys of the access log until there are none
+ * left.
+ */
+class AccessLogFetcher : public DispatcherCallback {
+public:
+    AccessLogFetcher(Warmup *w, KVStore *kv, LoadStorageKVPairCallback *cb)
+        : warmup(w), kvstore(kv), loadCb(cb) { }
+
+    bool callback(Dispatcher &, TaskId &) {
+        warmup_batch_t batch;
+        if (warmup->nextBatch(batch)) {
+            warmup->accessLogKeys.incr(fetchBatch(kvstore, batch, *loadCb));
+            loadCb->flush();
+            return true;
+        }
+        warmup->readerDone();
+        return false;
+    }
+
+    std::string description() {
+        return std::string("Loading the access log for warmup.");
+    }
+
+private:
+    Warmup                               *warmup;
+    KVStore                              *kvstore;
+    shared_ptr<LoadStorageKVPairCallback> loadCb;
+};
+
 //////////////////////////////////////////////////////////////////////////////
 //                                                                          //
 //    Implementation of the warmup class                                    //
@@ -392,11 +589,24 @@ Warmup::Warmup(EventuallyPersistentStore *st, Dispatcher *d) :
     estimatedItemCount(std::numeric_limits<size_t>::max()),
     corruptMutationLog(false),
     corruptAccessLog(false),
-    estimatedWarmupCount(std::numeric_limits<size_t>::max())
+    estimatedWarmupCount(std::numeric_limits<size_t>::max()),
+    stateTime(WarmupState::Done + 1), stateStart(0),
+    numReaders(st->getEPEngine().getConfiguration().getWarmupReaders()),
+    readDispatcher(NULL), dataLoadStarted(false), accessLogFetching(false),
+    accessLogRead(false), accessLogReadTime(0)
 {
 
 }
 
+Warmup::~Warmup()
+{
+    delete readDispatcher;
+    std::vector<KVStore*>::iterator it;
+    for (it = readers.begin(); it != readers.end(); ++it) {
+        delete *it;
+    }
+}
+
 void Warmup::setEstimatedItemCount(size_t to)
 {
     estimatedItemCount = to;
@@ -428,11 +638,16 @@ void Warmup::stop(void)
         transition(WarmupState::Done, true);
         done(*dispatcher, task);
     }
+    if (readDispatcher) {
+        // Warmup is complete now, so the dumps running are cancelled.
+        readDispatcher->stop(true);
+    }
 }
 
 bool Warmup::initialize(Dispatcher&, TaskId &)
 {
     startTime = gethrtime();
+    stateStart = startTime;
     initialVbState = store->loadVBucketState();
     store->loadSessionStats();
     transition(WarmupState::LoadingMutationLog);
@@ -533,12 +748,48 @@ bool Warmup::checkForAccessLog(Dispatcher&, TaskId &)
     return true;
 }
 
-bool Warmup::loadingAccessLog(Dispatcher&, TaskId &)
+bool Warmup::loadingAccessLog(Dispatcher &d, TaskId &t)
+{
+    if (!accessLogFetching) {
+        accessLogRead = readAccessLog();
+    }
+
+    if (runningReaders.get() > 0) {
+        d.snooze(t, LOAD_POLL_INTERVAL);
+        return true;
+    }
+
+    size_t numItems = store->getEPEngine().getEpStats().warmedUpValues;
+    if (accessLogRead && numItems) {
+        LOG(EXTENSION_LOG_WARNING,
+            "%d items loaded from access log, completed in %s", numItems,
+            hrtime2text((gethrtime() - stateStart) / 1000).c_str());
+        if (doReconstructLog()) {
+            store->mutationLog.commit1();
+            store->mutationLog.commit2();
+            setReconstructLog(false);
+        }
+        stopReaders();
+        transition(WarmupState::Done);
+    } else {
+        size_t estimatedCount = store->getEPEngine().getEpStats().warmedUpKeys;
+        setEstimatedWarmupCount(estimatedCount);
+        transition(WarmupState::LoadingData);
+    }
+    return true;
+}
+
+/**
+ * Load the keys of the access log, or of the previous one if it can't
+ * be read.
+ *
+ * @return true if a log was read
+ */
+bool Warmup::readAccessLog(void)
 {
     LoadStorageKVPairCallback *load_cb = createLKVPCB(initialVbState, true,
                                                       state.getState());
     bool success = false;
-    hrtime_t stTime = gethrtime();
     if (store->accessLog.exists()) {
         try {
             store->accessLog.open();
@@ -567,41 +818,27 @@ bool Warmup::loadingAccessLog(Dispatcher&, TaskId &)
         }
     }
 
-    size_t numItems = store->getEPEngine().getEpStats().warmedUpValues;
-    if (success && numItems) {
-        LOG(EXTENSION_LOG_WARNING,
-            "%d items loaded from access log, completed in %s", numItems,
-            hrtime2text((gethrtime() - stTime) / 1000).c_str());
-        if (doReconstructLog()) {
-            store->mutationLog.commit1();
-            store->mutationLog.commit2();
-            setReconstructLog(false);
-        }
-        transition(WarmupState::Done);
-    } else {
-        size_t estimatedCount = store->getEPEngine().getEpStats().warmedUpKeys;
-        setEstimatedWarmupCount(estimatedCount);
-        transition(WarmupState::LoadingData);
-    }
-
     delete load_cb;
-    return true;
+    return success;
 }
 
 size_t Warmup::doWarmup(MutationLog &lf, const std::map<uint16_t,
                         vbucket_state> &vbmap, Callback<GetValue> &cb)
 {
     MutationLogHarvester harvester(lf, &store->getEPEngine());
+    harvester.setReaders(numReaders);
     std::map<uint16_t, vbucket_state>::const_iterator it;
     for (it = vbmap.begin(); it != vbmap.end(); ++it) {
         harvester.setVBucket(it->first);
     }
 
     hrtime_t st = gethrtime();
-    if (!harvester.load()) {
+    bool clean = harvester.load();
+    hrtime_t end = gethrtime();
+    accessLogReadTime += end - st;
+    if (!clean) {
         return -1;
     }
-    hrtime_t end = gethrtime();
 
     size_t total = harvester.total();
     setEstimatedWarmupCount(total);
@@ -609,24 +846,92 @@ size_t Warmup::doWarmup(MutationLog &lf, const std::map<uint16_t,
         hrtime2text(end - st).c_str(), total);
 
     st = gethrtime();
-    WarmupCookie cookie(store, cb);
-    if (store->multiBGFetchEnabled()) {
-        harvester.apply(&cookie, &batchWarmupCallback);
-    } else {
+    if (!store->multiBGFetchEnabled()) {
+        WarmupCookie cookie(store, cb);
         harvester.apply(&cookie, &warmupCallback);
+        accessLogKeys.incr(cookie.loaded);
+        end = gethrtime();
+        LOG(EXTENSION_LOG_DEBUG,
+            "Populated log in %s with(l: %ld, s: %ld, e: %ld)",
+            hrtime2text(end - st).c_str(), cookie.loaded, cookie.skipped,
+            cookie.error);
+        return cookie.loaded;
+    }
+
+    Configuration &config = store->getEPEngine().getConfiguration();
+    WarmupBatches batches(batchesToFetch, config.getWarmupBatchSize());
+    harvester.apply(&batches, &queueWarmupBatches);
+    std::stable_partition(batchesToFetch.begin(), batchesToFetch.end(),
+                          IsActiveBatch(vbmap));
+    if (startParallelFetch()) {
+        return total;
+    }
+
+    size_t loaded = 0;
+    warmup_batch_t batch;
+    while (nextBatch(batch)) {
+        loaded += fetchBatch(store->getROUnderlying(), batch, cb);
     }
+    batchesToFetch.clear();
+    accessLogKeys.incr(loaded);
     end = gethrtime();
-    LOG(EXTENSION_LOG_DEBUG, "Populated log in %s with(l: %ld, s: %ld, e: %ld)",
-        hrtime2text(end - st).c_str(), cookie.loaded, cookie.skipped,
-        cookie.error);
-    return cookie.loaded;
+    LOG(EXTENSION_LOG_DEBUG, "Populated log in %s with %ld values",
+        hrtime2text(end - st).c_str(), loaded);
+    return loaded;
 }
 
-bool Warmup::loadingKVPairs(Dispatcher&, TaskId &)
+/**
+ * Hand the batches of the access log to the readers, if there's more
+ * than one of each.
+ */
+bool Warmup::startParallelFetch(void)
 {
-    shared_ptr<Callback<GetValue> > cb(createLKVPCB(initialVbState, false,
-                                                    state.getState()));
-    store->roUnderlying->dump(cb);
+    size_t n = std::min(numReaders, batchesToFetch.size());
+    if (n <= 1) {
+        return false;
+    }
+
+    LOG(EXTENSION_LOG_WARNING, "Fetching %d batches of the access log with "
+        "%d readers", static_cast<int>(batchesToFetch.size()),
+        static_cast<int>(n));
+    createReaders();
+    accessLogFetching = true;
+    runningReaders.set(n);
+    for (size_t i = 0; i < n; ++i) {
+        LoadStorageKVPairCallback *load_cb =
+            new LoadStorageKVPairCallback(store, true, state.getState(),
+                                          DUMP_BATCH_SIZE);
+        shared_ptr<DispatcherCallback> cb(new AccessLogFetcher(this,
+                                                               readers[i],
+                                                               load_cb));
+        readDispatcher->schedule(cb, NULL, Priority::WarmupPriority);
+    }
+    return true;
+}
+
+/**
+ * Hand the next batch of the access log to a reader.
+ *
+ * @return false if there is nothing left to fetch
+ */
+bool Warmup::nextBatch(warmup_batch_t &batch)
+{
+    LockHolder lh(loadMutex);
+    // Traffic may be enabled before the whole access log is loaded.
+    if (batchesToFetch.empty() || store->stats.warmupComplete.get()) {
+        return false;
+    }
+    batch.first = batchesToFetch.front().first;
+    batch.second.swap(batchesToFetch.front().second);
+    batchesToFetch.pop_front();
+    return true;
+}
+
+bool Warmup::loadingKVPairs(Dispatcher &d, TaskId &t)
+{
+    if (!loadData(d, t, false)) {
+        return true;
+    }
 
     if (doReconstructLog()) {
         store->mutationLog.commit1();
@@ -637,18 +942,163 @@ bool Warmup::loadingKVPairs(Dispatcher&, TaskId &)
     return true;
 }
 
-bool Warmup::loadingData(Dispatcher&, TaskId &)
+bool Warmup::loadingData(Dispatcher &d, TaskId &t)
 {
     size_t estimatedCount = store->getEPEngine().getEpStats().warmedUpKeys;
     setEstimatedWarmupCount(estimatedCount);
 
-    shared_ptr<Callback<GetValue> > cb(createLKVPCB(initialVbState, true,
-                                       state.getState()));
-    store->roUnderlying->dump(cb);
-    transition(WarmupState::Done);
+    if (loadData(d, t, true)) {
+        transition(WarmupState::Done);
+    }
+    return true;
+}
+
+/**
+ * Dump the items of all the vbuckets, in parallel if we can.
+ *
+ * @return false until all the vbuckets are loaded
+ */
+bool Warmup::loadData(Dispatcher &d, TaskId &t, bool maybeEnable)
+{
+    if (!dataLoadStarted) {
+        dataLoadStarted = true;
+        if (!startParallelLoad(maybeEnable)) {
+            LoadStorageKVPairCallback *load_cb =
+                createLKVPCB(initialVbState, maybeEnable, state.getState(),
+                             DUMP_BATCH_SIZE);
+            shared_ptr<Callback<GetValue> > cb(load_cb);
+            store->roUnderlying->dump(cb);
+            load_cb->flush();
+            stopReaders();
+            return true;
+        }
+    }
+
+    if (runningReaders.get() > 0) {
+        d.snooze(t, LOAD_POLL_INTERVAL);
+        return false;
+    }
+    stopReaders();
+    return true;
+}
+
+bool Warmup::startParallelLoad(bool maybeEnable)
+{
+    if (numReaders <= 1 || !store->storageProperties.hasEfficientVBDump()) {
+        return false;
+    }
+
+    // Dead vbuckets aren't loaded, like in a full dump.
+    std::vector<uint16_t> replicas;
+    std::map<uint16_t, vbucket_state>::const_iterator it;
+    for (it = initialVbState.begin(); it != initialVbState.end(); ++it) {
+        if (it->second.state == vbucket_state_active) {
+            vbucketsToLoad.push_back(it->first);
+        } else if (it->second.state == vbucket_state_replica) {
+            replicas.push_back(it->first);
+        }
+    }
+    vbucketsToLoad.insert(vbucketsToLoad.end(), replicas.begin(),
+                          replicas.end());
+
+    size_t n = std::min(numReaders, vbucketsToLoad.size());
+    if (n <= 1) {
+        vbucketsToLoad.clear();
+        return false;
+    }
+
+    LOG(EXTENSION_LOG_WARNING, "Loading %d vbuckets with %d readers",
+        static_cast<int>(vbucketsToLoad.size()), static_cast<int>(n));
+    createReaders();
+    runningReaders.set(n);
+    for (size_t i = 0; i < n; ++i) {
+        LoadStorageKVPairCallback *load_cb;
+        if (i == 0) {
+            load_cb = createLKVPCB(initialVbState, maybeEnable,
+                                   state.getState(), DUMP_BATCH_SIZE);
+        } else {
+            load_cb = new LoadStorageKVPairCallback(store, maybeEnable,
+                                                    state.getState(),
+                                                    DUMP_BATCH_SIZE);
+        }
+        shared_ptr<DispatcherCallback> cb(new WarmupReader(this, readers[i],
+                                                           load_cb));
+        readDispatcher->schedule(cb, NULL, Priority::WarmupPriority);
+    }
+    return true;
+}
+
+/**
+ * Hand the next vbucket to load to a reader.
+ *
+ * @return false if there is nothing left to load
+ */
+bool Warmup::nextVBucket(uint16_t &vbid)
+{
+    LockHolder lh(loadMutex);
+    // Like a full dump, stop loading once traffic is enabled.
+    if (vbucketsToLoad.empty() || store->stats.warmupComplete.get()) {
+        return false;
+    }
+    vbid = vbucketsToLoad.front();
+    vbucketsToLoad.pop_front();
     return true;
 }
 
+/**
+ * Start a thread and a read-only store for each reader, unless an
+ * earlier phase of the warmup did.
+ */
+void Warmup::createReaders(void)
+{
+    if (readDispatcher != NULL) {
+        return;
+    }
+    readDispatcher = new Dispatcher(store->getEPEngine(), "WARMUP_Dispatcher",
+                                    numReaders);
+    for (size_t i = 0; i < numReaders; ++i) {
+        readers.push_back(store->getEPEngine().newKVStore(true));
+    }
+    readDispatcher->start();
+}
+
+/**
+ * Stop the readers' threads and close their files once no phase of the
+ * warmup needs them anymore.
+ */
+void Warmup::stopReaders(void)
+{
+    if (readers.empty()) {
+        return;
+    }
+    readDispatcher->stop();
+    std::vector<KVStore*>::iterator it;
+    for (it = readers.begin(); it != readers.end(); ++it) {
+        delete *it;
+    }
+    readers.clear();
+}
+
+void Warmup::readerDone(void)
+{
+    if (--runningReaders == 0) {
+        LOG(EXTENSION_LOG_INFO, "All the warmup readers are done");
+    }
+}
+
+void Warmup::logNewItems(const std::vector<Item*> &items)
+{
+    if (!doReconstructLog() || items.empty()) {
+        return;
+    }
+    LockHolder lh(reconstructLogMutex);
+    std::vector<Item*>::const_iterator it;
+    for (it = items.begin(); it != items.end(); ++it) {
+        store->mutationLog.newItem((*it)->getVBucketId(), (*it)->getKey(),
+                                   (*it)->getId());
+    }
+}
+
 bool Warmup::done(Dispatcher&, TaskId &)
 {
     warmup = gethrtime() - startTime;
@@ -696,6 +1146,11 @@ bool Warmup::step(Dispatcher &d, TaskId &t) {
 void Warmup::transition(int to, bool force) {
     int old = state.getState();
     if (old != WarmupState::Done) {
+        hrtime_t now = gethrtime();
+        if (stateStart != 0) {
+            stateTime[old] += now - stateStart;
+        }
+        stateStart = now;
         state.transition(to, force);
         fireStateChange(old, to);
     }
@@ -736,6 +1191,29 @@ void Warmup::addStat(const char *nm, T val, ADD_STAT add_stat,
     add_casted_stat(name.data(), value.str().data(), add_stat, c);
 }
 
+static const char *getStateStatName(int st) {
+    switch (st) {
+    case WarmupState::Initialize:
+        return "initialize";
+    case WarmupState::LoadingMutationLog:
+        return "mutation_log";
+    case WarmupState::EstimateDatabaseItemCount:
+        return "count_estimate";
+    case WarmupState::KeyDump:
+        return "key_dump";
+    case WarmupState::CheckForAccessLog:
+        return "access_log_check";
+    case WarmupState::LoadingAccessLog:
+        return "access_log";
+    case WarmupState::LoadingKVPairs:
+        return "kv_pairs";
+    case WarmupState::LoadingData:
+        return "data";
+    default:
+        return "unknown";
+    }
+}
+
 void Warmup::addStats(ADD_STAT add_stat, const void *c) const
 {
     if (store->getEPEngine().getConfiguration().isWarmup()) {
@@ -788,16 +1266,36 @@ void Warmup::addStats(ADD_STAT add_stat, const void *c) const
         } else {
             addStat("estimated_value_count", estimatedWarmupCount, add_stat, c);
         }
+
+        addStat("readers", numReaders, add_stat, c);
+        hrtime_t accessLogTime = stateTime[WarmupState::LoadingAccessLog];
+        if (accessLogTime > 0) {
+            addStat("access_log_read_time", accessLogReadTime / 1000,
+                    add_stat, c);
+            addStat("access_log_keys", accessLogKeys, add_stat, c);
+            addStat("access_log_rate",
+                    accessLogKeys * 1000000000ULL / accessLogTime,
+                    add_stat, c);
+        }
+        for (int st = WarmupState::Initialize; st < WarmupState::Done; ++st) {
+            if (stateTime[st] > 0) {
+                std::string name(getStateStatName(st));
+                addStat((name + "_time").c_str(), stateTime[st] / 1000,
+                        add_stat, c);
+            }
+        }
    } else {
         addStat(NULL, "disabled", add_stat, c);
     }
 }
 
 LoadStorageKVPairCallback *Warmup::createLKVPCB(const std::map<uint16_t, vbucket_state> &st,
-                                                bool maybeEnable, int warmupState)
+                                                bool maybeEnable, int warmupState,
+                                                size_t batchSize)
 {
     LoadStorageKVPairCallback *load_cb;
-    load_cb = new LoadStorageKVPairCallback(store, maybeEnable, warmupState);
+    load_cb = new LoadStorageKVPairCallback(store, maybeEnable, warmupState,
+                                            batchSize);
     std::map<uint16_t, vbucket_state>::const_iterator it;
     for (it = st.begin(); it != st.end(); ++it) {
         uint16_t vbid = it->first;
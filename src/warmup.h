@@ -19,10 +19,12 @@
 
 #include "config.h"
 
+#include <deque>
 #include <list>
 #include <map>
 #include <ostream>
 #include <string>
+#include <vector>
 
 #include "ep.h"
 
@@ -61,11 +63,29 @@ public:
 };
 
 class LoadStorageKVPairCallback;
+class WarmupReader;
+class AccessLogFetcher;
 
+//! Keys of a vbucket to fetch at once, with their rowids.
+typedef std::pair<uint16_t, std::vector<std::pair<std::string, uint64_t> > >
+    warmup_batch_t;
+
+/**
+ * Loads the data from disk when the engine starts.
+ *
+ * With warmup_readers above one, a full dump of the vbuckets is read
+ * by that many threads, each through a read-only store of its own,
+ * the active vbuckets first.  The keys of an access log are fetched
+ * the same way, in batches sorted by rowid, after the log itself was
+ * checked by as many threads.  The warmup task polls for the end of
+ * the load meanwhile.
+ */
 class Warmup {
 public:
     Warmup(EventuallyPersistentStore *st, Dispatcher *d);
 
+    ~Warmup();
+
     bool step(Dispatcher&, TaskId &);
     void start(void);
     void stop(void);
@@ -87,10 +107,25 @@ public:
 
     hrtime_t getTime(void) { return warmup; }
 
+    /**
+     * Load the values of the keys in an access log.
+     *
+     * @return the number of values loaded (or queued for the readers),
+     *         -1 if the log isn't clean
+     */
     size_t doWarmup(MutationLog &lf, const std::map<uint16_t,
                     vbucket_state> &vbmap, Callback<GetValue> &cb);
 
+    /**
+     * Record loaded items in the mutation log, if it's being
+     * reconstructed.
+     */
+    void logNewItems(const std::vector<Item*> &items);
+
 private:
+    friend class WarmupReader;
+    friend class AccessLogFetcher;
+
     template <typename T>
     void addStat(const char *nm, T val, ADD_STAT add_stat, const void *c) const;
 
@@ -106,11 +141,23 @@ private:
     bool loadingData(Dispatcher&, TaskId &);
     bool done(Dispatcher&, TaskId &);
 
+    bool readAccessLog(void);
+    bool startParallelFetch(void);
+    bool nextBatch(warmup_batch_t &batch);
+
+    bool loadData(Dispatcher&, TaskId &, bool maybeEnable);
+    bool startParallelLoad(bool maybeEnable);
+    bool nextVBucket(uint16_t &vbid);
+    void createReaders(void);
+    void stopReaders(void);
+    void readerDone(void);
+
     void transition(int to, bool force=false);
 
 
     LoadStorageKVPairCallback *createLKVPCB(const std::map<uint16_t, vbucket_state> &st,
-                                            bool maybeEnable, int warmupState);
+                                            bool maybeEnable, int warmupState,
+                                            size_t batchSize = 1);
 
     WarmupState state;
     EventuallyPersistentStore *store;
@@ -130,6 +177,33 @@ private:
     bool corruptAccessLog;
     size_t estimatedWarmupCount;
 
+    //! Time spent in each state so far
+    std::vector<hrtime_t> stateTime;
+    hrtime_t stateStart;
+
+    size_t numReaders;
+    //! Runs the readers of a parallel load (NULL otherwise).
+    Dispatcher *readDispatcher;
+    //! A read-only store for each reader.
+    std::vector<KVStore*> readers;
+    Mutex loadMutex;
+    //! The vbuckets no reader took yet, the active ones first.
+    std::deque<uint16_t> vbucketsToLoad;
+    //! The access log batches no reader took yet, the active ones first.
+    std::deque<warmup_batch_t> batchesToFetch;
+    Atomic<size_t> runningReaders;
+    bool dataLoadStarted;
+
+    //! True once the access log was read and its keys handed to readers
+    bool accessLogFetching;
+    bool accessLogRead;
+    //! Values loaded from the access log
+    Atomic<size_t> accessLogKeys;
+    //! Time spent reading the access log itself
+    hrtime_t accessLogReadTime;
+    //! Loaded items are logged by one reader at a time.
+    Mutex reconstructLogMutex;
+
     struct {
         Mutex mutex;
         std::list<WarmupStateListener*> listeners;
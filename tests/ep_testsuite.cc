@@ -2452,6 +2452,59 @@ static enum test_result test_tap_rcvr_mutate(ENGINE_HANDLE *h, ENGINE_HANDLE_V1
     return SUCCESS;
 }
 
+static enum test_result test_tap_rcvr_mutate_batched(ENGINE_HANDLE *h,
+                                                     ENGINE_HANDLE_V1 *h1) {
+    char eng_specific[3];
+    memset(eng_specific, 0, sizeof(eng_specific));
+    for (int i = 0; i < 250; ++i) {
+        std::stringstream key, val;
+        key << "key" << i;
+        val << "value" << i;
+        check(h1->tap_notify(h, NULL, eng_specific, sizeof(eng_specific),
+                             1, 0, TAP_MUTATION, i, key.str().c_str(),
+                             key.str().length(), 0, 0, 0,
+                             val.str().c_str(), val.str().length(),
+                             0) == ENGINE_SUCCESS,
+              "Failed tap notify.");
+    }
+    // The first two batches are full and applied already.
+    check_key_value(h, h1, "key199", "value199", 8);
+
+    // A later mutation of the same key wins, and one asking for an ack
+    // is applied right away.
+    check(h1->tap_notify(h, NULL, eng_specific, sizeof(eng_specific),
+                         1, 0, TAP_MUTATION, 250, "key200", 6, 0, 0, 0,
+                         "newvalue", 8, 0) == ENGINE_SUCCESS,
+          "Failed tap notify.");
+    check(h1->tap_notify(h, NULL, eng_specific, sizeof(eng_specific),
+                         1, TAP_FLAG_ACK, TAP_MUTATION, 251, "key250", 6,
+                         0, 0, 0, "value250", 8, 0) == ENGINE_SUCCESS,
+          "Failed tap notify.");
+    check_key_value(h, h1, "key200", "newvalue", 8);
+    check_key_value(h, h1, "key250", "value250", 8);
+
+    // Anything else in the stream applies the mutations before it first.
+    check(h1->tap_notify(h, NULL, eng_specific, sizeof(eng_specific),
+                         1, 0, TAP_MUTATION, 252, "key251", 6, 0, 0, 0,
+                         "value251", 8, 0) == ENGINE_SUCCESS,
+          "Failed tap notify.");
+    check(h1->tap_notify(h, NULL, NULL, 0, 1, 0, TAP_DELETION, 253,
+                         "key251", 6, 0, 0, 0, NULL, 0, 0) == ENGINE_SUCCESS,
+          "Failed tap notify.");
+    check(verify_key(h, h1, "key251") == ENGINE_KEY_ENOENT,
+          "Expected the batched key to be deleted.");
+    for (int i = 0; i < 250; ++i) {
+        std::stringstream key, val;
+        key << "key" << i;
+        val << "value" << i;
+        if (i != 200) {
+            check_key_value(h, h1, key.str().c_str(), val.str().c_str(),
+                            val.str().length());
+        }
+    }
+    return SUCCESS;
+}
+
 static enum test_result test_tap_rcvr_checkpoint(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     char eng_specific[64];
     memset(eng_specific, 0, sizeof(eng_specific));
@@ -2671,6 +2724,311 @@ static enum test_result test_tap_stream(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1)
     return SUCCESS;
 }
 
+static enum test_result test_tap_stream_compressed(ENGINE_HANDLE *h,
+                                                   ENGINE_HANDLE_V1 *h1) {
+    // The TAP_CONNECT flag and the TAP_MUTATION flag from tapconnection.h
+    const uint32_t compressValues = 0x200;
+    const uint16_t compressedFlag = 0x08;
+
+    std::stringstream ss;
+    for (int i = 0; i < 100; ++i) {
+        ss << "{\"id\": " << i << ", \"type\": \"compressible\"}";
+    }
+    std::string big(ss.str());
+    check(store(h, h1, NULL, OPERATION_SET, "big", big.c_str(), NULL, 0, 0)
+          == ENGINE_SUCCESS, "Failed to store an item.");
+    check(store(h, h1, NULL, OPERATION_SET, "small", "value", NULL, 0, 0)
+          == ENGINE_SUCCESS, "Failed to store an item.");
+
+    const void *cookie = testHarness.create_cookie();
+    testHarness.lock_cookie(cookie);
+    std::string name = "tap_client_compressed";
+    TAP_ITERATOR iter = h1->get_tap_iterator(h, cookie, name.c_str(),
+                                             name.length(),
+                                             TAP_CONNECT_FLAG_DUMP |
+                                             compressValues, NULL, 0);
+    check(iter != NULL, "Failed to create a tap iterator");
+
+    item *it;
+    void *engine_specific;
+    uint16_t nengine_specific;
+    uint8_t ttl;
+    uint16_t flags;
+    uint32_t seqno;
+    uint16_t vbucket;
+    tap_event_t event;
+    std::string key;
+    std::string compressed;
+    bool gotSmall = false;
+
+    do {
+        event = iter(h, cookie, &it, &engine_specific,
+                     &nengine_specific, &ttl, &flags,
+                     &seqno, &vbucket);
+
+        switch (event) {
+        case TAP_PAUSE:
+            testHarness.waitfor_cookie(cookie);
+            break;
+        case TAP_OPAQUE:
+        case TAP_NOOP:
+            break;
+        case TAP_MUTATION:
+            {
+                testHarness.unlock_cookie(cookie);
+                check(get_key(h, h1, it, key), "Failed to read out the key");
+                item_info info;
+                info.nvalue = 1;
+                check(h1->get_item_info(h, NULL, it, &info),
+                      "Failed to get item info.");
+                std::string value(static_cast<char*>(info.value[0].iov_base),
+                                  info.value[0].iov_len);
+                if (key == "big") {
+                    check((flags & compressedFlag) != 0,
+                          "Expected a compressed value.");
+                    check(value.length() < big.length() / 2,
+                          "Expected the value to shrink.");
+                    compressed = value;
+                } else {
+                    check((flags & compressedFlag) == 0,
+                          "Expected a small value to be sent as is.");
+                    check(value == "value", "Unexpected value.");
+                    gotSmall = true;
+                }
+                h1->release(h, cookie, it);
+                testHarness.lock_cookie(cookie);
+            }
+            break;
+        case TAP_DISCONNECT:
+            break;
+        default:
+            std::cerr << "Unexpected event:  " << event << std::endl;
+            return FAIL;
+        }
+    } while (event != TAP_DISCONNECT);
+    testHarness.unlock_cookie(cookie);
+
+    check(!compressed.empty() && gotSmall, "Failed to receive the keys.");
+    check(get_int_stat(h, h1, "eq_tapq:tap_client_compressed:compressed_items",
+                       "tap") == 1, "Expected one compressed item.");
+
+    // A consumer restores the value sent compressed.
+    check(set_vbucket_state(h, h1, 1, vbucket_state_replica),
+          "Failed to set vbucket state.");
+    char eng_specific[3];
+    memset(eng_specific, 0, sizeof(eng_specific));
+    check(h1->tap_notify(h, NULL, eng_specific, sizeof(eng_specific),
+                         1, compressedFlag, TAP_MUTATION, 1, "big", 3, 0, 0, 0,
+                         compressed.data(), compressed.length(),
+                         1) == ENGINE_SUCCESS,
+          "Failed tap notify.");
+    check_key_value(h, h1, "big", big.data(), big.length(), 1);
+
+    // Corrupt data disconnects the stream.
+    check(h1->tap_notify(h, NULL, eng_specific, sizeof(eng_specific),
+                         1, compressedFlag, TAP_MUTATION, 2, "bad", 3, 0, 0, 0,
+                         compressed.data(), compressed.length() / 2,
+                         1) == ENGINE_DISCONNECT,
+          "Expected a corrupt value to disconnect.");
+    return SUCCESS;
+}
+
+static enum test_result test_tap_stream_shared_disk_backfill(ENGINE_HANDLE *h,
+                                                             ENGINE_HANDLE_V1 *h1) {
+    const int num_keys = 3000;
+    int initialPersisted = get_int_stat(h, h1, "ep_total_persisted");
+
+    for (int ii = 0; ii < num_keys; ++ii) {
+        std::stringstream ss;
+        ss << ii;
+        check(store(h, h1, NULL, OPERATION_SET, ss.str().c_str(),
+                    "value", NULL, 0, 0) == ENGINE_SUCCESS,
+              "Failed to store an item.");
+    }
+
+    useconds_t sleepTime = 128;
+    while (get_int_stat(h, h1, "ep_total_persisted")
+           < initialPersisted + num_keys) {
+        decayingSleep(&sleepTime);
+    }
+
+    for (int ii = 0; ii < num_keys; ++ii) {
+        std::stringstream ss;
+        ss << ii;
+        evict_key(h, h1, ss.str().c_str(), 0, "Ejected.");
+    }
+
+    // Two dumps of the same vbucket read it from disk together, and
+    // are drained in turn so neither lets the shared read run ahead.
+    const int num_taps = 2;
+    const void *cookies[num_taps];
+    TAP_ITERATOR iters[num_taps];
+    std::vector<bool> keys[num_taps];
+    bool done[num_taps];
+    for (int ii = 0; ii < num_taps; ++ii) {
+        std::stringstream ss;
+        ss << "tap_client_" << ii;
+        std::string name = ss.str();
+        cookies[ii] = testHarness.create_cookie();
+        testHarness.lock_cookie(cookies[ii]);
+        iters[ii] = h1->get_tap_iterator(h, cookies[ii], name.c_str(),
+                                         name.length(),
+                                         TAP_CONNECT_FLAG_DUMP, NULL, 0);
+        check(iters[ii] != NULL, "Failed to create a tap iterator");
+        keys[ii].resize(num_keys, false);
+        done[ii] = false;
+    }
+
+    item *it;
+    void *engine_specific;
+    uint16_t nengine_specific;
+    uint8_t ttl;
+    uint16_t flags;
+    uint32_t seqno;
+    uint16_t vbucket;
+    tap_event_t event;
+    std::string key;
+    int running = num_taps;
+
+    while (running > 0) {
+        bool paused = true;
+        for (int ii = 0; ii < num_taps; ++ii) {
+            if (done[ii]) {
+                continue;
+            }
+            event = iters[ii](h, cookies[ii], &it, &engine_specific,
+                              &nengine_specific, &ttl, &flags,
+                              &seqno, &vbucket);
+            switch (event) {
+            case TAP_PAUSE:
+                break;
+            case TAP_OPAQUE:
+            case TAP_NOOP:
+                paused = false;
+                break;
+            case TAP_MUTATION:
+                paused = false;
+                check(get_key(h, h1, it, key), "Failed to read out the key");
+                check(!keys[ii][atoi(key.c_str())], "Received a key twice");
+                keys[ii][atoi(key.c_str())] = true;
+                h1->release(h, cookies[ii], it);
+                break;
+            case TAP_DISCONNECT:
+                paused = false;
+                done[ii] = true;
+                --running;
+                break;
+            default:
+                std::cerr << "Unexpected event:  " << event << std::endl;
+                return FAIL;
+            }
+        }
+        if (paused) {
+            usleep(1000);
+        }
+    }
+
+    for (int ii = 0; ii < num_taps; ++ii) {
+        for (int jj = 0; jj < num_keys; ++jj) {
+            check(keys[ii][jj], "Failed to receive key");
+        }
+        testHarness.unlock_cookie(cookies[ii]);
+    }
+
+    return SUCCESS;
+}
+
+static enum test_result test_tap_stream_parallel_disk_backfill(ENGINE_HANDLE *h,
+                                                               ENGINE_HANDLE_V1 *h1) {
+    const int num_vbs = 4;
+    const int num_keys = 500;
+    int initialPersisted = get_int_stat(h, h1, "ep_total_persisted");
+    check(get_int_stat(h, h1, "ep_tap_backfill_readers", "tap") == num_vbs,
+          "Expected a backfill reader per vbucket");
+
+    for (int vb = 1; vb < num_vbs; ++vb) {
+        check(set_vbucket_state(h, h1, vb, vbucket_state_active),
+              "Failed to set vbucket state.");
+    }
+    for (int vb = 0; vb < num_vbs; ++vb) {
+        for (int ii = 0; ii < num_keys; ++ii) {
+            std::stringstream ss;
+            ss << vb * num_keys + ii;
+            check(store(h, h1, NULL, OPERATION_SET, ss.str().c_str(),
+                        "value", NULL, 0, vb) == ENGINE_SUCCESS,
+                  "Failed to store an item.");
+        }
+    }
+
+    useconds_t sleepTime = 128;
+    while (get_int_stat(h, h1, "ep_total_persisted")
+           < initialPersisted + num_vbs * num_keys) {
+        decayingSleep(&sleepTime);
+    }
+
+    for (int vb = 0; vb < num_vbs; ++vb) {
+        for (int ii = 0; ii < num_keys; ++ii) {
+            std::stringstream ss;
+            ss << vb * num_keys + ii;
+            evict_key(h, h1, ss.str().c_str(), vb, "Ejected.");
+        }
+    }
+
+    const void *cookie = testHarness.create_cookie();
+    testHarness.lock_cookie(cookie);
+    std::string name = "tap_client_thread";
+    TAP_ITERATOR iter = h1->get_tap_iterator(h, cookie, name.c_str(),
+                                             name.length(),
+                                             TAP_CONNECT_FLAG_DUMP, NULL,
+                                             0);
+    check(iter != NULL, "Failed to create a tap iterator");
+
+    item *it;
+    void *engine_specific;
+    uint16_t nengine_specific;
+    uint8_t ttl;
+    uint16_t flags;
+    uint32_t seqno;
+    uint16_t vbucket;
+    tap_event_t event;
+    std::string key;
+    std::vector<bool> keys(num_vbs * num_keys, false);
+
+    do {
+        event = iter(h, cookie, &it, &engine_specific,
+                     &nengine_specific, &ttl, &flags,
+                     &seqno, &vbucket);
+
+        switch (event) {
+        case TAP_PAUSE:
+            testHarness.waitfor_cookie(cookie);
+            break;
+        case TAP_OPAQUE:
+        case TAP_NOOP:
+        case TAP_DISCONNECT:
+            break;
+        case TAP_MUTATION:
+            check(get_key(h, h1, it, key), "Failed to read out the key");
+            check(!keys[atoi(key.c_str())], "Received a key twice");
+            check(atoi(key.c_str()) / num_keys == vbucket,
+                  "Received a key from the wrong vbucket");
+            keys[atoi(key.c_str())] = true;
+            h1->release(h, cookie, it);
+            break;
+        default:
+            std::cerr << "Unexpected event:  " << event << std::endl;
+            return FAIL;
+        }
+    } while (event != TAP_DISCONNECT);
+
+    for (int ii = 0; ii < num_vbs * num_keys; ++ii) {
+        check(keys[ii], "Failed to receive key");
+    }
+    testHarness.unlock_cookie(cookie);
+
+    return SUCCESS;
+}
+
 static enum test_result test_tap_sends_deleted(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     const int num_keys = 5;
     for (int ii = 0; ii < num_keys; ++ii) {
@@ -3086,6 +3444,89 @@ static enum test_result test_tap_filter_stream(ENGINE_HANDLE *h, ENGINE_HANDLE_V
     return SUCCESS;
 }
 
+static enum test_result test_tap_stream_batches(ENGINE_HANDLE *h,
+                                                ENGINE_HANDLE_V1 *h1) {
+    // Enough keys for many batches of items fetched from the checkpoint.
+    const int num_keys = 1000;
+    std::vector<bool> keys(num_keys, false);
+    for (int ii = 0; ii < num_keys; ++ii) {
+        std::stringstream ss;
+        ss << ii;
+        check(store(h, h1, NULL, OPERATION_SET, ss.str().c_str(),
+                    "value", NULL, 0, 0) == ENGINE_SUCCESS,
+              "Failed to store an item.");
+    }
+
+    const void *cookie = testHarness.create_cookie();
+    testHarness.lock_cookie(cookie);
+
+    // Stream vbucket 0 from the beginning of its checkpoints.
+    char userdata[16];
+    char *ptr = userdata;
+    uint16_t numOfVBs = htons(1);
+    uint16_t vb = htons(0);
+    uint64_t chkid = htonll(0);
+    memcpy(ptr, &numOfVBs, sizeof(uint16_t));
+    ptr += sizeof(uint16_t);
+    memcpy(ptr, &vb, sizeof(uint16_t));
+    ptr += sizeof(uint16_t);
+    memcpy(ptr, &numOfVBs, sizeof(uint16_t));
+    ptr += sizeof(uint16_t);
+    memcpy(ptr, &vb, sizeof(uint16_t));
+    ptr += sizeof(uint16_t);
+    memcpy(ptr, &chkid, sizeof(uint64_t));
+
+    std::string name = "tap_client_thread";
+    TAP_ITERATOR iter = h1->get_tap_iterator(h, cookie, name.c_str(),
+                                             name.length(),
+                                             TAP_CONNECT_FLAG_LIST_VBUCKETS |
+                                             TAP_CONNECT_CHECKPOINT,
+                                             static_cast<void*>(userdata),
+                                             sizeof(userdata));
+    check(iter != NULL, "Failed to create a tap iterator");
+
+    item *it;
+    void *engine_specific;
+    uint16_t nengine_specific;
+    uint8_t ttl;
+    uint16_t flags;
+    uint32_t seqno;
+    uint16_t vbucket;
+    tap_event_t event;
+    std::string key;
+    int found = 0;
+
+    do {
+        event = iter(h, cookie, &it, &engine_specific,
+                     &nengine_specific, &ttl, &flags,
+                     &seqno, &vbucket);
+
+        switch (event) {
+        case TAP_PAUSE:
+            testHarness.waitfor_cookie(cookie);
+            break;
+        case TAP_NOOP:
+        case TAP_OPAQUE:
+        case TAP_CHECKPOINT_START:
+        case TAP_CHECKPOINT_END:
+            break;
+        case TAP_MUTATION:
+            check(get_key(h, h1, it, key), "Failed to read out the key");
+            check(!keys[atoi(key.c_str())], "Received a key twice");
+            keys[atoi(key.c_str())] = true;
+            ++found;
+            h1->release(h, cookie, it);
+            break;
+        default:
+            std::cerr << "Unexpected event:  " << event << std::endl;
+            return FAIL;
+        }
+    } while (found < num_keys);
+
+    testHarness.unlock_cookie(cookie);
+    return SUCCESS;
+}
+
 static enum test_result test_tap_config(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     check(h1->get_stats(h, NULL, "tap", 3, add_stats) == ENGINE_SUCCESS,
           "Failed to get stats.");
@@ -3800,6 +4241,59 @@ static enum test_result test_warmup_conf(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1)
 }
 
 
+static enum test_result test_warmup_parallel(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    const int num_vbs = 8;
+    const int num_keys = 200;
+    for (int vb = 1; vb < num_vbs; ++vb) {
+        check(set_vbucket_state(h, h1, vb, vbucket_state_active),
+              "Failed to set vbucket state.");
+    }
+    for (int vb = 0; vb < num_vbs; ++vb) {
+        for (int ii = 0; ii < num_keys; ++ii) {
+            std::stringstream ss;
+            ss << "key-" << vb << "-" << ii;
+            item *it = NULL;
+            check(store(h, h1, NULL, OPERATION_SET, ss.str().c_str(),
+                        ss.str().c_str(), &it, 0, vb) == ENGINE_SUCCESS,
+                  "Failed to store an item.");
+            h1->release(h, NULL, it);
+        }
+    }
+    // Half of the vbuckets are loaded after the others as replicas.
+    for (int vb = num_vbs / 2; vb < num_vbs; ++vb) {
+        check(set_vbucket_state(h, h1, vb, vbucket_state_replica),
+              "Failed to set vbucket state.");
+    }
+    wait_for_flusher_to_settle(h, h1);
+
+    testHarness.reload_engine(&h, &h1,
+                              testHarness.engine_path,
+                              testHarness.get_current_testcase()->cfg,
+                              true, false);
+    wait_for_warmup_complete(h, h1);
+
+    check(get_int_stat(h, h1, "ep_warmup_readers", "warmup") == 4,
+          "Expected four warmup readers");
+    check(get_int_stat(h, h1, "ep_warmup_value_count", "warmup") ==
+          num_vbs * num_keys, "Failed to warm up all the values");
+    check(get_int_stat(h, h1, "ep_warmup_dups", "warmup") == 0,
+          "Unexpected duplicates");
+
+    for (int vb = num_vbs / 2; vb < num_vbs; ++vb) {
+        check(set_vbucket_state(h, h1, vb, vbucket_state_active),
+              "Failed to set vbucket state.");
+    }
+    for (int vb = 0; vb < num_vbs; ++vb) {
+        for (int ii = 0; ii < num_keys; ++ii) {
+            std::stringstream ss;
+            ss << "key-" << vb << "-" << ii;
+            check_key_value(h, h1, ss.str().c_str(), ss.str().c_str(),
+                            ss.str().length(), vb);
+        }
+    }
+    return SUCCESS;
+}
+
 static enum test_result test_warmup_stats(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     item *it = NULL;
     check(set_vbucket_state(h, h1, 0, vbucket_state_active), "Failed to set VB0 state.");
@@ -6772,6 +7266,8 @@ engine_test_t* get_tests(void) {
                  test_setup, teardown, NULL, prepare, cleanup),
         TestCase("warmup stats", test_warmup_stats, test_setup,
                  teardown, NULL, prepare, cleanup),
+        TestCase("warmup with parallel readers", test_warmup_parallel,
+                 test_setup, teardown, "warmup_readers=4", prepare, cleanup),
         TestCase("stats curr_items", test_curr_items, test_setup,
                  teardown, NULL, prepare, cleanup),
         TestCase("startup token stat", test_cbd_225, test_setup,
@@ -6801,6 +7297,12 @@ engine_test_t* get_tests(void) {
                  "tap_noop_interval=10", prepare, cleanup),
         TestCase("tap receiver mutation", test_tap_rcvr_mutate, test_setup,
                  teardown, NULL, prepare, cleanup),
+        TestCase("tap stream with compressed values",
+                 test_tap_stream_compressed, test_setup, teardown, NULL,
+                 prepare, cleanup),
+        TestCase("tap receiver batched mutations",
+                 test_tap_rcvr_mutate_batched, test_setup, teardown,
+                 "tap_consumer_batch_size=100", prepare, cleanup),
         TestCase("tap receiver checkpoint start/end", test_tap_rcvr_checkpoint,
                  test_setup, teardown, NULL, prepare, cleanup),
         TestCase("tap receiver mutation (dead)", test_tap_rcvr_mutate_dead,
@@ -6821,8 +7323,16 @@ engine_test_t* get_tests(void) {
                  test_setup, teardown, NULL, prepare, cleanup),
         TestCase("tap stream", test_tap_stream, test_setup,
                  teardown, NULL, prepare, cleanup),
+        TestCase("tap stream shared disk backfill",
+                 test_tap_stream_shared_disk_backfill, test_setup,
+                 teardown, NULL, prepare, cleanup),
+        TestCase("tap stream parallel disk backfill",
+                 test_tap_stream_parallel_disk_backfill, test_setup,
+                 teardown, "backfill_readers=4", prepare, cleanup),
         TestCase("tap stream send deletes", test_tap_sends_deleted, test_setup,
                  teardown, NULL, prepare, cleanup),
+        TestCase("tap stream in batches", test_tap_stream_batches,
+                 test_setup, teardown, NULL, prepare, cleanup),
         TestCase("tap tap sent from vb", test_sent_from_vb, test_setup,
                  teardown, NULL, prepare, cleanup),
         TestCase("tap agg stats", test_tap_agg_stats, test_setup,
@@ -0,0 +1,65 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+
+#include <new>
+
+#include "alloc_counter.h"
+#include "atomic.h"
+
+static Atomic<size_t> numAllocs;
+static Atomic<size_t> totalBytes;
+static Atomic<size_t> currentBytes;
+
+// Every block is preceded by its size, padded so the block stays
+// aligned the way malloc aligns it.
+static const size_t ALLOC_HEADER(16);
+
+void *operator new(size_t len) throw(std::bad_alloc) {
+    char *p = static_cast<char*>(malloc(len + ALLOC_HEADER));
+    if (p == NULL) {
+        throw std::bad_alloc();
+    }
+    *reinterpret_cast<size_t*>(p) = len;
+    numAllocs.incr(1);
+    totalBytes.incr(len);
+    currentBytes.incr(len);
+    return p + ALLOC_HEADER;
+}
+
+void operator delete(void *ptr) throw() {
+    if (ptr != NULL) {
+        char *p = static_cast<char*>(ptr) - ALLOC_HEADER;
+        currentBytes.decr(*reinterpret_cast<size_t*>(p));
+        free(p);
+    }
+}
+
+size_t AllocCounter::allocations() {
+    return numAllocs.get();
+}
+
+size_t AllocCounter::allocatedBytes() {
+    return totalBytes.get();
+}
+
+size_t AllocCounter::liveBytes() {
+    return currentBytes.get();
+}
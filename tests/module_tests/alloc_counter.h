@@ -0,0 +1,51 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef TESTS_MODULE_TESTS_ALLOC_COUNTER_H_
+#define TESTS_MODULE_TESTS_ALLOC_COUNTER_H_ 1
+
+#include "config.h"
+
+#include <stddef.h>
+
+/**
+ * Heap allocation counts for tests checking what an operation
+ * allocates.
+ *
+ * A test linking alloc_counter.cc gets a global operator new and
+ * delete that keep these counts.
+ */
+class AllocCounter {
+public:
+
+    /**
+     * The number of blocks allocated so far.
+     */
+    static size_t allocations();
+
+    /**
+     * The number of bytes allocated so far, freed or not.
+     */
+    static size_t allocatedBytes();
+
+    /**
+     * The number of bytes allocated and not freed yet.
+     */
+    static size_t liveBytes();
+};
+
+#endif  // TESTS_MODULE_TESTS_ALLOC_COUNTER_H_
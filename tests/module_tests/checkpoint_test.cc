@@ -18,7 +18,9 @@
 #include "config.h"
 
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
+#include <stdlib.h>
 
 #include <algorithm>
 #include <set>
@@ -300,9 +302,252 @@ void test_reset_checkpoint_id() {
     assert(items.size() == 0);
 }
 
+/**
+ * Update a few keys over and over so the checkpoint squeezes out the
+ * superseded entries, with a TAP cursor part way through it.
+ */
+void test_dedup_compaction() {
+    RCPtr<VBucket> vbucket(new VBucket(2, vbucket_state_active, global_stats,
+                                       checkpoint_config));
+    CheckpointManager *manager =
+        new CheckpointManager(global_stats, 2, checkpoint_config, 1);
+    manager->registerTAPCursor("tap");
+
+    const int numKeys = 10;
+    for (int round = 0; round < 100; ++round) {
+        for (int i = 0; i < numKeys; ++i) {
+            std::stringstream key;
+            key << "key-" << i;
+            queued_item qi(new QueuedItem(key.str(), 2, queue_op_set));
+            manager->queueDirty(qi, vbucket);
+        }
+        if (round == 50) {
+            // Consume the checkpoint_start item and the first few keys.
+            bool isLastMutationItem;
+            for (int i = 0; i < 4; ++i) {
+                assert(manager->nextItem("tap", isLastMutationItem).get());
+            }
+        }
+    }
+
+    // The TAP cursor still sits behind the keys queued since it moved.
+    assert(manager->getNumItemsForTAPConnection("tap") == numKeys);
+    std::set<std::string> seen;
+    bool isLastMutationItem = false;
+    while (!isLastMutationItem) {
+        queued_item qi = manager->nextItem("tap", isLastMutationItem);
+        assert(qi->getOperation() == queue_op_set);
+        assert(seen.insert(qi->getKey()).second);
+    }
+    assert(seen.size() == static_cast<size_t>(numKeys));
+
+    std::vector<queued_item> items;
+    manager->getAllItemsForPersistence(items);
+    assert(items.size() == static_cast<size_t>(numKeys) + 1);
+    delete manager;
+}
+
+/**
+ * Take runs of mutations through a TAP cursor, leaving the checkpoint
+ * start and the last mutation to nextItem().
+ */
+void test_tap_batch() {
+    RCPtr<VBucket> vbucket(new VBucket(3, vbucket_state_active, global_stats,
+                                       checkpoint_config));
+    CheckpointManager *manager =
+        new CheckpointManager(global_stats, 3, checkpoint_config, 1);
+    manager->registerTAPCursor("tap");
+
+    for (int i = 0; i < 10; ++i) {
+        std::stringstream key;
+        key << "key-" << i;
+        queued_item qi(new QueuedItem(key.str(), 3, queue_op_set));
+        manager->queueDirty(qi, vbucket);
+    }
+
+    std::vector<queued_item> items;
+    bool isLastMutationItem;
+    assert(manager->nextItems("tap", items, 100) == 0);
+    queued_item qi = manager->nextItem("tap", isLastMutationItem);
+    assert(qi->getOperation() == queue_op_checkpoint_start);
+
+    assert(manager->nextItems("tap", items, 4) == 4);
+    assert(manager->nextItems("tap", items, 100) == 5);
+    assert(manager->nextItems("tap", items, 100) == 0);
+    assert(items.size() == 9);
+    for (size_t i = 0; i < items.size(); ++i) {
+        std::stringstream key;
+        key << "key-" << i;
+        assert(items[i]->getKey() == key.str());
+    }
+
+    qi = manager->nextItem("tap", isLastMutationItem);
+    assert(qi->getKey() == "key-9");
+    assert(isLastMutationItem);
+    assert(manager->getNumItemsForTAPConnection("tap") == 0);
+    assert(manager->nextItems("nobody", items, 100) == 0);
+    delete manager;
+}
+
+static const int STRESS_WRITERS(4);
+static const int STRESS_CURSORS(12);
+static const int STRESS_KEYS(5000);
+static const int STRESS_MUTATIONS(50000);
+
+struct stress_args {
+    CheckpointManager *manager;
+    RCPtr<VBucket> vbucket;
+    Atomic<int> *writersLeft;
+    int id;
+    std::string name;
+    size_t received;
+    std::vector<bool> seen;
+};
+
+extern "C" {
+static void *launch_stress_writer(void *arg) {
+    struct stress_args *args = static_cast<struct stress_args *>(arg);
+    for (int i = 0; i < STRESS_MUTATIONS; ++i) {
+        std::stringstream key;
+        key << "stress:" << args->id * STRESS_KEYS + (i * 7) % STRESS_KEYS;
+        queued_item qi(new QueuedItem(key.str(), 3, queue_op_set));
+        args->manager->queueDirty(qi, args->vbucket);
+    }
+    --(*(args->writersLeft));
+    return NULL;
+}
+
+static void *launch_stress_reader(void *arg) {
+    struct stress_args *args = static_cast<struct stress_args *>(arg);
+    bool isLastItem;
+    while (true) {
+        bool writersDone = args->writersLeft->get() == 0;
+        queued_item qi = args->manager->nextItem(args->name, isLastItem);
+        if (qi->getOperation() == queue_op_set) {
+            ++args->received;
+            args->seen[atoi(qi->getKey().c_str() + 7)] = true;
+        } else if (qi->getOperation() == queue_op_empty) {
+            if (writersDone) {
+                break;
+            }
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+static void *launch_stress_flusher(void *arg) {
+    struct stress_args *args = static_cast<struct stress_args *>(arg);
+    while (true) {
+        bool writersDone = args->writersLeft->get() == 0;
+        std::vector<queued_item> items;
+        args->manager->getAllItemsForPersistence(items);
+        args->received += items.size();
+        bool newCheckpointCreated;
+        args->manager->removeClosedUnrefCheckpoints(args->vbucket, newCheckpointCreated);
+        if (items.empty()) {
+            if (writersDone) {
+                break;
+            }
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+}
+
+/**
+ * Run writers queueing mutations against TAP cursors reading them and
+ * the flusher draining them, checking that every cursor gets every
+ * key.
+ */
+void stress_cursors() {
+    RCPtr<VBucket> vbucket(new VBucket(3, vbucket_state_active, global_stats,
+                                       checkpoint_config));
+    CheckpointManager *manager =
+        new CheckpointManager(global_stats, 3, checkpoint_config, 1);
+    Atomic<int> writersLeft(STRESS_WRITERS);
+
+    const int numThreads = STRESS_WRITERS + STRESS_CURSORS + 1;
+    std::vector<stress_args> args(numThreads);
+    std::vector<pthread_t> threads(numThreads);
+    for (int i = 0; i < numThreads; ++i) {
+        args[i].manager = manager;
+        args[i].vbucket = vbucket;
+        args[i].writersLeft = &writersLeft;
+        args[i].id = i;
+        args[i].received = 0;
+        if (i >= STRESS_WRITERS && i < numThreads - 1) {
+            std::stringstream name;
+            name << "tap-" << i;
+            args[i].name = name.str();
+            args[i].seen.resize(STRESS_WRITERS * STRESS_KEYS);
+            manager->registerTAPCursor(args[i].name);
+        }
+    }
+
+    for (int i = 0; i < numThreads; ++i) {
+        void *(*fn)(void *) = launch_stress_reader;
+        if (i < STRESS_WRITERS) {
+            fn = launch_stress_writer;
+        } else if (i == numThreads - 1) {
+            fn = launch_stress_flusher;
+        }
+        assert(pthread_create(&threads[i], NULL, fn, &args[i]) == 0);
+    }
+    for (int i = 0; i < numThreads; ++i) {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+
+    for (int i = STRESS_WRITERS; i < numThreads - 1; ++i) {
+        assert(std::count(args[i].seen.begin(), args[i].seen.end(), true) ==
+               STRESS_WRITERS * STRESS_KEYS);
+    }
+    assert(args[numThreads - 1].received >=
+           static_cast<size_t>(STRESS_WRITERS * STRESS_KEYS));
+    delete manager;
+}
+
+/**
+ * Queue a batch of new keys and then update every one of them once.
+ */
+void test_queue_dirty_updates() {
+    const size_t numKeys = 200000;
+    RCPtr<VBucket> vbucket(new VBucket(1, vbucket_state_active, global_stats,
+                                       checkpoint_config));
+    CheckpointManager *manager =
+        new CheckpointManager(global_stats, 1, checkpoint_config, 1);
+
+    std::vector<std::string> keys;
+    keys.reserve(numKeys);
+    for (size_t i = 0; i < numKeys; ++i) {
+        std::stringstream key;
+        key << "user:" << (i * 7919) % 1000003;
+        keys.push_back(key.str());
+    }
+
+    for (size_t pass = 0; pass < 2; ++pass) {
+        for (size_t i = 0; i < numKeys; ++i) {
+            queued_item qi(new QueuedItem(keys[i], 1, queue_op_set));
+            manager->queueDirty(qi, vbucket);
+        }
+    }
+
+    std::vector<queued_item> items;
+    manager->getAllItemsForPersistence(items);
+    // The first checkpoint filled up, so its keys were queued again in
+    // the second one.
+    assert(items.size() == numKeys + checkpoint_config.getCheckpointMaxItems() + 3);
+    delete manager;
+}
+
 int main(int argc, char **argv) {
     (void)argc; (void)argv;
     putenv(strdup("ALLOW_NO_STATS_UPDATE=yeah"));
     basic_chk_test();
     test_reset_checkpoint_id();
+    test_dedup_compaction();
+    test_tap_batch();
+    stress_cursors();
+    test_queue_dirty_updates();
 }
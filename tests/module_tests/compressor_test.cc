@@ -0,0 +1,102 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+
+#include <cassert>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "compressor.h"
+
+static std::string roundTrip(const std::string &in, size_t outLen) {
+    std::vector<char> buf(outLen);
+    size_t n = Compressor::compress(in.data(), in.length(), &buf[0], outLen);
+    if (n == 0) {
+        return std::string();
+    }
+    assert(n <= outLen);
+    assert(Compressor::getDecompressedLength(&buf[0], n) == in.length());
+    std::vector<char> out(in.length());
+    assert(Compressor::decompress(&buf[0], n, &out[0], out.size()));
+    return std::string(&out[0], out.size());
+}
+
+static void testCompressible() {
+    std::stringstream ss;
+    for (int i = 0; i < 500; ++i) {
+        ss << "{\"name\": \"user" << i << "\", \"age\": " << (i % 90)
+           << ", \"city\": \"Mountain View\"}";
+    }
+    std::string doc(ss.str());
+    std::vector<char> buf(doc.length());
+    size_t n = Compressor::compress(doc.data(), doc.length(), &buf[0],
+                                    buf.size());
+    assert(n > 0);
+    assert(n < doc.length() / 3);
+    assert(roundTrip(doc, doc.length()) == doc);
+}
+
+static void testRuns() {
+    // Long runs need overlapping and long back references.
+    std::string doc(100000, 'x');
+    assert(roundTrip(doc, doc.length()) == doc);
+    doc = "ab" + std::string(1000, 'a') + "abc";
+    assert(roundTrip(doc, doc.length()) == doc);
+}
+
+static void testIncompressible() {
+    std::string doc;
+    srandom(42);
+    for (int i = 0; i < 4096; ++i) {
+        doc.push_back(static_cast<char>(random()));
+    }
+    // Random data doesn't fit in less than its size.
+    assert(roundTrip(doc, doc.length()).empty());
+    // It still round trips given enough room.
+    assert(roundTrip(doc, doc.length() * 2) == doc);
+    assert(roundTrip("a", 16) == "a");
+    assert(roundTrip("abcd", 4).empty());
+}
+
+static void testCorrupt() {
+    std::string doc(1000, 'y');
+    std::vector<char> buf(doc.length());
+    size_t n = Compressor::compress(doc.data(), doc.length(), &buf[0],
+                                    buf.size());
+    assert(n > 0);
+    std::vector<char> out(doc.length());
+    // Truncated.
+    assert(!Compressor::decompress(&buf[0], n - 1, &out[0], out.size()));
+    // Too small a buffer.
+    assert(!Compressor::decompress(&buf[0], n, &out[0], out.size() - 1));
+    // A reference before the start of the data.
+    char bad[] = { 0, 0, 0, 8, 0, 'a', static_cast<char>(0xe0), 0, 10 };
+    assert(!Compressor::decompress(bad, sizeof(bad), &out[0], out.size()));
+    assert(Compressor::getDecompressedLength("abc", 3) == 0);
+}
+
+int main() {
+    testCompressible();
+    testRuns();
+    testIncompressible();
+    testCorrupt();
+    return 0;
+}
@@ -0,0 +1,67 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <cassert>
+#include <vector>
+
+extern "C" {
+#include "crc32c.h"
+}
+
+static void testKnownValues() {
+    // From RFC 3720, B.4.
+    uint8_t buf[32];
+    memset(buf, 0, sizeof(buf));
+    assert(crc32c(buf, sizeof(buf)) == 0x8a9136aa);
+    memset(buf, 0xff, sizeof(buf));
+    assert(crc32c(buf, sizeof(buf)) == 0x62a8ab43);
+    for (int i = 0; i < 32; ++i) {
+        buf[i] = static_cast<uint8_t>(i);
+    }
+    assert(crc32c(buf, sizeof(buf)) == 0x46dd794e);
+    assert(crc32c_sw(buf, sizeof(buf)) == 0x46dd794e);
+
+    const char *check = "123456789";
+    assert(crc32c(reinterpret_cast<const uint8_t*>(check), 9) == 0xe3069283);
+    assert(crc32c(buf, 0) == 0);
+}
+
+static void testHardwareMatchesSoftware() {
+    std::vector<uint8_t> buf(4096 + 16);
+    srandom(42);
+    for (size_t i = 0; i < buf.size(); ++i) {
+        buf[i] = static_cast<uint8_t>(random());
+    }
+    // Every alignment and the lengths around the word sizes.
+    for (size_t offset = 0; offset < 16; ++offset) {
+        for (size_t len = 0; len < 80; ++len) {
+            assert(crc32c(&buf[offset], len) == crc32c_sw(&buf[offset], len));
+        }
+        assert(crc32c(&buf[offset], 4096) == crc32c_sw(&buf[offset], 4096));
+    }
+}
+
+int main() {
+    testKnownValues();
+    testHardwareMatchesSoftware();
+    return 0;
+}
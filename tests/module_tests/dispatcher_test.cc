@@ -18,6 +18,7 @@
 #include "config.h"
 
 #include <cassert>
+#include <vector>
 
 #include "atomic.h"
 #include "dispatcher.h"
@@ -74,6 +75,247 @@ bool TestCallback::callback(Dispatcher &d, TaskId &t) {
     return thing->doSomething(d, t);
 }
 
+static const size_t NUM_WORKERS(4);
+
+static void waitFor(Atomic<int> &counter, int n) {
+    while (counter.get() < n) {
+        usleep(100);
+    }
+}
+
+/**
+ * Holds a worker until released.
+ */
+class GateCallback : public DispatcherCallback {
+public:
+    GateCallback(Atomic<int> &entered, Atomic<bool> &open)
+        : in(entered), released(open) {}
+
+    bool callback(Dispatcher &, TaskId &) {
+        ++in;
+        while (!released.get()) {
+            usleep(100);
+        }
+        return false;
+    }
+
+    std::string description() { return std::string("Gate"); }
+
+private:
+    Atomic<int> &in;
+    Atomic<bool> &released;
+};
+
+/**
+ * Records the order in which tasks of a given priority start.
+ */
+class OrderCallback : public DispatcherCallback {
+public:
+    OrderCallback(int p, Atomic<int> &c, std::vector<int> &o, Mutex &m)
+        : priority(p), counter(c), order(o), mutex(m) {}
+
+    bool callback(Dispatcher &, TaskId &) {
+        LockHolder lh(mutex);
+        order.push_back(priority);
+        ++counter;
+        return false;
+    }
+
+    std::string description() { return std::string("Order"); }
+
+private:
+    int priority;
+    Atomic<int> &counter;
+    std::vector<int> &order;
+    Mutex &mutex;
+};
+
+class CountCallback : public DispatcherCallback {
+public:
+    CountCallback(Atomic<int> &c) : counter(c) {}
+
+    bool callback(Dispatcher &, TaskId &) {
+        ++counter;
+        return false;
+    }
+
+    std::string description() { return std::string("Count"); }
+
+private:
+    Atomic<int> &counter;
+};
+
+/**
+ * Runs until stopped, sleeping between runs, and checks it is never
+ * run by two workers at once.
+ */
+class RepeatCallback : public DispatcherCallback {
+public:
+    RepeatCallback(double s) : runs(0), snooze(s), inside(false),
+                               stopped(false) {}
+
+    bool callback(Dispatcher &d, TaskId &t) {
+        assert(!inside.swap(true));
+        usleep(10);
+        inside.set(false);
+        bool again(!stopped.get());
+        if (again) {
+            d.snooze(t, snooze);
+        }
+        // Counted last, so a wake() seen after this isn't overridden.
+        ++runs;
+        return again;
+    }
+
+    std::string description() { return std::string("Repeat"); }
+
+    Atomic<int> runs;
+
+private:
+    double snooze;
+    Atomic<bool> inside;
+
+public:
+    Atomic<bool> stopped;
+};
+
+/**
+ * Tasks that become ready together are spread over all the workers'
+ * queues, yet a single free worker still runs them in priority order.
+ */
+static void testPriorityAcrossWorkers() {
+    Dispatcher d(*engine, "Priority", NUM_WORKERS);
+    d.start();
+
+    Atomic<int> entered;
+    Atomic<bool> first(false), rest(false);
+    d.schedule(shared_ptr<DispatcherCallback>(new GateCallback(entered, first)),
+               NULL, Priority::BgFetcherPriority);
+    for (size_t i = 1; i < NUM_WORKERS; ++i) {
+        d.schedule(shared_ptr<DispatcherCallback>(new GateCallback(entered, rest)),
+                   NULL, Priority::BgFetcherPriority);
+    }
+    waitFor(entered, NUM_WORKERS);
+
+    const int ntasks(200);
+    Atomic<int> done;
+    std::vector<int> order;
+    Mutex mutex;
+    for (int i = 0; i < ntasks; ++i) {
+        const Priority &p(i % 2 ? Priority::ItemPagerPriority :
+                          Priority::VBucketDeletionPriority);
+        d.schedule(shared_ptr<DispatcherCallback>(
+                       new OrderCallback(p.getPriorityValue(), done,
+                                         order, mutex)),
+                   NULL, p);
+    }
+    first.set(true);
+    waitFor(done, ntasks);
+
+    for (int i = 1; i < ntasks; ++i) {
+        assert(order[i - 1] <= order[i]);
+    }
+    assert(d.getDispatcherState().getSteals() > 0);
+    rest.set(true);
+    d.stop();
+}
+
+/**
+ * Ready tasks queued behind a busy worker are taken by the others.
+ */
+static void testStealing() {
+    Dispatcher d(*engine, "Stealing", NUM_WORKERS);
+    d.start();
+
+    Atomic<int> entered;
+    Atomic<bool> open(false);
+    d.schedule(shared_ptr<DispatcherCallback>(new GateCallback(entered, open)),
+               NULL, Priority::BgFetcherPriority);
+    waitFor(entered, 1);
+
+    const int ntasks(100);
+    Atomic<int> done;
+    for (int i = 0; i < ntasks; ++i) {
+        d.schedule(shared_ptr<DispatcherCallback>(new CountCallback(done)),
+                   NULL, Priority::FlusherPriority);
+    }
+    waitFor(done, ntasks);
+    assert(d.getDispatcherState().isRunningTask());
+
+    open.set(true);
+    d.stop();
+    DispatcherState ds(d.getDispatcherState());
+    assert(ds.getWorkers().size() == NUM_WORKERS);
+    assert(ds.getSteals() > 0);
+}
+
+/**
+ * All the workers run tasks at the same time.
+ */
+static void testConcurrency() {
+    Dispatcher d(*engine, "Concurrency", NUM_WORKERS);
+    d.start();
+
+    Atomic<int> entered;
+    Atomic<bool> open(false);
+    for (size_t i = 0; i < NUM_WORKERS; ++i) {
+        d.schedule(shared_ptr<DispatcherCallback>(new GateCallback(entered, open)),
+                   NULL, Priority::FlusherPriority);
+    }
+    // Only returns once every gate holds its own worker.
+    waitFor(entered, NUM_WORKERS);
+    open.set(true);
+    d.stop();
+}
+
+/**
+ * Snoozed tasks may be woken early and cancelled tasks don't run,
+ * and a repeating task never runs on two workers at once.
+ */
+static void testSnoozeWakeCancel() {
+    Dispatcher d(*engine, "SnoozeWakeCancel", NUM_WORKERS);
+    d.start();
+
+    RepeatCallback *rc = new RepeatCallback(60);
+    shared_ptr<DispatcherCallback> rcb(rc);
+    TaskId repeater;
+    d.schedule(rcb, &repeater, Priority::ItemPagerPriority);
+    waitFor(rc->runs, 1);
+    for (int i = 2; i < 200; ++i) {
+        d.wake(repeater);
+        waitFor(rc->runs, i);
+    }
+
+    RepeatCallback *busy = new RepeatCallback(0);
+    shared_ptr<DispatcherCallback> bcb(busy);
+    TaskId busyTask;
+    d.schedule(bcb, &busyTask, Priority::FlusherPriority);
+    for (int i = 0; i < 1000; ++i) {
+        d.wake(busyTask);
+    }
+    waitFor(busy->runs, 1000);
+    busy->stopped.set(true);
+
+    Atomic<int> cancelled;
+    TaskId tid;
+    d.schedule(shared_ptr<DispatcherCallback>(new CountCallback(cancelled)),
+               &tid, Priority::FlusherPriority, 0.2);
+    d.cancel(tid);
+    d.cancel(repeater);
+    int runs(rc->runs.get());
+    usleep(400000);
+    assert(cancelled.get() == 0);
+    assert(rc->runs.get() == runs);
+
+    // Non-daemon tasks still waiting are run on the way out.
+    Atomic<int> completed;
+    d.schedule(shared_ptr<DispatcherCallback>(new CountCallback(completed)),
+               NULL, Priority::VBucketDeletionPriority, 60, false);
+    d.stop();
+    assert(completed.get() == 1);
+    assert(d.getState() == dispatcher_stopped);
+}
+
 int main(int argc, char **argv) {
     (void)argc; (void)argv;
     int expected_num_callbacks=3;
@@ -105,5 +347,11 @@ int main(int argc, char **argv) {
     IdleTask it;
     assert(hrtime2text(it.maxExpectedDuration()) == std::string("3600 ms"));
 
+    alarm(30);
+    testPriorityAcrossWorkers();
+    testStealing();
+    testConcurrency();
+    testSnoozeWakeCancel();
+
     return 0;
 }
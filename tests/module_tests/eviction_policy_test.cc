@@ -0,0 +1,374 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * Unit tests of the eviction policies, and a simulator replaying a key
+ * access trace against each of them to compare their hit ratios.
+ *
+ * Without arguments a synthetic trace is replayed: a skewed hot set,
+ * interrupted by scans of keys that are never read again.  To replay a
+ * real trace instead:
+ *
+ *   ./eviction_policy_test <trace file> <resident items>
+ *
+ * where the trace file holds one key per line.
+ */
+
+#include "config.h"
+
+#include <ep.h>
+#include <item.h>
+#include <stats.h>
+
+#include <cassert>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "eviction_policy.h"
+
+time_t time_offset;
+
+extern "C" {
+    static rel_time_t basic_current_time(void) {
+        return 0;
+    }
+
+    rel_time_t (*ep_current_time)() = basic_current_time;
+
+    time_t ep_real_time() {
+        return time(NULL) + time_offset;
+    }
+}
+
+EPStats global_stats;
+
+static StoredValue *storeOne(HashTable &h, const std::string &k) {
+    Item i(k, 0, 0, k.c_str(), k.length());
+    h.set(i);
+    StoredValue *v = h.find(const_cast<std::string&>(k), false);
+    assert(v);
+    v->markClean();
+    return v;
+}
+
+static void testNRUPhases() {
+    HashTable h(global_stats, 5, 1);
+    StoredValue *v = storeOne(h, "key");
+    NRUEvictionPolicy policy;
+
+    // The first run only takes values that are already cold.
+    assert(policy.decide(v, 1) == EVICT_KEEP);
+    policy.complete(true);
+    assert(policy.getPhase() == PAGING_RANDOM);
+
+    // The second ages them, picking victims among those turning cold.
+    assert(v->getNRUValue() == INITIAL_NRU_VALUE);
+    assert(policy.decide(v, 1) == EVICT_VICTIM);
+    assert(v->getNRUValue() == MAX_NRU_VALUE);
+
+    // A run that stopped early is carried on in the same phase.
+    policy.complete(false);
+    assert(policy.getPhase() == PAGING_RANDOM);
+    policy.complete(true);
+    assert(policy.getPhase() == PAGING_UNREFERENCED);
+    assert(policy.decide(v, 1) == EVICT_COLD);
+}
+
+static void testSLRUSegments() {
+    HashTable h(global_stats, 5, 1);
+    SLRUEvictionPolicy policy(1);
+    policy.begin();
+
+    // Values read once stay on probation, and go first.
+    StoredValue *once = storeOne(h, "once");
+    assert(policy.decide(once, 1) == EVICT_VICTIM);
+    assert(!once->isPromoted());
+    assert(policy.decide(once, 0) == EVICT_COLD);
+
+    // A value read again is promoted, and kept while there's room.
+    StoredValue *twice = storeOne(h, "twice");
+    twice->referenced();
+    assert(policy.decide(twice, 1) == EVICT_KEEP);
+    assert(twice->isPromoted());
+    for (int i = 0; i < 5; ++i) {
+        assert(policy.decide(twice, 1) == EVICT_KEEP);
+        assert(twice->isPromoted());
+    }
+
+    // Values the pager already ejected are left alone.
+    assert(once->ejectValue(global_stats, h));
+    assert(policy.decide(once, 1) == EVICT_KEEP);
+}
+
+static void testSLRUProtectedShare() {
+    HashTable h(global_stats, 5, 1);
+    SLRUEvictionPolicy policy(0.5);
+    policy.begin();
+
+    std::vector<StoredValue*> values;
+    for (int i = 0; i < 10; ++i) {
+        std::stringstream ss;
+        ss << "key" << i;
+        values.push_back(storeOne(h, ss.str()));
+        values.back()->referenced();
+    }
+
+    size_t promoted = 0;
+    std::vector<StoredValue*>::iterator it;
+    for (it = values.begin(); it != values.end(); ++it) {
+        policy.decide(*it, 0);
+        if ((*it)->isPromoted()) {
+            ++promoted;
+        }
+    }
+    assert(promoted == 5);
+
+    // None of the protected values was reused since, so a smaller
+    // segment demotes them down to its share.
+    SLRUEvictionPolicy smaller(0.2);
+    smaller.begin();
+    promoted = 0;
+    for (it = values.begin(); it != values.end(); ++it) {
+        smaller.decide(*it, 0);
+        if ((*it)->isPromoted()) {
+            ++promoted;
+        }
+    }
+    assert(promoted == 2);
+}
+
+/**
+ * Runs an eviction policy over the hash tables the way PagingVisitor
+ * does.
+ */
+class SimulatedPager : public HashTableVisitor {
+public:
+    SimulatedPager(EvictionPolicy &p, HashTable &h, double pcnt) :
+        policy(p), ht(h), percent(pcnt) {}
+
+    void visit(StoredValue *v) {
+        switch (policy.decide(v, percent)) {
+        case EVICT_COLD:
+        case EVICT_VICTIM:
+            v->ejectValue(global_stats, ht);
+            break;
+        case EVICT_KEEP:
+            break;
+        }
+    }
+
+private:
+    EvictionPolicy &policy;
+    HashTable &ht;
+    double percent;
+};
+
+/**
+ * Replays a key access trace against an eviction policy.
+ *
+ * Memory is counted in resident values.  Every access that misses
+ * loads the value (as a bg fetch or a set would), and every
+ * pagerInterval accesses the pager runs if more than capacity values
+ * are resident, down to the low watermark.  All the vbuckets are
+ * active.
+ */
+class Simulator {
+public:
+    Simulator(EvictionPolicy &p, size_t cap, size_t interval = 500,
+              size_t vbs = 4) :
+        policy(p), capacity(cap), lowWat(cap * 4 / 5),
+        pagerInterval(interval), accesses(0), hits(0), pagerRuns(0)
+    {
+        for (size_t i = 0; i < vbs; ++i) {
+            tables.push_back(new HashTable(global_stats, 3079, 3));
+        }
+    }
+
+    ~Simulator() {
+        std::vector<HashTable*>::iterator it;
+        for (it = tables.begin(); it != tables.end(); ++it) {
+            delete *it;
+        }
+    }
+
+    /**
+     * Read a key the way a GET does, storing it if it's missing.
+     */
+    void access(std::string &key) {
+        HashTable &h = *tables[tables[0]->hash(key) % tables.size()];
+        StoredValue *v = h.find(key, false);
+        if (v && v->isResident()) {
+            v->referenced();
+            ++hits;
+        } else if (v) {
+            // Fetch the ejected value, and retry the read.
+            Item itm(key, 0, 0, key.c_str(), key.length());
+            assert(v->unlocked_restoreValue(&itm, global_stats, h));
+            v->referenced();
+        } else {
+            storeOne(h, key);
+        }
+        if (++accesses % pagerInterval == 0 && resident() > capacity) {
+            page();
+        }
+    }
+
+    double hitRatio() const {
+        return accesses ? static_cast<double>(hits) / accesses : 0;
+    }
+
+    size_t getPagerRuns() const {
+        return pagerRuns;
+    }
+
+private:
+    size_t resident(HashTable &h) const {
+        return h.getNumItems() - h.getNumNonResidentItems();
+    }
+
+    size_t resident() const {
+        size_t rv(0);
+        std::vector<HashTable*>::const_iterator it;
+        for (it = tables.begin(); it != tables.end(); ++it) {
+            rv += resident(**it);
+        }
+        return rv;
+    }
+
+    void page() {
+        ++pagerRuns;
+        policy.begin();
+        bool finished = true;
+        std::vector<HashTable*>::iterator it;
+        for (it = tables.begin(); it != tables.end(); ++it) {
+            double current = static_cast<double>(resident());
+            if (current <= lowWat) {
+                finished = false;
+                break;
+            }
+            SimulatedPager pager(policy, **it, (current - lowWat) / current);
+            (*it)->visit(pager);
+        }
+        policy.complete(finished);
+    }
+
+    EvictionPolicy &policy;
+    std::vector<HashTable*> tables;
+    size_t capacity;
+    size_t lowWat;
+    size_t pagerInterval;
+    size_t accesses;
+    size_t hits;
+    size_t pagerRuns;
+};
+
+static std::string keyOf(const char *prefix, size_t n) {
+    std::stringstream ss;
+    ss << prefix << n;
+    return ss.str();
+}
+
+/**
+ * A skewed hot set of 4000 keys that fits in memory, with a scan of
+ * 6000 keys every 40000 accesses.  The scans read keys that are never
+ * read again, or with rescan the same keys every time, which were
+ * ejected since and are fetched back.
+ */
+static void syntheticTrace(std::vector<std::string> &trace, bool rescan) {
+    const size_t hotKeys = 4000;
+    size_t scanned = 0;
+    srandom(42);
+    for (int round = 0; round < 10; ++round) {
+        for (int i = 0; i < 40000; ++i) {
+            double u = static_cast<double>(random()) / RAND_MAX;
+            trace.push_back(keyOf("hot", static_cast<size_t>(hotKeys * u * u)));
+        }
+        for (int i = 0; i < 6000; ++i) {
+            trace.push_back(keyOf("scan", rescan ? i : scanned++));
+            double u = static_cast<double>(random()) / RAND_MAX;
+            trace.push_back(keyOf("hot", static_cast<size_t>(hotKeys * u * u)));
+        }
+    }
+}
+
+static double replay(EvictionPolicy &policy, std::vector<std::string> &trace,
+                     size_t capacity, bool report) {
+    std::srand(17);
+    Simulator sim(policy, capacity);
+    std::vector<std::string>::iterator it;
+    for (it = trace.begin(); it != trace.end(); ++it) {
+        sim.access(*it);
+    }
+    if (report) {
+        std::cout << policy.getName() << ": " << sim.hitRatio() * 100
+                  << "% hits, " << sim.getPagerRuns() << " pager runs"
+                  << std::endl;
+    }
+    return sim.hitRatio();
+}
+
+static void compare(std::vector<std::string> &trace, size_t capacity,
+                    bool check) {
+    NRUEvictionPolicy nru;
+    SLRUEvictionPolicy slru(0.8);
+    // Only a trace given on the command line reports its hit ratios.
+    double nruHits = replay(nru, trace, capacity, !check);
+    double slruHits = replay(slru, trace, capacity, !check);
+    if (check) {
+        // The scans displace the hot set under NRU, not under SLRU.
+        assert(slruHits > nruHits + 0.02);
+    }
+}
+
+int main(int argc, char **argv) {
+    putenv(strdup("ALLOW_NO_STATS_UPDATE=yeah"));
+    global_stats.setMaxDataSize(64*1024*1024);
+
+    if (argc == 3) {
+        std::ifstream in(argv[1]);
+        if (!in) {
+            std::cerr << "Can't open " << argv[1] << std::endl;
+            return 1;
+        }
+        std::vector<std::string> trace;
+        std::string key;
+        while (std::getline(in, key)) {
+            if (!key.empty()) {
+                trace.push_back(key);
+            }
+        }
+        compare(trace, strtoul(argv[2], NULL, 10), false);
+        return 0;
+    }
+
+    testNRUPhases();
+    testSLRUSegments();
+    testSLRUProtectedShare();
+
+    std::vector<std::string> trace;
+    syntheticTrace(trace, false);
+    compare(trace, 5000, true);
+
+    std::vector<std::string> rescans;
+    syntheticTrace(rescans, true);
+    compare(rescans, 5000, true);
+    return 0;
+}
@@ -25,7 +25,9 @@
 #include <algorithm>
 #include <cassert>
 #include <limits>
+#include <sstream>
 
+#include "alloc_counter.h"
 #include "threadtests.h"
 
 time_t time_offset;
@@ -282,6 +284,61 @@ static void testResize() {
     verifyFound(h, keys);
 }
 
+static void testIncrementalResize() {
+    HashTable h(global_stats, 769, 3);
+
+    std::vector<std::string> keys = generateKeys(5000);
+    storeMany(h, keys);
+    assert(h.getMigrationRemaining() == 0);
+
+    // Switching to the new bucket arrays doesn't move anything yet.
+    h.resize(6143);
+    assert(h.getSize() == 6143);
+    assert(h.getMigrationRemaining() == 769);
+    assert(h.getMaxResizePause() > 0);
+    assert(count(h) == 5000);
+
+    // Every access moves its own bucket and a few more.
+    std::string k(keys[42]);
+    assert(h.find(k));
+    size_t remaining = h.getMigrationRemaining();
+    assert(remaining < 769);
+    assert(remaining >= 769 - 3 * 3);
+
+    // Items may be added and removed while migrating.
+    std::vector<std::string> more = generateKeys(5100, 5000);
+    storeMany(h, more);
+    assert(h.del(keys[0]));
+    assert(count(h) == 5099);
+
+    // The rest is moved in slices, one of each stripe per pass.
+    while (h.migrate(10, 0) > 0) {
+        assert(h.getMigrationRemaining() < remaining);
+        remaining = h.getMigrationRemaining();
+    }
+    assert(count(h) == 5099);
+    assert(h.del(keys[1]));
+    keys.erase(keys.begin(), keys.begin() + 2);
+    verifyFound(h, keys);
+    verifyFound(h, more);
+
+    // A resize started before the previous one is done finishes it.
+    h.resize(12289);
+    h.resize(3079);
+    assert(h.getSize() == 3079);
+    assert(h.getMigrationRemaining() == 12289);
+    verifyFound(h, keys);
+
+    HashTableDepthStatVisitor depthCounter;
+    h.visitDepth(depthCounter);
+    assert(depthCounter.size == 5098);
+    assert(h.getMigrationRemaining() > 0);
+
+    // Tables are never smaller than one bucket per lock.
+    h.resize(2);
+    assert(h.getSize() == 3079);
+}
+
 class AccessGenerator : public Generator<bool> {
 public:
 
@@ -327,6 +384,52 @@ static void testConcurrentAccessResize() {
     getCompletedThreads(16, &gen);
 }
 
+/**
+ * Collects the keys it sees, yielding after every lock stripe.
+ */
+class SlicedCollector : public HashTableVisitor {
+public:
+    SlicedCollector() : slices(0) {}
+
+    void visit(StoredValue *v) {
+        seen.push_back(v->getKey());
+    }
+
+    bool shouldYield() {
+        ++slices;
+        return true;
+    }
+
+    std::vector<std::string> seen;
+    size_t slices;
+};
+
+static void testResumableVisit() {
+    HashTable h(global_stats, 5, 3);
+
+    std::vector<std::string> keys = generateKeys(5000);
+    storeMany(h, keys);
+
+    SlicedCollector c;
+    size_t stripe = 0;
+    bool resized = false;
+    while (!h.visit(c, stripe)) {
+        assert(stripe > 0 && stripe < 3);
+        // The stripes are stable across a resize, so the rest of the
+        // table is still visited exactly once.
+        if (!resized) {
+            h.resize(6143);
+            resized = true;
+        }
+    }
+    assert(stripe == 0);
+    assert(c.slices == 2);
+
+    std::sort(c.seen.begin(), c.seen.end());
+    std::sort(keys.begin(), keys.end());
+    assert(c.seen == keys);
+}
+
 static void testAutoResize() {
     HashTable h(global_stats, 5, 3);
 
@@ -373,6 +476,45 @@ static void testAdd() {
     assert(count(h, false) == nkeys);
 }
 
+static void testInsertMulti() {
+    HashTable h(global_stats, 5, 3);
+    const int nkeys = 100;
+
+    std::vector<std::string> keys = generateKeys(nkeys);
+    std::vector<Item*> items;
+    std::vector<std::string>::iterator it;
+    for (it = keys.begin(); it != keys.end(); ++it) {
+        items.push_back(new Item(*it, 0, 0, it->data(), it->length(), 1));
+    }
+    // A key loaded twice in a batch is only inserted once.
+    items.push_back(new Item(keys[0], 0, 0, "dup", 3, 2));
+
+    std::vector<mutation_type_t> results;
+    h.insertMulti(items, false, false, results);
+    assert(results.size() == items.size());
+    for (int i = 0; i < nkeys; ++i) {
+        assert(results[i] == NOT_FOUND);
+        StoredValue *v = h.find(keys[i]);
+        assert(v);
+        assert(!v->isDirty());
+    }
+    assert(results[nkeys] == INVALID_CAS);
+    assert(count(h) == nkeys);
+    assert(h.find(keys[0])->getValue()->length() == keys[0].length());
+
+    // Keys already present can't be loaded partially.
+    h.insertMulti(items, false, true, results);
+    for (size_t i = 0; i < results.size(); ++i) {
+        assert(results[i] == INVALID_CAS);
+    }
+    assert(count(h) == nkeys);
+
+    std::vector<Item*>::iterator iit;
+    for (iit = items.begin(); iit != items.end(); ++iit) {
+        delete *iit;
+    }
+}
+
 static void testDepthCounting() {
     HashTable h(global_stats, 5, 1);
     const int nkeys = 5000;
@@ -386,6 +528,214 @@ static void testDepthCounting() {
     assert(depthCounter.max > 1000);
 }
 
+/**
+ * Store keys shaped like the ones we see in production (a common
+ * prefix and a counter, 40-200 bytes) and return the depth stats.
+ */
+static void hashLongKeys(HashTable &h, int nkeys,
+                         HashTableDepthStatVisitor &depthCounter) {
+    std::string pad(160, 'x');
+    for (int i = 0; i < nkeys; ++i) {
+        char buf[64];
+        snprintf(buf, sizeof(buf), "user::profile::%08d::", i);
+        std::string k(buf);
+        k.append(pad, 0, (i * 7) % pad.size());
+        store(h, k);
+    }
+    h.visitDepth(depthCounter);
+}
+
+static void testHashDistribution() {
+    const int nkeys = 20000;
+    const int nbuckets = 1531;
+
+    HashTable::setDefaultHashPolicy("djb");
+    HashTable legacy(global_stats, nbuckets, 1);
+    assert(strcmp(legacy.getHashPolicyName(), "djb") == 0);
+    HashTableDepthStatVisitor djbDepth;
+    hashLongKeys(legacy, nkeys, djbDepth);
+
+    HashTable::setDefaultHashPolicy("bogus");
+    HashTable::setDefaultHashPolicy("xxhash");
+    HashTable h(global_stats, nbuckets, 1);
+    assert(strcmp(h.getHashPolicyName(), "xxhash") == 0);
+    HashTableDepthStatVisitor xxDepth;
+    hashLongKeys(h, nkeys, xxDepth);
+
+    assert(djbDepth.size == static_cast<size_t>(nkeys));
+    assert(xxDepth.size == static_cast<size_t>(nkeys));
+    // ~13 items per bucket on average; a uniform hash stays well
+    // within 3x of that.
+    assert(xxDepth.min > 0);
+    assert(xxDepth.max < 3 * (nkeys / nbuckets));
+
+    // Short keys must hash consistently too.
+    std::vector<std::string> keys = generateKeys(1000);
+    storeMany(h, keys);
+    verifyFound(h, keys);
+}
+
+static void testGroupedLayout() {
+    HashTable::setDefaultBucketLayout("grouped");
+    size_t initialSize = global_stats.currentSize.get();
+    {
+        HashTable h(global_stats, 5, 1);
+        assert(strcmp(h.getBucketLayoutName(), "grouped") == 0);
+        const int nkeys = 5000;
+
+        // Way more than a group per bucket, so most items overflow.
+        std::vector<std::string> keys = generateKeys(nkeys);
+        storeMany(h, keys);
+        assert(count(h) == nkeys);
+        verifyFound(h, keys);
+
+        HashTableDepthStatVisitor depthCounter;
+        h.visitDepth(depthCounter);
+        assert(depthCounter.size == static_cast<size_t>(nkeys));
+        assert(depthCounter.max > 900);
+
+        // Deleting from the slots leaves the overflow chains in place.
+        std::vector<std::string> odd, even;
+        for (int i = 0; i < nkeys; ++i) {
+            (i % 2 ? odd : even).push_back(keys[i]);
+        }
+        std::vector<std::string>::iterator it;
+        for (it = even.begin(); it != even.end(); ++it) {
+            assert(h.del(*it));
+            assert(!h.del(*it));
+        }
+        assert(count(h) == nkeys / 2);
+        verifyFound(h, odd);
+
+        h.resize(769);
+        assert(h.getSize() == 769);
+        assert(strcmp(h.getBucketLayoutName(), "grouped") == 0);
+        verifyFound(h, odd);
+
+        // Few enough per bucket to fit in the groups now.
+        HashTableDepthStatVisitor smallDepth;
+        h.visitDepth(smallDepth);
+        assert(smallDepth.size == odd.size());
+        storeMany(h, even);
+        assert(count(h) == nkeys);
+    }
+    assert(global_stats.currentSize.get() == initialSize);
+
+    testReverseDeletions();
+    testForwardDeletions();
+    testFind();
+    testAdd();
+    testResize();
+    testConcurrentAccessResize();
+
+    HashTable::setDefaultBucketLayout("chained");
+    HashTable h(global_stats, 5, 1);
+    assert(strcmp(h.getBucketLayoutName(), "chained") == 0);
+}
+
+static void testCompactFields() {
+    HashTable h(global_stats, 5, 1);
+
+    std::string k("plain");
+    Item plain(k, 0, 0, k.c_str(), k.length());
+    assert(h.set(plain) == WAS_CLEAN);
+    StoredValue *v = h.find(k);
+    assert(v);
+    // No optional fields: just room for the id and seqno.
+    assert(v->metaDataSize() ==
+           StoredValue::headerSize() + sizeof(void*) + k.length());
+    assert(v->getKey() == k);
+    assert(v->getId() == -1);
+    assert(v->getSeqno() == 1);
+    assert(v->getFlags() == 0);
+    assert(v->getExptime() == 0);
+
+    // Growing the id and seqno stays within the reserve.
+    v->setId(123456789);
+    v->setSeqno(1000);
+    assert(!v->hasExternalFields());
+    assert(v->getId() == 123456789);
+    assert(v->getSeqno() == 1000);
+    assert(v->getKey() == k);
+
+    // A lock doesn't fit anymore, so the fields move out of line.
+    v->lock(10);
+    assert(v->hasExternalFields());
+    assert(v->isLocked(5));
+    assert(v->getId() == 123456789);
+    assert(v->getSeqno() == 1000);
+    assert(v->getKey() == k);
+    v->unlock();
+    assert(!v->isLocked(5));
+    v->setFlags(42);
+    assert(v->getFlags() == 42);
+
+    // Items created with flags and an expiry carry them inline.
+    std::string rk("rich");
+    Item rich(rk, 0xdeadbeef, 1234567, rk.c_str(), rk.length());
+    assert(h.set(rich) == WAS_CLEAN);
+    v = h.find(rk);
+    assert(v);
+    assert(v->metaDataSize() ==
+           StoredValue::headerSize() + sizeof(void*) + 8 + rk.length());
+    assert(!v->hasExternalFields());
+    assert(v->getFlags() == 0xdeadbeef);
+    assert(v->getExptime() == 1234567);
+    v->setPendingId();
+    assert(v->isPendingId());
+    v->setId(1LL << 50);
+    assert(v->hasExternalFields());
+    assert(v->getId() == 1LL << 50);
+    assert(v->getFlags() == 0xdeadbeef);
+
+    // Replacing the value keeps what's stored out of line.
+    Item again(k, 0, 0, rk.c_str(), rk.length());
+    assert(h.set(again) == WAS_DIRTY);
+    v = h.find(k);
+    assert(v->getFlags() == 0);
+    assert(v->getSeqno() == 1001);
+
+    h.clear();
+    assert(h.getNumItems() == 0);
+    assert(h.metaDataMemory.get() == 0);
+}
+
+static void testItemOverhead() {
+    // 100k keys of 16-40 bytes; a third have flags, a tenth a TTL.
+    HashTable h(global_stats, 65521, 1);
+    const size_t nkeys = 100000;
+    size_t keyBytes = 0;
+    for (size_t i = 0; i < nkeys; ++i) {
+        char buf[64];
+        int len = snprintf(buf, sizeof(buf), "user:%08lu:%.*s",
+                           static_cast<unsigned long>(i), static_cast<int>(i % 25),
+                           "profile:settings:session");
+        uint32_t flags = i % 3 == 0 ? 0x10000 + i : 0;
+        time_t exptime = i % 10 == 0 ? 86400 : 0;
+        Item it(std::string(buf, len), flags, exptime, "v", 1);
+        assert(h.set(it) == WAS_CLEAN);
+        keyBytes += len;
+    }
+    // Ids as assigned by the first flush.
+    int64_t id = 0;
+    for (size_t i = 0; i < nkeys; i += 7) {
+        char buf[64];
+        int len = snprintf(buf, sizeof(buf), "user:%08lu:%.*s",
+                           static_cast<unsigned long>(i), static_cast<int>(i % 25),
+                           "profile:settings:session");
+        std::string key(buf, len);
+        StoredValue *v = h.find(key);
+        assert(v);
+        v->setId(++id * 1000);
+    }
+
+    // The fixed header this replaced was 56 bytes.
+    size_t fixed = 56 * nkeys + keyBytes;
+    size_t compact = h.metaDataMemory.get();
+    assert(compact < fixed);
+    h.clear();
+}
+
 static void testPoisonKey() {
     std::string k("A\\NROBs_oc)$zqJ1C.9?XU}Vn^(LW\"`+K/4lykF[ue0{ram;fvId6h=p&Zb3T~SQ]82'ixDP");
 
@@ -559,6 +909,116 @@ static void testSizeStatsEjectFlush() {
     free(someval);
 }
 
+static void testSizeStatsCompress() {
+    global_stats.reset();
+    HashTable ht(global_stats, 5, 1);
+    size_t initialSize = global_stats.currentSize.get();
+
+    const char *k("somekey");
+    std::string kstring(k);
+    std::string value;
+    for (int i = 0; value.length() < 16 * 1024; ++i) {
+        std::stringstream ss;
+        ss << "{\"id\": " << i << ", \"type\": \"compressible\"}";
+        value.append(ss.str());
+    }
+
+    Item i(k, 0, 0, value.data(), value.length());
+    assert(ht.set(i) == WAS_CLEAN);
+    size_t cacheSize = ht.cacheSize.get();
+
+    StoredValue *v(ht.find(kstring));
+    assert(v);
+    // Dirty values are left for the flusher.
+    assert(!v->compressValue(global_stats, ht, 0));
+    v->markClean();
+    assert(!v->compressValue(global_stats, ht, value.length() + 1));
+    assert(v->compressValue(global_stats, ht, 0));
+    assert(!v->compressValue(global_stats, ht, 0));
+    assert(v->isCompressed() && v->isResident());
+    assert(v->valLength() == value.length());
+    assert(ht.cacheSize.get() < cacheSize / 2);
+    assert(global_stats.numCompressedValues.get() == 1);
+    assert(global_stats.compressedValueSize.get() == v->getValue()->length());
+
+    // Readers get the value as it was stored.
+    Item *it = v->toItem(false, 0);
+    assert(std::string(it->getData(), it->getNBytes()) == value);
+    delete it;
+    assert(v->isCompressed());
+
+    assert(v->decompressValue(global_stats, ht));
+    assert(!v->isCompressed());
+    assert(ht.cacheSize.get() == cacheSize);
+    assert(v->getValue()->length() == value.length());
+    assert(global_stats.numCompressedValues.get() == 0);
+    assert(global_stats.compressedValueSize.get() == 0);
+    assert(global_stats.numValueDecompressions.get() == 1);
+
+    // Ejecting a compressed value goes straight to disk.
+    assert(v->compressValue(global_stats, ht, 0));
+    assert(v->ejectValue(global_stats, ht));
+    assert(!v->isCompressed() && !v->isResident());
+    assert(v->valLength() == value.length());
+    assert(global_stats.numCompressedValues.get() == 0);
+    ht.del(kstring);
+
+    Item again(k, 0, 0, value.data(), value.length());
+    assert(ht.set(again) == WAS_CLEAN);
+    v = ht.find(kstring);
+    v->markClean();
+    assert(v->compressValue(global_stats, ht, 0));
+    ht.clear();
+
+    assert(ht.memSize.get() == 0);
+    assert(ht.cacheSize.get() == 0);
+    assert(initialSize == global_stats.currentSize.get());
+    assert(global_stats.numCompressedValues.get() == 0);
+    assert(global_stats.compressedValueSize.get() == 0);
+    assert(global_stats.numValueCompressions.get() == 3);
+}
+
+/**
+ * Hand out 100KB values the way a GET does, and check the items share
+ * the stored blobs instead of copying them.
+ */
+static void testGetItem() {
+    HashTable h(global_stats, 5, 1);
+    const int nkeys = 32;
+    const size_t valueSize = 100 * 1024;
+    std::string value(valueSize, 'x');
+    std::vector<std::string> keys;
+    for (int i = 0; i < nkeys; ++i) {
+        char buf[64];
+        snprintf(buf, sizeof(buf), "document:json:%08d", i);
+        keys.push_back(buf);
+        Item it(keys.back(), 0, 0, value.data(), value.size());
+        assert(h.set(it) == WAS_CLEAN);
+    }
+
+    const size_t gets = 1000;
+    size_t copied = 0;
+    size_t allocsBefore = AllocCounter::allocations();
+    size_t bytesBefore = AllocCounter::allocatedBytes();
+    for (size_t i = 0; i < gets; ++i) {
+        StoredValue *v = h.find(keys[i % nkeys]);
+        Item *it = v->toItem(false, 0);
+        if (it->getData() != v->getValue()->getData()) {
+            copied += it->getNBytes();
+        }
+        assert(it->getNBytes() == valueSize);
+        delete it;
+    }
+    size_t allocs = AllocCounter::allocations() - allocsBefore;
+    size_t bytes = AllocCounter::allocatedBytes() - bytesBefore;
+
+    assert(copied == 0);
+    // The item itself and its key.
+    assert(allocs <= 2 * gets);
+    assert(bytes < 256 * gets);
+    h.clear();
+}
+
 int main() {
     putenv(strdup("ALLOW_NO_STATS_UPDATE=yeah"));
     global_stats.setMaxDataSize(64*1024*1024);
@@ -571,10 +1031,14 @@ int main() {
     testFind();
     testAdd();
     testAddExpiry();
+    testInsertMulti();
     testDepthCounting();
+    testHashDistribution();
     testPoisonKey();
     testResize();
+    testIncrementalResize();
     testConcurrentAccessResize();
+    testResumableVisit();
     testAutoResize();
     testSizeStats();
     testSizeStatsFlush();
@@ -582,5 +1046,10 @@ int main() {
     testSizeStatsSoftDelFlush();
     testSizeStatsEject();
     testSizeStatsEjectFlush();
+    testSizeStatsCompress();
+    testGroupedLayout();
+    testCompactFields();
+    testItemOverhead();
+    testGetItem();
     exit(0);
 }
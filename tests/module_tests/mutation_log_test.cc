@@ -19,16 +19,22 @@
 
 #include <pthread.h>
 #include <signal.h>
+#include <sys/stat.h>
 
 #include <algorithm>
 #include <map>
 #include <set>
+#include <sstream>
 #include <stdexcept>
 #include <vector>
 
 #include "assert.h"
 #include "mutation_log.h"
 
+extern "C" {
+#include "crc32.h"
+}
+
 #define TMP_LOG_FILE "/tmp/mlt_test.log"
 
 static void testUnconfigured() {
@@ -182,6 +188,147 @@ static void testLogging() {
     remove(TMP_LOG_FILE);
 }
 
+static void testLoggingManyBlocks() {
+    remove(TMP_LOG_FILE);
+
+    const int nkeys(20000);
+    MutationLog ml(TMP_LOG_FILE);
+    ml.open();
+    for (int i = 0; i < nkeys; ++i) {
+        std::stringstream ss;
+        ss << "key" << i;
+        ml.newItem(i % 4, ss.str(), i + 1);
+    }
+    ml.commit1();
+    ml.commit2();
+
+    // The full blocks are on disk once a commit has synced them.
+    size_t blocks(ml.logSize / ml.getBlockSize() - 1);
+    assert(blocks > LOG_WRITE_BUFFERS);
+    assert(ml.writeTimeHisto.total() == blocks);
+    assert(ml.syncTimeHisto.total() == 1);
+
+    {
+        MutationLog reader(TMP_LOG_FILE);
+        reader.open(true);
+        MutationLogHarvester h(reader);
+        for (uint16_t vb = 0; vb < 4; ++vb) {
+            h.setVBucket(vb);
+        }
+        assert(!h.load());
+        assert(h.getItemsSeen()[ML_NEW] > nkeys / 2);
+    }
+
+    // The rest is written when the log is closed.
+    ml.close();
+    {
+        MutationLog reader(TMP_LOG_FILE);
+        reader.open(true);
+        MutationLogHarvester h(reader);
+        for (uint16_t vb = 0; vb < 4; ++vb) {
+            h.setVBucket(vb);
+        }
+        assert(h.load());
+        assert(h.getItemsSeen()[ML_NEW] == nkeys);
+        assert(h.getItemsSeen()[ML_COMMIT2] == 1);
+    }
+
+    remove(TMP_LOG_FILE);
+}
+
+/**
+ * Load the log with the given number of readers.
+ *
+ * @return whether the load threw a CRC exception
+ */
+static bool harvest(size_t readers, std::map<std::string, uint64_t> *maps,
+                    size_t *seen) {
+    MutationLog ml(TMP_LOG_FILE);
+    ml.open(true);
+    MutationLogHarvester h(ml);
+    h.setReaders(readers);
+    for (uint16_t vb = 0; vb < 4; ++vb) {
+        h.setVBucket(vb);
+    }
+    bool damaged(false);
+    try {
+        h.load();
+    } catch (MutationLog::CRCReadException &e) {
+        damaged = true;
+    }
+    memcpy(seen, h.getItemsSeen(), MUTATION_LOG_TYPES * sizeof(size_t));
+    h.apply(maps, loaderFun);
+    return damaged;
+}
+
+static void testLoadingMapped() {
+    remove(TMP_LOG_FILE);
+
+    const int nkeys(20000);
+    {
+        MutationLog ml(TMP_LOG_FILE);
+        ml.open();
+        for (int i = 0; i < nkeys; ++i) {
+            std::stringstream ss;
+            ss << "key" << i;
+            ml.newItem(i % 4, ss.str(), i + 1);
+            if (i % 7 == 0) {
+                ml.delItem(i % 4, ss.str());
+            }
+            if (i % 5000 == 4999) {
+                if (i == 9999) {
+                    ml.deleteAll(1);
+                }
+                ml.commit1();
+                ml.commit2();
+            }
+        }
+    }
+
+    std::map<std::string, uint64_t> serial[4];
+    size_t serialSeen[MUTATION_LOG_TYPES];
+    assert(!harvest(1, serial, serialSeen));
+    assert(serialSeen[ML_NEW] == nkeys);
+    assert(serialSeen[ML_COMMIT2] == 4);
+
+    std::map<std::string, uint64_t> mapped[4];
+    size_t mappedSeen[MUTATION_LOG_TYPES];
+    assert(!harvest(4, mapped, mappedSeen));
+    assert(memcmp(serialSeen, mappedSeen, sizeof(serialSeen)) == 0);
+    for (int vb = 0; vb < 4; ++vb) {
+        assert(serial[vb] == mapped[vb]);
+    }
+    assert(mapped[1].size() < mapped[2].size());
+
+    // Break a block in the middle of the log.
+    struct stat st;
+    assert(stat(TMP_LOG_FILE, &st) == 0);
+    off_t pos(st.st_size / 2 + 100);
+    int file = open(TMP_LOG_FILE, O_RDWR, 0666);
+    assert(lseek(file, pos, SEEK_SET) == pos);
+    uint8_t b;
+    assert(read(file, &b, sizeof(b)) == 1);
+    assert(lseek(file, pos, SEEK_SET) == pos);
+    b = ~b;
+    assert(write(file, &b, sizeof(b)) == 1);
+    close(file);
+
+    // Everything up to the damaged block is replayed either way.
+    for (int vb = 0; vb < 4; ++vb) {
+        serial[vb].clear();
+        mapped[vb].clear();
+    }
+    assert(harvest(1, serial, serialSeen));
+    assert(harvest(4, mapped, mappedSeen));
+    assert(serialSeen[ML_NEW] > 0 && serialSeen[ML_NEW] < nkeys);
+    assert(memcmp(serialSeen, mappedSeen, sizeof(serialSeen)) == 0);
+    for (int vb = 0; vb < 4; ++vb) {
+        assert(serial[vb] == mapped[vb]);
+    }
+
+    remove(TMP_LOG_FILE);
+}
+
 static void testDelAll() {
     remove(TMP_LOG_FILE);
 
@@ -413,6 +560,105 @@ static void testLoggingBadCRC() {
     remove(TMP_LOG_FILE);
 }
 
+/**
+ * Write a log the way a version with 16 bit CRCs did.
+ */
+static void writeOldLog() {
+    const size_t bs(4096);
+    std::vector<uint8_t> buf(MIN_LOG_HEADER_SIZE + bs);
+    uint32_t header[4] = { htonl(LOG_VERSION_CRC16), htonl(bs), htonl(1), 0 };
+    memcpy(&buf[0], header, sizeof(header));
+
+    uint8_t *block = &buf[MIN_LOG_HEADER_SIZE];
+    size_t pos(HEADER_RESERVED_CRC16);
+    MutationLogEntry *e;
+    e = MutationLogEntry::newEntry(block + pos, 1, ML_NEW, 3, "key1");
+    pos += e->len();
+    e = MutationLogEntry::newEntry(block + pos, 2, ML_NEW, 2, "key1");
+    pos += e->len();
+    e = MutationLogEntry::newEntry(block + pos, 0, ML_COMMIT1, 0, "");
+    pos += e->len();
+    e = MutationLogEntry::newEntry(block + pos, 0, ML_COMMIT2, 0, "");
+    uint16_t entries(htons(4));
+    memcpy(block + 2, &entries, sizeof(entries));
+    uint16_t crc16(htons(crc32buf(block + 2, bs - 2) & 0xffff));
+    memcpy(block, &crc16, sizeof(crc16));
+
+    int file = open(TMP_LOG_FILE, O_CREAT|O_TRUNC|O_RDWR, 0666);
+    assert(file >= 0);
+    assert(write(file, &buf[0], buf.size()) == (ssize_t)buf.size());
+    close(file);
+}
+
+static void testLoggingOldVersion() {
+    remove(TMP_LOG_FILE);
+    writeOldLog();
+
+    {
+        // Appending to an old log keeps its format.
+        MutationLog ml(TMP_LOG_FILE);
+        ml.open();
+        assert(ml.header().version() == LOG_VERSION_CRC16);
+        ml.newItem(3, "key2", 3);
+        ml.delItem(3, "key1");
+        ml.commit1();
+        ml.commit2();
+    }
+
+    {
+        MutationLog ml(TMP_LOG_FILE);
+        ml.open();
+        assert(ml.header().version() == LOG_VERSION_CRC16);
+        MutationLogHarvester h(ml);
+        h.setVBucket(2);
+        h.setVBucket(3);
+
+        assert(h.load());
+        assert(h.getItemsSeen()[ML_NEW] == 3);
+        assert(h.getItemsSeen()[ML_DEL] == 1);
+        assert(h.getItemsSeen()[ML_COMMIT2] == 2);
+
+        std::map<std::string, uint64_t> maps[4];
+        h.apply(&maps, loaderFun);
+        assert(maps[2].size() == 1);
+        assert(maps[3].size() == 1);
+        assert(maps[3].find("key2") != maps[3].end());
+
+        // A new log is written in the current format.
+        assert(ml.reset());
+        assert(ml.header().version() == LOG_VERSION);
+        ml.newItem(3, "key3", 4);
+        ml.commit1();
+        ml.commit2();
+    }
+
+    {
+        MutationLog ml(TMP_LOG_FILE);
+        ml.open();
+        MutationLogHarvester h(ml);
+        h.setVBucket(3);
+        assert(h.load());
+        assert(h.getItemsSeen()[ML_NEW] == 1);
+    }
+
+    // Logs of versions we don't know aren't read.
+    uint32_t version(htonl(LOG_VERSION + 1));
+    int file = open(TMP_LOG_FILE, O_RDWR, 0666);
+    assert(pwrite(file, &version, sizeof(version), 0) == sizeof(version));
+    close(file);
+    {
+        MutationLog ml(TMP_LOG_FILE);
+        try {
+            ml.open();
+            abort();
+        } catch(MutationLog::ReadException &e) {
+            // expected
+        }
+    }
+
+    remove(TMP_LOG_FILE);
+}
+
 static void testLoggingShortRead() {
     remove(TMP_LOG_FILE);
 
@@ -524,9 +770,12 @@ int main(int, char **) {
     testUnconfigured();
     testSyncSet();
     testLogging();
+    testLoggingManyBlocks();
+    testLoadingMapped();
     testDelAll();
     testLoggingDirty();
     testLoggingBadCRC();
+    testLoggingOldVersion();
     testLoggingShortRead();
     testYUNOOPEN();
 
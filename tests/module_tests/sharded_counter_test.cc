@@ -0,0 +1,81 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <unistd.h>
+
+#include <cassert>
+
+#include "sharded_counter.h"
+#include "threadtests.h"
+
+const size_t numThreads    = 50;
+const size_t numIterations = 10000;
+
+/**
+ * Bumps a counter up and down; what is left is one per iteration.
+ */
+template <typename C>
+class CounterBumper : public Generator<bool> {
+public:
+
+    CounterBumper(C &c, size_t n) : counter(c), iterations(n) {}
+
+    bool operator()() {
+        for (size_t j = 0; j < iterations; ++j) {
+            counter.incr(3);
+            counter.decr(2);
+        }
+        return true;
+    }
+
+private:
+    C      &counter;
+    size_t  iterations;
+};
+
+static void testSingleThread() {
+    ShardedCounter<size_t> c;
+    assert(c.get() == 0);
+    ++c;
+    c++;
+    c += 10;
+    assert(c.get() == 12);
+    --c;
+    c -= 5;
+    c.decr(6);
+    assert(c.get() == 0);
+    c.incr(42);
+    assert(static_cast<size_t>(c) == 42);
+    c = 7;
+    assert(c.get() == 7);
+}
+
+static void testConcurrent() {
+    ShardedCounter<size_t> c;
+    CounterBumper<ShardedCounter<size_t> > gen(c, numIterations);
+    getCompletedThreads<bool>(numThreads, &gen);
+    assert(c.get() == numThreads * numIterations);
+}
+
+int main() {
+    alarm(120);
+    testSingleThread();
+    testConcurrent();
+    return 0;
+}
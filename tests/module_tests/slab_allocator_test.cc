@@ -0,0 +1,237 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <unistd.h>
+
+#include <cassert>
+#include <cstring>
+#include <vector>
+
+#include "slab_allocator.h"
+#include "threadtests.h"
+
+/**
+ * A small deterministic generator, so every thread gets its own stream.
+ */
+class SizeMix {
+public:
+    SizeMix(uint32_t seed) : state(seed * 2654435761U + 1) { }
+
+    uint32_t next() {
+        state = state * 1103515245U + 12345U;
+        return state >> 8;
+    }
+
+    /**
+     * Sizes resembling a cache workload: item metadata with keys of up
+     * to 64 bytes, and values that are mostly small with a long tail.
+     */
+    size_t size() {
+        uint32_t r = next();
+        switch (r % 20) {
+        case 0: case 1: case 2: case 3: case 4: case 5: case 6: case 7:
+            return 72 + (r >> 5) % 64;
+        case 8: case 9: case 10: case 11: case 12: case 13: case 14: case 15:
+        case 16:
+            return 32 + (r >> 5) % 480;
+        case 17: case 18:
+            return 512 + (r >> 5) % 3584;
+        default:
+            return 4096 + (r >> 5) % 12000;
+        }
+    }
+
+private:
+    uint32_t state;
+};
+
+struct Chunk {
+    Chunk() : p(NULL), len(0) { }
+    void  *p;
+    size_t len;
+};
+
+static void *slabAlloc(size_t len) {
+    void *p = SlabAllocator::allocate(len);
+    assert(p);
+    return p;
+}
+
+static void slabFree(void *p, size_t len) {
+    SlabAllocator::deallocate(p, len);
+}
+
+typedef void *(*alloc_fn)(size_t);
+typedef void (*free_fn)(void *, size_t);
+
+/**
+ * Replace random entries of a working set, filling each new chunk.
+ */
+static void churn(std::vector<Chunk> &chunks, size_t ops, SizeMix &mix,
+                  alloc_fn alloc, free_fn release) {
+    for (size_t i = 0; i < ops; ++i) {
+        Chunk &c = chunks[mix.next() % chunks.size()];
+        if (c.p) {
+            release(c.p, c.len);
+        }
+        c.len = mix.size();
+        c.p = alloc(c.len);
+        memset(c.p, 1, c.len);
+    }
+}
+
+static void releaseAll(std::vector<Chunk> &chunks, free_fn release) {
+    std::vector<Chunk>::iterator it;
+    for (it = chunks.begin(); it != chunks.end(); ++it) {
+        if (it->p) {
+            release(it->p, it->len);
+            it->p = NULL;
+        }
+    }
+}
+
+static void testChunkSizes() {
+    size_t prev = 0;
+    for (size_t len = 1; len <= SlabAllocator::MAX_CHUNK_SIZE; ++len) {
+        size_t cs = SlabAllocator::getChunkSize(len);
+        assert(cs >= len);
+        assert(cs % 16 == 0);
+        assert(cs >= prev);
+        // Rounding never wastes more than a quarter (plus alignment).
+        assert(len < 32 || cs <= len + len / 4 + 16);
+        prev = cs;
+    }
+    assert(SlabAllocator::getChunkSize(SlabAllocator::MAX_CHUNK_SIZE) ==
+           SlabAllocator::MAX_CHUNK_SIZE);
+}
+
+static void testDisabled() {
+    SlabAllocator::setEnabled(false);
+    assert(SlabAllocator::allocate(100) == NULL);
+    SlabAllocator::setEnabled(true);
+    assert(SlabAllocator::allocate(SlabAllocator::MAX_CHUNK_SIZE + 1) == NULL);
+}
+
+static void testAllocFree() {
+    const size_t n = 20000;
+    std::vector<Chunk> chunks(n);
+    SizeMix mix(1);
+    size_t outstanding = 0;
+    for (size_t i = 0; i < n; ++i) {
+        chunks[i].len = mix.size();
+        chunks[i].p = SlabAllocator::allocate(chunks[i].len);
+        assert(chunks[i].p);
+        memset(chunks[i].p, static_cast<int>(i & 0xff), chunks[i].len);
+        outstanding += SlabAllocator::getChunkSize(chunks[i].len);
+    }
+
+    // No chunk was handed out twice or overlaps another.
+    for (size_t i = 0; i < n; ++i) {
+        const unsigned char *p = static_cast<unsigned char*>(chunks[i].p);
+        for (size_t j = 0; j < chunks[i].len; ++j) {
+            assert(p[j] == (i & 0xff));
+        }
+    }
+
+    assert(SlabAllocator::getReservedBytes() >=
+           SlabAllocator::getFreeBytes() + SlabAllocator::getCachedBytes() +
+           outstanding);
+
+    size_t reserved = SlabAllocator::getReservedBytes();
+    releaseAll(chunks, SlabAllocator::deallocate);
+
+    // Allocating the same mix again is served by the freed chunks.
+    SizeMix again(1);
+    for (size_t i = 0; i < n; ++i) {
+        chunks[i].len = again.size();
+        chunks[i].p = SlabAllocator::allocate(chunks[i].len);
+        assert(chunks[i].p);
+    }
+    assert(SlabAllocator::getReservedBytes() == reserved);
+    releaseAll(chunks, SlabAllocator::deallocate);
+}
+
+class ChurnThread : public Generator<bool> {
+public:
+    ChurnThread(size_t ws, size_t o, alloc_fn a, free_fn f) :
+        workingSet(ws), ops(o), alloc(a), release(f), seed(0) { }
+
+    bool operator()() {
+        std::vector<Chunk> chunks(workingSet);
+        SizeMix mix(++seed);
+        churn(chunks, ops, mix, alloc, release);
+        releaseAll(chunks, release);
+        return true;
+    }
+
+private:
+    size_t      workingSet;
+    size_t      ops;
+    alloc_fn    alloc;
+    free_fn     release;
+    Atomic<int> seed;
+};
+
+static void testThreads() {
+    size_t cachedBefore = SlabAllocator::getCachedBytes();
+    ChurnThread gen(1000, 50000, slabAlloc, slabFree);
+    getCompletedThreads<bool>(8, &gen);
+
+    // The caches of exited threads went back to the shared freelists.
+    assert(SlabAllocator::getCachedBytes() == cachedBefore);
+}
+
+class PassThread : public Generator<bool> {
+public:
+    PassThread(std::vector<Chunk> &c) : chunks(c) { }
+
+    bool operator()() {
+        releaseAll(chunks, SlabAllocator::deallocate);
+        return true;
+    }
+
+private:
+    std::vector<Chunk> &chunks;
+};
+
+static void testFreeOnOtherThread() {
+    std::vector<Chunk> chunks(5000);
+    SizeMix mix(7);
+    churn(chunks, chunks.size(), mix, slabAlloc, slabFree);
+    size_t free = SlabAllocator::getFreeBytes();
+
+    PassThread gen(chunks);
+    getCompletedThreads<bool>(1, &gen);
+    assert(SlabAllocator::getFreeBytes() > free);
+
+    // And they can be allocated from here again.
+    churn(chunks, chunks.size() * 2, mix, slabAlloc, slabFree);
+    releaseAll(chunks, SlabAllocator::deallocate);
+}
+
+int main() {
+    alarm(120);
+    testChunkSizes();
+    testDisabled();
+    SlabAllocator::setEnabled(true);
+    testAllocFree();
+    testThreads();
+    testFreeOnOtherThread();
+    return 0;
+}